@@ -0,0 +1,308 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// BlockFilter.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "BlockFilter.h"
+#include "serialize.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+
+using namespace Coin;
+
+const uint8_t BlockFilter::BASIC_FILTER_TYPE;
+const unsigned int BlockFilter::P;
+const uint64_t BlockFilter::M;
+
+static const char* FILTER_TOO_SHORT = "Invalid data - block filter too short.";
+
+inline uint64_t ROTL64(uint64_t x, int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+inline uint64_t readLE64(const unsigned char* p)
+{
+    uint64_t n = 0;
+    for (int i = 7; i >= 0; i--) { n = (n << 8) | p[i]; }
+    return n;
+}
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+// SipHash-2-4, see https://131002.net/siphash/
+static uint64_t sipHash(uint64_t k0, uint64_t k1, const unsigned char* data, std::size_t size)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char* end = data + (size & ~(std::size_t)7);
+    for (; data != end; data += 8)
+    {
+        uint64_t m = readLE64(data);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t b = (uint64_t)size << 56;
+    for (std::size_t i = 0; i < (size & 7); i++) { b |= (uint64_t)data[i] << (8 * i); }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
+// (x * n) >> 64, which maps a 64-bit hash evenly onto [0, n) without a division.
+static uint64_t fastRange64(uint64_t x, uint64_t n)
+{
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+#else
+    uint64_t xHi = x >> 32, xLo = (uint32_t)x;
+    uint64_t nHi = n >> 32, nLo = (uint32_t)n;
+    uint64_t hiLo = xHi * nLo;
+    uint64_t loHi = xLo * nHi;
+    uint64_t cross = ((xLo * nLo) >> 32) + (uint32_t)hiLo + (uint32_t)loHi;
+    return xHi * nHi + (hiLo >> 32) + (loHi >> 32) + (cross >> 32);
+#endif
+}
+
+// Golomb-Rice coded values, most significant bit first.
+class BitReader
+{
+public:
+    BitReader(const unsigned char* begin, const unsigned char* end) : p(begin), end(end), buffer(0), bits(0) { }
+
+    uint64_t read(unsigned int n) // n <= 56
+    {
+        while (bits < n)
+        {
+            if (p == end) throw std::runtime_error(FILTER_TOO_SHORT);
+            buffer = (buffer << 8) | *p++;
+            bits += 8;
+        }
+        bits -= n;
+        return (buffer >> bits) & ((1ULL << n) - 1);
+    }
+
+    uint64_t readGolombRice()
+    {
+        uint64_t q = 0;
+        while (read(1)) { q++; }
+        return (q << BlockFilter::P) | read(BlockFilter::P);
+    }
+
+private:
+    const unsigned char* p;
+    const unsigned char* end;
+    uint64_t buffer;
+    unsigned int bits;
+};
+
+class BitWriter
+{
+public:
+    explicit BitWriter(uchar_vector& buffer) : out(buffer), byte(0), bits(0) { }
+
+    void write(uint64_t value, unsigned int n)
+    {
+        while (n > 0)
+        {
+            unsigned int count = std::min(8 - bits, n);
+            n -= count;
+            byte |= (unsigned char)(((value >> n) & ((1U << count) - 1)) << (8 - bits - count));
+            bits += count;
+            if (bits == 8) { flush(); }
+        }
+    }
+
+    void writeGolombRice(uint64_t value)
+    {
+        for (uint64_t q = value >> BlockFilter::P; q > 0; q--) { write(1, 1); }
+        write(0, 1);
+        write(value, BlockFilter::P);
+    }
+
+    void flush()
+    {
+        if (bits == 0) return;
+        out.push_back(byte);
+        byte = 0;
+        bits = 0;
+    }
+
+private:
+    uchar_vector& out;
+    unsigned char byte;
+    unsigned int bits;
+};
+
+BlockFilter::BlockFilter(const uchar_vector& blockHash, const uchar_vector& encoded_)
+    : encoded(encoded_)
+{
+    setKey(blockHash);
+
+    ByteReader reader(encoded);
+    n = reader.readVarInt(FILTER_TOO_SHORT);
+    if (n > 0xffffffff) throw std::runtime_error("Invalid data - block filter has too many elements.");
+    dataOffset = reader.position();
+}
+
+BlockFilter::BlockFilter(const uchar_vector& blockHash, const std::vector<uchar_vector>& elements)
+{
+    setKey(blockHash);
+
+    std::set<uchar_vector> unique;
+    for (auto& element: elements)
+    {
+        if (!element.empty()) { unique.insert(element); }
+    }
+    n = unique.size();
+
+    std::vector<uint64_t> values;
+    values.reserve(n);
+    for (auto& element: unique) { values.push_back(hashToRange(element)); }
+    std::sort(values.begin(), values.end());
+
+    writeVarInt(encoded, n);
+    dataOffset = encoded.size();
+
+    BitWriter writer(encoded);
+    uint64_t last = 0;
+    for (uint64_t value: values)
+    {
+        writer.writeGolombRice(value - last);
+        last = value;
+    }
+    writer.flush();
+}
+
+bool BlockFilter::match(const uchar_vector& element) const
+{
+    return matchAny(std::vector<uchar_vector>(1, element));
+}
+
+bool BlockFilter::matchAny(const std::vector<uchar_vector>& elements) const
+{
+    if (n == 0) return false;
+
+    std::vector<uint64_t> queries;
+    queries.reserve(elements.size());
+    for (auto& element: elements)
+    {
+        if (!element.empty()) { queries.push_back(hashToRange(element)); }
+    }
+    if (queries.empty()) return false;
+
+    BitReader reader(encoded.data() + dataOffset, encoded.data() + encoded.size());
+
+    if (queries.size() <= n)
+    {
+        // Walk the sorted queries alongside the filter.
+        std::sort(queries.begin(), queries.end());
+        auto query = queries.begin();
+        uint64_t value = 0;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            value += reader.readGolombRice();
+            while (*query < value)
+            {
+                if (++query == queries.end()) return false;
+            }
+            if (*query == value) return true;
+        }
+        return false;
+    }
+
+    // With many more queries than filter values, decode the filter once and look each query up
+    // in it instead of sorting them all. Values are spread evenly over [0, n * M), so bucketing
+    // them by value / M leaves about one value in each bucket.
+    std::vector<uint64_t> values(n);
+    std::vector<uint32_t> buckets(n + 1, 0); // index of the first value in each bucket
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < n; i++)
+    {
+        value += reader.readGolombRice();
+        values[i] = value;
+        uint64_t bucket = std::min(value / M, n - 1);
+        buckets[bucket + 1] = (uint32_t)(i + 1);
+    }
+    for (uint64_t i = 1; i <= n; i++) { buckets[i] = std::max(buckets[i], buckets[i - 1]); }
+
+    for (uint64_t query: queries)
+    {
+        uint64_t bucket = std::min(query / M, n - 1);
+        for (uint32_t i = buckets[bucket]; i < buckets[bucket + 1]; i++)
+        {
+            if (values[i] == query) return true;
+        }
+    }
+    return false;
+}
+
+uchar_vector BlockFilter::getHash() const
+{
+    uchar_vector hash(CSHA256::OUTPUT_SIZE);
+    SHA256D(&hash[0], encoded.data(), encoded.size());
+    return hash.getReverse();
+}
+
+uchar_vector BlockFilter::getHeader(const uchar_vector& prevHeader) const
+{
+    return getHeader(getHash(), prevHeader);
+}
+
+uchar_vector BlockFilter::getHeader(const uchar_vector& filterHash, const uchar_vector& prevHeader)
+{
+    if (filterHash.size() != 32 || prevHeader.size() != 32) throw std::runtime_error("BlockFilter::getHeader() - hashes must be 32 bytes.");
+
+    uchar_vector data;
+    data.reserve(64);
+    writeReversed(data, filterHash.data(), 32);
+    writeReversed(data, prevHeader.data(), 32);
+
+    uchar_vector header(CSHA256::OUTPUT_SIZE);
+    SHA256D(&header[0], data.data(), data.size());
+    return header.getReverse();
+}
+
+void BlockFilter::setKey(const uchar_vector& blockHash)
+{
+    if (blockHash.size() != 32) throw std::runtime_error("BlockFilter - block hash must be 32 bytes.");
+
+    // The key is the first 16 bytes of the hash as it is serialized.
+    uchar_vector key = blockHash.getReverse();
+    k0 = readLE64(&key[0]);
+    k1 = readLE64(&key[8]);
+}
+
+uint64_t BlockFilter::hashToRange(const uchar_vector& element) const
+{
+    return fastRange64(sipHash(k0, k1, element.data(), element.size()), n * M);
+}
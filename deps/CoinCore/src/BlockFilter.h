@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// BlockFilter.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#ifndef BLOCK_FILTER_H__
+#define BLOCK_FILTER_H__
+
+#include <stdutils/uchar_vector.h>
+
+#include <stdint.h>
+#include <vector>
+
+namespace Coin {
+
+// BIP158 basic block filter. A Golomb-coded set of the output scripts a block creates and the
+// output scripts its inputs spend, hashed with SipHash keyed by the block hash.
+//
+// Block hashes and filter hashes and headers are in the byte order hashes are shown in, the
+// same as CoinBlockHeader::hash().
+class BlockFilter
+{
+public:
+    static const uint8_t BASIC_FILTER_TYPE = 0;
+    static const unsigned int P = 19;
+    static const uint64_t M = 784931;
+
+    BlockFilter() : k0(0), k1(0), n(0), dataOffset(0) { }
+
+    // encoded is the filter as a cfilter message carries it.
+    BlockFilter(const uchar_vector& blockHash, const uchar_vector& encoded);
+
+    // Builds the filter for elements. Empty elements and repeats are left out.
+    BlockFilter(const uchar_vector& blockHash, const std::vector<uchar_vector>& elements);
+
+    const uchar_vector& getEncoded() const { return encoded; }
+    uint64_t getN() const { return n; }
+
+    bool match(const uchar_vector& element) const;
+
+    // True if any of the elements is in the filter. They are all hashed first and then checked
+    // in a single pass over the filter, so this is much faster than calling match() for each.
+    // Throws if the filter is not coded right.
+    bool matchAny(const std::vector<uchar_vector>& elements) const;
+
+    // Double SHA-256 of the encoded filter.
+    uchar_vector getHash() const;
+
+    // The filter header, which commits to this filter and every one before it.
+    uchar_vector getHeader(const uchar_vector& prevHeader) const;
+    static uchar_vector getHeader(const uchar_vector& filterHash, const uchar_vector& prevHeader);
+
+private:
+    uint64_t k0;
+    uint64_t k1;
+    uint64_t n;
+    uchar_vector encoded;
+    std::size_t dataOffset; // of the Golomb-Rice coded values, past n
+
+    void setKey(const uchar_vector& blockHash);
+    uint64_t hashToRange(const uchar_vector& element) const;
+};
+
+}
+
+#endif // BLOCK_FILTER_H__
@@ -126,3 +126,16 @@ bool BloomFilter::match(const uchar_vector& data) const
     }
     return true;
 }
+
+double BloomFilter::getFalsePositiveRate() const
+{
+    if (bFull) return 1.0;
+    if (filter.empty()) return 0.0;
+
+    uint64_t bitsSet = 0;
+    for (unsigned char byte: filter)
+    {
+        for (; byte; byte &= byte - 1) { bitsSet++; }
+    }
+    return pow((double)bitsSet / (filter.size() * 8), nHashFuncs);
+}
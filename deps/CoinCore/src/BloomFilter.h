@@ -33,7 +33,7 @@ private:
     uint32_t hash(uint n, const uchar_vector& data) const;
 
 public:
-    BloomFilter() : bSet(false) { }
+    BloomFilter() : bSet(false), bFull(false), bEmpty(true), nHashFuncs(0), nTweak(0), nFlags(0) { }
     BloomFilter(uint32_t nElements, double falsePositiveRate, uint32_t _nTweak, uint8_t _nFlags);
 
     void set(uint32_t nElements, double falsePositiveRate, uint32_t _nTweak, uint8_t _nFlags);
@@ -44,6 +44,9 @@ public:
     void insert(const uchar_vector& data);
     bool match(const uchar_vector& data) const;
 
+    // Estimated from the share of bits set, so it goes up as elements are inserted.
+    double getFalsePositiveRate() const;
+
     const uchar_vector& getFilter() const { return filter; }
     uint32_t getNHashFuncs() const { return nHashFuncs; }
     uint32_t getNTweak() const { return nTweak; }
@@ -23,6 +23,7 @@
 
 #include <iomanip>
 #include <algorithm>
+#include <atomic>
 
 #include <assert.h>
 
@@ -35,6 +36,10 @@ uchar_vector g_zero32bytes("0000000000000000000000000000000000000000000000000000
 unsigned char g_addressVersion = 0x00;
 unsigned char g_multiSigAddressVersion = 0x05;
 
+// Memoized hash statistics
+static std::atomic<uint64_t> g_hashCacheHits(0);
+static std::atomic<uint64_t> g_hashCacheMisses(0);
+
 void SetAddressVersion(unsigned char version)
 {
     g_addressVersion = version;
@@ -118,61 +123,67 @@ const uchar_vector& CoinNodeStructure::getHashLittleEndian(hashfunc_t hashfunc)
     return hashLittleEndian_;
 }
 
+uint64_t CoinNodeStructure::getHashCacheHits()
+{
+    return g_hashCacheHits;
+}
+
+uint64_t CoinNodeStructure::getHashCacheMisses()
+{
+    return g_hashCacheMisses;
+}
+
+void CoinNodeStructure::resetHashCacheStats()
+{
+    g_hashCacheHits = 0;
+    g_hashCacheMisses = 0;
+}
+
 uint32_t CoinNodeStructure::getChecksum() const
 {
     getHash();
     return vch_to_uint<uint32_t>(uchar_vector(hash_.begin(), hash_.begin() + 4), LITTLE_ENDIAN_);
 }
 
+uchar_vector CoinNodeStructure::serializeToBuffer() const
+{
+    uchar_vector rval;
+    rval.reserve(getSize());
+    serializeTo(rval);
+    return rval;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // class VarInt implementation
 //
 uint64_t VarInt::getSize() const
 {
-    if (this->value < 0xfd) return 1;
-    if (this->value <= 0xffff) return 3;
-    if (this->value <= 0xffffffff) return 5;
-    return 9;
+    return varIntSize(this->value);
 }
 
-uchar_vector VarInt::getSerialized() const
+void VarInt::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval;
-    if (this->value < 0xfd) {
-        rval.push_back(value);
-        return rval;
-    }
-    if (this->value <= 0xffff) {
-        rval.push_back(0xfd);
-        rval += uint_to_vch<uint16_t>(this->value, LITTLE_ENDIAN_);
-        return rval;
-    }
-    if (this->value <= 0xffffffff) {
-        rval.push_back(0xfe);
-        rval += uint_to_vch<uint32_t>(this->value, LITTLE_ENDIAN_);
-        return rval;
-    }
-    rval.push_back(0xff);
-    rval += uint_to_vch<uint64_t>(this->value, LITTLE_ENDIAN_);
-    return rval;
+    writeVarInt(buffer, this->value);
 }
 
 void VarInt::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_VAR_INT_SIZE)
-        throw runtime_error("Invalid data - VarInt too small.");
-
-    if (bytes[0] < 0xfd)
-        this->value = bytes[0];
-    else if ((bytes[0] == 0xfd) && (bytes.size() >= 3))
-        this->value = vch_to_uint<uint16_t>(uchar_vector(bytes.begin() + 1, bytes.begin() + 3), LITTLE_ENDIAN_);
-    else if ((bytes[0] == 0xfe) && (bytes.size() >= 5))
-        this->value = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + 1, bytes.begin() + 5), LITTLE_ENDIAN_);
-    else if (bytes.size() >= 9)
-        this->value = vch_to_uint<uint64_t>(uchar_vector(bytes.begin() + 1, bytes.begin() + 9), LITTLE_ENDIAN_);
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void VarInt::setSerialized(ByteReader& reader)
+{
+    unsigned char prefix = reader.readUInt8("Invalid data - VarInt too small.");
+    if (prefix < 0xfd)
+        this->value = prefix;
+    else if (prefix == 0xfd)
+        this->value = reader.readUInt16("Invalid data - VarInt length is wrong.");
+    else if (prefix == 0xfe)
+        this->value = reader.readUInt32("Invalid data - VarInt length is wrong.");
     else
-        throw runtime_error("Invalid data - VarInt length is wrong.");
+        this->value = reader.readUInt64("Invalid data - VarInt length is wrong.");
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -185,22 +196,26 @@ uint64_t VarString::getSize() const
     return length.getSize() + this->value.size();
 }
 
-uchar_vector VarString::getSerialized() const
+void VarString::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval;
-    VarInt length(this->value.size());
-    rval += length.getSerialized();
-    rval += uchar_vector(this->value.begin(), this->value.end());
-    return rval;
+    writeVarInt(buffer, this->value.size());
+    writeBytes(buffer, (const unsigned char*)this->value.data(), this->value.size());
 }
 
 void VarString::setSerialized(const uchar_vector& bytes)
 {
-    VarInt length(bytes);
-    if (bytes.size() < length.getSize() + length.value)
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void VarString::setSerialized(ByteReader& reader)
+{
+    uint64_t length = reader.readVarInt("Invalid data - VarInt too small.");
+    if (length > reader.remaining())
         throw runtime_error("Invalid data - VarString too small.");
 
-    value = string(bytes.begin() + length.getSize(), bytes.begin() + length.getSize() + length.value);
+    const char* p = (const char*)reader.read(length, "Invalid data - VarString too small.");
+    value.assign(p, length);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -233,16 +248,13 @@ NetworkAddress::NetworkAddress(const NetworkAddress& netaddr)
     this->port = netaddr.port;
 }
 
-uchar_vector NetworkAddress::getSerialized() const
+void NetworkAddress::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval;
     if (this->hasTime)
-        rval += uint_to_vch(this->time, LITTLE_ENDIAN_);
-    rval += uint_to_vch(this->services, LITTLE_ENDIAN_);
-    uchar_vector ipv6vch(this->ipv6.getBytes(), 16);
-    rval += ipv6vch;
-    rval += uint_to_vch(this->port, BIG_ENDIAN_);
-    return rval;
+        writeUInt32(buffer, this->time);
+    writeUInt64(buffer, this->services);
+    writeBytes(buffer, this->ipv6.getBytes(), 16);
+    writeUInt16BE(buffer, this->port);
 }
 
 void NetworkAddress::set(uint64_t services, const unsigned char ipv6_bytes[], uint16_t port)
@@ -255,22 +267,21 @@ void NetworkAddress::set(uint64_t services, const unsigned char ipv6_bytes[], ui
 
 void NetworkAddress::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_NETWORK_ADDRESS_SIZE)
-        throw runtime_error("Invalid data - NetworkAddress too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader, bytes.size() >= 30);
+}
 
-    uint pos = 0;
-    this->hasTime = (bytes.size() >= 30);
-    if (this->hasTime) {
-        this->time = vch_to_uint<uint32_t>(bytes, LITTLE_ENDIAN_);
-        pos += sizeof(uint32_t);
-    }
-    this->services = vch_to_uint<uint64_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + sizeof(uint64_t)), LITTLE_ENDIAN_);
-    pos += sizeof(uint64_t);
-    unsigned char ipv6_bytes[16];
-    uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 16).copyToArray(ipv6_bytes);
-    this->ipv6 = ipv6_bytes;
-    pos += 16;
-    this->port = vch_to_uint<uint16_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + sizeof(uint16_t)), BIG_ENDIAN_);
+void NetworkAddress::setSerialized(ByteReader& reader, bool bHasTime)
+{
+    const char* error = "Invalid data - NetworkAddress too small.";
+    reader.require(bHasTime ? 30 : MIN_NETWORK_ADDRESS_SIZE, error);
+
+    this->hasTime = bHasTime;
+    if (this->hasTime)
+        this->time = reader.readUInt32(error);
+    this->services = reader.readUInt64(error);
+    this->ipv6 = reader.read(16, error);
+    this->port = reader.readUInt16BE(error);
 }
 
 string NetworkAddress::getName() const
@@ -332,14 +343,13 @@ MessageHeader::MessageHeader(const MessageHeader& header)
     this->checksum = header.checksum; // will be ignored if hasChecksum == false
 }
 
-uchar_vector MessageHeader::getSerialized() const
+void MessageHeader::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(this->magic, LITTLE_ENDIAN_);
-    rval += uchar_vector((unsigned char*)this->command, 12);
-    rval += uint_to_vch(this->length, LITTLE_ENDIAN_);
+    writeUInt32(buffer, this->magic);
+    writeBytes(buffer, (const unsigned char*)this->command, 12);
+    writeUInt32(buffer, this->length);
     if (this->hasChecksum)
-        rval += uint_to_vch(this->checksum, LITTLE_ENDIAN_);
-    return rval;
+        writeUInt32(buffer, this->checksum);
 }
 
 void MessageHeader::setSerialized(const uchar_vector& bytes)
@@ -355,6 +365,18 @@ void MessageHeader::setSerialized(const uchar_vector& bytes)
         this->checksum = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + 20, bytes.begin() + 24), LITTLE_ENDIAN_);
 }
 
+void MessageHeader::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - MessageHeader too small.";
+    reader.require(24, error);
+
+    this->magic = reader.readUInt32(error);
+    reader.readBytes((unsigned char*)this->command, 12, error);
+    this->length = reader.readUInt32(error);
+    this->checksum = reader.readUInt32(error);
+    this->hasChecksum = true;
+}
+
 string MessageHeader::toString() const
 {
     stringstream ss;
@@ -474,6 +496,26 @@ void CoinNodeMessage::setMessage(uint32_t magic, CoinNodeStructure* pPayload)
         PongMessage* pMessage = static_cast<PongMessage*>(pPayload);
         this->pPayload = new PongMessage(*pMessage);
     }
+    else if (command == "getcfilters") {
+        this->header = MessageHeader(magic, command.c_str(), pPayload->getSize(), pPayload->getChecksum());
+        GetCFiltersMessage* pMessage = static_cast<GetCFiltersMessage*>(pPayload);
+        this->pPayload = new GetCFiltersMessage(*pMessage);
+    }
+    else if (command == "getcfheaders") {
+        this->header = MessageHeader(magic, command.c_str(), pPayload->getSize(), pPayload->getChecksum());
+        GetCFHeadersMessage* pMessage = static_cast<GetCFHeadersMessage*>(pPayload);
+        this->pPayload = new GetCFHeadersMessage(*pMessage);
+    }
+    else if (command == "cfilter") {
+        this->header = MessageHeader(magic, command.c_str(), pPayload->getSize(), pPayload->getChecksum());
+        CFilterMessage* pMessage = static_cast<CFilterMessage*>(pPayload);
+        this->pPayload = new CFilterMessage(*pMessage);
+    }
+    else if (command == "cfheaders") {
+        this->header = MessageHeader(magic, command.c_str(), pPayload->getSize(), pPayload->getChecksum());
+        CFHeadersMessage* pMessage = static_cast<CFHeadersMessage*>(pPayload);
+        this->pPayload = new CFHeadersMessage(*pMessage);
+    }
     else {
         string error_msg = "Unrecognized command: ";
         error_msg += command;
@@ -491,25 +533,26 @@ uint64_t CoinNodeMessage::getSize() const
     return this->header.getSize() + this->pPayload->getSize();
 }
 
-uchar_vector CoinNodeMessage::getSerialized() const
+void CoinNodeMessage::serializeTo(uchar_vector& buffer) const
 {
     if (!pPayload) throw runtime_error("Message not initialized.");
-    uchar_vector rval = this->header.getSerialized();
-    rval += this->pPayload->getSerialized();
-    return rval;
+    this->header.serializeTo(buffer);
+    this->pPayload->serializeTo(buffer);
 }
 
 void CoinNodeMessage::setSerialized(const uchar_vector& bytes)
 {
-    this->header.setSerialized(bytes);
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void CoinNodeMessage::setSerialized(ByteReader& reader)
+{
+    this->header.setSerialized(reader);
     string command = this->header.command;
-//      if ((command == "version") || (command == "verack"))
-// VERSION_CHECKSUM_CHANGE
-/*      if (command == "verack")
-            this->header.removeChecksum();
-*/
-    if (bytes.size() < header.getSize() + header.length)
-        throw runtime_error("Invalid data - CoinNodeMessage too small.");
+
+    // Payloads are parsed directly out of the caller's buffer.
+    ByteReader payload(reader.read(header.length, "Invalid data - CoinNodeMessage too small."), header.length);
 
     if (pPayload) {
         delete pPayload;
@@ -517,8 +560,7 @@ void CoinNodeMessage::setSerialized(const uchar_vector& bytes)
     }
 
     if (command == "version") {
-        this->pPayload =
-        new VersionMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new VersionMessage(payload);
     }
     else if (command == "verack") {
         this->pPayload = new BlankMessage("verack");
@@ -527,66 +569,67 @@ void CoinNodeMessage::setSerialized(const uchar_vector& bytes)
         this->pPayload = new BlankMessage("mempool");
     }
     else if (command == "addr") {
-        this->pPayload =
-            new AddrMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new AddrMessage(payload);
     }
     else if (command == "inv") {
-        this->pPayload =
-            new Inventory(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new Inventory(payload);
     }
     else if (command == "getdata") {
-        this->pPayload =
-            new GetDataMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new GetDataMessage(payload);
     }
     else if (command == "notfound") {
-        this->pPayload =
-            new NotFoundMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new NotFoundMessage(payload);
     }
     else if (command == "getblocks") {
-        this->pPayload =
-            new GetBlocksMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new GetBlocksMessage(payload);
     }
     else if (command == "getheaders") {
-        this->pPayload =
-            new GetHeadersMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new GetHeadersMessage(payload);
     }
     else if (command == "tx") {
-        this->pPayload =
-            new Transaction(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new Transaction(payload);
     }
     else if (command == "block") {
-        this->pPayload =
-            new CoinBlock(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new CoinBlock(payload);
     }
     else if (command == "merkleblock") {
-        this->pPayload =
-            new MerkleBlock(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new MerkleBlock(payload);
     }
     else if (command == "headers") {
-        this->pPayload =
-            new HeadersMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new HeadersMessage(payload);
     }
     else if (command == "getaddr") {
         this->pPayload = new GetAddrMessage();
     }
     else if (command == "filterload") {
-        this->pPayload =
-            new FilterLoadMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        FilterLoadMessage filterLoad(payload);
+        if (!payload.atEnd())
+            throw runtime_error("Invalid data - filter length incorrect.");
+        this->pPayload = new FilterLoadMessage(filterLoad);
     }
     else if (command == "filteradd") {
-        this->pPayload =
-            new FilterAddMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new FilterAddMessage(payload);
     }
     else if (command == "filterclear") {
         this->pPayload = new BlankMessage("filterclear");
     }
     else if (command == "ping") {
-        this->pPayload =
-            new PingMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new PingMessage(payload);
     }
     else if (command == "pong") {
-        this->pPayload =
-            new PongMessage(uchar_vector(bytes.begin() + header.getSize(), bytes.begin() + header.getSize() + header.length));
+        this->pPayload = new PongMessage(payload);
+    }
+    else if (command == "getcfilters") {
+        this->pPayload = new GetCFiltersMessage(payload);
+    }
+    else if (command == "getcfheaders") {
+        this->pPayload = new GetCFHeadersMessage(payload);
+    }
+    else if (command == "cfilter") {
+        this->pPayload = new CFilterMessage(payload);
+    }
+    else if (command == "cfheaders") {
+        this->pPayload = new CFHeadersMessage(payload);
     }
     else {
         string error_msg = "Unrecognized command: ";
@@ -663,49 +706,44 @@ uint64_t VersionMessage::getSize() const
     return size;
 }
 
-uchar_vector VersionMessage::getSerialized() const
+void VersionMessage::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(version_, LITTLE_ENDIAN_);
-    rval += uint_to_vch(services_, LITTLE_ENDIAN_);
-    rval += uint_to_vch(timestamp_, LITTLE_ENDIAN_);
-    rval += recipientAddress_.getSerialized();
-    rval += senderAddress_.getSerialized();
-    rval += uint_to_vch(nonce_, LITTLE_ENDIAN_);
-    rval += subVersion_.getSerialized();
-    rval += uint_to_vch(startHeight_, LITTLE_ENDIAN_);
-    if (version_ >= 70001) { rval.push_back(relay_ ? 1 : 0); }
-    return rval;
+    writeUInt32(buffer, version_);
+    writeUInt64(buffer, services_);
+    writeUInt64(buffer, timestamp_);
+    recipientAddress_.serializeTo(buffer);
+    senderAddress_.serializeTo(buffer);
+    writeUInt64(buffer, nonce_);
+    subVersion_.serializeTo(buffer);
+    writeUInt32(buffer, startHeight_);
+    if (version_ >= 70001) { writeUInt8(buffer, relay_ ? 1 : 0); }
 }
 
 void VersionMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_VERSION_MESSAGE_SIZE)
-        throw runtime_error("Invalid data - VersionMessage too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void VersionMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - VersionMessage too small.";
+    reader.require(MIN_VERSION_MESSAGE_SIZE, error);
 
-    version_ = vch_to_uint<uint32_t>(bytes, LITTLE_ENDIAN_);
-    if (version_ >= 70001 && bytes.size() < MIN_VERSION_MESSAGE_SIZE + 1)
+    version_ = reader.readUInt32(error);
+    if (version_ >= 70001 && reader.remaining() < MIN_VERSION_MESSAGE_SIZE + 1 - 4)
         throw runtime_error("Invalid data - VersionMessage is too small for version >= 70001.");
 
-    uint pos = 4;
-    services_ = vch_to_uint<uint64_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 8), LITTLE_ENDIAN_);
-    pos += 8;
-    timestamp_ = vch_to_uint<uint64_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 8), LITTLE_ENDIAN_);
-    pos += 8;
-    recipientAddress_ = NetworkAddress(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 26));
-    pos += 26;
-    senderAddress_ = NetworkAddress(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 26));
-    pos += 26;
-    nonce_ = vch_to_uint<uint64_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 8), LITTLE_ENDIAN_);
-    pos += 8;
-    subVersion_ = VarString(uchar_vector(bytes.begin() + pos, bytes.end()));
-    pos += subVersion_.getSize();
-    if (bytes.size() < pos + 4)
-        throw runtime_error("Invalid data - VersionMessage missing startHeight.");
-    startHeight_ = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 4), LITTLE_ENDIAN_);
+    services_ = reader.readUInt64(error);
+    timestamp_ = reader.readUInt64(error);
+    recipientAddress_.setSerialized(reader, false);
+    senderAddress_.setSerialized(reader, false);
+    nonce_ = reader.readUInt64(error);
+    subVersion_.setSerialized(reader);
+    startHeight_ = reader.readUInt32("Invalid data - VersionMessage missing startHeight.");
     if (version_ >= 70001)
     {
-        pos += 4;
-        relay_ = (bytes[pos] != 0);
+        relay_ = (reader.readUInt8("Invalid data - VersionMessage missing relay.") != 0);
     }
     else
     {
@@ -749,29 +787,30 @@ string VersionMessage::toIndentedString(uint spaces) const
 //
 // class AddrMessage implementation
 //
-uchar_vector AddrMessage::getSerialized() const
+void AddrMessage::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = VarInt(addrList.size()).getSerialized();
-    for (uint i = 0; i < addrList.size(); i++) {
-        rval += addrList[i].getSerialized();
-    }
-    return rval;
+    writeVarInt(buffer, addrList.size());
+    for (auto& addr: addrList) { addr.serializeTo(buffer); }
 }
 
 void AddrMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_ADDR_MESSAGE_SIZE)
-        throw runtime_error("Invalid data - AddrMessage too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void AddrMessage::setSerialized(ByteReader& reader)
+{
+    reader.require(MIN_ADDR_MESSAGE_SIZE, "Invalid data - AddrMessage too small.");
 
     addrList.clear();
 
-    VarInt count(bytes);
-    uint pos = count.getSize();
-    for (uint i = 0; i < count.value; i++) {
-        NetworkAddress addr(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 30));
-        addrList.push_back(addr);
-        pos += 30;
-    }
+    uint64_t count = reader.readVarInt("Invalid data - VarInt too small.");
+    if (count > reader.remaining() / 30)
+        throw runtime_error("Invalid data - AddrMessage too small.");
+
+    addrList.resize(count);
+    for (auto& addr: addrList) { addr.setSerialized(reader, true); }
 }
 
 string AddrMessage::toString() const
@@ -800,24 +839,26 @@ string AddrMessage::toIndentedString(uint spaces) const
 //
 // class InventoryItem implementation
 //
-uchar_vector InventoryItem::getSerialized() const
+void InventoryItem::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(itemType, LITTLE_ENDIAN_);
-    uchar_vector hashBytes((unsigned char*)hash, 32);
-    hashBytes.reverse(); // to little endian
-    rval += hashBytes;
-    return rval;
+    writeUInt32(buffer, itemType);
+    writeReversed(buffer, hash, 32); // to little endian
 }
 
 void InventoryItem::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_INVENTORY_ITEM_SIZE)
-        throw runtime_error("Invalid data - InventoryItem too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void InventoryItem::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - InventoryItem too small.";
+    reader.require(MIN_INVENTORY_ITEM_SIZE, error);
 
-    this->itemType = vch_to_uint<uint32_t>(bytes, LITTLE_ENDIAN_);
-    uchar_vector hashBytes(bytes.begin() + 4, bytes.begin() + 36);
-    hashBytes.reverse(); // to big endian
-    hashBytes.copyToArray((unsigned char*)this->hash);
+    this->itemType = reader.readUInt32(error);
+    const unsigned char* p = reader.read(32, error);
+    std::reverse_copy(p, p + 32, this->hash); // to big endian
 }
 
 string InventoryItem::toString() const
@@ -839,28 +880,26 @@ string InventoryItem::toIndentedString(uint spaces) const
 //
 // class Inventory implementation
 //
-uchar_vector Inventory::getSerialized() const
+void Inventory::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector data = VarInt(this->items.size()).getSerialized();
-
-    for (uint i = 0; i < this->items.size(); i++)
-        data += (this->items)[i].getSerialized();
-
-    return data;
+    writeVarInt(buffer, this->items.size());
+    for (auto& item: this->items) { item.serializeTo(buffer); }
 }
 
 void Inventory::setSerialized(const uchar_vector& bytes)
 {
-    VarInt count(bytes);
-    uint pos = count.getSize();
-    if (bytes.size() < pos + MIN_INVENTORY_ITEM_SIZE*count.value)
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void Inventory::setSerialized(ByteReader& reader)
+{
+    uint64_t count = reader.readVarInt("Invalid data - VarInt too small.");
+    if (count > reader.remaining() / MIN_INVENTORY_ITEM_SIZE)
         throw runtime_error("Invalid data - message too small.");
 
-    for (uint i = 0; i < count.value; i++) {
-        uchar_vector field(bytes.begin() + pos, bytes.end());
-        InventoryItem item(field); pos += item.getSerialized().size();
-        (this->items).push_back(item);
-    }
+    this->items.resize(count);
+    for (auto& item: this->items) { item.setSerialized(reader); }
 }
 
 string Inventory::toString() const
@@ -947,34 +986,33 @@ GetBlocksMessage::GetBlocksMessage(const string& hex)
     this->setSerialized(bytes);
 }
 
-uchar_vector GetBlocksMessage::getSerialized() const
+void GetBlocksMessage::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(this->version, LITTLE_ENDIAN_);
-    rval += VarInt(this->blockLocatorHashes.size()).getSerialized();
-    for (uint i = 0; i < this->blockLocatorHashes.size(); i++)
-        rval += uchar_vector(this->blockLocatorHashes[i].begin(), this->blockLocatorHashes[i].begin() + 32).getReverse();
-    rval += uchar_vector(this->hashStop).getReverse();
-    return rval;
+    writeUInt32(buffer, this->version);
+    writeVarInt(buffer, this->blockLocatorHashes.size());
+    for (auto& hash: this->blockLocatorHashes) { writeReversed(buffer, hash.data(), 32); }
+    writeReversed(buffer, this->hashStop.data(), this->hashStop.size());
 }
 
 void GetBlocksMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_GET_BLOCKS_SIZE)
-        throw runtime_error("Invalid data - GetBlocksMessage too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void GetBlocksMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - GetBlocksMessage has wrong length.";
+    reader.require(MIN_GET_BLOCKS_SIZE, "Invalid data - GetBlocksMessage too small.");
 
-    this->version = vch_to_uint<uint32_t>(bytes, LITTLE_ENDIAN_); uint pos = 4;
-    VarInt count(uchar_vector(bytes.begin() + 4, bytes.end())); pos += count.getSize();
-    if (bytes.size() < pos + 32*(count.value + 1))
-        throw runtime_error("Invalid data - GetBlocksMessage has wrong length.");
-    this->blockLocatorHashes.clear();
-    uchar_vector hash;
-    for (uint i = 0; i < count.value; i++) {
-        hash.assign(bytes.begin() + pos, bytes.begin() + pos + 32); pos += 32;
-        hash.reverse();
-        this->blockLocatorHashes.push_back(hash);
-    }
-    this->hashStop.assign(bytes.begin() + pos, bytes.begin() + pos + 32);
-    this->hashStop.reverse();
+    this->version = reader.readUInt32(error);
+    uint64_t count = reader.readVarInt(error);
+    if (count >= reader.remaining() / 32)
+        throw runtime_error(error);
+
+    this->blockLocatorHashes.resize(count);
+    for (auto& hash: this->blockLocatorHashes) { reader.readReversed(hash, 32, error); }
+    reader.readReversed(this->hashStop, 32, error);
 }
 
 string GetBlocksMessage::toString() const
@@ -1008,35 +1046,33 @@ string GetBlocksMessage::toIndentedString(uint spaces) const
 //
 // class GetHeadersMessage implementation
 //
-uchar_vector GetHeadersMessage::getSerialized() const
+void GetHeadersMessage::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(this->version, LITTLE_ENDIAN_);
-    rval += VarInt(this->blockLocatorHashes.size()).getSerialized();
-    for (uint i = 0; i < this->blockLocatorHashes.size(); i++)
-        rval += uchar_vector(this->blockLocatorHashes[i].begin(), this->blockLocatorHashes[i].begin() + 32).getReverse();
-    rval += uchar_vector(this->hashStop).getReverse();
-    return rval;
+    writeUInt32(buffer, this->version);
+    writeVarInt(buffer, this->blockLocatorHashes.size());
+    for (auto& hash: this->blockLocatorHashes) { writeReversed(buffer, hash.data(), 32); }
+    writeReversed(buffer, this->hashStop.data(), this->hashStop.size());
 }
 
 void GetHeadersMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_GET_BLOCKS_SIZE)
-        throw runtime_error("Invalid data - GetHeadersMessage too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    this->version = vch_to_uint<uint32_t>(bytes, LITTLE_ENDIAN_); uint pos = 4;
-    VarInt count(uchar_vector(bytes.begin() + pos, bytes.end())); pos += count.getSize();
-    if (bytes.size() < pos + 32*(count.value + 1))
-        throw runtime_error("Invalid data - GetHeadersMessage has wrong length.");
+void GetHeadersMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - GetHeadersMessage has wrong length.";
+    reader.require(MIN_GET_BLOCKS_SIZE, "Invalid data - GetHeadersMessage too small.");
 
-    this->blockLocatorHashes.clear();
-    uchar_vector hash;
-    for (uint i = 0; i < count.value; i++) {
-        hash.assign(bytes.begin() + pos, bytes.begin() + pos + 32); pos += 32;
-        hash.reverse();
-        this->blockLocatorHashes.push_back(hash);
-    }
-    this->hashStop.assign(bytes.begin() + pos, bytes.begin() + pos + 32);
-    this->hashStop.reverse();
+    this->version = reader.readUInt32(error);
+    uint64_t count = reader.readVarInt(error);
+    if (count >= reader.remaining() / 32)
+        throw runtime_error(error);
+
+    this->blockLocatorHashes.resize(count);
+    for (auto& hash: this->blockLocatorHashes) { reader.readReversed(hash, 32, error); }
+    reader.readReversed(this->hashStop, 32, error);
 }
 
 string GetHeadersMessage::toString() const
@@ -1075,24 +1111,26 @@ void OutPoint::setPoint(const uchar_vector& hashBytes, uint index)
     this->index = index;
 }
 
-uchar_vector OutPoint::getSerialized() const
+void OutPoint::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval(this->hash, 32);
-    rval.reverse(); // to big endian
-    rval += uint_to_vch(this->index, LITTLE_ENDIAN_);
-    return rval;
+    writeReversed(buffer, this->hash, 32); // to big endian
+    writeUInt32(buffer, this->index);
 }
 
 void OutPoint::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_OUT_POINT_SIZE)
-        throw runtime_error("Invalid data - OutPoint too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    uchar_vector hashBytes(bytes.begin(), bytes.begin() + 32);
-    hashBytes.reverse(); // to little endian
+void OutPoint::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - OutPoint too small.";
+    reader.require(MIN_OUT_POINT_SIZE, error);
 
-    memcpy(this->hash, &hashBytes[0], 32);
-    this->index = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + 32, bytes.begin() + 36), LITTLE_ENDIAN_);
+    const unsigned char* p = reader.read(32, error);
+    std::reverse_copy(p, p + 32, this->hash); // to little endian
+    this->index = reader.readUInt32(error);
 }
 
 string OutPoint::toDelimited(const string& delimiter) const
@@ -1132,33 +1170,40 @@ uint64_t ScriptWitness::getSize() const
     return rval;
 }
 
-uchar_vector ScriptWitness::getSerialized() const
+void ScriptWitness::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = VarInt(stack.size()).getSerialized();
+    writeVarInt(buffer, stack.size());
     for (auto& item: stack)
     {
-        rval += VarInt(item.size()).getSerialized();
-        rval += item;
+        writeVarInt(buffer, item.size());
+        writeBytes(buffer, item);
     }
-    return rval;
-    
 }
 
 void ScriptWitness::setSerialized(const uchar_vector& bytes)
 {
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void ScriptWitness::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - ScriptWitness parse error";
+
     clear();
 
-    VarInt count(bytes);
-    uint pos = count.getSize();
-    for (uint i = 0; i < count.value; i++)
+    uint64_t count = reader.readVarInt(error);
+    if (count > reader.remaining())
+        throw runtime_error(error);
+
+    stack.resize(count);
+    for (auto& item: stack)
     {
-        VarInt size(uchar_vector(bytes.begin() + pos, bytes.end())); pos += size.getSize();
-        if (bytes.size() < pos + size.value)
-            throw runtime_error("Invalid data - ScriptWitness parse error");
+        uint64_t size = reader.readVarInt(error);
+        if (size > reader.remaining())
+            throw runtime_error(error);
 
-        uchar_vector item;
-        item.assign(bytes.begin() + pos, bytes.begin() + pos + size.value); pos += size.value;
-        stack.push_back(item);
+        reader.readBytes(item, size, error);
     }
 }
 
@@ -1177,30 +1222,39 @@ TxIn::TxIn(const OutPoint& previousOut, const string& scriptSigHex, uint32_t seq
 
 uchar_vector TxIn::getSerialized(bool includeScriptSigLength) const
 {
-    uchar_vector rval = this->previousOut.getSerialized();
-    if (includeScriptSigLength)
-        rval += VarInt(this->scriptSig.size()).getSerialized();
-    rval += this->scriptSig;
-    rval += uint_to_vch(this->sequence, LITTLE_ENDIAN_);
+    uchar_vector rval;
+    rval.reserve(getSize());
+    serializeTo(rval, includeScriptSigLength);
     return rval;
 }
 
+void TxIn::serializeTo(uchar_vector& buffer, bool includeScriptSigLength) const
+{
+    this->previousOut.serializeTo(buffer);
+    if (includeScriptSigLength)
+        writeVarInt(buffer, this->scriptSig.size());
+    writeBytes(buffer, this->scriptSig);
+    writeUInt32(buffer, this->sequence);
+}
+
 void TxIn::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_TX_IN_SIZE)
-        throw runtime_error("Invalid data - TxIn too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    this->previousOut.setSerialized(bytes);
-    VarInt scriptLength(uchar_vector(bytes.begin() + 36, bytes.end()));
-    uint pos =  scriptLength.getSize() + 36;
-    if (bytes.size() < pos + scriptLength.value) {
-        cout << "TxIn: " << bytes.getHex() << endl;
-        throw runtime_error("Invalid data - TxIn script length too small.");
-    }
+void TxIn::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - TxIn script length too small.";
+    reader.require(MIN_TX_IN_SIZE, "Invalid data - TxIn too small.");
+
+    this->previousOut.setSerialized(reader);
+    uint64_t scriptLength = reader.readVarInt(error);
+    if (scriptLength > reader.remaining())
+        throw runtime_error(error);
 
-    this->scriptSig.assign(bytes.begin() + pos, bytes.begin() + pos + scriptLength.value);
-    pos += scriptLength.value;
-    this->sequence = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 4), LITTLE_ENDIAN_);
+    reader.readBytes(this->scriptSig, scriptLength, error);
+    this->sequence = reader.readUInt32("Invalid data - TxIn missing sequence.");
 }
 
 string TxIn::getAddress() const
@@ -1267,26 +1321,30 @@ TxOut::TxOut(uint64_t value, const string& scriptPubKeyHex)
     this->scriptPubKey = script;
 }
 
-uchar_vector TxOut::getSerialized() const
+void TxOut::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(this->value, LITTLE_ENDIAN_);
-    rval += VarInt(this->scriptPubKey.size()).getSerialized();
-    rval += this->scriptPubKey;
-    return rval;
+    writeUInt64(buffer, this->value);
+    writeVarInt(buffer, this->scriptPubKey.size());
+    writeBytes(buffer, this->scriptPubKey);
 }
 
 void TxOut::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_TX_OUT_SIZE)
-        throw runtime_error("Invalid data - TxOut too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    this->value = vch_to_uint<uint64_t>(bytes, LITTLE_ENDIAN_);
-    VarInt scriptLength(uchar_vector(bytes.begin() + 8, bytes.end()));
-    uint pos = scriptLength.getSize() + 8;
-    if (bytes.size() < pos + scriptLength.value)
-        throw runtime_error("Invalid data - TxOut script length too small.");
+void TxOut::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - TxOut script length too small.";
+    reader.require(MIN_TX_OUT_SIZE, "Invalid data - TxOut too small.");
 
-    this->scriptPubKey.assign(bytes.begin() + pos, bytes.begin() + pos + scriptLength.value);
+    this->value = reader.readUInt64(error);
+    uint64_t scriptLength = reader.readVarInt(error);
+    if (scriptLength > reader.remaining())
+        throw runtime_error(error);
+
+    reader.readBytes(this->scriptPubKey, scriptLength, error);
 }
 
 string TxOut::getAddress() const
@@ -1352,16 +1410,35 @@ Transaction::Transaction(const string& hex)
     this->setSerialized(bytes);
 }
 
+void Transaction::updateHashCache(bool bWithWitness) const
+{
+    bool& isSet = bWithWitness ? isWtxidSet_ : isTxidSet_;
+    if (isSet)
+    {
+        g_hashCacheHits++;
+        return;
+    }
+
+    g_hashCacheMisses++;
+    uchar_vector& hash = bWithWitness ? wtxid_ : txid_;
+    hash = sha256_2(getSerialized(bWithWitness));
+    (bWithWitness ? wtxidLittleEndian_ : txidLittleEndian_) = hash.getReverse();
+    isSet = true;
+}
+
 const uchar_vector& Transaction::getHash(bool bWithWitness) const
 {
-    hash_ = sha256_2(getSerialized(bWithWitness));
-    return hash_;
+    // Without witness data the wtxid is the txid.
+    bWithWitness = bWithWitness && hasWitness();
+    updateHashCache(bWithWitness);
+    return bWithWitness ? wtxid_ : txid_;
 }
 
 const uchar_vector& Transaction::getHashLittleEndian(bool bWithWitness) const
 {
-    hashLittleEndian_ = sha256_2(getSerialized(bWithWitness)).getReverse();
-    return hashLittleEndian_;
+    bWithWitness = bWithWitness && hasWitness();
+    updateHashCache(bWithWitness);
+    return bWithWitness ? wtxidLittleEndian_ : txidLittleEndian_;
 }
 
 const uchar_vector& Transaction::getHash(hashfunc_t hashfunc, bool bWithWitness) const
@@ -1378,8 +1455,8 @@ const uchar_vector& Transaction::getHashLittleEndian(hashfunc_t hashfunc, bool b
 
 uint32_t Transaction::getChecksum() const
 {
-    getHash(true);
-    return vch_to_uint<uint32_t>(uchar_vector(hash_.begin(), hash_.begin() + 4), LITTLE_ENDIAN_);
+    const uchar_vector& hash = getHash(true);
+    return vch_to_uint<uint32_t>(uchar_vector(hash.begin(), hash.begin() + 4), LITTLE_ENDIAN_);
 }
 
 uint64_t Transaction::getSize(bool bWithWitness) const
@@ -1430,39 +1507,45 @@ uint64_t Transaction::getVSize() const
     return count;
 }
 uchar_vector Transaction::getSerialized(bool bWithWitness) const
+{
+    uchar_vector rval;
+    rval.reserve(getSize(bWithWitness));
+    serializeTo(rval, bWithWitness);
+    return rval;
+}
+
+void Transaction::serializeTo(uchar_vector& buffer, bool bWithWitness) const
 {
     bWithWitness = bWithWitness && hasWitness();
 
     // version
-    uchar_vector rval = uint_to_vch(version, LITTLE_ENDIAN_);
+    writeUInt32(buffer, version);
 
     if (bWithWitness)
     {
         // mask
-        rval.push_back(0x00);
+        writeUInt8(buffer, 0x00);
 
         // flags
-        rval.push_back(0x01);
+        writeUInt8(buffer, 0x01);
     }
 
     // inputs
-    rval += VarInt(inputs.size()).getSerialized();
-    for (auto& input: inputs) { rval += input.getSerialized(); }
+    writeVarInt(buffer, inputs.size());
+    for (auto& input: inputs) { input.serializeTo(buffer); }
 
     // outputs
-    rval += VarInt(outputs.size()).getSerialized();
-    for (auto& output: outputs) { rval += output.getSerialized(); }
+    writeVarInt(buffer, outputs.size());
+    for (auto& output: outputs) { output.serializeTo(buffer); }
 
     if (bWithWitness)
     {
         // witness
-        for (auto& input: inputs) { rval += input.scriptWitness.getSerialized(); }
+        for (auto& input: inputs) { input.scriptWitness.serializeTo(buffer); }
     }
 
     // lock time
-    rval += uint_to_vch(lockTime, LITTLE_ENDIAN_);
-
-    return rval;
+    writeUInt32(buffer, lockTime);
 }
 
 void Transaction::setSerialized(const uchar_vector& bytes)
@@ -1470,56 +1553,56 @@ void Transaction::setSerialized(const uchar_vector& bytes)
     if (bytes.size() < MIN_TRANSACTION_SIZE)
         throw runtime_error(string("Invalid data - Transaction too small: ") + bytes.getHex());
 
-    // version
-    this->version = vch_to_uint<uint32_t>(uchar_vector(bytes.begin(), bytes.begin() + 4), LITTLE_ENDIAN_);
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void Transaction::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - Transaction too small.";
+    reader.require(MIN_TRANSACTION_SIZE, error);
+
+    resetHash();
+    resetSigHash();
 
-    uint pos = 4;
+    // version
+    this->version = reader.readUInt32(error);
 
     int flags = 0;
-    if (bytes[pos] == 0)
+    if (reader.peek(error) == 0)
     {
         // witness serialization
-        pos++;
-        flags = bytes[pos++];
+        reader.skip(1, error);
+        flags = reader.readUInt8(error);
         if (flags != 1)
             throw runtime_error("Invalid data - unrecognized flags");
     }
 
-    // inputs
+    // inputs - parsed in place, reserving no more than the remaining bytes could hold
     this->inputs.clear();
-    VarInt count(uchar_vector(bytes.begin() + pos, bytes.end()));
-    pos += count.getSize();
-    uint64_t i;
-    for (i = 0; i < count.value; i++) {
-        TxIn txIn(uchar_vector(bytes.begin() + pos, bytes.end()));
-        this->addInput(txIn);
-        pos += txIn.getSize();
+    uint64_t count = reader.readVarInt(error);
+    this->inputs.reserve(std::min<uint64_t>(count, reader.remaining() / MIN_TX_IN_SIZE));
+    for (uint64_t i = 0; i < count; i++) {
+        this->inputs.emplace_back();
+        this->inputs.back().setSerialized(reader);
     }
 
     // outputs
     this->outputs.clear();
-    count.setSerialized(uchar_vector(bytes.begin() + pos, bytes.end()));
-    pos += count.getSize();
-    for (i = 0; i < count.value; i++) {
-        TxOut txOut(uchar_vector(bytes.begin() + pos, bytes.end()));
-        this->addOutput(txOut);
-        pos += txOut.getSize();
+    count = reader.readVarInt(error);
+    this->outputs.reserve(std::min<uint64_t>(count, reader.remaining() / MIN_TX_OUT_SIZE));
+    for (uint64_t i = 0; i < count; i++) {
+        this->outputs.emplace_back();
+        this->outputs.back().setSerialized(reader);
     }
 
     if (flags != 0)
     {
-        for (auto& input: inputs)
-        {
-            input.scriptWitness.setSerialized(uchar_vector(bytes.begin() + pos, bytes.end()));
-            pos += input.scriptWitness.getSize();
-        }
+        for (auto& input: inputs) { input.scriptWitness.setSerialized(reader); }
     }
 
-    if (bytes.size() < pos + 4)
-        throw runtime_error("Invalid data - Transaction missing lockTime.");
-
     // lock time
-    this->lockTime = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 4), LITTLE_ENDIAN_);
+    this->lockTime = reader.readUInt32("Invalid data - Transaction missing lockTime.");
 }
 
 string Transaction::toString() const
@@ -1576,6 +1659,7 @@ void Transaction::clearScriptSigs()
 {
     for (uint i = 0; i < this->inputs.size(); i++)
         this->inputs[i].scriptSig.clear();
+    resetHash();
 }
 
 void Transaction::setScriptSig(uint index, const uchar_vector& scriptSig)
@@ -1583,6 +1667,7 @@ void Transaction::setScriptSig(uint index, const uchar_vector& scriptSig)
     if (index > inputs.size()-1)
         throw runtime_error("Index out of range.");
     inputs[index].scriptSig = scriptSig;
+    resetHash();
 }
 
 void Transaction::setScriptSig(uint index, const string& scriptSigHex)
@@ -1602,7 +1687,11 @@ uint64_t Transaction::getTotalSent() const
 
 uchar_vector Transaction::getHashWithAppendedCode(uint32_t code) const
 {
-    return sha256_2(this->getSerialized() + uint_to_vch(code, LITTLE_ENDIAN_));
+    uchar_vector data;
+    data.reserve(getSize() + 4);
+    serializeTo(data);
+    writeUInt32(data, code);
+    return sha256_2(data);
 }
 
 uchar_vector Transaction::getSigHash(uint32_t hashType, uint index, const uchar_vector& script, uint64_t value) const
@@ -1610,76 +1699,142 @@ uchar_vector Transaction::getSigHash(uint32_t hashType, uint index, const uchar_
     if (index >= inputs.size())
         throw runtime_error("Index out of range.");
 
+    return getSigHashContext().getSigHash(hashType, index, script, value, !inputs[index].scriptWitness.isEmpty());
+}
+
+const SigHashContext& Transaction::getSigHashContext() const
+{
+    if (!sigHashContext_) { sigHashContext_ = std::make_shared<SigHashContext>(*this); }
+    return *sigHashContext_;
+}
+
+void Transaction::resetSigHash()
+{
+    sigHashContext_.reset();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// class SigHashContext implementation
+//
+static void checkSigHashType(uint32_t hashType)
+{
     // TODO: Add other hashtype support
     if (hashType != SIGHASH_ALL && hashType != (SIGHASH_ALL | SIGHASH_FORKID_BCO)) 
         throw runtime_error("Unsupported hash type.");
+}
 
-    if (inputs[index].scriptWitness.isEmpty())
+static void writeSigHashType(uchar_vector& buffer, uint32_t hashType)
+{
+    writeUInt32(buffer, hashType);
+    if (hashType & SIGHASH_FORKID_BCO)
     {
-        // Old sighash
-        Transaction copy(*this);
-        for (uint i = 0; i < copy.inputs.size(); i++)
-        {
-            if (index == i) { copy.inputs[i].scriptSig = script; }
-            else            { copy.inputs[i].scriptSig.clear();  }
-        }
-        if (hashType & SIGHASH_FORKID_BCO) {
-            uint8_t size = 3;
-            return sha256_2(copy.getSerialized(false) + uint_to_vch(hashType, LITTLE_ENDIAN_) 
-                + uint_to_vch(size, LITTLE_ENDIAN_)   + vector<unsigned char>{'b', 'c', 'o'});
-        }
-        else {
-            return sha256_2(copy.getSerialized(false) + uint_to_vch(hashType, LITTLE_ENDIAN_));
-        }
+        writeUInt8(buffer, 3);
+        writeBytes(buffer, (const unsigned char*)"bco", 3);
     }
+}
 
-    if (hashPrevouts.empty())
+SigHashContext::SigHashContext(const Transaction& tx)
+    : version_(tx.version), lockTime_(tx.lockTime)
+{
+    uchar_vector ss;
+    ss.reserve(tx.inputs.size() * 36);
+    for (auto& input: tx.inputs) { input.previousOut.serializeTo(ss); }
+    hashPrevouts_ = sha256_2(ss);
+
+    ss.clear();
+    for (auto& input: tx.inputs) { writeUInt32(ss, input.sequence); }
+    hashSequence_ = sha256_2(ss);
+
+    ss.clear();
+    for (auto& output: tx.outputs) { output.serializeTo(ss); }
+    hashOutputs_ = sha256_2(ss);
+
+    // Legacy skeleton: the transaction without witness data and with every scriptSig empty.
+    skeleton_.reserve(tx.getSize(false));
+    writeUInt32(skeleton_, tx.version);
+    writeVarInt(skeleton_, tx.inputs.size());
+    scriptOffsets_.reserve(tx.inputs.size());
+    for (auto& input: tx.inputs)
     {
-        uchar_vector ss;
-        for (auto& input: inputs) { ss += input.previousOut.getSerialized(); }
-        hashPrevouts = sha256_2(ss);
-    }
-
-    if (hashSequence.empty())
+        input.previousOut.serializeTo(skeleton_);
+        scriptOffsets_.push_back(skeleton_.size());
+        writeVarInt(skeleton_, 0);
+        writeUInt32(skeleton_, input.sequence);
+    }
+    writeVarInt(skeleton_, tx.outputs.size());
+    for (auto& output: tx.outputs) { output.serializeTo(skeleton_); }
+    writeUInt32(skeleton_, tx.lockTime);
+
+    midstates_.resize(scriptOffsets_.size());
+    CSHA256 hasher;
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < scriptOffsets_.size(); i++)
     {
-        uchar_vector ss;
-        for (auto& input: inputs) { ss += uint_to_vch(input.sequence, LITTLE_ENDIAN_); }
-        hashSequence = sha256_2(ss);
+        hasher.Write(&skeleton_[pos], scriptOffsets_[i] - pos);
+        pos = scriptOffsets_[i];
+        midstates_[i] = hasher;
     }
+}
 
-    if (hashOutputs.empty())
-    {
-        uchar_vector ss;
-        for (auto& output: outputs) { ss += output.getSerialized(); }
-        hashOutputs = sha256_2(ss);
-    }
+uchar_vector SigHashContext::getSigHash(uint32_t hashType, uint index, const uchar_vector& script, uint64_t value, bool bWitnessV0) const
+{
+    return bWitnessV0 ? getWitnessV0SigHash(hashType, index, script, value) : getLegacySigHash(hashType, index, script);
+}
 
+uchar_vector SigHashContext::getLegacySigHash(uint32_t hashType, uint index, const uchar_vector& script) const
+{
+    if (index >= scriptOffsets_.size())
+        throw runtime_error("Index out of range.");
+
+    checkSigHashType(hashType);
+
+    // Splice the script being signed into the skeleton in place of the empty scriptSig.
     uchar_vector ss;
-    ss += uint_to_vch(version, LITTLE_ENDIAN_);
-    ss += hashPrevouts;
-    ss += hashSequence;
-    ss += inputs[index].previousOut.getSerialized();
-    ss += VarInt(script.size()).getSerialized();
-    ss += script;
-    ss += uint_to_vch(value, LITTLE_ENDIAN_);
-    ss += uint_to_vch(inputs[index].sequence, LITTLE_ENDIAN_);
-    ss += hashOutputs;
-    ss += uint_to_vch(lockTime, LITTLE_ENDIAN_);
-    ss += uint_to_vch(hashType, LITTLE_ENDIAN_);
-    if (hashType & SIGHASH_FORKID_BCO)
-    {
-        uint8_t size = 3;
-        ss += uint_to_vch(size, LITTLE_ENDIAN_);
-        ss += vector<unsigned char>{'b', 'c', 'o'};
-    }
-    return sha256_2(ss);
+    ss.reserve(9 + script.size());
+    writeVarInt(ss, script.size());
+    writeBytes(ss, script);
+
+    std::size_t pos = scriptOffsets_[index] + 1;
+    CSHA256 hasher = midstates_[index];
+    hasher.Write(&ss[0], ss.size());
+    hasher.Write(&skeleton_[pos], skeleton_.size() - pos);
+
+    ss.clear();
+    writeSigHashType(ss, hashType);
+    hasher.Write(&ss[0], ss.size());
+
+    uchar_vector hash(CSHA256::OUTPUT_SIZE);
+    hasher.Finalize(&hash[0]);
+    hasher.Reset().Write(&hash[0], hash.size()).Finalize(&hash[0]);
+    return hash;
 }
 
-void Transaction::resetSigHash()
+uchar_vector SigHashContext::getWitnessV0SigHash(uint32_t hashType, uint index, const uchar_vector& script, uint64_t value) const
 {
-    hashPrevouts.clear();
-    hashSequence.clear();
-    hashOutputs.clear();
+    if (index >= scriptOffsets_.size())
+        throw runtime_error("Index out of range.");
+
+    checkSigHashType(hashType);
+
+    // The outpoint precedes the scriptSig length in the skeleton and the sequence follows it.
+    const unsigned char* outpoint = &skeleton_[scriptOffsets_[index] - 36];
+    const unsigned char* sequence = &skeleton_[scriptOffsets_[index] + 1];
+
+    uchar_vector ss;
+    ss.reserve(160 + script.size());
+    writeUInt32(ss, version_);
+    writeBytes(ss, hashPrevouts_);
+    writeBytes(ss, hashSequence_);
+    writeBytes(ss, outpoint, 36);
+    writeVarInt(ss, script.size());
+    writeBytes(ss, script);
+    writeUInt64(ss, value);
+    writeBytes(ss, sequence, 4);
+    writeBytes(ss, hashOutputs_);
+    writeUInt32(ss, lockTime_);
+    writeSigHashType(ss, hashType);
+    return sha256_2(ss);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1699,23 +1854,22 @@ CoinBlockHeader::CoinBlockHeader(const string& hex)
     resetHash();
 }
 
-uchar_vector CoinBlockHeader::getSerialized() const
+void CoinBlockHeader::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = uint_to_vch(version_, LITTLE_ENDIAN_);
-    rval += prevBlockHash_.getReverse(); // all big endian
-    rval += merkleRoot_.getReverse();
-    rval += uint_to_vch(timestamp_, LITTLE_ENDIAN_);
+    writeUInt32(buffer, version_);
+    writeReversed(buffer, prevBlockHash_.data(), prevBlockHash_.size()); // all big endian
+    writeReversed(buffer, merkleRoot_.data(), merkleRoot_.size());
+    writeUInt32(buffer, timestamp_);
 
     if (static_cast<int64_t>(timestamp_) >= BCO_BLOCK_UNIXTIME_MIN) {
-        rval += uint_to_vch(bits_, LITTLE_ENDIAN_);
-        rval += uint_to_vch(nonce_, LITTLE_ENDIAN_);
-        rval += uint_to_vch(plotseed_, LITTLE_ENDIAN_);
+        writeUInt<bits_t>(buffer, bits_);
+        writeUInt<nonce_t>(buffer, nonce_);
+        writeUInt<plotseed_t>(buffer, plotseed_);
     }
     else {
-        rval += uint_to_vch<uint32_t>((uint32_t)bits_, LITTLE_ENDIAN_);
-        rval += uint_to_vch<uint32_t>((uint32_t)nonce_, LITTLE_ENDIAN_);
+        writeUInt32(buffer, (uint32_t)bits_);
+        writeUInt32(buffer, (uint32_t)nonce_);
     }
-    return rval;
 }
 
 void CoinBlockHeader::setSerialized(const uchar_vector& bytes)
@@ -1723,38 +1877,33 @@ void CoinBlockHeader::setSerialized(const uchar_vector& bytes)
     if (bytes.size() < MIN_BITCOIN_BLOCK_HEADER_SIZE)
         throw runtime_error("Invalid data - CoinBlockHeader too small.");
 
-    version_ = vch_to_uint<uint32_t>(bytes, LITTLE_ENDIAN_); uint pos = 4;
-
-    uchar_vector subbytes(bytes.begin() + pos, bytes.begin() + pos + 32); pos += 32;
-    subbytes.reverse();
-    prevBlockHash_ = subbytes;
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    subbytes.assign(bytes.begin() + pos, bytes.begin() + pos + 32); pos += 32;
-    subbytes.reverse();
-    merkleRoot_ = subbytes;
+void CoinBlockHeader::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - CoinBlockHeader too small.";
+    reader.require(MIN_BITCOIN_BLOCK_HEADER_SIZE, error);
 
-    size_t dis = sizeof(timestamp_);
-    timestamp_ = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + dis), LITTLE_ENDIAN_); pos += dis;
+    version_ = reader.readUInt32(error);
+    reader.readReversed(prevBlockHash_, 32, error);
+    reader.readReversed(merkleRoot_, 32, error);
+    timestamp_ = reader.readUInt32(error);
 
     bcoHead_ = false;
     if (static_cast<int64_t>(timestamp_) >= BCO_BLOCK_UNIXTIME_MIN) {
         bcoHead_ = true;
-        if (bytes.size() < MIN_BCO_BLOCK_HEADER_SIZE) 
+        if (reader.remaining() < sizeof(bits_) + sizeof(nonce_) + sizeof(plotseed_))
             return;
 
-        dis = sizeof(bits_);
-        bits_ = vch_to_uint<bits_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + dis), LITTLE_ENDIAN_); pos += dis;
-
-        dis = sizeof(nonce_);
-        nonce_ = vch_to_uint<nonce_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + dis), LITTLE_ENDIAN_); pos += dis;
-
-        dis = sizeof(plotseed_);
-        plotseed_ = vch_to_uint<plotseed_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + dis), LITTLE_ENDIAN_); pos += dis;
+        bits_ = reader.readUInt<bits_t>(error);
+        nonce_ = reader.readUInt<nonce_t>(error);
+        plotseed_ = reader.readUInt<plotseed_t>(error);
     }
     else {
-        dis = sizeof(uint32_t);
-        bits_ = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + dis), LITTLE_ENDIAN_); pos += dis;
-        nonce_ = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + dis), LITTLE_ENDIAN_); pos += dis;
+        bits_ = reader.readUInt32(error);
+        nonce_ = reader.readUInt32(error);
     }
 
     resetHash();
@@ -1843,8 +1992,13 @@ string CoinBlockHeader::toIndentedString(uint spaces) const
 
 const uchar_vector& CoinBlockHeader::getHash() const
 {
-    if (!isHashSet_)
+    if (isHashSet_)
+    {
+        g_hashCacheHits++;
+    }
+    else
     {
+        g_hashCacheMisses++;
         hash_ = CoinNodeStructure::getHash(hashfunc_);
         hashLittleEndian_ = hash_.getReverse();
         isHashSet_ = true;
@@ -1854,8 +2008,13 @@ const uchar_vector& CoinBlockHeader::getHash() const
 
 const uchar_vector& CoinBlockHeader::getHashLittleEndian() const
 {
-    if (!isHashSet_)
+    if (isHashSet_)
     {
+        g_hashCacheHits++;
+    }
+    else
+    {
+        g_hashCacheMisses++;
         hash_ = CoinNodeStructure::getHash(hashfunc_);
         hashLittleEndian_ = hash_.getReverse();
         isHashSet_ = true;
@@ -1898,21 +2057,19 @@ CoinBlock::CoinBlock(const string& hex)
 
 uint64_t CoinBlock::getSize() const
 {
-    uint64_t size = 80 + VarInt(this->txs.size()).getSize();
+    uint64_t size = this->blockHeader.getSize() + VarInt(this->txs.size()).getSize();
     for (uint i = 0; i < txs.size(); i++)
         size += txs[i].getSize();
     return size;
 }
 
-uchar_vector CoinBlock::getSerialized() const
+void CoinBlock::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = this->blockHeader.getSerialized();
+    this->blockHeader.serializeTo(buffer);
 
     // add transactions
-    rval += VarInt(this->txs.size()).getSerialized();
-    for (uint i = 0; i < this->txs.size(); i++)
-        rval += this->txs[i].getSerialized();
-    return rval;
+    writeVarInt(buffer, this->txs.size());
+    for (auto& tx: this->txs) { tx.serializeTo(buffer); }
 }
 
 void CoinBlock::setSerialized(const uchar_vector& bytes)
@@ -1920,17 +2077,28 @@ void CoinBlock::setSerialized(const uchar_vector& bytes)
     if (bytes.size() < MIN_COIN_BLOCK_SIZE)
         throw runtime_error("Invalid data - CoinBlock too small.");
 
-    this->blockHeader.setSerialized(bytes);
-    uint pos = MIN_COIN_BLOCK_HEADER_SIZE(this->blockHeader.IsBcoHeader());
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void CoinBlock::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - CoinBlock transactions exceed block size.";
+    reader.require(MIN_COIN_BLOCK_SIZE, "Invalid data - CoinBlock too small.");
+
+    std::size_t start = reader.position();
+    this->blockHeader.setSerialized(reader);
+    if (reader.position() - start != MIN_COIN_BLOCK_HEADER_SIZE(this->blockHeader.IsBcoHeader()))
+        throw runtime_error("Invalid data - CoinBlock too small.");
 
     MerkleTree txMerkleTree;
-    VarInt count(uchar_vector(bytes.begin() + pos, bytes.end())); pos += count.getSize();
-    for (uint i = 0; i < count.value; i++) {
-        Transaction tx(uchar_vector(bytes.begin() + pos, bytes.end())); pos += tx.getSize();
-        this->txs.push_back(tx);
-        txMerkleTree.addHash(tx.getHash());
-        if (bytes.size() < pos)
-            throw runtime_error("Invalid data - CoinBlock transactions exceed block size.");
+    uint64_t count = reader.readVarInt(error);
+    this->txs.clear();
+    this->txs.reserve(std::min<uint64_t>(count, reader.remaining() / MIN_TRANSACTION_SIZE));
+    for (uint64_t i = 0; i < count; i++) {
+        this->txs.emplace_back();
+        this->txs.back().setSerialized(reader);
+        txMerkleTree.addHash(this->txs.back().getHash());
     }
     if (blockHeader.merkleRoot() != txMerkleTree.getRootLittleEndian()) {
         throw runtime_error("Invalid data - CoinBlock merkle root mismatch.");
@@ -2040,50 +2208,53 @@ PartialMerkleTree MerkleBlock::merkleTree() const
 
 uint64_t MerkleBlock::getSize() const
 {
-    return MIN_COIN_BLOCK_HEADER_SIZE(bcoHead) + 4 + VarInt(hashes.size()).getSize() + (hashes.size() * 32) + VarInt(flags.size()).getSize() + flags.size();
+    return blockHeader.getSize() + 4 + VarInt(hashes.size()).getSize() + (hashes.size() * 32) + VarInt(flags.size()).getSize() + flags.size();
 }
 
-uchar_vector MerkleBlock::getSerialized() const
+void MerkleBlock::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = blockHeader.getSerialized();
-    rval += uint_to_vch(nTxs, LITTLE_ENDIAN_);
-    rval += VarInt(hashes.size()).getSerialized();
-    for (uint i = 0; i < hashes.size(); i++) {
+    blockHeader.serializeTo(buffer);
+    writeUInt32(buffer, nTxs);
+    writeVarInt(buffer, hashes.size());
+    for (auto& hash: hashes) {
         // TODO: make sure hashes are all 32 bytes
-        rval += hashes[i];
+        writeBytes(buffer, hash);
     }
-    rval += VarInt(flags.size()).getSerialized();
-    rval += flags;
-    return rval;
+    writeVarInt(buffer, flags.size());
+    writeBytes(buffer, flags);
 }
 
 void MerkleBlock::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < MIN_MERKLE_BLOCK_SIZE)
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void MerkleBlock::setSerialized(ByteReader& reader)
+{
+    reader.require(MIN_MERKLE_BLOCK_SIZE, "Invalid data - MerkleBlock too small.");
+
+    std::size_t start = reader.position();
+    this->blockHeader.setSerialized(reader);
+    if (reader.position() - start != MIN_COIN_BLOCK_HEADER_SIZE(this->blockHeader.IsBcoHeader()))
         throw runtime_error("Invalid data - MerkleBlock too small.");
 
-    this->blockHeader.setSerialized(bytes);
-    uint pos = MIN_COIN_BLOCK_HEADER_SIZE(this->blockHeader.IsBcoHeader());
+    const char* error = "Invalid data - MerkleBlock hash count invalid.";
+    nTxs = reader.readUInt32(error);
 
-    nTxs = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 4), LITTLE_ENDIAN_); pos += 4;
+    uint64_t nHashes = reader.readVarInt(error);
+    if (reader.atEnd() || nHashes > (reader.remaining() - 1) / 32)
+        throw runtime_error(error);
 
-    VarInt nHashes(uchar_vector(bytes.begin() + pos, bytes.end())); pos += nHashes.getSize();
-    if (bytes.size() < pos + (nHashes.value * 32) + 1)
-        throw runtime_error("Invalid data - MerkleBlock hash count invalid.");
+    hashes.resize(nHashes);
+    for (auto& hash: hashes) { reader.readBytes(hash, 32, error); }
 
-    hashes.clear();
-    for (uint i = 0; i < nHashes.value; i++) {
-        hashes.push_back(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 32)); pos += 32;
-    }
-        
-    VarInt nFlags(uchar_vector(bytes.begin() + pos, bytes.end())); pos += nFlags.getSize();
-    if (bytes.size() < pos + nFlags.value)
-        throw runtime_error("Invalid data - MerkleBlock flag count invalid.");
+    error = "Invalid data - MerkleBlock flag count invalid.";
+    uint64_t nFlags = reader.readVarInt(error);
+    if (nFlags > reader.remaining())
+        throw runtime_error(error);
 
-    flags.clear();
-    for (uint i = 0; i < nFlags.value; i++) {
-        flags.push_back(bytes[pos + i]);
-    }
+    reader.readBytes(flags, nFlags, error);
 }
 
 string MerkleBlock::toString() const
@@ -2141,42 +2312,42 @@ uint64_t HeadersMessage::getSize() const
     uint64_t totalSize = 0;
     for (auto& h : headers)
     {
-        totalSize += h.IsBcoHeader() ? MIN_BCO_BLOCK_HEADER_SIZE : MIN_BITCOIN_BLOCK_HEADER_SIZE;
-        totalSize += 1;
+        totalSize += h.getSize() + 1;
     }
     return VarInt(this->headers.size()).getSize() + totalSize /*this->headers.size()*(MIN_BCO_BLOCK_HEADER_SIZE + 1)*/;
 }
 
-uchar_vector HeadersMessage::getSerialized() const
+void HeadersMessage::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = VarInt(this->headers.size()).getSerialized();
-    for (uint i = 0; i < this->headers.size(); i++) {
-        rval += this->headers[i].getSerialized();
-        rval.push_back(0);
+    writeVarInt(buffer, this->headers.size());
+    for (auto& header: this->headers) {
+        header.serializeTo(buffer);
+        writeUInt8(buffer, 0);
     }
-    return rval;
 }
 
 void HeadersMessage::setSerialized(const uchar_vector& bytes)
 {
-    VarInt count(bytes);
-    if (bytes.size() < count.getSize() + count.value*(MIN_BITCOIN_BLOCK_HEADER_SIZE + 1))
-        throw runtime_error("Invalid data - HeadersMessage too small.");
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    uint pos = count.getSize();
-    this->headers.clear();
-    for (uint i = 0; i < count.value; i++) {
-        // Try parse header. It may binary incompatible with BTC and BCO
-        CoinBlockHeader header(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + MIN_BITCOIN_BLOCK_HEADER_SIZE));
-        if (header.IsBcoHeader()) {
-            CoinBlockHeader header(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + MIN_BCO_BLOCK_HEADER_SIZE));
-            this->headers.push_back(header);
-            pos += MIN_BCO_BLOCK_HEADER_SIZE + 1; // an extra blank byte is added.
-        }
-        else {
-            this->headers.push_back(header);
-            pos += MIN_BITCOIN_BLOCK_HEADER_SIZE + 1; // an extra blank byte is added.
-        }
+void HeadersMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - HeadersMessage too small.";
+    uint64_t count = reader.readVarInt(error);
+    if (count > reader.remaining() / (MIN_BITCOIN_BLOCK_HEADER_SIZE + 1))
+        throw runtime_error(error);
+
+    this->headers.resize(count);
+    for (auto& header: this->headers) {
+        // The header format (BTC or BCO) is decided by its timestamp.
+        std::size_t start = reader.position();
+        header.setSerialized(reader);
+        if (reader.position() - start != MIN_COIN_BLOCK_HEADER_SIZE(header.IsBcoHeader()))
+            throw runtime_error(error);
+
+        reader.skip(1, error); // an extra blank byte is added.
     }
 }
 
@@ -2211,14 +2382,13 @@ uint64_t FilterLoadMessage::getSize() const
     return VarInt(filter.size()).getSize() + filter.size() + 9; 
 }
 
-uchar_vector FilterLoadMessage::getSerialized() const
+void FilterLoadMessage::serializeTo(uchar_vector& buffer) const
 {
-    uchar_vector rval = VarInt(filter.size()).getSerialized();
-    rval += filter;
-    rval += uint_to_vch(nHashFuncs, LITTLE_ENDIAN_);
-    rval += uint_to_vch(nTweak, LITTLE_ENDIAN_);
-    rval.push_back(nFlags);
-    return rval;
+    writeVarInt(buffer, filter.size());
+    writeBytes(buffer, filter);
+    writeUInt32(buffer, nHashFuncs);
+    writeUInt32(buffer, nTweak);
+    writeUInt8(buffer, nFlags);
 }
 
 void FilterLoadMessage::setSerialized(const uchar_vector& bytes)
@@ -2227,17 +2397,27 @@ void FilterLoadMessage::setSerialized(const uchar_vector& bytes)
         throw std::runtime_error("Invalid data - FilterLoadMessage too small.");
     }
 
-    VarInt filterSize(bytes);
-    std::size_t filterSizeLength = filterSize.getSize();
-    if (bytes.size() != filterSizeLength + filterSize.value + 9) {
+    ByteReader reader(bytes);
+    setSerialized(reader);
+    if (!reader.atEnd()) {
         throw std::runtime_error("Invalid data - filter length incorrect.");
     }
+}
+
+void FilterLoadMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - filter length incorrect.";
+    reader.require(MIN_FILTER_LOAD_SIZE, "Invalid data - FilterLoadMessage too small.");
+
+    uint64_t filterSize = reader.readVarInt(error);
+    if (filterSize > reader.remaining()) {
+        throw std::runtime_error(error);
+    }
 
-    uint pos = filterSizeLength + filterSize.value;
-    filter.assign(bytes.begin() + filterSizeLength, bytes.begin() + pos);
-    nHashFuncs = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 4), LITTLE_ENDIAN_); pos += 4;
-    nTweak = vch_to_uint<uint32_t>(uchar_vector(bytes.begin() + pos, bytes.begin() + pos + 4), LITTLE_ENDIAN_); pos += 4;
-    nFlags = (uint8_t)bytes[pos]; 
+    reader.readBytes(filter, filterSize, error);
+    nHashFuncs = reader.readUInt32(error);
+    nTweak = reader.readUInt32(error);
+    nFlags = reader.readUInt8(error);
 }
 
 std::string FilterLoadMessage::toString() const
@@ -2256,17 +2436,22 @@ std::string FilterLoadMessage::toIndentedString(uint spaces) const
 //
 void FilterAddMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.empty()) {
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void FilterAddMessage::setSerialized(ByteReader& reader)
+{
+    if (reader.atEnd()) {
         throw std::runtime_error("Invalid data - cannot be empty.");
     }
 
-    VarInt dataSize(bytes);
-    uint pos = dataSize.getSize();
-    if (bytes.size() < pos + dataSize.value) {
+    uint64_t dataSize = reader.readVarInt("Invalid data - too short.");
+    if (dataSize > reader.remaining()) {
         throw std::runtime_error("Invalid data - too short.");
     }
 
-    data.assign(bytes.begin() + pos, bytes.begin() + pos + dataSize.value);
+    reader.readBytes(data, dataSize, "Invalid data - too short.");
 }
 
 std::string FilterAddMessage::toString() const
@@ -2288,18 +2473,20 @@ PingMessage::PingMessage()
     nonce = 0; // TODO: set to random value
 }
 
-uchar_vector PingMessage::getSerialized() const
+void PingMessage::serializeTo(uchar_vector& buffer) const
 {
-    return uint_to_vch(nonce, LITTLE_ENDIAN_);
+    writeUInt64(buffer, nonce);
 }
 
 void PingMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < sizeof(uint64_t)) {
-        throw std::runtime_error("Invalid data - PingMessage too small.");
-    }
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    nonce = vch_to_uint<uint64_t>(uchar_vector(bytes.begin(), bytes.begin() + 8), LITTLE_ENDIAN_);
+void PingMessage::setSerialized(ByteReader& reader)
+{
+    nonce = reader.readUInt64("Invalid data - PingMessage too small.");
 }
 
 std::string PingMessage::toString() const
@@ -2316,18 +2503,20 @@ std::string PingMessage::toIndentedString(uint spaces) const
 //
 // class PongMessage implementation
 //
-uchar_vector PongMessage::getSerialized() const
+void PongMessage::serializeTo(uchar_vector& buffer) const
 {
-    return uint_to_vch(nonce, LITTLE_ENDIAN_);
+    writeUInt64(buffer, nonce);
 }
 
 void PongMessage::setSerialized(const uchar_vector& bytes)
 {
-    if (bytes.size() < sizeof(uint64_t)) {
-        throw std::runtime_error("Invalid data - PongMessage too small.");
-    }
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
 
-    nonce = vch_to_uint<uint64_t>(uchar_vector(bytes.begin(), bytes.begin() + 8), LITTLE_ENDIAN_);
+void PongMessage::setSerialized(ByteReader& reader)
+{
+    nonce = reader.readUInt64("Invalid data - PongMessage too small.");
 }
 
 std::string PongMessage::toString() const
@@ -2340,3 +2529,141 @@ std::string PongMessage::toIndentedString(uint spaces) const
     return "";
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// class GetCFiltersMessage implementation
+//
+void GetCFiltersMessage::serializeTo(uchar_vector& buffer) const
+{
+    writeUInt8(buffer, filterType);
+    writeUInt32(buffer, startHeight);
+    writeReversed(buffer, stopHash.data(), stopHash.size());
+}
+
+void GetCFiltersMessage::setSerialized(const uchar_vector& bytes)
+{
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void GetCFiltersMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - GetCFiltersMessage too small.";
+    filterType = reader.readUInt8(error);
+    startHeight = reader.readUInt32(error);
+    reader.readReversed(stopHash, 32, error);
+}
+
+std::string GetCFiltersMessage::toString() const
+{
+    std::stringstream ss;
+    ss << "filterType: " << (int)filterType << ", startHeight: " << startHeight << ", stopHash: " << stopHash.getHex();
+    return ss.str();
+}
+
+std::string GetCFiltersMessage::toIndentedString(uint spaces) const
+{
+    std::stringstream ss;
+    ss << blankSpaces(spaces) << "filterType: " << (int)filterType << endl
+       << blankSpaces(spaces) << "startHeight: " << startHeight << endl
+       << blankSpaces(spaces) << "stopHash: " << stopHash.getHex();
+    return ss.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// class CFilterMessage implementation
+//
+void CFilterMessage::serializeTo(uchar_vector& buffer) const
+{
+    writeUInt8(buffer, filterType);
+    writeReversed(buffer, blockHash.data(), blockHash.size());
+    writeVarInt(buffer, filter.size());
+    writeBytes(buffer, filter);
+}
+
+void CFilterMessage::setSerialized(const uchar_vector& bytes)
+{
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void CFilterMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - CFilterMessage too small.";
+    filterType = reader.readUInt8(error);
+    reader.readReversed(blockHash, 32, error);
+    uint64_t filterSize = reader.readVarInt(error);
+    if (filterSize > reader.remaining())
+        throw std::runtime_error(error);
+    reader.readBytes(filter, filterSize, error);
+}
+
+std::string CFilterMessage::toString() const
+{
+    std::stringstream ss;
+    ss << "filterType: " << (int)filterType << ", blockHash: " << blockHash.getHex() << ", filter: " << filter.size() << " bytes";
+    return ss.str();
+}
+
+std::string CFilterMessage::toIndentedString(uint spaces) const
+{
+    std::stringstream ss;
+    ss << blankSpaces(spaces) << "filterType: " << (int)filterType << endl
+       << blankSpaces(spaces) << "blockHash: " << blockHash.getHex() << endl
+       << blankSpaces(spaces) << "filter: " << filter.size() << " bytes";
+    return ss.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// class CFHeadersMessage implementation
+//
+void CFHeadersMessage::serializeTo(uchar_vector& buffer) const
+{
+    writeUInt8(buffer, filterType);
+    writeReversed(buffer, stopHash.data(), stopHash.size());
+    writeReversed(buffer, prevFilterHeader.data(), prevFilterHeader.size());
+    writeVarInt(buffer, filterHashes.size());
+    for (auto& hash: filterHashes) { writeReversed(buffer, hash.data(), hash.size()); }
+}
+
+void CFHeadersMessage::setSerialized(const uchar_vector& bytes)
+{
+    ByteReader reader(bytes);
+    setSerialized(reader);
+}
+
+void CFHeadersMessage::setSerialized(ByteReader& reader)
+{
+    const char* error = "Invalid data - CFHeadersMessage has wrong length.";
+    reader.require(MIN_CFHEADERS_SIZE, "Invalid data - CFHeadersMessage too small.");
+
+    filterType = reader.readUInt8(error);
+    reader.readReversed(stopHash, 32, error);
+    reader.readReversed(prevFilterHeader, 32, error);
+    uint64_t count = reader.readVarInt(error);
+    if (count > reader.remaining() / 32)
+        throw std::runtime_error(error);
+
+    filterHashes.resize(count);
+    for (auto& hash: filterHashes) { reader.readReversed(hash, 32, error); }
+}
+
+std::string CFHeadersMessage::toString() const
+{
+    std::stringstream ss;
+    ss << "filterType: " << (int)filterType << ", stopHash: " << stopHash.getHex() << ", prevFilterHeader: " << prevFilterHeader.getHex() << ", filterHashes: " << filterHashes.size();
+    return ss.str();
+}
+
+std::string CFHeadersMessage::toIndentedString(uint spaces) const
+{
+    std::stringstream ss;
+    ss << blankSpaces(spaces) << "filterType: " << (int)filterType << endl
+       << blankSpaces(spaces) << "stopHash: " << stopHash.getHex() << endl
+       << blankSpaces(spaces) << "prevFilterHeader: " << prevFilterHeader.getHex() << endl
+       << blankSpaces(spaces) << "filterHashes: " << filterHashes.size();
+    return ss.str();
+}
+
@@ -14,6 +14,7 @@
 #include "hash.h"
 #include "IPv6.h"
 #include "MerkleTree.h"
+#include "serialize.h"
 
 #include "BigInt.h"
 
@@ -21,6 +22,7 @@
 
 #include <functional>
 #include <list>
+#include <memory>
 #include <queue>
 
 #include <stdio.h>
@@ -34,6 +36,7 @@ void SetAddressVersion(unsigned char version);
 void SetMultiSigAddressVersion(unsigned char version);
 
 #define NODE_NETWORK                  1
+#define NODE_COMPACT_FILTERS     (1 << 6)
 
 #define MSG_ERROR                     0
 #define MSG_TX                        1
@@ -67,6 +70,11 @@ const uint32_t MSG_TYPE_MASK        = 0xffffffff >> 2;
 #define MIN_COIN_BLOCK_SIZE         140
 #define MIN_MERKLE_BLOCK_SIZE        86
 #define MIN_FILTER_LOAD_SIZE         10
+#define MIN_GET_CFILTERS_SIZE        37
+#define MIN_CFHEADERS_SIZE           66
+
+#define MAX_GET_CFILTERS_BLOCKS    1000
+#define MAX_GET_CFHEADERS_BLOCKS   2000
 
 #define BLOOM_UPDATE_NONE             0
 #define BLOOM_UPDATE_ALL              1
@@ -125,10 +133,21 @@ public:
     virtual uchar_vector getSerialized() const = 0;
     virtual void setSerialized(const uchar_vector& bytes) = 0;
 
+    // Appends the serialization to buffer. Overridden by structures that can write in place.
+    virtual void serializeTo(uchar_vector& buffer) const { buffer += getSerialized(); }
+
     virtual std::string toString() const = 0;
     virtual std::string toIndentedString(uint spaces = 0) const = 0;
 
+    // Lookups served by the memoized transaction and block header hashes.
+    static uint64_t getHashCacheHits();
+    static uint64_t getHashCacheMisses();
+    static void resetHashCacheStats();
+
 protected:
+    // Allocates getSize() bytes once and fills them with serializeTo().
+    uchar_vector serializeToBuffer() const;
+
     mutable uchar_vector hash_;
     mutable uchar_vector hashLittleEndian_;
     mutable bool isHashSet_;
@@ -148,8 +167,10 @@ public:
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const
     {
@@ -176,8 +197,10 @@ public:
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const { return value; }
     std::string toIndentedString(uint spaces = 0) const { return blankSpaces(spaces) + this->value; }
@@ -202,8 +225,10 @@ public:
 	
     const char* getCommand() const { return ""; }
     uint64_t getSize() const { return hasTime ? 30 : 26; }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader, bool bHasTime);
 
     std::string getName() const; 
 
@@ -224,8 +249,10 @@ public:
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const { return hasChecksum ? 24 : 20; }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader); // always reads the checksum
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -250,14 +277,17 @@ public:
     CoinNodeMessage(const CoinNodeMessage& message) { this->setMessage(message.header.magic, message.pPayload); }
     CoinNodeMessage(uint32_t magic, CoinNodeStructure* pPayload) { this->setMessage(magic, pPayload); }
     CoinNodeMessage(const uchar_vector& bytes) { this->pPayload = NULL; this->setSerialized(bytes); }
+    explicit CoinNodeMessage(ByteReader& reader) { this->pPayload = NULL; this->setSerialized(reader); }
     ~CoinNodeMessage();
 
     void setMessage(uint32_t magic, CoinNodeStructure* pPayload);
 
     const char* getCommand() const { return this->pPayload->getCommand(); }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -284,6 +314,7 @@ public:
         bool relay = true
     );
     VersionMessage(const uchar_vector bytes) { this->setSerialized(bytes); }
+    explicit VersionMessage(ByteReader& reader) { this->setSerialized(reader); }
 
     int32_t version() const { return version_; }
     uint64_t services() const { return services_; }
@@ -297,8 +328,10 @@ public:
 
     const char* getCommand() const { return "version"; }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -326,6 +359,7 @@ public:
     uint64_t getSize() const { return 0; }
 
     uchar_vector getSerialized() const { uchar_vector rval; return rval; }
+    void serializeTo(uchar_vector& /*buffer*/) const { }
     void setSerialized(const uchar_vector& /*bytes*/) { }
 
     std::string toString() const { return ""; }
@@ -341,6 +375,7 @@ public:
     uint64_t getSize() const { return 0; }
 
     uchar_vector getSerialized() const { uchar_vector rval; return rval; }
+    void serializeTo(uchar_vector& /*buffer*/) const { }
     void setSerialized(const uchar_vector& /*bytes*/) { }
 
     std::string toString() const { return ""; }
@@ -354,12 +389,15 @@ public:
 
     AddrMessage(const std::vector<NetworkAddress> addrList) { this->addrList = addrList; }
     AddrMessage(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit AddrMessage(ByteReader& reader) { this->setSerialized(reader); }
 
     const char* getCommand() const { return "addr"; }
     uint64_t getSize() const { return VarInt(this->addrList.size()).getSize() + 30*this->addrList.size(); }
 
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -373,6 +411,7 @@ public:
 
     InventoryItem() { }
     InventoryItem(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit InventoryItem(ByteReader& reader) { this->setSerialized(reader); }
     InventoryItem(const InventoryItem& item)
     {
         this->itemType = item.itemType;
@@ -400,8 +439,10 @@ public:
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const { return 36; }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -418,6 +459,7 @@ public:
     Inventory() { }
     Inventory(const std::vector<InventoryItem> items) { this->items = items; }
     Inventory(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit Inventory(ByteReader& reader) { this->setSerialized(reader); }
     Inventory(const Inventory& inv) { this->items = inv.getItems(); }
 
     void addItem(const InventoryItem& item) { (this->items).push_back(item); }
@@ -428,8 +470,10 @@ public:
 
     const char* getCommand() const { return "inv"; }
     uint64_t getSize() const { return VarInt(this->items.size()).getSize() + 36*this->items.size(); }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -441,6 +485,7 @@ public:
     GetDataMessage() { }
     GetDataMessage(const std::vector<InventoryItem> items) { this->items = items; }
     GetDataMessage(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit GetDataMessage(ByteReader& reader) { this->setSerialized(reader); }
     GetDataMessage(const Inventory& inv) { this->items = inv.getItems(); }
 
     const char* getCommand() const { return "getdata"; }
@@ -454,6 +499,7 @@ public:
     NotFoundMessage() { }
     NotFoundMessage(const std::vector<InventoryItem> items) { this->items = items; }
     NotFoundMessage(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit NotFoundMessage(ByteReader& reader) { this->setSerialized(reader); }
     NotFoundMessage(const Inventory& inv) { this->items = inv.getItems(); }
 
     const char* getCommand() const { return "getdata"; }
@@ -500,6 +546,7 @@ public:
         this->hashStop = getBlocksMessage.hashStop;
     }
     GetBlocksMessage(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit GetBlocksMessage(ByteReader& reader) { this->setSerialized(reader); }
     GetBlocksMessage(uint32_t version, const std::vector<uchar_vector>& blockLocatorHashes, const uchar_vector& hashStop = g_zero32bytes)
     {
         this->version = version;
@@ -510,8 +557,10 @@ public:
 
     const char* getCommand() const { return "getblocks"; }
     uint64_t getSize() const { return VarInt(this->blockLocatorHashes.size()).getSize() + 32*this->blockLocatorHashes.size() + 36; }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -535,6 +584,7 @@ public:
         this->hashStop = getHeadersMessage.hashStop;
     }
     GetHeadersMessage(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit GetHeadersMessage(ByteReader& reader) { this->setSerialized(reader); }
     GetHeadersMessage(uint32_t version, const std::vector<uchar_vector>& blockLocatorHashes, const uchar_vector& hashStop = g_zero32bytes)
     {
         this->version = version;
@@ -544,8 +594,10 @@ public:
 
     const char* getCommand() const { return "getheaders"; }
     uint64_t getSize() const { return VarInt(this->blockLocatorHashes.size()).getSize() + 32*this->blockLocatorHashes.size() + 36; }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -563,6 +615,7 @@ public:
     OutPoint(const uchar_vector& hashBytes, uint index) { this->setPoint(hashBytes, index); }
     OutPoint(const std::string& hashHex, uint index) { uchar_vector hashBytes; hashBytes.setHex(hashHex); this->setPoint(hashBytes, index); }
     OutPoint(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit OutPoint(ByteReader& reader) { this->setSerialized(reader); }
     OutPoint(const OutPoint& outPoint)
     {
         memcpy(this->hash, outPoint.hash, 32);
@@ -573,8 +626,10 @@ public:
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const { return 36; }
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string getTxHash() const { return uchar_vector(this->hash, 32).getHex(); }
 	
@@ -598,8 +653,10 @@ public:
     const char* getCommand() const { return ""; }
     uint64_t getSize() const;
 
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     // TODO: toString methods
     std::string toString() const { return std::string(); }
@@ -621,12 +678,16 @@ public:
         : previousOut(_previousOut), scriptSig(_scriptSig), sequence(_sequence) { }
     TxIn(const OutPoint& previousOut, const std::string& scriptSigHex, uint32_t sequence);
     TxIn(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit TxIn(ByteReader& reader) { this->setSerialized(reader); }
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const { return VarInt(this->scriptSig.size()).getSize() + scriptSig.size() + 40; } // 40 = previousOut + sequence
     uchar_vector getSerialized() const { return this->getSerialized(true); }
     uchar_vector getSerialized(bool includeScriptSigLength) const;
+    void serializeTo(uchar_vector& buffer) const { this->serializeTo(buffer, true); }
+    void serializeTo(uchar_vector& buffer, bool includeScriptSigLength) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     uchar_vector getOutpointHash() const { return uchar_vector(this->previousOut.hash, 32); }
     uint32_t getOutpointIndex() const { return this->previousOut.index; }
@@ -651,11 +712,14 @@ public:
         : value(_value), scriptPubKey(_scriptPubKey) { }
     TxOut(uint64_t value, const std::string& scriptPubKeyHex);
     TxOut(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit TxOut(ByteReader& reader) { this->setSerialized(reader); }
 
     const char* getCommand() const { return ""; }
     uint64_t getSize() const { return VarInt(this->scriptPubKey.size()).getSize() + scriptPubKey.size() + 8; } // 8 = sizeof(value)
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string getAddress() const;
     std::string toString() const;
@@ -663,6 +727,8 @@ public:
     std::string toJson() const;
 };
 
+class SigHashContext;
+
 class Transaction : public CoinNodeStructure
 {
 public:
@@ -673,9 +739,12 @@ public:
 
     Transaction() { this->version = 1; lockTime = 0; }
     Transaction(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit Transaction(ByteReader& reader) { this->setSerialized(reader); }
     Transaction(const std::string& hex);
     Transaction(const Transaction& tx)
-        : version(tx.version), inputs(tx.inputs), outputs(tx.outputs), lockTime(tx.lockTime) { }
+        : version(tx.version), inputs(tx.inputs), outputs(tx.outputs), lockTime(tx.lockTime),
+          txid_(tx.txid_), txidLittleEndian_(tx.txidLittleEndian_), wtxid_(tx.wtxid_), wtxidLittleEndian_(tx.wtxidLittleEndian_),
+          isTxidSet_(tx.isTxidSet_), isWtxidSet_(tx.isWtxidSet_), sigHashContext_(tx.sigHashContext_) { }
 
     const uchar_vector& getHash() const { return getHash(false); }
     const uchar_vector& getHash(bool bWithWitness) const;
@@ -703,8 +772,11 @@ public:
 
     uchar_vector getSerialized() const { return this->getSerialized(true); }
     uchar_vector getSerialized(bool bWithWitness) const;
+    void serializeTo(uchar_vector& buffer) const { this->serializeTo(buffer, true); }
+    void serializeTo(uchar_vector& buffer, bool bWithWitness) const;
 
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -714,22 +786,65 @@ public:
     void setScriptSig(uint index, const uchar_vector& scriptSig);
     void setScriptSig(uint index, const std::string& scriptSigHex);
 
-    void clearInputs() { inputs.clear(); }
-    void clearOutputs() { outputs.clear(); }
+    void clearInputs() { inputs.clear(); resetHash(); resetSigHash(); }
+    void clearOutputs() { outputs.clear(); resetHash(); resetSigHash(); }
 
-    void addInput(const TxIn& txin) { inputs.push_back(txin); }
-    void addOutput(const TxOut& txout) { outputs.push_back(txout); }
+    void addInput(const TxIn& txin) { inputs.push_back(txin); resetHash(); resetSigHash(); }
+    void addOutput(const TxOut& txout) { outputs.push_back(txout); resetHash(); resetSigHash(); }
 	
     uint64_t getTotalSent() const;
 
     uchar_vector getHashWithAppendedCode(uint32_t code) const; // in little endian
+    // Signature hashes come from a memoized SigHashContext. The setters above invalidate it; call
+    // resetSigHash() after modifying the public members directly.
     uchar_vector getSigHash(uint32_t hashType, uint index, const uchar_vector& script, uint64_t value = 0) const;
+    const SigHashContext& getSigHashContext() const; // built on first use, shared by copies
     void resetSigHash();
 
+    // The txid and wtxid are memoized. The setters above invalidate them; call this after
+    // modifying the public members directly.
+    void resetHash() const { isTxidSet_ = false; isWtxidSet_ = false; }
+
 private:
-    mutable uchar_vector hashPrevouts;
-    mutable uchar_vector hashSequence;
-    mutable uchar_vector hashOutputs;
+    mutable uchar_vector txid_;
+    mutable uchar_vector txidLittleEndian_;
+    mutable uchar_vector wtxid_;
+    mutable uchar_vector wtxidLittleEndian_;
+    mutable bool isTxidSet_ = false;
+    mutable bool isWtxidSet_ = false;
+
+    mutable std::shared_ptr<const SigHashContext> sigHashContext_;
+
+    void updateHashCache(bool bWithWitness) const;
+};
+
+// Precomputed signature hash state for one transaction. Everything that does not depend on the
+// input being signed is derived once, so signing or verifying all inputs costs a single pass over
+// the transaction for witness inputs. Legacy inputs hash a stripped copy of the transaction that is
+// serialized once, resuming from a saved SHA-256 midstate at the input being signed.
+class SigHashContext
+{
+public:
+    explicit SigHashContext(const Transaction& tx);
+
+    // Same results as Transaction::getSigHash.
+    uchar_vector getSigHash(uint32_t hashType, uint index, const uchar_vector& script, uint64_t value, bool bWitnessV0) const;
+    uchar_vector getLegacySigHash(uint32_t hashType, uint index, const uchar_vector& script) const;
+    uchar_vector getWitnessV0SigHash(uint32_t hashType, uint index, const uchar_vector& script, uint64_t value) const;
+
+    std::size_t getInputCount() const { return scriptOffsets_.size(); }
+
+private:
+    uint32_t version_;
+    uint32_t lockTime_;
+
+    uchar_vector hashPrevouts_;
+    uchar_vector hashSequence_;
+    uchar_vector hashOutputs_;
+
+    uchar_vector skeleton_;                     // no witness, every scriptSig empty
+    std::vector<std::size_t> scriptOffsets_;    // position of each input's scriptSig length in skeleton_
+    std::vector<CSHA256> midstates_;            // skeleton_ hashed up to each scriptOffsets_ entry
 };
 
 class CoinBlock;
@@ -755,6 +870,7 @@ public:
     { }
 
     CoinBlockHeader(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit CoinBlockHeader(ByteReader& reader) { setSerialized(reader); }
     CoinBlockHeader(const std::string& hex);
 
     void set(uint32_t version, uint32_t timestamp, bits_t bits, nonce_t nonce = 0, plotseed_t plotseed = 0, const uchar_vector& prevBlockHash = g_zero32bytes, const uchar_vector& merkleRoot = g_zero32bytes)
@@ -762,6 +878,8 @@ public:
         isHashSet_ = false;
         isPOWHashSet_ = false;
 
+        // Same as the parser, so a header set from its fields hashes and serializes like one read in.
+        bcoHead_ = static_cast<int64_t>(timestamp) >= BCO_BLOCK_UNIXTIME_MIN;
         version_ = version;
         prevBlockHash_ = prevBlockHash;
         merkleRoot_ = merkleRoot;
@@ -781,10 +899,12 @@ public:
     plotseed_t plotseed() const { return plotseed_; }
 
     const char* getCommand() const { return ""; }
-    uint64_t getSize() const { return 80; }
+    uint64_t getSize() const { return MIN_COIN_BLOCK_HEADER_SIZE(static_cast<int64_t>(timestamp_) >= BCO_BLOCK_UNIXTIME_MIN); }
     
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -792,7 +912,7 @@ public:
     void nonce(uint32_t nonce) { nonce_ = nonce; isHashSet_ = false; isPOWHashSet_ = false; }
     void incrementNonce() { nonce_++; isHashSet_ = false; isPOWHashSet_ = false; }
 
-    void plotseed(plotseed_t plotseed) { plotseed_ = plotseed; }
+    void plotseed(plotseed_t plotseed) { plotseed_ = plotseed; isHashSet_ = false; isPOWHashSet_ = false; }
 
     const BigInt getTarget() const;
     void setTarget(const BigInt& target);
@@ -856,6 +976,7 @@ public:
         this->blockHeader = CoinBlockHeader(version, timestamp, bits, 0, 0, prevBlockHash);
     }
     CoinBlock(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit CoinBlock(ByteReader& reader) { this->setSerialized(reader); }
     CoinBlock(const std::string& hex);
 
     const uchar_vector& hash() const { return blockHeader.getHashLittleEndian(); }
@@ -871,8 +992,10 @@ public:
     
     const char* getCommand() const { return "block"; }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -899,7 +1022,6 @@ public:
     uint32_t nTxs;
     std::vector<uchar_vector> hashes;
     uchar_vector flags;
-    bool bcoHead = false;
 
     MerkleBlock() { }
     MerkleBlock(const CoinBlockHeader& _blockHeader, uint32_t _nTxs, const std::vector<uchar_vector>& _hashes, const uchar_vector& _flags)
@@ -908,6 +1030,7 @@ public:
         : blockHeader(merkleBlock.blockHeader), nTxs(merkleBlock.nTxs), hashes(merkleBlock.hashes), flags(merkleBlock.flags) { }
     MerkleBlock(const PartialMerkleTree& merkleTree, uint32_t version, const uchar_vector& prevBlockHash, uint32_t timestamp, bits_t bits, nonce_t nonce, plotseed_t plotseed);
     explicit MerkleBlock(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit MerkleBlock(ByteReader& reader) { setSerialized(reader); }
 
     const uchar_vector& hash() const { return blockHeader.getHashLittleEndian(); }
     uint32_t version() const { return blockHeader.version(); }
@@ -925,8 +1048,10 @@ public:
 
     const char* getCommand() const { return "merkleblock"; }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -943,12 +1068,15 @@ public:
     HeadersMessage() { }
     HeadersMessage(const std::vector<CoinBlockHeader>& headers) { this->headers = headers; }
     HeadersMessage(const uchar_vector& bytes) { this->setSerialized(bytes); }
+    explicit HeadersMessage(ByteReader& reader) { this->setSerialized(reader); }
     HeadersMessage(const std::string& hex);
 
     const char* getCommand() const { return "headers"; }
     uint64_t getSize() const;
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -966,6 +1094,7 @@ public:
     uint64_t getSize() const { return 0; }
 
     uchar_vector getSerialized() const { uchar_vector rval; return rval; }
+    void serializeTo(uchar_vector& /*buffer*/) const { }
     void setSerialized(const uchar_vector& /*bytes*/) { }
 
     std::string toString() const { return ""; }
@@ -983,12 +1112,15 @@ public:
     FilterLoadMessage(uint32_t nHashFuncs_ = 0, uint32_t nTweak_ = 0, uint8_t nFlags_ = 0, const uchar_vector& filter_ = uchar_vector())
         : filter(filter_), nHashFuncs(nHashFuncs_), nTweak(nTweak_), nFlags(nFlags_) { }
     FilterLoadMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit FilterLoadMessage(ByteReader& reader) { setSerialized(reader); }
 
     const char* getCommand() const { return "filterload"; }
     uint64_t getSize() const;
 
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -1001,12 +1133,15 @@ public:
 
     FilterAddMessage() { }
     FilterAddMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit FilterAddMessage(ByteReader& reader) { setSerialized(reader); }
 
     const char* getCommand() const { return "filteradd"; }
     uint64_t getSize() const { return VarInt(data.size()).getSize() + data.size(); }
 
-    uchar_vector getSerialized() const { return VarInt(data.size()).getSerialized() + data; }
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const { writeVarInt(buffer, data.size()); writeBytes(buffer, data); }
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -1025,12 +1160,15 @@ public:
 
     PingMessage();
     PingMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit PingMessage(ByteReader& reader) { setSerialized(reader); }
 
     const char* getCommand() const { return "ping"; }
     uint64_t getSize() const { return sizeof(uint64_t); }
 
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -1043,12 +1181,100 @@ public:
 
     PongMessage(uint64_t nonce_) : nonce(nonce_) { }
     PongMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit PongMessage(ByteReader& reader) { setSerialized(reader); }
 
     const char* getCommand() const { return "pong"; }
     uint64_t getSize() const { return sizeof(uint64_t); }
 
-    uchar_vector getSerialized() const;
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
+    void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
+
+    std::string toString() const;
+    std::string toIndentedString(uint spaces = 0) const;
+};
+
+// BIP157 compact block filters. Block hashes and filter hashes and headers are in the byte order
+// hashes are shown in.
+class GetCFiltersMessage : public CoinNodeStructure
+{
+public:
+    uint8_t filterType;
+    uint32_t startHeight;
+    uchar_vector stopHash;
+
+    GetCFiltersMessage(uint8_t filterType_ = 0, uint32_t startHeight_ = 0, const uchar_vector& stopHash_ = g_zero32bytes)
+        : filterType(filterType_), startHeight(startHeight_), stopHash(stopHash_) { }
+    GetCFiltersMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit GetCFiltersMessage(ByteReader& reader) { setSerialized(reader); }
+
+    const char* getCommand() const { return "getcfilters"; }
+    uint64_t getSize() const { return MIN_GET_CFILTERS_SIZE; }
+
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
+    void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
+
+    std::string toString() const;
+    std::string toIndentedString(uint spaces = 0) const;
+};
+
+class GetCFHeadersMessage : public GetCFiltersMessage
+{
+public:
+    GetCFHeadersMessage(uint8_t filterType_ = 0, uint32_t startHeight_ = 0, const uchar_vector& stopHash_ = g_zero32bytes)
+        : GetCFiltersMessage(filterType_, startHeight_, stopHash_) { }
+    GetCFHeadersMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit GetCFHeadersMessage(ByteReader& reader) { setSerialized(reader); }
+
+    const char* getCommand() const { return "getcfheaders"; }
+};
+
+class CFilterMessage : public CoinNodeStructure
+{
+public:
+    uint8_t filterType;
+    uchar_vector blockHash;
+    uchar_vector filter;
+
+    CFilterMessage(uint8_t filterType_ = 0, const uchar_vector& blockHash_ = g_zero32bytes, const uchar_vector& filter_ = uchar_vector())
+        : filterType(filterType_), blockHash(blockHash_), filter(filter_) { }
+    CFilterMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit CFilterMessage(ByteReader& reader) { setSerialized(reader); }
+
+    const char* getCommand() const { return "cfilter"; }
+    uint64_t getSize() const { return 33 + VarInt(filter.size()).getSize() + filter.size(); }
+
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
+    void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
+
+    std::string toString() const;
+    std::string toIndentedString(uint spaces = 0) const;
+};
+
+class CFHeadersMessage : public CoinNodeStructure
+{
+public:
+    uint8_t filterType;
+    uchar_vector stopHash;
+    uchar_vector prevFilterHeader;
+    std::vector<uchar_vector> filterHashes;
+
+    CFHeadersMessage() : filterType(0) { }
+    CFHeadersMessage(const uchar_vector& bytes) { setSerialized(bytes); }
+    explicit CFHeadersMessage(ByteReader& reader) { setSerialized(reader); }
+
+    const char* getCommand() const { return "cfheaders"; }
+    uint64_t getSize() const { return 65 + VarInt(filterHashes.size()).getSize() + 32 * filterHashes.size(); }
+
+    uchar_vector getSerialized() const { return serializeToBuffer(); }
+    void serializeTo(uchar_vector& buffer) const;
     void setSerialized(const uchar_vector& bytes);
+    void setSerialized(ByteReader& reader);
 
     std::string toString() const;
     std::string toIndentedString(uint spaces = 0) const;
@@ -16,38 +16,59 @@
 #include <stdexcept>
 #include <algorithm>
 #include <ctime>
+#include <unordered_set>
 
 using namespace Coin;
 
+// Parent of two nodes, hashed without leaving the stack.
+static hash256_t hashPair(const hash256_t& left, const hash256_t& right)
+{
+    unsigned char pair[64];
+    std::copy(left.begin(), left.end(), pair);
+    std::copy(right.begin(), right.end(), pair + 32);
+
+    hash256_t parent;
+    SHA256D(parent.data(), pair, sizeof(pair));
+    return parent;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // class MerkleTree implementation
 //
 uchar_vector MerkleTree::getRoot() const
 {
-    uchar_vector pairedHashes;
     if (hashes_.size() == 0)
-        return pairedHashes; // empty vector
+        return uchar_vector(); // empty vector
 
     if (hashes_.size() == 1)
         return hashes_[0];
 
-    MerkleTree tree;
-    for (unsigned int i = 0; i < hashes_.size(); i += 2) {
-        pairedHashes = hashes_[i];
-        if (i + 1 < hashes_.size()) {
-            // two different nodes
-            pairedHashes += hashes_[i + 1];
-        }
-        else {
+    // Each level is stored contiguously so all of its pairs are hashed in one batch.
+    const std::size_t HASH_SIZE = CSHA256::OUTPUT_SIZE;
+    std::size_t count = hashes_.size();
+    uchar_vector level;
+    level.reserve((count + 1) * HASH_SIZE);
+    for (auto& hash: hashes_)
+    {
+        if (hash.size() != HASH_SIZE) throw std::runtime_error("MerkleTree::getRoot() - invalid hash size.");
+        level += hash;
+    }
+
+    while (count > 1)
+    {
+        if (count % 2)
+        {
             // the same node with itself
-            pairedHashes += hashes_[i];
+            level.insert(level.end(), level.end() - HASH_SIZE, level.end());
+            count++;
         }
-        //pairedHashes.reverse();
-        tree.addHash(sha256_2(pairedHashes));
+        count /= 2;
+        SHA256D64(&level[0], &level[0], count);
+        level.resize(count * HASH_SIZE);
     }
 
-    return tree.getRoot(); // recurse
+    return level;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -57,18 +78,18 @@ uchar_vector MerkleTree::getRoot() const
 std::string PartialMerkleTree::toIndentedString(bool showIndices) const
 {
     std::stringstream ss;
-    ss << "root: " << uchar_vector(root_).getReverse().getHex() << std::endl;
+    ss << "root: " << root_.getReverse().getHex() << std::endl;
     ss << "nTxs: " << nTxs_ << std::endl;
     ss << "merkleHashes: " << std::endl;
     unsigned int i = 0;
     for (auto& hash: merkleHashes_) {
-        ss << "  " << i++ << ": " << uchar_vector(hash).getReverse().getHex() << std::endl; 
+        ss << "  " << i++ << ": " << hash.getReverse().getHex() << std::endl; 
     }
 
     ss << "txHashes: " << std::endl;
     i = 0;
     for (auto& hash: txHashes_) {
-        ss << "  " << i++ << ": " << uchar_vector(hash).getReverse().getHex() << std::endl;
+        ss << "  " << i++ << ": " << hash.getReverse().getHex() << std::endl;
     }
 
     if (showIndices)
@@ -100,8 +121,8 @@ void PartialMerkleTree::setCompressed(unsigned int nTxs, const std::vector<uchar
     txHashes_.clear();
     bits_.clear();
 
-    std::queue<uchar_vector> hashQueue;
-    for (auto& hash: hashes) { hashQueue.push(hash); }
+    std::queue<hash256_t> hashQueue;
+    for (auto& hash: hashes) { hashQueue.push(hash256_t(hash)); }
 
     std::queue<bool> bitQueue; 
     for (auto& flag: flags) {
@@ -119,7 +140,7 @@ void PartialMerkleTree::setCompressed(unsigned int nTxs, const std::vector<uchar
     updateTxIndices();
 }
 
-void PartialMerkleTree::setCompressed(std::queue<uchar_vector>& hashQueue, std::queue<bool>& bitQueue, unsigned int depth)
+void PartialMerkleTree::setCompressed(std::queue<hash256_t>& hashQueue, std::queue<bool>& bitQueue, unsigned int depth)
 {
     depth_ = depth;
 
@@ -155,14 +176,14 @@ void PartialMerkleTree::setCompressed(std::queue<uchar_vector>& hashQueue, std::
         PartialMerkleTree rightSubtree;
         rightSubtree.setCompressed(hashQueue, bitQueue, depth);
 
-        root_ = sha256_2(leftSubtree.root_ + rightSubtree.root_);
+        root_ = hashPair(leftSubtree.root_, rightSubtree.root_);
         merkleHashes_.splice(merkleHashes_.end(), rightSubtree.merkleHashes_);
         txHashes_.splice(txHashes_.end(), rightSubtree.txHashes_);
         bits_.splice(bits_.end(), rightSubtree.bits_);
     }
     else {
         // There's no right subtree - copy over this node's hash
-        root_ = sha256_2(leftSubtree.root_ + leftSubtree.root_);
+        root_ = hashPair(leftSubtree.root_, leftSubtree.root_);
     }
 }
 
@@ -198,9 +219,9 @@ void PartialMerkleTree::setUncompressed(const std::vector<MerkleLeaf>& leaves, s
 */
     // We've hit a leaf. Store the hash and push a true bit if matched, a false bit if unmatched.
     if (depth == 0) {
-        root_ = leaves[begin].first;
-        merkleHashes_.push_back(leaves[begin].first);
-        if (leaves[begin].second) txHashes_.push_back(leaves[begin].first);
+        root_ = hash256_t(leaves[begin].first);
+        merkleHashes_.push_back(root_);
+        if (leaves[begin].second) txHashes_.push_back(root_);
         bits_.push_back(leaves[begin].second);
         return;
     }
@@ -223,14 +244,14 @@ void PartialMerkleTree::setUncompressed(const std::vector<MerkleLeaf>& leaves, s
         PartialMerkleTree rightSubtree;
         rightSubtree.setUncompressed(leaves, begin + partitionPos, end, depth);
 
-        root_ = sha256_2(leftSubtree.root_ + rightSubtree.root_);
+        root_ = hashPair(leftSubtree.root_, rightSubtree.root_);
 
         merkleHashes_.splice(merkleHashes_.end(), rightSubtree.merkleHashes_);
         txHashes_.splice(txHashes_.end(), rightSubtree.txHashes_);
         bits_.splice(bits_.end(), rightSubtree.bits_);
     }
     else {
-        root_ = sha256_2(leftSubtree.root_ + leftSubtree.root_);
+        root_ = hashPair(leftSubtree.root_, leftSubtree.root_);
     }
 
     if (txHashes_.empty()) {
@@ -256,12 +277,12 @@ void PartialMerkleTree::merge(const PartialMerkleTree& other)
     if (root_ != other.root_)
         throw std::runtime_error("PartialMerkleTree::merge - root does not match.");
 
-    std::queue<uchar_vector> hashQueue1;
+    std::queue<hash256_t> hashQueue1;
     for (auto& hash: merkleHashes_) { hashQueue1.push(hash); }
     std::queue<bool> bitQueue1;
     for (auto& bit: bits_) { bitQueue1.push(bit); }
 
-    std::queue<uchar_vector> hashQueue2;
+    std::queue<hash256_t> hashQueue2;
     for (auto& hash: other.merkleHashes_) { hashQueue2.push(hash); }
     std::queue<bool> bitQueue2;
     for (auto& bit: other.bits_) { bitQueue2.push(bit); }
@@ -275,7 +296,7 @@ void PartialMerkleTree::merge(const PartialMerkleTree& other)
     updateTxIndices();
 }
 
-void PartialMerkleTree::merge(std::queue<uchar_vector>& hashQueue1, std::queue<uchar_vector>& hashQueue2, std::queue<bool>& bitQueue1, std::queue<bool>& bitQueue2, unsigned int depth)
+void PartialMerkleTree::merge(std::queue<hash256_t>& hashQueue1, std::queue<hash256_t>& hashQueue2, std::queue<bool>& bitQueue1, std::queue<bool>& bitQueue2, unsigned int depth)
 {
     if (hashQueue1.empty())
     {
@@ -348,20 +369,20 @@ void PartialMerkleTree::merge(std::queue<uchar_vector>& hashQueue1, std::queue<u
     txHashes_.splice(txHashes_.end(), leftSubtree.txHashes_);
     bits_.splice(bits_.end(), leftSubtree.bits_);
 
-    uchar_vector root;
+    hash256_t root;
     if (!hashQueue1.empty())
     {
         PartialMerkleTree rightSubtree;
         rightSubtree.setCompressed(hashQueue1, bitQueue1, depth);
 
-        root = sha256_2(leftSubtree.root_ + rightSubtree.root_);
+        root = hashPair(leftSubtree.root_, rightSubtree.root_);
         merkleHashes_.splice(merkleHashes_.end(), rightSubtree.merkleHashes_);
         txHashes_.splice(txHashes_.end(), rightSubtree.txHashes_);
         bits_.splice(bits_.end(), rightSubtree.bits_);
     }
     else
     {
-        root = sha256_2(leftSubtree.root_ + leftSubtree.root_);
+        root = hashPair(leftSubtree.root_, leftSubtree.root_);
     }
 
     if (root != hashQueue2.front())
@@ -398,7 +419,7 @@ uchar_vector PartialMerkleTree::getFlags() const
 void PartialMerkleTree::updateTxIndices()
 {
     // TODO: optimize
-    std::set<uchar_vector> txHashesSet = getTxHashesSet();
+    std::unordered_set<hash256_t> txHashesSet(txHashes_.begin(), txHashes_.end());
     txIndices_.clear();
     unsigned int i = 0;
     for (auto& hash: merkleHashes_)
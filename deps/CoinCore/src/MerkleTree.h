@@ -12,6 +12,7 @@
 #pragma once
 
 #include "hash.h"
+#include "fixedhash.h"
 
 #include <stdutils/uchar_vector.h>
 
@@ -57,38 +58,38 @@ public:
 
     unsigned int getNTxs() const { return nTxs_; }
     unsigned int getDepth() const { return depth_; }
-    const std::list<uchar_vector>& getMerkleHashes() const { return merkleHashes_; }
+    const std::list<hash256_t>& getMerkleHashes() const { return merkleHashes_; }
     std::vector<uchar_vector> getMerkleHashesVector() const
     {
         std::vector<uchar_vector> rval;
-        for (auto& hash: merkleHashes_) { rval.push_back(hash); }
+        for (auto& hash: merkleHashes_) { rval.push_back(hash.getBytes()); }
         return rval;
     }
 
-    const std::list<uchar_vector>& getTxHashes() const { return txHashes_; }
+    const std::list<hash256_t>& getTxHashes() const { return txHashes_; }
     std::vector<uchar_vector> getTxHashesVector() const
     {
         std::vector<uchar_vector> rval;
-        for (auto& hash: txHashes_) { rval.push_back(hash); }
+        for (auto& hash: txHashes_) { rval.push_back(hash.getBytes()); }
         return rval;
     }
     std::vector<uchar_vector> getTxHashesLittleEndianVector() const
     {
         std::vector<uchar_vector> rval;
-        for (auto& hash: txHashes_) { rval.push_back(uchar_vector(hash).getReverse()); }
+        for (auto& hash: txHashes_) { rval.push_back(hash.getReverse().getBytes()); }
         return rval;
     }
 
     std::set<uchar_vector> getTxHashesSet() const
     {
         std::set<uchar_vector> rval;
-        for (auto& hash: txHashes_) { rval.insert(hash); }
+        for (auto& hash: txHashes_) { rval.insert(hash.getBytes()); }
         return rval;
     }
     std::set<uchar_vector> getTxHashesLittleEndianSet() const
     {
         std::set<uchar_vector> rval;
-        for (auto& hash: txHashes_) { rval.insert(uchar_vector(hash).getReverse()); }
+        for (auto& hash: txHashes_) { rval.insert(hash.getReverse().getBytes()); }
         return rval;
     }
 
@@ -102,23 +103,23 @@ public:
 
     uchar_vector getFlags() const;
 
-    const uchar_vector& getRoot() const { return root_; }
-    uchar_vector getRootLittleEndian() const { return uchar_vector(root_).getReverse(); }
+    uchar_vector getRoot() const { return root_.getBytes(); }
+    uchar_vector getRootLittleEndian() const { return root_.getReverse().getBytes(); }
 
     std::string toIndentedString(bool showIndices = false) const;
 
 private:
     unsigned int nTxs_;
     unsigned int depth_;
-    std::list<uchar_vector> merkleHashes_;
-    std::list<uchar_vector> txHashes_;
+    std::list<hash256_t> merkleHashes_;
+    std::list<hash256_t> txHashes_;
     std::list<unsigned int> txIndices_;
     std::list<bool> bits_;
-    uchar_vector root_;
+    hash256_t root_;
 
-    void setCompressed(std::queue<uchar_vector>& hashQueue, std::queue<bool>& bitQueue, unsigned int depth);
+    void setCompressed(std::queue<hash256_t>& hashQueue, std::queue<bool>& bitQueue, unsigned int depth);
     void setUncompressed(const std::vector<MerkleLeaf>& leaves, std::size_t begin, std::size_t end, unsigned int depth);
-    void merge(std::queue<uchar_vector>& hashQueue1, std::queue<uchar_vector>& hashQueue2, std::queue<bool>& bitQueue1, std::queue<bool>& bitQueue2, unsigned int depth);
+    void merge(std::queue<hash256_t>& hashQueue1, std::queue<hash256_t>& hashQueue2, std::queue<bool>& bitQueue1, std::queue<bool>& bitQueue2, unsigned int depth);
 
     void updateTxIndices();
 };
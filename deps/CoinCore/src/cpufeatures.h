@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// cpufeatures.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+// Runtime detection of the x86 extensions used by the hash kernels. HAVE_X86_CPUID is only
+// defined where the compiler can also build code for those extensions with target attributes.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_X86_CPUID 1
+
+#include <cpuid.h>
+#include <stdint.h>
+
+namespace Coin {
+namespace CPU {
+
+inline bool HaveSSE2()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return edx & (1 << 26);
+}
+
+inline bool HaveSSE41()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & (1 << 19);
+}
+
+// Bit of ebx in cpuid leaf 7.
+inline bool HaveLeaf7(uint32_t bit)
+{
+    if (__get_cpuid_max(0, nullptr) < 7) return false;
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ebx & bit;
+}
+
+// Whether the OS saves the register states in xcr0Mask across context switches.
+inline bool HaveOSSupport(uint32_t xcr0Mask)
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+
+    const uint32_t OSXSAVE = 1 << 27, AVX = 1 << 28;
+    if ((ecx & (OSXSAVE | AVX)) != (OSXSAVE | AVX)) return false;
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    return (xcr0_lo & xcr0Mask) == xcr0Mask;
+}
+
+// XMM and YMM state, plus the opmask and upper ZMM state for AVX-512.
+inline bool HaveAVX2()      { return HaveOSSupport(0x06) && HaveLeaf7(1 << 5); }
+inline bool HaveAVX512F()   { return HaveOSSupport(0xE6) && HaveLeaf7(1 << 16); }
+inline bool HaveSHANI()     { return HaveSSE41() && HaveLeaf7(1 << 29); }
+
+} // CPU
+} // Coin
+
+#endif
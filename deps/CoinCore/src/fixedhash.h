@@ -0,0 +1,123 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// fixedhash.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#ifndef __FIXEDHASH_H___
+#define __FIXEDHASH_H___
+
+#include <stdutils/uchar_vector.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace Coin
+{
+
+// Fixed-size digest held by value. Trivially copyable, so containers store it inline
+// instead of pointing at a separate heap buffer the way uchar_vector does. The all-zero
+// value is the default and can serve as the empty marker in open-addressing tables.
+// Byte order is whatever the bytes were constructed from; nothing is reversed implicitly.
+template<std::size_t N>
+class FixedHash
+{
+public:
+    static const std::size_t SIZE = N;
+
+    FixedHash() { std::memset(data_, 0, N); }
+    explicit FixedHash(const unsigned char* data) { std::memcpy(data_, data, N); }
+    explicit FixedHash(const std::vector<unsigned char>& bytes)
+    {
+        if (bytes.size() != N) throw std::runtime_error("FixedHash - invalid hash size.");
+        std::memcpy(data_, bytes.data(), N);
+    }
+
+    unsigned char* data() { return data_; }
+    const unsigned char* data() const { return data_; }
+    static std::size_t size() { return N; }
+
+    unsigned char* begin() { return data_; }
+    unsigned char* end() { return data_ + N; }
+    const unsigned char* begin() const { return data_; }
+    const unsigned char* end() const { return data_ + N; }
+
+    bool isZero() const
+    {
+        for (std::size_t i = 0; i < N; i++) { if (data_[i]) return false; }
+        return true;
+    }
+
+    uchar_vector getBytes() const { return uchar_vector(data_, data_ + N); }
+    std::string getHex() const { return getBytes().getHex(); }
+
+    FixedHash getReverse() const
+    {
+        FixedHash rval;
+        std::reverse_copy(data_, data_ + N, rval.data_);
+        return rval;
+    }
+
+    bool operator==(const FixedHash& rhs) const { return std::memcmp(data_, rhs.data_, N) == 0; }
+    bool operator!=(const FixedHash& rhs) const { return std::memcmp(data_, rhs.data_, N) != 0; }
+    bool operator<(const FixedHash& rhs) const { return std::memcmp(data_, rhs.data_, N) < 0; }
+
+    bool operator==(const std::vector<unsigned char>& rhs) const { return rhs.size() == N && std::memcmp(data_, rhs.data(), N) == 0; }
+    bool operator!=(const std::vector<unsigned char>& rhs) const { return !(*this == rhs); }
+
+private:
+    unsigned char data_[N];
+};
+
+typedef FixedHash<32> hash256_t;    // block hashes, txids, sha256
+typedef FixedHash<20> hash160_t;    // hash160 of pubkeys and scripts
+
+// Random per-process key so peers cannot pick hashes that collide in our tables.
+inline uint64_t getFixedHashSalt()
+{
+    static const uint64_t salt = []() {
+        std::random_device rd;
+        return ((uint64_t)rd() << 32) ^ rd();
+    }();
+    return salt;
+}
+
+// The digests are already uniformly distributed, so the first 16 bytes are folded with
+// the salt and mixed instead of running a full hash over all of them.
+template<std::size_t N>
+struct FixedHashHasher
+{
+    std::size_t operator()(const FixedHash<N>& hash) const
+    {
+        static_assert(N >= 16, "FixedHashHasher needs at least 16 bytes.");
+        uint64_t a, b;
+        std::memcpy(&a, hash.data(), 8);
+        std::memcpy(&b, hash.data() + 8, 8);
+        uint64_t x = a ^ getFixedHashSalt();
+        x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+        x ^= b;
+        x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return (std::size_t)x;
+    }
+};
+
+}
+
+namespace std
+{
+
+template<std::size_t N>
+struct hash<Coin::FixedHash<N>> : public Coin::FixedHashHasher<N> { };
+
+}
+
+#endif // __FIXEDHASH_H___
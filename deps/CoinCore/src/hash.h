@@ -20,31 +20,23 @@
 
 #include "hashblock.h" // for Hash9
 #include "scrypt/scrypt.h" // for scrypt_1024_1_1_256
+#include "sha256.h"
 
 // All inputs and outputs are big endian
 
+// For hot paths use SHA256Digest, SHA256D and SHA256DBatch from sha256.h directly, which write
+// into caller provided buffers.
 inline uchar_vector sha256(const uchar_vector& data)
 {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, &data[0], data.size());
-    SHA256_Final(hash, &sha256);
-    uchar_vector rval(hash, SHA256_DIGEST_LENGTH);
+    uchar_vector rval(CSHA256::OUTPUT_SIZE);
+    SHA256Digest(&rval[0], data.data(), data.size());
     return rval;
 }
 
 inline uchar_vector sha256_2(const uchar_vector& data)
 {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, &data[0], data.size());
-    SHA256_Final(hash, &sha256);
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, hash, SHA256_DIGEST_LENGTH);
-    SHA256_Final(hash, &sha256);
-    uchar_vector rval(hash, SHA256_DIGEST_LENGTH);
+    uchar_vector rval(CSHA256::OUTPUT_SIZE);
+    SHA256D(&rval[0], data.data(), data.size());
     return rval;
 }
 
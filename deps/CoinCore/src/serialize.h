@@ -0,0 +1,182 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// serialize.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#ifndef __SERIALIZE_H___
+#define __SERIALIZE_H___
+
+#include <stdutils/uchar_vector.h>
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace Coin
+{
+
+// Forward-only cursor over a contiguous byte range. Nested structures read
+// from the same cursor so a message is parsed in a single pass without ever
+// copying the unread remainder of the buffer. The caller owns the memory and
+// must keep it alive while the reader is in use.
+class ByteReader
+{
+public:
+    ByteReader(const unsigned char* data, std::size_t size)
+        : begin_(data), pos_(data), end_(data + size) { }
+    explicit ByteReader(const std::vector<unsigned char>& bytes)
+        : begin_(bytes.data()), pos_(bytes.data()), end_(bytes.data() + bytes.size()) { }
+
+    std::size_t size() const { return end_ - begin_; }
+    std::size_t position() const { return pos_ - begin_; }
+    std::size_t remaining() const { return end_ - pos_; }
+    bool atEnd() const { return pos_ == end_; }
+
+    // Pointer to the next unread byte.
+    const unsigned char* data() const { return pos_; }
+
+    void require(std::size_t n, const char* error) const
+    {
+        if (remaining() < n) throw std::runtime_error(error);
+    }
+
+    unsigned char peek(const char* error) const
+    {
+        require(1, error);
+        return *pos_;
+    }
+
+    void skip(std::size_t n, const char* error)
+    {
+        require(n, error);
+        pos_ += n;
+    }
+
+    // Returns a pointer to the next n bytes and advances past them.
+    const unsigned char* read(std::size_t n, const char* error)
+    {
+        require(n, error);
+        const unsigned char* p = pos_;
+        pos_ += n;
+        return p;
+    }
+
+    void readBytes(uchar_vector& dest, std::size_t n, const char* error)
+    {
+        const unsigned char* p = read(n, error);
+        dest.assign(p, p + n);
+    }
+
+    void readBytes(unsigned char* dest, std::size_t n, const char* error)
+    {
+        const unsigned char* p = read(n, error);
+        std::copy(p, p + n, dest);
+    }
+
+    // Copies n bytes into dest in reverse order.
+    void readReversed(uchar_vector& dest, std::size_t n, const char* error)
+    {
+        const unsigned char* p = read(n, error);
+        dest.assign(std::reverse_iterator<const unsigned char*>(p + n), std::reverse_iterator<const unsigned char*>(p));
+    }
+
+    uint8_t readUInt8(const char* error) { return *read(1, error); }
+
+    // Little endian unless noted otherwise.
+    template<typename T>
+    T readUInt(const char* error)
+    {
+        const unsigned char* p = read(sizeof(T), error);
+        T n = 0;
+        for (std::size_t i = sizeof(T); i > 0; i--) { n = (n << 8) | p[i - 1]; }
+        return n;
+    }
+
+    uint16_t readUInt16(const char* error) { return readUInt<uint16_t>(error); }
+    uint32_t readUInt32(const char* error) { return readUInt<uint32_t>(error); }
+    uint64_t readUInt64(const char* error) { return readUInt<uint64_t>(error); }
+
+    uint16_t readUInt16BE(const char* error)
+    {
+        const unsigned char* p = read(2, error);
+        return ((uint16_t)p[0] << 8) | p[1];
+    }
+
+    uint64_t readVarInt(const char* error)
+    {
+        unsigned char prefix = readUInt8(error);
+        if (prefix < 0xfd)  return prefix;
+        if (prefix == 0xfd) return readUInt16(error);
+        if (prefix == 0xfe) return readUInt32(error);
+        return readUInt64(error);
+    }
+
+private:
+    const unsigned char* begin_;
+    const unsigned char* pos_;
+    const unsigned char* end_;
+};
+
+// Append-only writers. Callers reserve the exact size up front (see
+// CoinNodeStructure::getSize) so a whole structure serializes into a single
+// allocation.
+inline void writeUInt8(uchar_vector& buffer, uint8_t n) { buffer.push_back(n); }
+
+// Little endian unless noted otherwise.
+template<typename T>
+inline void writeUInt(uchar_vector& buffer, T n)
+{
+    for (std::size_t i = 0; i < sizeof(T); i++) { buffer.push_back((unsigned char)(n >> (8 * i))); }
+}
+
+inline void writeUInt16(uchar_vector& buffer, uint16_t n) { writeUInt<uint16_t>(buffer, n); }
+inline void writeUInt32(uchar_vector& buffer, uint32_t n) { writeUInt<uint32_t>(buffer, n); }
+inline void writeUInt64(uchar_vector& buffer, uint64_t n) { writeUInt<uint64_t>(buffer, n); }
+
+inline void writeUInt16BE(uchar_vector& buffer, uint16_t n)
+{
+    buffer.push_back((unsigned char)(n >> 8));
+    buffer.push_back((unsigned char)n);
+}
+
+inline std::size_t varIntSize(uint64_t n)
+{
+    if (n < 0xfd)           return 1;
+    if (n <= 0xffff)        return 3;
+    if (n <= 0xffffffff)    return 5;
+    return 9;
+}
+
+inline void writeVarInt(uchar_vector& buffer, uint64_t n)
+{
+    if (n < 0xfd)               { writeUInt8(buffer, n); }
+    else if (n <= 0xffff)       { writeUInt8(buffer, 0xfd); writeUInt16(buffer, n); }
+    else if (n <= 0xffffffff)   { writeUInt8(buffer, 0xfe); writeUInt32(buffer, n); }
+    else                        { writeUInt8(buffer, 0xff); writeUInt64(buffer, n); }
+}
+
+inline void writeBytes(uchar_vector& buffer, const unsigned char* data, std::size_t n)
+{
+    buffer.insert(buffer.end(), data, data + n);
+}
+
+inline void writeBytes(uchar_vector& buffer, const std::vector<unsigned char>& bytes)
+{
+    buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+}
+
+// Appends n bytes in reverse order.
+inline void writeReversed(uchar_vector& buffer, const unsigned char* data, std::size_t n)
+{
+    buffer.insert(buffer.end(), std::reverse_iterator<const unsigned char*>(data + n), std::reverse_iterator<const unsigned char*>(data));
+}
+
+}
+
+#endif // __SERIALIZE_H___
@@ -0,0 +1,407 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// sha256.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "sha256.h"
+
+#include <cstring>
+
+#include "cpufeatures.h"
+
+#if defined(HAVE_X86_CPUID)
+#define ENABLE_SHA256_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+inline void WriteBE64(unsigned char* p, uint64_t x)
+{
+    WriteBE32(p, x >> 32);
+    WriteBE32(p + 4, (uint32_t)x);
+}
+
+// Compression function: hashes blocks consecutive 64-byte blocks into the state s.
+typedef void (*TransformFunc)(uint32_t* s, const unsigned char* chunk, size_t blocks);
+
+namespace scalar
+{
+
+inline uint32_t Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+inline uint32_t Ch(uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); }
+inline uint32_t Maj(uint32_t x, uint32_t y, uint32_t z) { return (x & y) | (z & (x | y)); }
+inline uint32_t Sigma0(uint32_t x) { return Rotr(x, 2) ^ Rotr(x, 13) ^ Rotr(x, 22); }
+inline uint32_t Sigma1(uint32_t x) { return Rotr(x, 6) ^ Rotr(x, 11) ^ Rotr(x, 25); }
+inline uint32_t sigma0(uint32_t x) { return Rotr(x, 7) ^ Rotr(x, 18) ^ (x >> 3); }
+inline uint32_t sigma1(uint32_t x) { return Rotr(x, 17) ^ Rotr(x, 19) ^ (x >> 10); }
+
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--)
+    {
+        uint32_t w[16];
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i++)
+        {
+            if (i < 16)
+                w[i] = ReadBE32(chunk + 4 * i);
+            else
+                w[i & 15] += sigma1(w[(i - 2) & 15]) + w[(i - 7) & 15] + sigma0(w[(i - 15) & 15]);
+
+            uint32_t t1 = h + Sigma1(e) + Ch(e, f, g) + K[i] + w[i & 15];
+            uint32_t t2 = Sigma0(a) + Maj(a, b, c);
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+        chunk += 64;
+    }
+}
+
+}
+
+#ifdef ENABLE_SHA256_X86
+namespace shani
+{
+
+// Four rounds using message words W, then the next four-word group of the schedule.
+#define SHANI_ROUNDS(W, j) \
+    msg = _mm_add_epi32(W, _mm_loadu_si128((const __m128i*)&K[4 * (j)])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+#define SHANI_SCHEDULE(W0, W1, W2, W3) \
+    W0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(W0, W1), _mm_alignr_epi8(W3, W2, 4)), W3);
+
+__attribute__((target("sha,sse4.1")))
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The SHA instructions keep the state as ABEF and CDGH.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--)
+    {
+        const __m128i save0 = state0, save1 = state1;
+        __m128i msg;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 0)), mask);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16)), mask);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 32)), mask);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 48)), mask);
+
+        SHANI_ROUNDS(w0, 0)
+        SHANI_ROUNDS(w1, 1)
+        SHANI_ROUNDS(w2, 2)
+        SHANI_ROUNDS(w3, 3)
+        for (int j = 4; j < 16; j += 4)
+        {
+            SHANI_SCHEDULE(w0, w1, w2, w3) SHANI_ROUNDS(w0, j)
+            SHANI_SCHEDULE(w1, w2, w3, w0) SHANI_ROUNDS(w1, j + 1)
+            SHANI_SCHEDULE(w2, w3, w0, w1) SHANI_ROUNDS(w2, j + 2)
+            SHANI_SCHEDULE(w3, w0, w1, w2) SHANI_ROUNDS(w3, j + 3)
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+        chunk += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&s[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&s[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#undef SHANI_ROUNDS
+#undef SHANI_SCHEDULE
+
+}
+
+namespace avx2
+{
+
+// Eight independent messages, one per 32-bit lane.
+
+#define AVX2_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define AVX2_XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+// One 64-byte block per lane. w holds the sixteen big endian message words of each lane.
+__attribute__((target("avx2")))
+void Transform8(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+        {
+            __m256i w2 = w[(i - 2) & 15], w15 = w[(i - 15) & 15];
+            __m256i s1 = AVX2_XOR3(AVX2_ROTR(w2, 17), AVX2_ROTR(w2, 19), _mm256_srli_epi32(w2, 10));
+            __m256i s0 = AVX2_XOR3(AVX2_ROTR(w15, 7), AVX2_ROTR(w15, 18), _mm256_srli_epi32(w15, 3));
+            w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s1), _mm256_add_epi32(w[(i - 7) & 15], s0));
+        }
+
+        __m256i S1 = AVX2_XOR3(AVX2_ROTR(e, 6), AVX2_ROTR(e, 11), AVX2_ROTR(e, 25));
+        __m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(K[i]), w[i & 15])));
+        __m256i S0 = AVX2_XOR3(AVX2_ROTR(a, 2), AVX2_ROTR(a, 13), AVX2_ROTR(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = _mm256_add_epi32(S0, maj);
+        h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+        d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+    s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+    s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+}
+
+#undef AVX2_ROTR
+#undef AVX2_XOR3
+
+__attribute__((target("avx2")))
+void LoadBlocks(__m256i* w, const unsigned char* const* p)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = _mm256_set_epi32(ReadBE32(p[7] + 4 * i), ReadBE32(p[6] + 4 * i), ReadBE32(p[5] + 4 * i), ReadBE32(p[4] + 4 * i),
+                                ReadBE32(p[3] + 4 * i), ReadBE32(p[2] + 4 * i), ReadBE32(p[1] + 4 * i), ReadBE32(p[0] + 4 * i));
+    }
+}
+
+// Double SHA-256 of eight consecutive messages of len bytes each.
+__attribute__((target("avx2")))
+void HashD8(unsigned char* out, const unsigned char* in, size_t len)
+{
+    __m256i s[8], w[16];
+    for (int i = 0; i < 8; i++) { s[i] = _mm256_set1_epi32(IV[i]); }
+
+    const unsigned char* p[8];
+    size_t full = len / 64;
+    for (size_t block = 0; block < full; block++)
+    {
+        for (int lane = 0; lane < 8; lane++) { p[lane] = in + lane * len + block * 64; }
+        LoadBlocks(w, p);
+        Transform8(s, w);
+    }
+
+    // Remaining bytes plus padding fit in one or two blocks.
+    size_t rem = len % 64;
+    size_t tailBlocks = rem + 9 <= 64 ? 1 : 2;
+    unsigned char tail[8][128];
+    for (int lane = 0; lane < 8; lane++)
+    {
+        std::memcpy(tail[lane], in + lane * len + full * 64, rem);
+        tail[lane][rem] = 0x80;
+        std::memset(tail[lane] + rem + 1, 0, tailBlocks * 64 - rem - 9);
+        WriteBE64(tail[lane] + tailBlocks * 64 - 8, (uint64_t)len << 3);
+    }
+    for (size_t block = 0; block < tailBlocks; block++)
+    {
+        for (int lane = 0; lane < 8; lane++) { p[lane] = tail[lane] + block * 64; }
+        LoadBlocks(w, p);
+        Transform8(s, w);
+    }
+
+    // The second hash is over the 32-byte first hash, whose words are already in s.
+    for (int i = 0; i < 8; i++) { w[i] = s[i]; s[i] = _mm256_set1_epi32(IV[i]); }
+    w[8] = _mm256_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++) { w[i] = _mm256_setzero_si256(); }
+    w[15] = _mm256_set1_epi32(256);
+    Transform8(s, w);
+
+    uint32_t words[8];
+    for (int i = 0; i < 8; i++)
+    {
+        _mm256_storeu_si256((__m256i*)words, s[i]);
+        for (int lane = 0; lane < 8; lane++) { WriteBE32(out + lane * 32 + i * 4, words[lane]); }
+    }
+}
+
+}
+
+#endif
+
+struct Implementation
+{
+    std::string name;
+    TransformFunc transform;
+    bool batch8;
+};
+
+Implementation Detect()
+{
+    Implementation impl = { "scalar", &scalar::Transform, false };
+#ifdef ENABLE_SHA256_X86
+    // A single SHA-NI stream outruns the eight-lane AVX2 kernel per message.
+    if (Coin::CPU::HaveSHANI())        { impl.name = "sha-ni"; impl.transform = &shani::Transform; }
+    else if (Coin::CPU::HaveAVX2())    { impl.name = "avx2"; impl.batch8 = true; }
+#endif
+    return impl;
+}
+
+Implementation& Selected()
+{
+    static Implementation impl = Detect();
+    return impl;
+}
+
+}
+
+std::string SHA256AutoDetect()
+{
+    return Selected().name;
+}
+
+bool SHA256SelectImplementation(const std::string& name)
+{
+    Implementation& impl = Selected();
+    if (name == "scalar")
+    {
+        impl.name = name; impl.transform = &scalar::Transform; impl.batch8 = false;
+        return true;
+    }
+#ifdef ENABLE_SHA256_X86
+    if (name == "sha-ni" && Coin::CPU::HaveSHANI())
+    {
+        impl.name = name; impl.transform = &shani::Transform; impl.batch8 = false;
+        return true;
+    }
+    if (name == "avx2" && Coin::CPU::HaveAVX2())
+    {
+        impl.name = name; impl.transform = &scalar::Transform; impl.batch8 = true;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string SHA256Implementation()
+{
+    return Selected().name;
+}
+
+////// CSHA256
+
+CSHA256::CSHA256() : bytes(0)
+{
+    Reset();
+}
+
+CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
+{
+    TransformFunc transform = Selected().transform;
+    const unsigned char* end = data + len;
+    size_t bufsize = bytes % 64;
+    if (bufsize && bufsize + len >= 64)
+    {
+        // Fill the buffer and process it.
+        std::memcpy(buf + bufsize, data, 64 - bufsize);
+        bytes += 64 - bufsize;
+        data += 64 - bufsize;
+        transform(s, buf, 1);
+        bufsize = 0;
+    }
+    if (end - data >= 64)
+    {
+        size_t blocks = (end - data) / 64;
+        transform(s, data, blocks);
+        data += 64 * blocks;
+        bytes += 64 * blocks;
+    }
+    if (end > data)
+    {
+        // Keep the remainder for the next call.
+        std::memcpy(buf + bufsize, data, end - data);
+        bytes += end - data;
+    }
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    static const unsigned char pad[64] = { 0x80 };
+    unsigned char sizedesc[8];
+    WriteBE64(sizedesc, bytes << 3);
+    Write(pad, 1 + ((119 - (bytes % 64)) % 64));
+    Write(sizedesc, 8);
+    for (int i = 0; i < 8; i++) { WriteBE32(hash + 4 * i, s[i]); }
+}
+
+CSHA256& CSHA256::Reset()
+{
+    bytes = 0;
+    std::memcpy(s, IV, sizeof(s));
+    return *this;
+}
+
+////// One-shot and batch helpers
+
+void SHA256Digest(unsigned char* out, const unsigned char* data, size_t len)
+{
+    CSHA256().Write(data, len).Finalize(out);
+}
+
+void SHA256D(unsigned char* out, const unsigned char* data, size_t len)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256 hasher;
+    hasher.Write(data, len).Finalize(hash);
+    hasher.Reset().Write(hash, sizeof(hash)).Finalize(out);
+}
+
+void SHA256DBatch(unsigned char* out, const unsigned char* in, size_t len, size_t count)
+{
+#ifdef ENABLE_SHA256_X86
+    if (Selected().batch8)
+    {
+        for (; count >= 8; count -= 8)
+        {
+            avx2::HashD8(out, in, len);
+            out += 8 * 32;
+            in += 8 * len;
+        }
+    }
+#endif
+    for (; count > 0; count--)
+    {
+        SHA256D(out, in, len);
+        out += 32;
+        in += len;
+    }
+}
@@ -0,0 +1,56 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// sha256.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+// SHA-256 hasher. The compression function is picked at runtime, see SHA256AutoDetect.
+class CSHA256
+{
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA256& Reset();
+};
+
+// Selects the fastest SHA-256 implementation this CPU supports and returns its name.
+// Called automatically on first use; calling it again is harmless.
+std::string SHA256AutoDetect();
+
+// Forces one of "sha-ni", "avx2" or "scalar". Returns false if the CPU does not support it.
+// Not thread safe; meant for tests and benchmarks.
+bool SHA256SelectImplementation(const std::string& name);
+
+// Name of the implementation in use.
+std::string SHA256Implementation();
+
+// Single and double SHA-256 of one message into a caller provided 32-byte buffer.
+void SHA256Digest(unsigned char* out, const unsigned char* data, size_t len);
+void SHA256D(unsigned char* out, const unsigned char* data, size_t len);
+
+// Double SHA-256 of count independent messages of len bytes each, stored back to back in in.
+// Writes count 32-byte hashes back to back to out. Eight messages at a time are hashed in
+// parallel when the AVX2 kernel is selected. Typical inputs are merkle tree levels (64 bytes)
+// and block headers. out may point to in, so a merkle level can be reduced in place.
+void SHA256DBatch(unsigned char* out, const unsigned char* in, size_t len, size_t count);
+
+// Merkle tree level helper: count double hashes of 64-byte inputs.
+inline void SHA256D64(unsigned char* out, const unsigned char* in, size_t count) { SHA256DBatch(out, in, 64, count); }
@@ -1,33 +1,405 @@
-#include "shabal256.h"
-
-extern "C" {
-#include "hashfunc/sph_shabal.h"
-}
-
-CShabal256::CShabal256()
-{
-    cc = new sph_shabal256_context;
-    ::sph_shabal256_init(cc);
-}
-
-CShabal256::~CShabal256()
-{
-    delete (sph_shabal256_context*)cc;
-}
-
-CShabal256& CShabal256::Write(const unsigned char* data, size_t len)
-{
-    ::sph_shabal256(cc, (const void*)data, len);
-    return *this;
-}
-
-void CShabal256::Finalize(unsigned char hash[OUTPUT_SIZE])
-{
-    ::sph_shabal256_close(cc, hash);
-}
-
-CShabal256& CShabal256::Reset()
-{
-    ::sph_shabal256_init(cc);
-    return *this;
-}
+#include "shabal256.h"
+
+#include <cstring>
+#include <stdexcept>
+
+extern "C" {
+#include "hashfunc/sph_shabal.h"
+}
+
+#include "cpufeatures.h"
+
+#if defined(HAVE_X86_CPUID)
+#define ENABLE_SHABAL256_X86 1
+#endif
+
+#if defined(__GNUC__)
+#define SHABAL_INLINE inline __attribute__((always_inline))
+// Vectors are only passed to and returned from the always inlined helpers, so the ABI
+// differences GCC warns about never come into play.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#else
+#define SHABAL_INLINE inline
+#endif
+
+CShabal256::CShabal256()
+{
+    cc = new sph_shabal256_context;
+    ::sph_shabal256_init(cc);
+}
+
+CShabal256::~CShabal256()
+{
+    delete (sph_shabal256_context*)cc;
+}
+
+CShabal256& CShabal256::Write(const unsigned char* data, size_t len)
+{
+    ::sph_shabal256(cc, (const void*)data, len);
+    return *this;
+}
+
+void CShabal256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    ::sph_shabal256_close(cc, hash);
+}
+
+CShabal256& CShabal256::Reset()
+{
+    ::sph_shabal256_init(cc);
+    return *this;
+}
+
+namespace
+{
+
+const uint32_t A_INIT[12] = {
+    0x52F84552, 0xE54B7999, 0x2D8EE3EC, 0xB9645191, 0xE0078B86, 0xBB7C44C9,
+    0xD2B5C1CA, 0xB0D2EB8C, 0x14CE5A45, 0x22AF50DC, 0xEFFDBC6B, 0xEB21B74A
+};
+
+const uint32_t B_INIT[16] = {
+    0xB555C6EE, 0x3E710596, 0xA72A652F, 0x9301515F, 0xDA28C1FA, 0x696FD868, 0x9CB6BF72, 0x0AFE4002,
+    0xA6E03615, 0x5138C1D4, 0xBE216306, 0xB38B8890, 0x3EA8B96B, 0x3299ACE4, 0x30924DD4, 0x55CB34A5
+};
+
+const uint32_t C_INIT[16] = {
+    0xB405F031, 0xC4233EBA, 0xB3733979, 0xC0DD9D55, 0xC51C28AE, 0xA327B8E1, 0x56C56167, 0xED614433,
+    0x88B59D60, 0x60E2CEBA, 0x758B4B8B, 0x83E82A7F, 0xBC968828, 0xE6E00BF7, 0xBA839E55, 0x9B491C60
+};
+
+inline uint32_t ReadLE32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void WriteLE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// V is uint32_t or a GCC vector of them. Every operation below works the same on both, so one
+// definition serves each lane count. The helpers are always inlined into the per-ISA entry
+// points further down, which is where the vector instructions get picked.
+
+template <typename V>
+SHABAL_INLINE V Splat(uint32_t x)
+{
+    V v = V();
+    return v + x;
+}
+
+template <typename V>
+SHABAL_INLINE V Rotl(const V& x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+// One step of the permutation for word i of the message, s being 0, 16 or 32.
+#define SHABAL_ELT(s, i) \
+    A[((s) + (i)) % 12] = ((A[((s) + (i)) % 12] ^ (Rotl(A[((s) + (i) + 11) % 12], 15) * 5) ^ C[(24 - (i)) % 16]) * 3) \
+        ^ B[((i) + 13) % 16] ^ (B[((i) + 9) % 16] & ~B[((i) + 6) % 16]) ^ M[i]; \
+    B[i] = ~(Rotl(B[i], 1) ^ A[((s) + (i)) % 12]);
+
+#define SHABAL_STEP(s) \
+    SHABAL_ELT(s, 0)  SHABAL_ELT(s, 1)  SHABAL_ELT(s, 2)  SHABAL_ELT(s, 3) \
+    SHABAL_ELT(s, 4)  SHABAL_ELT(s, 5)  SHABAL_ELT(s, 6)  SHABAL_ELT(s, 7) \
+    SHABAL_ELT(s, 8)  SHABAL_ELT(s, 9)  SHABAL_ELT(s, 10) SHABAL_ELT(s, 11) \
+    SHABAL_ELT(s, 12) SHABAL_ELT(s, 13) SHABAL_ELT(s, 14) SHABAL_ELT(s, 15)
+
+// Shabal-256 state of one message per lane. All lanes hash messages of the same length, so
+// they share the block counter.
+template <typename V>
+struct State
+{
+    V A[12], B[16], C[16];
+    uint32_t Wlow, Whigh;
+
+    SHABAL_INLINE void Init()
+    {
+        for (int i = 0; i < 12; i++) { A[i] = Splat<V>(A_INIT[i]); }
+        for (int i = 0; i < 16; i++) { B[i] = Splat<V>(B_INIT[i]); C[i] = Splat<V>(C_INIT[i]); }
+        Wlow = 1;
+        Whigh = 0;
+    }
+
+    SHABAL_INLINE void Permute(const V* M)
+    {
+        A[0] ^= Splat<V>(Wlow);
+        A[1] ^= Splat<V>(Whigh);
+        for (int i = 0; i < 16; i++) { B[i] = Rotl(B[i], 17); }
+        SHABAL_STEP(0)
+        SHABAL_STEP(16)
+        SHABAL_STEP(32)
+        for (int k = 0; k < 12; k++) { A[11 - k] += C[(22 - k) % 16]; }
+        for (int k = 0; k < 12; k++) { A[11 - k] += C[(26 - k) % 16]; }
+        for (int k = 0; k < 12; k++) { A[11 - k] += C[(30 - k) % 16]; }
+    }
+
+    SHABAL_INLINE void SwapBC()
+    {
+        for (int i = 0; i < 16; i++) { V t = B[i]; B[i] = C[i]; C[i] = t; }
+    }
+
+    SHABAL_INLINE void Block(const V* M)
+    {
+        for (int i = 0; i < 16; i++) { B[i] += M[i]; }
+        Permute(M);
+        for (int i = 0; i < 16; i++) { C[i] -= M[i]; }
+        SwapBC();
+        if (++Wlow == 0) Whigh++;
+    }
+
+    // M is the padded last block. The hash is left in B[8] to B[15].
+    SHABAL_INLINE void Close(const V* M)
+    {
+        for (int i = 0; i < 16; i++) { B[i] += M[i]; }
+        Permute(M);
+        for (int i = 0; i < 3; i++)
+        {
+            SwapBC();
+            Permute(M);
+        }
+    }
+};
+
+#undef SHABAL_ELT
+#undef SHABAL_STEP
+
+template <typename V, size_t LANES>
+SHABAL_INLINE void HashInterleaved(uint32_t* out, const uint32_t* in, size_t words)
+{
+    State<V> s;
+    s.Init();
+
+    V M[16];
+    for (; words >= 16; words -= 16, in += 16 * LANES)
+    {
+        for (int i = 0; i < 16; i++) { std::memcpy(&M[i], in + i * LANES, sizeof(V)); }
+        s.Block(M);
+    }
+
+    // The last block is never full: a multiple of 64 bytes still gets a block of padding.
+    for (size_t i = 0; i < 16; i++)
+    {
+        if (i < words)
+            std::memcpy(&M[i], in + i * LANES, sizeof(V));
+        else
+            M[i] = Splat<V>(i == words ? 0x80 : 0);
+    }
+    s.Close(M);
+
+    for (int i = 0; i < 8; i++) { std::memcpy(out + i * LANES, &s.B[8 + i], sizeof(V)); }
+}
+
+// LANES consecutive messages of len bytes.
+template <typename V, size_t LANES>
+SHABAL_INLINE void HashBytes(unsigned char* out, const unsigned char* in, size_t len)
+{
+    State<V> s;
+    s.Init();
+
+    uint32_t words[16 * LANES];
+    V M[16];
+    size_t full = len / 64;
+    for (size_t block = 0; block < full; block++)
+    {
+        for (size_t lane = 0; lane < LANES; lane++)
+        {
+            const unsigned char* p = in + lane * len + block * 64;
+            for (int i = 0; i < 16; i++) { words[i * LANES + lane] = ReadLE32(p + 4 * i); }
+        }
+        for (int i = 0; i < 16; i++) { std::memcpy(&M[i], words + i * LANES, sizeof(V)); }
+        s.Block(M);
+    }
+
+    size_t rem = len % 64;
+    for (size_t lane = 0; lane < LANES; lane++)
+    {
+        unsigned char tail[64];
+        std::memcpy(tail, in + lane * len + full * 64, rem);
+        tail[rem] = 0x80;
+        std::memset(tail + rem + 1, 0, 63 - rem);
+        for (int i = 0; i < 16; i++) { words[i * LANES + lane] = ReadLE32(tail + 4 * i); }
+    }
+    for (int i = 0; i < 16; i++) { std::memcpy(&M[i], words + i * LANES, sizeof(V)); }
+    s.Close(M);
+
+    for (int i = 0; i < 8; i++) { std::memcpy(words + i * LANES, &s.B[8 + i], sizeof(V)); }
+    for (size_t lane = 0; lane < LANES; lane++)
+    {
+        for (int i = 0; i < 8; i++) { WriteLE32(out + lane * 32 + i * 4, words[i * LANES + lane]); }
+    }
+}
+
+typedef void (*InterleavedFunc)(uint32_t* out, const uint32_t* in, size_t words);
+typedef void (*BatchFunc)(unsigned char* out, const unsigned char* in, size_t len);
+
+namespace scalar
+{
+
+void Interleaved(uint32_t* out, const uint32_t* in, size_t words) { HashInterleaved<uint32_t, 1>(out, in, words); }
+void Batch(unsigned char* out, const unsigned char* in, size_t len) { HashBytes<uint32_t, 1>(out, in, len); }
+
+}
+
+#ifdef ENABLE_SHABAL256_X86
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef uint32_t v16u __attribute__((vector_size(64)));
+
+namespace sse2
+{
+
+__attribute__((target("sse2")))
+void Interleaved(uint32_t* out, const uint32_t* in, size_t words) { HashInterleaved<v4u, 4>(out, in, words); }
+
+__attribute__((target("sse2")))
+void Batch(unsigned char* out, const unsigned char* in, size_t len) { HashBytes<v4u, 4>(out, in, len); }
+
+}
+
+namespace avx2
+{
+
+__attribute__((target("avx2")))
+void Interleaved(uint32_t* out, const uint32_t* in, size_t words) { HashInterleaved<v8u, 8>(out, in, words); }
+
+__attribute__((target("avx2")))
+void Batch(unsigned char* out, const unsigned char* in, size_t len) { HashBytes<v8u, 8>(out, in, len); }
+
+}
+
+namespace avx512
+{
+
+__attribute__((target("avx512f")))
+void Interleaved(uint32_t* out, const uint32_t* in, size_t words) { HashInterleaved<v16u, 16>(out, in, words); }
+
+__attribute__((target("avx512f")))
+void Batch(unsigned char* out, const unsigned char* in, size_t len) { HashBytes<v16u, 16>(out, in, len); }
+
+}
+
+#endif
+
+struct Implementation
+{
+    std::string name;
+    size_t lanes;
+};
+
+bool Supported(const std::string& name)
+{
+    if (name == "scalar") return true;
+#ifdef ENABLE_SHABAL256_X86
+    if (name == "sse2") return Coin::CPU::HaveSSE2();
+    if (name == "avx2") return Coin::CPU::HaveAVX2();
+    if (name == "avx512") return Coin::CPU::HaveAVX512F();
+#endif
+    return false;
+}
+
+size_t LanesOf(const std::string& name)
+{
+    if (name == "avx512") return 16;
+    if (name == "avx2") return 8;
+    if (name == "sse2") return 4;
+    return 1;
+}
+
+Implementation Detect()
+{
+    const char* names[] = { "avx512", "avx2", "sse2" };
+    for (const char* name: names)
+    {
+        if (Supported(name)) return Implementation{ name, LanesOf(name) };
+    }
+    return Implementation{ "scalar", 1 };
+}
+
+Implementation& Selected()
+{
+    static Implementation impl = Detect();
+    return impl;
+}
+
+InterleavedFunc GetInterleaved(size_t lanes)
+{
+    switch (lanes)
+    {
+    case 1: return &scalar::Interleaved;
+#ifdef ENABLE_SHABAL256_X86
+    case 4: return &sse2::Interleaved;
+    case 8: return &avx2::Interleaved;
+    case 16: return &avx512::Interleaved;
+#endif
+    }
+    return nullptr;
+}
+
+BatchFunc GetBatch(size_t lanes)
+{
+    switch (lanes)
+    {
+    case 1: return &scalar::Batch;
+#ifdef ENABLE_SHABAL256_X86
+    case 4: return &sse2::Batch;
+    case 8: return &avx2::Batch;
+    case 16: return &avx512::Batch;
+#endif
+    }
+    return nullptr;
+}
+
+}
+
+std::string Shabal256AutoDetect()
+{
+    return Selected().name;
+}
+
+bool Shabal256SelectImplementation(const std::string& name)
+{
+    if (!Supported(name)) return false;
+
+    Implementation& impl = Selected();
+    impl.name = name;
+    impl.lanes = LanesOf(name);
+    return true;
+}
+
+std::string Shabal256Implementation()
+{
+    return Selected().name;
+}
+
+size_t Shabal256Lanes()
+{
+    return Selected().lanes;
+}
+
+void Shabal256Interleaved(uint32_t* out, const uint32_t* in, size_t words, size_t lanes)
+{
+    InterleavedFunc hash = lanes <= Selected().lanes ? GetInterleaved(lanes) : nullptr;
+    if (!hash) throw std::runtime_error("Shabal256Interleaved - unsupported lane count.");
+    hash(out, in, words);
+}
+
+void Shabal256Batch(unsigned char* out, const unsigned char* in, size_t len, size_t count)
+{
+    // Widest kernel first, narrower ones for what is left over.
+    const size_t widths[] = { 16, 8, 4, 1 };
+    for (size_t width: widths)
+    {
+        if (width > Selected().lanes) continue;
+
+        BatchFunc hash = GetBatch(width);
+        for (; count >= width; count -= width)
+        {
+            hash(out, in, len);
+            out += width * 32;
+            in += width * len;
+        }
+    }
+}
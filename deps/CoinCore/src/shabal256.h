@@ -2,6 +2,8 @@
 #define BITCOIN_CRYPTO_SHABAL256_H
 
 #include <cstddef>
+#include <stdint.h>
+#include <string>
 
 /** A hasher class for SHABAL-256. */
 class CShabal256
@@ -19,4 +21,30 @@ public:
     CShabal256& Reset();
 };
 
-#endif // BITCOIN_CRYPTO_SHABAL256_H
\ No newline at end of file
+/** Shabal does not parallelize within one message, so the kernels below hash several messages
+ *  of the same length side by side, one per SIMD lane: "avx512" runs 16, "avx2" 8, "sse2" 4 and
+ *  "scalar" 1. The widest one this CPU supports is picked on first use. */
+std::string Shabal256AutoDetect();
+
+/** Forces one of "avx512", "avx2", "sse2" or "scalar". Returns false if the CPU does not support it.
+ *  Not thread safe; meant for tests and benchmarks. */
+bool Shabal256SelectImplementation(const std::string& name);
+
+/** Name of the implementation in use. */
+std::string Shabal256Implementation();
+
+/** Number of messages the implementation in use hashes at once. */
+size_t Shabal256Lanes();
+
+/** Shabal-256 of lanes messages of words little endian 32-bit words each. The messages are
+ *  interleaved: word w of message l is in[w * lanes + l]. The eight words of each hash are
+ *  written to out the same way, so chained hashes like PoC plot generation can feed one
+ *  call's output into the next call's input. lanes has to be 1, 4, 8 or 16 and at most
+ *  Shabal256Lanes(). out may not overlap in. */
+void Shabal256Interleaved(uint32_t* out, const uint32_t* in, size_t words, size_t lanes);
+
+/** Shabal-256 of count independent messages of len bytes each, stored back to back in in.
+ *  Writes count 32-byte hashes back to back to out. */
+void Shabal256Batch(unsigned char* out, const unsigned char* in, size_t len, size_t count);
+
+#endif // BITCOIN_CRYPTO_SHABAL256_H
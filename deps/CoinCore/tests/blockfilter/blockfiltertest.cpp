@@ -0,0 +1,210 @@
+#include <BlockFilter.h>
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace Coin;
+using namespace std;
+
+// Checks the BIP158 basic filter against the testnet genesis vector from BIP158, SipHash-2-4
+// against the reference vectors from the SipHash paper, the filter header chain, and that
+// match() and both paths of matchAny() find every element and agree with each other.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+// BIP158 testnet-19 vector for block 0.
+static const char* GENESIS_HASH = "000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943";
+static const char* GENESIS_OUTPUT_SCRIPT =
+    "4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec1"
+    "12de5c384df7ba0b8d578a4c702b6bf11d5fac";
+static const char* GENESIS_FILTER = "019dfca8";
+static const char* GENESIS_HEADER = "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750";
+
+// SipHash-2-4 of the messages 00, 00 01, ..., 00 01 ... 0e keyed with 00 01 ... 0f.
+static const uint64_t SIPHASH_VECTORS[] =
+{
+    0x74f839c593dc67fdULL, 0x0d6c8009d9a94f5aULL, 0x85676696d7fb7e2dULL, 0xcf2794e0277187b7ULL,
+    0x18765564cd99a68dULL, 0xcbc9466e58fee3ceULL, 0xab0200f58b01d137ULL, 0x93f5f5799a932462ULL,
+    0x9e0082df0ba9e4b0ULL, 0x7a5dbbc594ddb9f3ULL, 0xf4b32f46226bada7ULL, 0x751e8fbc860ee5fbULL,
+    0x14ea5627c0843d90ULL, 0xf723ca908e7af2eeULL, 0xa129ca6149be45e5ULL
+};
+
+static uint64_t fastRange(uint64_t x, uint64_t n)
+{
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+}
+
+// Golomb-Rice codes values written out bit by bit, to check BlockFilter's own coder against.
+static uchar_vector encodeFilter(vector<uint64_t> values)
+{
+    sort(values.begin(), values.end());
+
+    string bits;
+    uint64_t last = 0;
+    for (uint64_t value: values)
+    {
+        uint64_t delta = value - last;
+        last = value;
+        bits += string(delta >> BlockFilter::P, '1') + '0';
+        for (int i = BlockFilter::P - 1; i >= 0; i--) { bits += ((delta >> i) & 1) ? '1' : '0'; }
+    }
+    while (bits.size() % 8) { bits += '0'; }
+
+    uchar_vector encoded;
+    encoded.push_back((unsigned char)values.size()); // fewer than 0xfd
+    for (size_t i = 0; i < bits.size(); i += 8) { encoded.push_back((unsigned char)stoi(bits.substr(i, 8), nullptr, 2)); }
+    return encoded;
+}
+
+static uchar_vector sha256d(const uchar_vector& data)
+{
+    uchar_vector hash(32);
+    SHA256(data.data(), data.size(), &hash[0]);
+    SHA256(&hash[0], 32, &hash[0]);
+    return hash;
+}
+
+static void testGenesis()
+{
+    uchar_vector blockHash(GENESIS_HASH);
+    uchar_vector script(GENESIS_OUTPUT_SCRIPT);
+
+    BlockFilter built(blockHash, vector<uchar_vector>(1, script));
+    check(built.getEncoded().getHex() == GENESIS_FILTER, "genesis filter is built as " + built.getEncoded().getHex());
+
+    BlockFilter filter(blockHash, uchar_vector(GENESIS_FILTER));
+    check(filter.getN() == 1, "genesis filter has one element");
+    check(filter.match(script), "genesis filter matches the coinbase output script");
+    check(!filter.match(uchar_vector("76a914000000000000000000000000000000000000000088ac")), "genesis filter does not match another script");
+
+    uchar_vector hash = filter.getHash();
+    check(hash == sha256d(uchar_vector(GENESIS_FILTER)).getReverse(), "genesis filter hash");
+    check(filter.getHeader(uchar_vector(32, 0)).getHex() == GENESIS_HEADER, "genesis filter header is " + filter.getHeader(uchar_vector(32, 0)).getHex());
+
+    // The next header commits to this one: double SHA-256 of the filter hash followed by the
+    // previous header, both as serialized.
+    uchar_vector nextFilterHash = sha256d(uchar_vector("00")).getReverse();
+    uchar_vector data = nextFilterHash.getReverse();
+    data += uchar_vector(GENESIS_HEADER).getReverse();
+    check(BlockFilter::getHeader(nextFilterHash, uchar_vector(GENESIS_HEADER)) == sha256d(data).getReverse(), "filter header chains onto the previous one");
+    check(BlockFilter(blockHash, uchar_vector("00")).getHeader(uchar_vector(GENESIS_HEADER)) == sha256d(data).getReverse(), "empty filter header chains onto the previous one");
+}
+
+static void testSipHash()
+{
+    // The key is the first 16 bytes of the block hash as serialized.
+    uchar_vector key;
+    for (int i = 0; i < 16; i++) { key.push_back((unsigned char)i); }
+    uchar_vector blockHash = key;
+    blockHash += uchar_vector(16, 0);
+    blockHash.reverse();
+
+    vector<uchar_vector> elements;
+    uchar_vector message;
+    for (int i = 0; i < 15; i++)
+    {
+        message.push_back((unsigned char)i);
+        elements.push_back(message);
+
+        // One element at a time...
+        BlockFilter single(blockHash, vector<uchar_vector>(1, message));
+        check(single.getEncoded() == encodeFilter(vector<uint64_t>(1, fastRange(SIPHASH_VECTORS[i], BlockFilter::M))),
+            "filter of the " + to_string(i + 1) + "-byte SipHash vector");
+    }
+
+    // ...and all of them in one filter.
+    uint64_t n = elements.size();
+    vector<uint64_t> values;
+    for (uint64_t hash: SIPHASH_VECTORS) { values.push_back(fastRange(hash, n * BlockFilter::M)); }
+    BlockFilter filter(blockHash, elements);
+    check(filter.getEncoded() == encodeFilter(values), "filter of all SipHash vectors");
+    for (auto& element: elements) { check(filter.match(element), "SipHash vector filter matches " + element.getHex()); }
+}
+
+static void testMatch()
+{
+    uchar_vector blockHash("00000000000000000002a7c4c1e48d76c5a37902165a270156b7a8d72728a054");
+
+    vector<uchar_vector> elements, others;
+    for (uint32_t i = 0; i < 2000; i++)
+    {
+        uchar_vector index;
+        for (int j = 0; j < 4; j++) { index.push_back((unsigned char)(i >> (8 * j))); }
+        uchar_vector script("0014");
+        script += uchar_vector(&sha256d(index)[0], 20);
+        (i < 1000 ? elements : others).push_back(script);
+    }
+
+    // Repeats and empty elements are left out.
+    vector<uchar_vector> withRepeats = elements;
+    withRepeats.push_back(elements[0]);
+    withRepeats.push_back(uchar_vector());
+    BlockFilter built(blockHash, withRepeats);
+    check(built.getN() == elements.size(), "filter leaves out repeats and empty elements");
+
+    BlockFilter filter(blockHash, built.getEncoded());
+    check(filter.getN() == elements.size(), "decoded filter has every element");
+
+    unsigned int falsePositives = 0;
+    for (auto& element: elements) { check(filter.match(element), "filter matches element " + element.getHex()); }
+    for (auto& other: others) { if (filter.match(other)) falsePositives++; }
+    check(falsePositives < 5, to_string(falsePositives) + " false positives out of 1000");
+
+    // Up to n queries walk the sorted queries alongside the filter.
+    check(!filter.matchAny(vector<uchar_vector>(others.begin(), others.begin() + 900)) || falsePositives, "sorted walk finds no element that is not in the filter");
+    for (size_t i = 0; i < elements.size(); i += 97)
+    {
+        vector<uchar_vector> queries(others.begin(), others.begin() + 500);
+        queries.push_back(elements[i]);
+        check(filter.matchAny(queries), "sorted walk finds element " + to_string(i));
+    }
+
+    // More queries than elements look each one up in buckets of the decoded filter.
+    check(!filter.matchAny(others) || falsePositives, "bucket lookup finds no element that is not in the filter");
+    for (size_t i = 0; i < elements.size(); i += 97)
+    {
+        vector<uchar_vector> queries = others;
+        queries.insert(queries.begin() + i % others.size(), elements[i]);
+        check(filter.matchAny(queries), "bucket lookup finds element " + to_string(i));
+    }
+
+    // A small filter leaves most buckets empty.
+    BlockFilter small(blockHash, vector<uchar_vector>(elements.begin(), elements.begin() + 3));
+    for (size_t i = 0; i < 3; i++)
+    {
+        check(small.matchAny(vector<uchar_vector>(1, elements[i])), "sorted walk in a small filter finds element " + to_string(i));
+        vector<uchar_vector> queries(others.begin(), others.begin() + 10);
+        queries.push_back(elements[i]);
+        check(small.matchAny(queries), "bucket lookup in a small filter finds element " + to_string(i));
+    }
+
+    check(!BlockFilter(blockHash, uchar_vector("00")).match(elements[0]), "empty filter matches nothing");
+
+    // A filter that ends early cannot be read.
+    uchar_vector truncated = built.getEncoded();
+    truncated.resize(truncated.size() / 2);
+    bool threw = false;
+    try { BlockFilter(blockHash, truncated).matchAny(others); }
+    catch (const std::runtime_error&) { threw = true; }
+    check(threw, "truncated filter throws");
+}
+
+int main()
+{
+    testGenesis();
+    testSipHash();
+    testMatch();
+
+    cout << (ok ? "All tests passed." : "Some tests failed.") << endl;
+    return ok ? 0 : 1;
+}
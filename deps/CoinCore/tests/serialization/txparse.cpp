@@ -0,0 +1,57 @@
+#include <CoinNodeData.h>
+#include <numericdata.h>
+
+#include <chrono>
+#include <iostream>
+
+using namespace Coin;
+using namespace std;
+
+// Builds a transaction with the given number of inputs and outputs and times
+// how long it takes to parse its serialization. Parse time should scale
+// linearly with the input count.
+
+Transaction buildTransaction(unsigned int nInputs, unsigned int nOutputs)
+{
+    Transaction tx;
+    uchar_vector scriptSig("483045022100e5b3c8f0a1b2c3d4e5f60718293a4b5c6d7e8f9a0b1c2d3e4f5a6b7c8d9e0f1a0220112233445566778899aabbccddeeff00112233445566778899aabbccddeeff0011012102aabbccddeeff00112233445566778899aabbccddeeff00112233445566778899aa");
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        uchar_vector hash = sha256(uint_to_vch(i, LITTLE_ENDIAN_));
+        tx.addInput(TxIn(OutPoint(hash, i % 4), scriptSig, 0xffffffff));
+    }
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        tx.addOutput(TxOut(100000 + i, "76a914000102030405060708090a0b0c0d0e0f1011121388ac"));
+    }
+    return tx;
+}
+
+int main()
+{
+    try
+    {
+        const unsigned int ROUNDS = 5;
+        for (unsigned int nInputs = 1000; nInputs <= 16000; nInputs *= 2)
+        {
+            uchar_vector bytes = buildTransaction(nInputs, 2).getSerialized();
+
+            auto start = chrono::steady_clock::now();
+            Transaction tx;
+            for (unsigned int i = 0; i < ROUNDS; i++) { tx.setSerialized(bytes); }
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() / ROUNDS;
+
+            if (tx.getSerialized() != bytes) throw runtime_error("Round trip mismatch.");
+
+            cout << "inputs: " << nInputs << ", bytes: " << bytes.size() << ", parse time: " << elapsed << " us, "
+                 << (double)elapsed * 1000 / nInputs << " ns/input" << endl;
+        }
+    }
+    catch (const exception& e)
+    {
+        cout << "Exception: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <sha256.h>
+
+#include <openssl/sha.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// Checks every SHA-256 implementation this CPU supports against OpenSSL and
+// times the double hash of a merkle level and of a header chain with each.
+
+static vector<unsigned char> opensslSHA256D(const unsigned char* data, size_t len)
+{
+    vector<unsigned char> hash(32);
+    SHA256(data, len, &hash[0]);
+    SHA256(&hash[0], 32, &hash[0]);
+    return hash;
+}
+
+static bool check(const string& impl)
+{
+    vector<unsigned char> data(1000);
+    for (size_t i = 0; i < data.size(); i++) { data[i] = (unsigned char)(i * 131 + 7); }
+
+    unsigned char out[32], expected[32];
+    for (size_t len = 0; len <= 300; len++)
+    {
+        SHA256(&data[0], len, expected);
+        SHA256Digest(out, &data[0], len);
+        if (memcmp(out, expected, 32)) { cout << impl << ": SHA256Digest mismatch at length " << len << endl; return false; }
+
+        // Streaming in uneven pieces.
+        CSHA256 hasher;
+        for (size_t pos = 0; pos < len; pos += 1 + pos % 37) { hasher.Write(&data[pos], min(len - pos, 1 + pos % 37)); }
+        hasher.Finalize(out);
+        if (memcmp(out, expected, 32)) { cout << impl << ": CSHA256 mismatch at length " << len << endl; return false; }
+    }
+
+    const size_t lengths[] = { 0, 32, 55, 56, 64, 80, 96, 119, 120 };
+    for (size_t len: lengths)
+    {
+        for (size_t count = 0; count <= 19; count++)
+        {
+            vector<unsigned char> hashes(32 * count);
+            if (count) SHA256DBatch(&hashes[0], &data[0], len, count);
+            for (size_t i = 0; i < count; i++)
+            {
+                if (opensslSHA256D(&data[i * len], len) != vector<unsigned char>(&hashes[32 * i], &hashes[32 * i] + 32))
+                {
+                    cout << impl << ": SHA256DBatch mismatch for length " << len << " count " << count << " index " << i << endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static double timeBatch(size_t len, size_t count, unsigned int rounds)
+{
+    vector<unsigned char> data(len * count, 0x5a);
+    vector<unsigned char> hashes(32 * count);
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < rounds; i++) { SHA256DBatch(&hashes[0], &data[0], len, count); }
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    return (double)elapsed / (rounds * count);
+}
+
+int main()
+{
+    cout << "detected: " << SHA256AutoDetect() << endl;
+
+    bool ok = true;
+    const char* impls[] = { "scalar", "avx2", "sha-ni" };
+    for (const char* impl: impls)
+    {
+        if (!SHA256SelectImplementation(impl)) { cout << impl << ": not supported" << endl; continue; }
+        if (!check(impl)) { ok = false; continue; }
+        cout << impl << ": ok   64-byte " << timeBatch(64, 4096, 50) << " ns/hash   96-byte " << timeBatch(96, 4096, 50) << " ns/hash" << endl;
+    }
+
+    vector<unsigned char> data(64 * 4096, 0x5a), hash(32);
+    auto start = chrono::steady_clock::now();
+    for (unsigned int r = 0; r < 50; r++)
+        for (size_t i = 0; i < 4096; i++) { hash = opensslSHA256D(&data[64 * i], 64); }
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    cout << "openssl: 64-byte " << (double)elapsed / (50 * 4096) << " ns/hash" << endl;
+
+    return ok ? 0 : 1;
+}
@@ -13,6 +13,8 @@
 
 #pragma once
 
+#include "StorageProfile.h"
+
 #include <CoinQ/CoinQ_coinparams.h>
 
 #include <string>
@@ -41,6 +43,7 @@ public:
     const std::string&          getDatabaseUser() const { return m_databaseUser; }
     const std::string&          getDatabasePassword() const { return m_databasePassword; }
     const std::string&          getNetworkName() const { return m_networkName; }
+    const CoinDB::StorageProfile& getStorageProfile() const { return m_storageProfile; }
     const CoinQ::CoinParams&    getCoinParams() const { return m_networkSelector.getCoinParams(); }
 
 protected:
@@ -52,6 +55,8 @@ protected:
     std::string m_databaseUser;
     std::string m_databasePassword;
     std::string m_networkName;
+    std::string m_storageProfileName;
+    CoinDB::StorageProfile m_storageProfile;
 
     CoinQ::NetworkSelector m_networkSelector;
 };
@@ -67,6 +72,7 @@ inline CoinDBConfig::CoinDBConfig() : m_options("Options")
         ("dbuser", po::value<std::string>(&m_databaseUser), "database user")
         ("dbpasswd", po::value<std::string>(&m_databasePassword), "database password")
         ("network", po::value<std::string>(&m_networkName), "network name (default: bitcoin)")
+        ("dbprofile", po::value<std::string>(&m_storageProfileName), "sqlite storage profile: safe (rollback journal, sync every commit), balanced (write-ahead log, sync every commit, concurrent readers), fast (write-ahead log, a power loss can undo the last commits) or default (leave the database as it is)")
     ;
 }
 
@@ -109,6 +115,8 @@ inline bool CoinDBConfig::parseParams(int argc, char* argv[])
     std::transform(m_networkName.begin(), m_networkName.end(), m_networkName.begin(), ::tolower);
     m_networkSelector.select(m_networkName);
 
+    m_storageProfile = CoinDB::StorageProfile::fromName(m_storageProfileName);
+
     return true;
 }
 
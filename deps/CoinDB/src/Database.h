@@ -15,7 +15,11 @@
 
 #pragma once
 
+#include "StorageProfile.h"
+
 #include <string>
+#include <sstream>
+#include <vector>
 #include <memory>   // std::unique_ptr
 #include <cstdlib>  // std::exit
 #include <iostream>
@@ -32,6 +36,7 @@
 #  include <odb/transaction.hxx>
 #  include <odb/schema-catalog.hxx>
 #  include <odb/sqlite/database.hxx>
+#  include <odb/sqlite/connection-factory.hxx>
 #elif defined(DATABASE_PGSQL)
 #  include <odb/pgsql/database.hxx>
 #elif defined(DATABASE_ORACLE)
@@ -104,8 +109,48 @@ open_database (int& argc, char* argv[], bool create = false)
   return db;
 }
 
+#if defined(DATABASE_SQLITE)
+inline void applyStorageProfile(odb::sqlite::database& db, const StorageProfile& profile)
+{
+    if (profile.type == StorageProfile::DEFAULT) return;
+
+    std::vector<std::string> pragmas;
+    pragmas.push_back(profile.fullSync ? "PRAGMA synchronous=FULL" : "PRAGMA synchronous=NORMAL");
+    if (profile.cacheSize > 0)
+    {
+        std::stringstream ss;
+        ss << "PRAGMA cache_size=-" << profile.cacheSize;
+        pragmas.push_back(ss.str());
+    }
+    if (profile.mmapSize > 0)
+    {
+        std::stringstream ss;
+        ss << "PRAGMA mmap_size=" << profile.mmapSize;
+        pragmas.push_back(ss.str());
+    }
+    if (profile.busyTimeout > 0)
+    {
+        std::stringstream ss;
+        ss << "PRAGMA busy_timeout=" << profile.busyTimeout;
+        pragmas.push_back(ss.str());
+    }
+
+    // The journal mode is kept in the file, the rest is set on each connection. Holding them all
+    // at once makes the pool open every connection it will ever hand out.
+    std::vector<odb::sqlite::connection_ptr> connections;
+    unsigned int count = profile.connections > 0 ? profile.connections : 1;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        connections.push_back(db.connection());
+        odb::sqlite::connection_ptr& c = connections.back();
+        if (i == 0) { c->execute(profile.wal ? "PRAGMA journal_mode=WAL" : "PRAGMA journal_mode=DELETE"); }
+        for (auto& pragma: pragmas) { c->execute(pragma); }
+    }
+}
+#endif
+
 inline std::unique_ptr<odb::database>
-openDatabase(const std::string& user, const std::string& passwd, const std::string& dbname, bool create = false)
+openDatabase(const std::string& user, const std::string& passwd, const std::string& dbname, bool create = false, const StorageProfile& profile = StorageProfile())
 {
     using namespace odb::core;
 
@@ -114,7 +159,23 @@ openDatabase(const std::string& user, const std::string& passwd, const std::stri
 #elif defined(DATABASE_SQLITE)
     int flags = SQLITE_OPEN_READWRITE;
     if (create) flags |= SQLITE_OPEN_CREATE;
-    std::unique_ptr<database> db(new odb::sqlite::database(dbname, flags, false));
+
+    // ODB's connection pool opens its connections with a shared cache unless told otherwise. A
+    // shared cache locks whole tables, so readers would fail with SQLITE_LOCKED while a write is
+    // in progress instead of reading from the write-ahead log.
+    if (profile.wal) flags |= SQLITE_OPEN_PRIVATECACHE;
+
+    odb::sqlite::database* sqlitedb;
+    if (profile.connections > 0)
+    {
+        sqlitedb = new odb::sqlite::database(dbname, flags, false, "", new odb::sqlite::connection_pool_factory(profile.connections));
+    }
+    else
+    {
+        sqlitedb = new odb::sqlite::database(dbname, flags, false);
+    }
+    std::unique_ptr<database> db(sqlitedb);
+    applyStorageProfile(*sqlitedb, profile);
 #endif
 
   // Create the database schema. Due to bugs in SQLite foreign key
@@ -1132,6 +1132,29 @@ Coin::Transaction Tx::toCoinCore() const
     return coin_tx;
 }
 
+Tx::signabletxins_t Tx::signable_txins(std::vector<std::string>& errors) const
+{
+    using namespace CoinQ::Script;
+
+    Coin::Transaction coin_tx = toCoinCore();
+
+    signabletxins_t signabletxins(txins_.size());
+    errors.assign(txins_.size(), std::string());
+    for (std::size_t i = 0; i < txins_.size(); i++)
+    {
+        std::shared_ptr<TxOut> outpoint = txins_[i]->outpoint();
+        try
+        {
+            signabletxins[i] = std::make_shared<SignableTxIn>(coin_tx, i, outpoint ? outpoint->value() : 0);
+        }
+        catch (const std::exception& e)
+        {
+            errors[i] = e.what();
+        }
+    }
+    return signabletxins;
+}
+
 void Tx::setBlock(std::shared_ptr<BlockHeader> blockheader, uint32_t blockindex)
 {
     blockheader_ = blockheader;
@@ -57,7 +57,7 @@ typedef odb::nullable<unsigned long> null_id_t;
 ////////////////////
 
 #define SCHEMA_BASE_VERSION 12
-#define SCHEMA_VERSION      22
+#define SCHEMA_VERSION      23
 
 #ifdef ODB_COMPILER
 #pragma db model version(SCHEMA_BASE_VERSION, SCHEMA_VERSION, open)
@@ -905,6 +905,14 @@ private:
     KeyVector keys_;
 
     std::shared_ptr<Contact> contact_;
+
+    // Next unused script in a bin, and the script lookups done for every synched transaction.
+    // MySQL can only index the leading bytes of a BLOB.
+    #pragma db index("account_bin_status_index_i") members(account_bin_, status_, index_)
+    #pragma db sqlite:index("txinscript_i") member(txinscript_)
+    #pragma db sqlite:index("txoutscript_i") member(txoutscript_)
+    #pragma db mysql:index("txinscript_i") member(txinscript_, "(64)")
+    #pragma db mysql:index("txoutscript_i") member(txoutscript_, "(64)")
 };
 
 
@@ -1037,7 +1045,7 @@ private:
     #pragma db id auto
     unsigned long id_;
 
-    #pragma db not_null
+    #pragma db not_null index
     std::shared_ptr<BlockHeader> blockheader_;
 
     uint32_t txcount_;
@@ -1048,6 +1056,7 @@ private:
 
     bytes_t flags_;
 
+    #pragma db index
     bool txsinserted_;
 
     friend class boost::serialization::access;
@@ -1106,7 +1115,7 @@ public:
 
     void script(const bytes_t& script) { script_ = script; }
     const bytes_t& script() const { return script_; }
-    bytes_t unsigned_script() const; // throws exception if script type is not recognized
+    bytes_t unsigned_script() const; // throws exception if script type is not recognized. Converts the whole transaction, see Tx::signable_txins().
 
     uint32_t sequence() const { return sequence_; }
     bytes_t raw() const;
@@ -1148,6 +1157,9 @@ private:
         id_column("object_id") value_column("value")
     std::vector<bytes_t> scriptwitnessstack_;
 
+    #pragma db index("tx_txindex_i") members(tx_, txindex_)
+    #pragma db index("outhash_outindex_i") members(outhash_, outindex_)
+
     friend class boost::serialization::access;
     template<class Archive>
     void save(Archive& ar, const unsigned int version) const
@@ -1283,7 +1295,7 @@ private:
     std::weak_ptr<Tx> tx_;
     uint32_t txindex_;
 
-    #pragma db null
+    #pragma db null index
     std::shared_ptr<TxIn> spent_;
 
     #pragma db null
@@ -1305,6 +1317,11 @@ private:
     // Redundant but convenient for view queries.
     status_t status_;
 
+    // Outpoint lookups and the unspent outputs of an account.
+    #pragma db index("tx_txindex_i") members(tx_, txindex_)
+    #pragma db index("receiving_account_status_i") members(receiving_account_, status_)
+    #pragma db index("sending_account_status_i") members(sending_account_, status_)
+
     friend class boost::serialization::access;
     template<class Archive>
     void serialize(Archive& ar, const unsigned int /*version*/)
@@ -1358,6 +1375,12 @@ public:
 
     Coin::Transaction toCoinCore() const;
 
+    // One SignableTxIn for each of txins(), all built from a single conversion of the transaction
+    // so they share its signature hash context. Null where the script type is not recognized,
+    // with the reason at the same index in errors.
+    typedef std::vector<std::shared_ptr<CoinQ::Script::SignableTxIn>> signabletxins_t;
+    signabletxins_t signable_txins(std::vector<std::string>& errors) const;
+
     void setBlock(std::shared_ptr<BlockHeader> blockheader, uint32_t blockindex);
 
     unsigned long id() const { return id_; }
@@ -1422,6 +1445,7 @@ private:
     unsigned long id_;
 
     // hash stays empty until transaction is fully signed.
+    #pragma db index
     bytes_t hash_;
 
     // We'll use the unsigned hash as a unique identifier to avoid malleability issues.
@@ -1452,7 +1476,7 @@ private:
     uint64_t txin_total_;
     uint64_t txout_total_;
 
-    #pragma db null
+    #pragma db null index
     std::shared_ptr<BlockHeader> blockheader_;
 
     #pragma db null
@@ -1711,6 +1735,20 @@ struct ScriptCountView
     unsigned long max_index;
 };
 
+#pragma db view \
+    object(SigningScript)
+struct SigningScriptIndexView
+{
+    #pragma db column(SigningScript::id_)
+    unsigned long id;
+
+    #pragma db column(SigningScript::txinscript_)
+    bytes_t txinscript;
+
+    #pragma db column(SigningScript::txoutscript_)
+    bytes_t txoutscript;
+};
+
 #pragma db view \
     object(Tx) \
     object(BlockHeader: Tx::blockheader_)
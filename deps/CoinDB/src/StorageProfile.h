@@ -0,0 +1,90 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinDB
+//
+// StorageProfile.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdexcept>
+#include <string>
+
+namespace CoinDB
+{
+
+// How a SQLite vault trades durability for speed. Other databases ignore it.
+//
+//  default     Leaves the database as it is: the journal mode it was last opened with and SQLite's
+//              default settings.
+//  safe        Rollback journal, synced on every commit. What vaults have always used.
+//  balanced    Write-ahead log, synced on every commit. Commits are as durable as with safe but cost
+//              one sync instead of several, and readers on other connections run while a write is
+//              in progress. The page cache is larger and the file is memory mapped.
+//  fast        As balanced, but the log is only synced at checkpoints. Nothing is lost if the program
+//              crashes and the vault never ends up corrupt, but a power loss or system crash can undo
+//              the last commits. Synched blocks are fetched again; a transaction created or signed
+//              just before would be lost.
+//
+// With a write-ahead log the vault file has -wal and -shm files next to it. Close the vault before
+// copying the file, or copy all three.
+struct StorageProfile
+{
+    enum type_t
+    {
+        DEFAULT,
+        SAFE,
+        BALANCED,
+        FAST
+    };
+
+    explicit StorageProfile(type_t type_ = DEFAULT)
+        : type(type_), wal(false), fullSync(true), cacheSize(0), mmapSize(0), connections(0), busyTimeout(0)
+    {
+        if (type == BALANCED || type == FAST)
+        {
+            wal = true;
+            fullSync = (type == BALANCED);
+            cacheSize = 32 * 1024;
+            mmapSize = 256 * 1024 * 1024;
+            connections = 4;
+            busyTimeout = 5000;
+        }
+    }
+
+    type_t      type;
+    bool        wal;            // journal_mode=WAL, otherwise DELETE. Ignored for DEFAULT.
+    bool        fullSync;       // synchronous=FULL, otherwise NORMAL
+    int         cacheSize;      // page cache per connection in KiB, 0 for the SQLite default
+    uint64_t    mmapSize;       // bytes of the file mapped into memory, 0 for none
+    unsigned int connections;   // most connections open at once, 0 for no limit
+    unsigned int busyTimeout;   // milliseconds to wait for a lock held by another connection
+
+    const char* getName() const
+    {
+        switch (type)
+        {
+        case SAFE:      return "safe";
+        case BALANCED:  return "balanced";
+        case FAST:      return "fast";
+        default:        return "default";
+        }
+    }
+
+    static StorageProfile fromName(const std::string& name)
+    {
+        if (name.empty() || name == "default")  return StorageProfile(DEFAULT);
+        if (name == "safe")                     return StorageProfile(SAFE);
+        if (name == "balanced")                 return StorageProfile(BALANCED);
+        if (name == "fast")                     return StorageProfile(FAST);
+        throw std::runtime_error("Invalid storage profile: " + name + ". Use default, safe, balanced or fast.");
+    }
+};
+
+}
@@ -16,6 +16,9 @@
 using namespace CoinDB;
 using namespace CoinQ;
 
+const unsigned int DEFAULT_MERKLE_BATCH_BLOCKS = 100;
+const std::chrono::milliseconds DEFAULT_MERKLE_BATCH_LATENCY(1000);
+
 const std::string SynchedVault::getStatusString(status_t status)
 {
     switch (status)
@@ -50,7 +53,11 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
     m_bSynching(false),
     m_bBlockTreeSynched(false),
     m_bGotMempool(false),
-    m_bInsertMerkleBlocks(false)
+    m_bInsertMerkleBlocks(false),
+    m_merkleBatchBlocks(0),
+    m_maxMerkleBatchBlocks(DEFAULT_MERKLE_BATCH_BLOCKS),
+    m_maxMerkleBatchLatency(DEFAULT_MERKLE_BATCH_LATENCY),
+    m_bStopMerkleFlush(false)
 {
     LOGGER(trace) << "SynchedVault::SynchedVault()" << std::endl;
 
@@ -153,6 +160,13 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
     {
         LOGGER(trace) << "SynchedVault - Block sync complete." << std::endl;
 
+        // The last block of a sync reaches the best height and is normally stored already.
+        if (m_vault)
+        {
+            std::lock_guard<std::mutex> lock(m_vaultMutex);
+            flushMerkleUpdates();
+        }
+
         if (m_networkSync.connected())
         {
             updateStatus(SYNCHED);
@@ -194,6 +208,7 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
 
         try
         {
+            flushMerkleUpdates();
             m_vault->insertNewTx(cointx);
         }
         catch (const VaultException& e)
@@ -216,21 +231,7 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
         std::lock_guard<std::mutex> lock(m_vaultMutex);
         if (!m_vault) return;
 
-        try
-        {
-            m_vault->insertMerkleTx(chainmerkleblock, cointx, txindex, txcount);
-        }
-        catch (const VaultException& e)
-        {
-            LOGGER(error) << e.what() << std::endl;
-            m_notifyVaultError(e.what(), e.code());
-        } 
-        catch (const std::exception& e)
-        {
-            LOGGER(error) << e.what() << std::endl;
-            m_notifyVaultError(e.what(), -1);
-        } 
-	
+        queueMerkleUpdate(MerkleUpdate(chainmerkleblock, cointx, txindex, txcount));
     });
 
     m_networkSync.subscribeTxConfirmed([this](const ChainMerkleBlock& chainmerkleblock, const bytes_t& txhash, unsigned int txindex, unsigned int txcount)
@@ -241,20 +242,7 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
         std::lock_guard<std::mutex> lock(m_vaultMutex);
         if (!m_vault) return;
 
-        try
-        {
-            m_vault->confirmMerkleTx(chainmerkleblock, txhash, txindex, txcount);
-        }
-        catch (const VaultException& e)
-        {
-            LOGGER(error) << e.what() << std::endl;
-            m_notifyVaultError(e.what(), e.code());
-        } 
-        catch (const std::exception& e)
-        {
-            LOGGER(error) << e.what() << std::endl;
-            m_notifyVaultError(e.what(), -1);
-        } 
+        queueMerkleUpdate(MerkleUpdate(chainmerkleblock, txhash, txindex, txcount));
     });
 
     m_networkSync.subscribeMerkleBlock([this](const ChainMerkleBlock& chainMerkleBlock)
@@ -267,22 +255,7 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
         if (!m_vault) return;
         if (!m_bInsertMerkleBlocks) return;
 
-        try
-        {
-            std::shared_ptr<MerkleBlock> merkleblock(new MerkleBlock(chainMerkleBlock));
-	    merkleblock->txsinserted(true);
-            m_vault->insertMerkleBlock(merkleblock);
-        }
-        catch (const VaultException& e)
-        {
-            LOGGER(error) << e.what() << std::endl;
-            m_notifyVaultError(e.what(), e.code());
-        } 
-        catch (const std::exception& e)
-        {
-            LOGGER(error) << e.what() << std::endl;
-            m_notifyVaultError(e.what(), -1);
-        }
+        queueMerkleUpdate(MerkleUpdate(chainMerkleBlock));
     });
 
     m_networkSync.subscribeBlockTreeChanged([this]()
@@ -297,6 +270,8 @@ SynchedVault::SynchedVault(const CoinQ::CoinParams& coinParams) :
     {
         updateBestHeader(height, hash);
     });
+
+    m_merkleFlushThread = std::thread([this]() { merkleFlushLoop(); });
 }
 
 // Destructor
@@ -305,6 +280,13 @@ SynchedVault::~SynchedVault()
     LOGGER(trace) << "SynchedVault::~SynchedVault()" << std::endl;
     stopSync();
     closeVault();
+
+    {
+        std::lock_guard<std::mutex> lock(m_vaultMutex);
+        m_bStopMerkleFlush = true;
+    }
+    m_merkleFlushCond.notify_one();
+    m_merkleFlushThread.join();
 }
 
 // Block tree operations
@@ -319,23 +301,24 @@ void SynchedVault::loadHeaders(const std::string& blockTreeFile, bool bCheckProo
 }
 
 // Vault operations
-void SynchedVault::openVault(const std::string& dbname, bool bCreate, uint32_t version, const std::string& network, bool migrate)
+void SynchedVault::openVault(const std::string& dbname, bool bCreate, uint32_t version, const std::string& network, bool migrate, const StorageProfile& profile)
 {
-    openVault("", "", dbname, bCreate, version, network, migrate);
+    openVault("", "", dbname, bCreate, version, network, migrate, profile);
 }
 
-void SynchedVault::openVault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool bCreate, uint32_t version, const std::string& network, bool migrate)
+void SynchedVault::openVault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool bCreate, uint32_t version, const std::string& network, bool migrate, const StorageProfile& profile)
 {
-    LOGGER(trace) << "SynchedVault::openVault(" << dbuser << ", ..., " << dbname << ", " << (bCreate ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ")" << std::endl;
+    LOGGER(trace) << "SynchedVault::openVault(" << dbuser << ", ..., " << dbname << ", " << (bCreate ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ", " << profile.getName() << ")" << std::endl;
 
     {
         std::lock_guard<std::mutex> lock(m_vaultMutex);
         m_notifyVaultClosed();
+        flushMerkleUpdates();
         if (m_vault) delete m_vault;
         m_vault = new Vault;
         try
         {
-            m_vault->open(dbuser, dbpasswd, dbname, bCreate, version, network, migrate);
+            m_vault->open(dbuser, dbpasswd, dbname, bCreate, version, network, migrate, profile);
         }
         catch (const std::exception& e)
         {
@@ -382,6 +365,7 @@ void SynchedVault::closeVault()
 
         m_bInsertMerkleBlocks = false;
         m_networkSync.stopSynchingBlocks();
+        flushMerkleUpdates();
         delete m_vault;
         m_vault = nullptr;
     }
@@ -392,6 +376,14 @@ void SynchedVault::closeVault()
 }
 
 // Peer to peer network operations
+void SynchedVault::startSync()
+{
+    LOGGER(trace) << "SynchedVault::startSync()" << std::endl;
+    m_bInsertMerkleBlocks = false;
+    updateStatus(STARTING);
+    m_networkSync.start();
+}
+
 void SynchedVault::startSync(const std::string& host, const std::string& port)
 {
     LOGGER(trace) << "SynchedVault::startSync(" << host << ", " << port << ")" << std::endl;
@@ -411,6 +403,11 @@ void SynchedVault::stopSync()
 {
     LOGGER(trace) << "SynchedVault::stopSync()" << std::endl;
     m_networkSync.stop();
+
+    // Whatever came in before the peers closed is kept.
+    if (!m_vault) return;
+    std::lock_guard<std::mutex> lock(m_vaultMutex);
+    flushMerkleUpdates();
 }
 
 //TODO: get rid of m_bInsertMerkleBlocks
@@ -422,6 +419,7 @@ void SynchedVault::suspendBlockUpdates()
     if (!m_bInsertMerkleBlocks) return;
     std::lock_guard<std::mutex> lock(m_vaultMutex);
     m_bInsertMerkleBlocks = false;
+    flushMerkleUpdates();
 }
 
 void SynchedVault::syncBlocks()
@@ -431,9 +429,10 @@ void SynchedVault::syncBlocks()
     if (!m_bConnected) throw std::runtime_error("Not connected.");
 
     if (!m_vault) throw std::runtime_error("No vault is open.");
-    std::lock_guard<std::mutex> lock(m_vaultMutex);
+    std::unique_lock<std::mutex> lock(m_vaultMutex);
     if (!m_vault) throw std::runtime_error("No vault is open.");
 
+    flushMerkleUpdates();
     uint32_t startTime = m_vault->getMaxFirstBlockTimestamp();
     if (startTime == 0)
     {
@@ -441,11 +440,15 @@ void SynchedVault::syncBlocks()
         return;
     }
 
-    m_networkSync.setBloomFilter(m_vault->getBloomFilter(0.001, 0, 0));
+    loadFilter();
 
     std::vector<bytes_t> locatorHashes = m_vault->getLocatorHashes();
     m_bGotMempool = false;
     m_bInsertMerkleBlocks = true;
+
+    // The blocks synched handler takes the vault lock, and is called right away when the vault
+    // is already synched.
+    lock.unlock();
     m_networkSync.syncBlocks(locatorHashes, startTime);
 }
 
@@ -456,6 +459,14 @@ void SynchedVault::setFilterParams(double falsePositiveRate, uint32_t nTweak, ui
     m_filterFlags = nFlags;
 }
 
+void SynchedVault::setMerkleBatchParams(unsigned int maxBlocks, std::chrono::milliseconds maxLatency)
+{
+    std::lock_guard<std::mutex> lock(m_vaultMutex);
+    m_maxMerkleBatchBlocks = maxBlocks > 0 ? maxBlocks : 1;
+    m_maxMerkleBatchLatency = maxLatency;
+    m_merkleFlushCond.notify_one();
+}
+
 void SynchedVault::updateBloomFilter()
 {
     LOGGER(trace) << "SynchedVault::updateBloomFilter()" << std::endl;
@@ -464,7 +475,109 @@ void SynchedVault::updateBloomFilter()
     std::lock_guard<std::mutex> lock(m_vaultMutex);
     if (!m_vault) throw std::runtime_error("No vault is open.");
 
-    m_networkSync.setBloomFilter(m_vault->getBloomFilter(0.001, 0, 0));
+    loadFilter();
+}
+
+void SynchedVault::loadFilter()
+{
+    if (m_networkSync.compactFiltersEnabled())
+    {
+        // Nothing goes to the peers, the filters they serve are matched here.
+        std::vector<bytes_t> scripts;
+        std::vector<bytes_t> outpoints;
+        m_vault->getFilterElements(scripts, outpoints);
+        m_networkSync.setWatchedScripts(scripts, outpoints);
+    }
+    else
+    {
+        // Elements added since the filter was sent go out with filteradd. It is only rebuilt and
+        // sent whole once it fills up, or if the peers do not have it.
+        std::vector<bytes_t> additions;
+        if (m_vault->getBloomFilterAdditions(additions) && m_networkSync.addToBloomFilter(additions)) return;
+
+        m_networkSync.setBloomFilter(m_vault->getBloomFilter(0.001, 0, 0));
+    }
+}
+
+void SynchedVault::queueMerkleUpdate(const MerkleUpdate& update)
+{
+    if (m_merkleUpdates.empty())
+    {
+        m_merkleBatchStart = std::chrono::steady_clock::now();
+        m_merkleFlushCond.notify_one();
+    }
+    m_merkleUpdates.push_back(update);
+
+    // Blocks are only ever stored whole.
+    if (!update.isBlockEnd()) return;
+    m_merkleBatchBlocks++;
+
+    if (m_merkleBatchBlocks >= m_maxMerkleBatchBlocks ||
+        update.chainmerkleblock.height >= (int)m_bestHeight ||
+        std::chrono::steady_clock::now() - m_merkleBatchStart >= m_maxMerkleBatchLatency)
+    {
+        flushMerkleUpdates();
+    }
+}
+
+void SynchedVault::flushMerkleUpdates()
+{
+    if (m_merkleUpdates.empty()) return;
+
+    merkleupdates_t updates;
+    updates.swap(m_merkleUpdates);
+    m_merkleBatchBlocks = 0;
+    if (!m_vault) return;
+
+    try
+    {
+        m_vault->insertMerkleUpdates(updates);
+        return;
+    }
+    catch (const std::exception& e)
+    {
+        LOGGER(debug) << "SynchedVault - storing " << updates.size() << " merkle update(s) at once failed, storing them one at a time: " << e.what() << std::endl;
+    }
+
+    // Only the updates that fail on their own are lost, as when each was stored as it came in.
+    for (auto& update: updates)
+    {
+        try
+        {
+            m_vault->insertMerkleUpdates(merkleupdates_t(1, update));
+        }
+        catch (const VaultException& e)
+        {
+            LOGGER(error) << e.what() << std::endl;
+            m_notifyVaultError(e.what(), e.code());
+        } 
+        catch (const std::exception& e)
+        {
+            LOGGER(error) << e.what() << std::endl;
+            m_notifyVaultError(e.what(), -1);
+        } 
+    }
+}
+
+void SynchedVault::merkleFlushLoop()
+{
+    std::unique_lock<std::mutex> lock(m_vaultMutex);
+    while (!m_bStopMerkleFlush)
+    {
+        if (m_merkleUpdates.empty())
+        {
+            m_merkleFlushCond.wait(lock);
+        }
+        else if (std::chrono::steady_clock::now() - m_merkleBatchStart >= m_maxMerkleBatchLatency)
+        {
+            LOGGER(trace) << "SynchedVault - storing " << m_merkleUpdates.size() << " merkle update(s) that waited for " << m_maxMerkleBatchLatency.count() << " ms." << std::endl;
+            flushMerkleUpdates();
+        }
+        else
+        {
+            m_merkleFlushCond.wait_until(lock, m_merkleBatchStart + m_maxMerkleBatchLatency);
+        }
+    }
 }
 
 // This function recursively tries to send dependencies.
@@ -547,6 +660,8 @@ void SynchedVault::insertFakeMerkleBlock(unsigned int nExtraLeaves)
     std::unique_lock<std::mutex> lock(m_vaultMutex);
     if (!m_vault) throw std::runtime_error("No vault is open.");
 
+    flushMerkleUpdates();
+
     txs_t txs = m_vault->getTxs(Tx::PROPAGATED);
     std::vector<Coin::Transaction> cointxs;
     std::vector<uchar_vector> txhashes;
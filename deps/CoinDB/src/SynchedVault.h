@@ -17,7 +17,10 @@
 
 #include <CoinQ/CoinQ_netsync.h>
 
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
 
 namespace CoinDB
 {
@@ -44,20 +47,31 @@ public:
     void loadHeaders(const std::string& blockTreeFile, bool bCheckProofOfWork = false, CoinQBlockTreeMem::callback_t callback = nullptr);
     bool areHeadersLoaded() const { return m_bBlockTreeLoaded; }
 
-    void openVault(const std::string& dbname, bool bCreate = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
-    void openVault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool bCreate = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
+    void openVault(const std::string& dbname, bool bCreate = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false, const StorageProfile& profile = StorageProfile());
+    void openVault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool bCreate = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false, const StorageProfile& profile = StorageProfile());
     void closeVault();
     bool isVaultOpen() const { return (m_vault != nullptr); }
     Vault* getVault() const { return m_vault; }
 
+    void startSync();   // from the fastest known peer address
     void startSync(const std::string& host, const std::string& port);
     void startSync(const std::string& host, int port);
     void stopSync();
+    void addDownloadPeer(const std::string& host, const std::string& port = "") { m_networkSync.addDownloadPeer(host, port); } // must be stopped
+    void loadPeerAddresses(const std::string& filename) { m_networkSync.loadPeerAddresses(filename); }
+    void setAutoDownloadPeers(unsigned int count) { m_networkSync.setAutoDownloadPeers(count); } // must be stopped
+    void enableCompactFilters(bool bEnable = true) { m_networkSync.enableCompactFilters(bEnable); } // must be stopped
+    bool compactFiltersEnabled() const { return m_networkSync.compactFiltersEnabled(); }
     bool isConnected() const { return m_networkSync.connected(); }
     void suspendBlockUpdates();
     void syncBlocks();
 
     void setFilterParams(double falsePositiveRate, uint32_t nTweak, uint8_t nFlags);
+
+    // Synched blocks and their transactions are stored maxBlocks blocks at a time in a single
+    // database transaction. A batch is stored sooner once it reaches the best known block or has
+    // been open for maxLatency. Vault notifications for a batch go out once it is stored.
+    void setMerkleBatchParams(unsigned int maxBlocks, std::chrono::milliseconds maxLatency);
     void updateBloomFilter();
 
     status_t getStatus() const { return m_status; }
@@ -131,6 +145,7 @@ private:
     double                      m_filterFalsePositiveRate;
     uint32_t                    m_filterTweak;
     uint8_t                     m_filterFlags;
+    void                        loadFilter(); // bloom filter or compact filter watch list, m_vaultMutex held
 
     CoinQ::Network::NetworkSync m_networkSync;
     std::string                 m_blockTreeFile;
@@ -142,6 +157,22 @@ private:
 
     bool                        m_bInsertMerkleBlocks;
 
+    // Merkle block batching, m_vaultMutex held
+    merkleupdates_t             m_merkleUpdates;        // not stored yet
+    unsigned int                m_merkleBatchBlocks;    // whole blocks in m_merkleUpdates
+    std::chrono::steady_clock::time_point m_merkleBatchStart;
+    unsigned int                m_maxMerkleBatchBlocks;
+    std::chrono::milliseconds   m_maxMerkleBatchLatency;
+    void                        queueMerkleUpdate(const MerkleUpdate& update);
+    void                        flushMerkleUpdates();
+
+    // Stores a batch once it has been open for m_maxMerkleBatchLatency even if no block ends
+    // meanwhile, as when sync stalls.
+    bool                        m_bStopMerkleFlush;     // m_vaultMutex held
+    std::condition_variable     m_merkleFlushCond;
+    std::thread                 m_merkleFlushThread;
+    void                        merkleFlushLoop();
+
     // Vault state events
     VaultSignal                 m_notifyVaultOpened;
     VoidSignal                  m_notifyVaultClosed;
@@ -44,6 +44,13 @@
 
 using namespace CoinDB;
 
+// The bloom filter is rebuilt once its false positive rate gets this many times what it was asked
+// for. It is built with room for this share more elements than it starts with, and at least
+// BLOOM_FILTER_MIN_HEADROOM.
+static const double BLOOM_FILTER_REBUILD_RATIO = 2.0;
+static const double BLOOM_FILTER_HEADROOM = 0.25;
+static const std::size_t BLOOM_FILTER_MIN_HEADROOM = 100;
+
 /*
  * data migration
 */
@@ -69,6 +76,7 @@ static const migration_entry<14> migrate_compressed_keys_entry(&migrate_compress
  * class Vault implementation
 */
 Vault::Vault(int argc, char** argv, bool create, uint32_t version, const std::string& network, bool migrate)
+    : concurrentReads_(false), bloomElementsLoaded_(false), bloomFalsePositiveRate_(0.0), bloomScriptMaxId_(0), scriptIndexLoaded_(false), scriptIndexMaxId_(0)
 {
     LOGGER(trace) << "Vault::Vault(..., " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ")" << std::endl;
 
@@ -77,20 +85,22 @@ Vault::Vault(int argc, char** argv, bool create, uint32_t version, const std::st
 //    if (create) setSchemaVersion(version);
 }
 
-Vault::Vault(const std::string& dbname, bool create, uint32_t version, const std::string& network, bool migrate)
+Vault::Vault(const std::string& dbname, bool create, uint32_t version, const std::string& network, bool migrate, const StorageProfile& profile)
+    : concurrentReads_(false), bloomElementsLoaded_(false), bloomFalsePositiveRate_(0.0), bloomScriptMaxId_(0), scriptIndexLoaded_(false), scriptIndexMaxId_(0)
 {
-    LOGGER(trace) << "Vault::Vault(" << dbname << ", " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ")" << std::endl;
+    LOGGER(trace) << "Vault::Vault(" << dbname << ", " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ", " << profile.getName() << ")" << std::endl;
 
-    open("", "", dbname, create, version, network, migrate);
+    open("", "", dbname, create, version, network, migrate, profile);
 //    name_ = dbname;
 //    if (create) setSchemaVersion(version);
 }
 
-Vault::Vault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create, uint32_t version, const std::string& network, bool migrate)
+Vault::Vault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create, uint32_t version, const std::string& network, bool migrate, const StorageProfile& profile)
+    : concurrentReads_(false), bloomElementsLoaded_(false), bloomFalsePositiveRate_(0.0), bloomScriptMaxId_(0), scriptIndexLoaded_(false), scriptIndexMaxId_(0)
 {
-    LOGGER(trace) << "Vault::Vault(" << dbuser << ", ..., " << dbname << ", " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ")" << std::endl;
+    LOGGER(trace) << "Vault::Vault(" << dbuser << ", ..., " << dbname << ", " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ", " << profile.getName() << ")" << std::endl;
 
-    open(dbuser, dbpasswd, dbname, create, version, network, migrate);
+    open(dbuser, dbpasswd, dbname, create, version, network, migrate, profile);
 //    name_ = dbname;
 //    if (create) setSchemaVersion(version);
 }
@@ -153,7 +163,9 @@ void Vault::open(int argc, char** argv, bool create, uint32_t version, const std
 
     if (argc >= 2) name_ = argv[1];
 
+    boost::unique_lock<boost::shared_mutex> dbLock(dbMutex_);
     boost::lock_guard<boost::mutex> lock(mutex);
+    concurrentReads_ = false;
 
     try
     {
@@ -237,23 +249,30 @@ void Vault::open(int argc, char** argv, bool create, uint32_t version, const std
     }
 }
 
-void Vault::open(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create, uint32_t version, const std::string& network, bool migrate)
+void Vault::open(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create, uint32_t version, const std::string& network, bool migrate, const StorageProfile& profile)
 {
-    LOGGER(trace) << "Vault::open(" << dbuser << ", ..., " << dbname << ", " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ")" << std::endl;
+    LOGGER(trace) << "Vault::open(" << dbuser << ", ..., " << dbname << ", " << (create ? "true" : "false") << ", " << version << ", " << network << ", " << (migrate ? "true" : "false") << ", " << profile.getName() << ")" << std::endl;
 
     name_ = dbname;
 
+    boost::unique_lock<boost::shared_mutex> dbLock(dbMutex_);
     boost::lock_guard<boost::mutex> lock(mutex);
 
     try
     {
-        db_ = openDatabase(dbuser, dbpasswd, dbname, create);
+        db_ = openDatabase(dbuser, dbpasswd, dbname, create, profile);
     }
     catch (const std::exception& e)
     {
         throw VaultFailedToOpenDatabaseException(name_, e.what());
     }
 
+#if defined(DATABASE_SQLITE)
+    concurrentReads_ = profile.type != StorageProfile::DEFAULT && profile.wal;
+#else
+    concurrentReads_ = false;
+#endif
+
     odb::schema_version v(db_->schema_version());
     odb::schema_version bv(odb::schema_catalog::base_version(*db_));
     odb::schema_version cv(odb::schema_catalog::current_version(*db_));
@@ -332,8 +351,29 @@ void Vault::close()
     LOGGER(trace) << "Vault::close()" << std::endl;
 
     if (!db_) return;
+    boost::unique_lock<boost::shared_mutex> dbLock(dbMutex_);
     boost::lock_guard<boost::mutex> lock(mutex);
     db_.reset();
+    concurrentReads_ = false;
+
+    bloomElementsLoaded_ = false;
+    bloomElements_.clear();
+    bloomAdditions_.clear();
+    bloomFilter_ = Coin::BloomFilter();
+    bloomScriptMaxId_ = 0;
+    bloomScriptMaxScript_.clear();
+
+    scriptIndexLoaded_ = false;
+    scriptIndexMaxId_ = 0;
+    scriptIndexMaxScript_.clear();
+    txinScriptIndex_.clear();
+    txoutScriptIndex_.clear();
+}
+
+Vault::ReadLock::ReadLock(const Vault& vault)
+    : dbLock_(vault.dbMutex_)
+{
+    if (!vault.concurrentReads_) { lock_ = boost::unique_lock<boost::mutex>(vault.mutex); }
 }
 
 uint32_t Vault::getSchemaVersion() const
@@ -527,31 +567,97 @@ Coin::BloomFilter Vault::getBloomFilter(double falsePositiveRate, uint32_t nTwea
 }
 
 Coin::BloomFilter Vault::getBloomFilter_unwrapped(double falsePositiveRate, uint32_t nTweak, uint32_t nFlags) const
+{
+    // Read again each time, since other writers may have changed the database.
+    loadBloomFilterElements_unwrapped();
+
+    bloomAdditions_.clear();
+    bloomFalsePositiveRate_ = falsePositiveRate;
+    if (bloomElements_.empty())
+    {
+        bloomFilter_ = Coin::BloomFilter();
+        return bloomFilter_;
+    }
+
+    std::size_t headroom = std::max((std::size_t)(bloomElements_.size() * BLOOM_FILTER_HEADROOM), BLOOM_FILTER_MIN_HEADROOM);
+    bloomFilter_.set(bloomElements_.size() + headroom, falsePositiveRate, nTweak, nFlags);
+    for (auto& element: bloomElements_) { bloomFilter_.insert(element); }
+    return bloomFilter_;
+}
+
+bool Vault::getBloomFilterAdditions(std::vector<bytes_t>& additions) const
+{
+    LOGGER(trace) << "Vault::getBloomFilterAdditions()" << std::endl;
+
+#if defined(LOCK_ALL_CALLS)
+    boost::lock_guard<boost::mutex> lock(mutex);
+#endif
+    odb::core::session s;
+    odb::core::transaction t(db_->begin());
+    return getBloomFilterAdditions_unwrapped(additions);
+}
+
+bool Vault::getBloomFilterAdditions_unwrapped(std::vector<bytes_t>& additions) const
+{
+    additions.clear();
+    if (!bloomElementsLoaded_ || !bloomFilter_.isSet()) return false;
+
+    if (!loadNewBloomFilterScripts_unwrapped())
+    {
+        LOGGER(debug) << "Vault::getBloomFilterAdditions_unwrapped() - signing scripts were rolled back, rebuilding the bloom filter." << std::endl;
+        bloomElementsLoaded_ = false;
+        return false;
+    }
+
+    for (auto& element: bloomAdditions_) { bloomFilter_.insert(element); }
+    if (bloomFilter_.getFalsePositiveRate() > bloomFalsePositiveRate_ * BLOOM_FILTER_REBUILD_RATIO)
+    {
+        // Spent outpoints are dropped when it is read back from the database.
+        LOGGER(debug) << "Vault::getBloomFilterAdditions_unwrapped() - bloom filter is full, rebuilding it." << std::endl;
+        bloomElementsLoaded_ = false;
+        return false;
+    }
+
+    additions.swap(bloomAdditions_);
+    return true;
+}
+
+static void getBloomFilterScriptElements(const SigningScript& script, std::vector<bytes_t>& elements)
 {
     using namespace CoinQ::Script;
 
+    if (script.account()->use_witness())
+    {
+        WitnessProgram_P2WSH wp(script.redeemscript());
+        elements.push_back(wp.script());
+        if (script.account()->use_witness_p2sh())
+        {
+            elements.push_back(getScriptPubKeyPayee(script.txoutscript()).second);
+        }
+    }
+    else
+    {
+        elements.push_back(getScriptPubKeyPayee(script.txoutscript()).second);
+        elements.push_back(script.redeemscript());
+    }
+}
+
+void Vault::loadBloomFilterElements_unwrapped() const
+{
     std::vector<bytes_t> elements;
 
     // Add scripts
+    bloomScriptMaxId_ = 0;
+    bloomScriptMaxScript_.clear();
     {
         odb::result<SigningScript> r(db_->query<SigningScript>());
         for (auto& script: r)
         {
-
-            // Add script elements
-            if (script.account()->use_witness())
+            getBloomFilterScriptElements(script, elements);
+            if (script.id() > bloomScriptMaxId_)
             {
-                WitnessProgram_P2WSH wp(script.redeemscript());
-                elements.push_back(wp.script());
-                if (script.account()->use_witness_p2sh())
-                {
-                    elements.push_back(getScriptPubKeyPayee(script.txoutscript()).second);
-                }
-            }
-            else
-            {
-                elements.push_back(getScriptPubKeyPayee(script.txoutscript()).second);
-                elements.push_back(script.redeemscript());
+                bloomScriptMaxId_ = script.id();
+                bloomScriptMaxScript_ = script.txoutscript();
             }
         }
     }
@@ -571,11 +677,104 @@ Coin::BloomFilter Vault::getBloomFilter_unwrapped(double falsePositiveRate, uint
         }
     }
 
-    if (elements.empty()) return Coin::BloomFilter();
+    bloomElements_ = std::set<bytes_t>(elements.begin(), elements.end());
+    bloomAdditions_.clear();
+    bloomElementsLoaded_ = true;
+}
+
+bool Vault::loadNewBloomFilterScripts_unwrapped() const
+{
+    // Scripts another process stored in the same database are only found by reading them. Ids
+    // only grow, so those are the rows from the highest id we have read onwards.
+    typedef odb::query<SigningScript> query_t;
+    odb::result<SigningScript> r(db_->query<SigningScript>((query_t::id >= bloomScriptMaxId_) + "ORDER BY" + query_t::id));
+    auto it = r.begin();
+
+    // A rolled back transaction hands its ids out again, so the row we last read must still be
+    // there with the same script. If it is not, the ids after it cannot be trusted.
+    if (bloomScriptMaxId_ > 0)
+    {
+        if (it == r.end() || it->id() != bloomScriptMaxId_ || it->txoutscript() != bloomScriptMaxScript_) return false;
+        ++it;
+    }
+
+    for (; it != r.end(); ++it)
+    {
+        std::vector<bytes_t> elements;
+        getBloomFilterScriptElements(*it, elements);
+        for (auto& element: elements)
+        {
+            if (bloomElements_.insert(element).second) { bloomAdditions_.push_back(element); }
+        }
+        bloomScriptMaxId_ = it->id();
+        bloomScriptMaxScript_ = it->txoutscript();
+    }
+    return true;
+}
+
+void Vault::addBloomFilterScript_unwrapped(std::shared_ptr<SigningScript> script) const
+{
+    // Until they are loaded the database has them all.
+    if (!bloomElementsLoaded_) return;
+
+    std::vector<bytes_t> elements;
+    getBloomFilterScriptElements(*script, elements);
+    for (auto& element: elements)
+    {
+        if (bloomElements_.insert(element).second) { bloomAdditions_.push_back(element); }
+    }
+}
+
+void Vault::addBloomFilterTxOuts_unwrapped(std::shared_ptr<Tx> tx) const
+{
+    // Unsigned transactions have no hash yet.
+    if (!bloomElementsLoaded_ || tx->hash().empty()) return;
+
+    for (auto& txout: tx->txouts())
+    {
+        if (!txout->sending_account()) continue;
+
+        bytes_t element = Coin::OutPoint(tx->hash(), txout->txindex()).getSerialized();
+        if (bloomElements_.insert(element).second) { bloomAdditions_.push_back(element); }
+    }
+}
+
+void Vault::getFilterElements(std::vector<bytes_t>& scripts, std::vector<bytes_t>& outpoints) const
+{
+    LOGGER(trace) << "Vault::getFilterElements()" << std::endl;
+
+#if defined(LOCK_ALL_CALLS)
+    boost::lock_guard<boost::mutex> lock(mutex);
+#endif
+    odb::core::session s;
+    odb::core::transaction t(db_->begin());
+    getFilterElements_unwrapped(scripts, outpoints);
+}
+
+void Vault::getFilterElements_unwrapped(std::vector<bytes_t>& scripts, std::vector<bytes_t>& outpoints) const
+{
+    scripts.clear();
+    outpoints.clear();
 
-    Coin::BloomFilter filter(elements.size(), falsePositiveRate, nTweak, nFlags);
-    for (auto& element: elements) { filter.insert(element); }
-    return filter;
+    // Compact filters hold whole output scripts rather than their data pushes
+    {
+        odb::result<SigningScript> r(db_->query<SigningScript>());
+        for (auto& script: r) { scripts.push_back(script.txoutscript()); }
+    }
+
+    {
+        typedef odb::query<TxOut> query_t;
+        odb::result<TxOut> r(db_->query<TxOut>(query_t::sending_account != 0 && query_t::status == TxOut::UNSPENT));
+        for (auto& txout: r)
+        {
+            std::shared_ptr<Tx> tx = txout.tx();
+            if (tx)
+            {
+                Coin::OutPoint outpoint(tx->hash(), txout.txindex());
+                outpoints.push_back(outpoint.getSerialized());
+            }
+        }
+    }
 }
 
 hashvector_t Vault::getIncompleteBlockHashes() const
@@ -1426,6 +1625,8 @@ std::shared_ptr<Account> Vault::importAccount_unwrapped(boost::archive::text_iar
         {
             for (auto& key: script->keys()) { db_->persist(key); }
             db_->persist(script);
+            addBloomFilterScript_unwrapped(script);
+            addScriptIndex_unwrapped(script);
         }
 
         db_->update(bin);
@@ -1530,10 +1731,14 @@ void Vault::newAccount(const std::string& account_name, unsigned int minsigs, co
         std::shared_ptr<SigningScript> changeSigningScript = changeAccountBin->newSigningScript();
         for (auto& key: changeSigningScript->keys()) { db_->persist(key); } 
         db_->persist(changeSigningScript);
+        addBloomFilterScript_unwrapped(changeSigningScript);
+        addScriptIndex_unwrapped(changeSigningScript);
 
         std::shared_ptr<SigningScript> defaultSigningScript = defaultAccountBin->newSigningScript();
         for (auto& key: defaultSigningScript->keys()) { db_->persist(key); }
         db_->persist(defaultSigningScript);
+        addBloomFilterScript_unwrapped(defaultSigningScript);
+        addScriptIndex_unwrapped(defaultSigningScript);
     }
     db_->update(changeAccountBin);
     db_->update(defaultAccountBin);
@@ -1596,7 +1801,7 @@ std::vector<TxOutView> Vault::getUnspentTxOutViews(const std::string& account_na
     LOGGER(trace) << "Vault::getUnspentTxOutViews(" << account_name << ", " << min_confirmations << ")" << std::endl;
 
 #if defined(LOCK_ALL_CALLS)
-    boost::lock_guard<boost::mutex> lock(mutex);
+    ReadLock lock(*this);
 #endif
     odb::core::session s;
     odb::core::transaction t(db_->begin());
@@ -1657,7 +1862,7 @@ uint64_t Vault::getAccountBalance(const std::string& account_name, unsigned int
     std::vector<Tx::status_t> tx_statuses = Tx::getStatusFlags(tx_flags);
 
 #if defined(LOCK_ALL_CALLS)
-    boost::lock_guard<boost::mutex> lock(mutex);
+    ReadLock lock(*this);
 #endif
     odb::core::transaction t(db_->begin());
     typedef odb::query<BalanceView> query_t;
@@ -1706,6 +1911,8 @@ std::shared_ptr<AccountBin> Vault::addAccountBin(const std::string& account_name
         std::shared_ptr<SigningScript> script = bin->newSigningScript();
         for (auto& key: script->keys()) { db_->persist(key); }
         db_->persist(script);
+        addBloomFilterScript_unwrapped(script);
+        addScriptIndex_unwrapped(script);
     }
     db_->update(bin);
     db_->update(account);
@@ -1812,6 +2019,8 @@ void Vault::refillAccountBinPool_unwrapped(std::shared_ptr<AccountBin> bin, uint
             script->status(SigningScript::ISSUED);
             for (auto& key: script->keys()) { db_->persist(key); }
             db_->persist(script); 
+            addBloomFilterScript_unwrapped(script);
+            addScriptIndex_unwrapped(script);
         }
     }
 
@@ -1825,6 +2034,8 @@ void Vault::refillAccountBinPool_unwrapped(std::shared_ptr<AccountBin> bin, uint
         std::shared_ptr<SigningScript> script = bin->newSigningScript();
         for (auto& key: script->keys()) { db_->persist(key); }
         db_->persist(script); 
+        addBloomFilterScript_unwrapped(script);
+        addScriptIndex_unwrapped(script);
     } 
     db_->update(bin);
 }
@@ -1842,7 +2053,7 @@ std::vector<SigningScriptView> Vault::getSigningScriptViews(const std::string& a
     query += "ORDER BY" + query_t::Account::name + "ASC," + query_t::AccountBin::name + "ASC," + query_t::SigningScript::status + "DESC," + query_t::SigningScript::index + "ASC";
 
 #if defined(LOCK_ALL_CALLS)
-    boost::lock_guard<boost::mutex> lock(mutex);
+    ReadLock lock(*this);
 #endif
     odb::core::session s;
     odb::core::transaction t(db_->begin());
@@ -2043,12 +2254,16 @@ std::shared_ptr<AccountBin> Vault::importAccountBin_unwrapped(const std::string&
         script->status(SigningScript::ISSUED);
         for (auto& key: script->keys()) { db_->persist(key); }
         db_->persist(script);
+        addBloomFilterScript_unwrapped(script);
+        addScriptIndex_unwrapped(script);
     }
     for (unsigned int i = 0; i < DEFAULT_UNUSED_POOL_SIZE; i++)
     {
         std::shared_ptr<SigningScript> script = bin->newSigningScript();
         for (auto& key: script->keys()) { db_->persist(key); }
         db_->persist(script);
+        addBloomFilterScript_unwrapped(script);
+        addScriptIndex_unwrapped(script);
     }
     db_->update(bin);
     
@@ -2242,7 +2457,7 @@ std::vector<TxView> Vault::getTxViews(int tx_status_flags, unsigned long start,
     }
 
 #if defined(LOCK_ALL_CALLS)
-    boost::lock_guard<boost::mutex> lock(mutex);
+    ReadLock lock(*this);
 #endif
     odb::core::transaction t(db_->begin());
     std::vector<TxView> views;
@@ -2359,6 +2574,7 @@ std::shared_ptr<Tx> Vault::insertTx_unwrapped(std::shared_ptr<Tx> tx, bool repla
                     }
                     stored_tx->updateStatus(tx->status(), true);
                     db_->update(stored_tx);
+                    addBloomFilterTxOuts_unwrapped(stored_tx);
                     updated = true;
                 }
                 else
@@ -2392,6 +2608,7 @@ std::shared_ptr<Tx> Vault::insertTx_unwrapped(std::shared_ptr<Tx> tx, bool repla
                     {
                         stored_tx->updateStatus(Tx::NO_STATUS, true);
                         db_->update(stored_tx);
+                        addBloomFilterTxOuts_unwrapped(stored_tx);
                         updated = true;
                     }
                 }
@@ -2437,8 +2654,13 @@ std::shared_ptr<Tx> Vault::insertTx_unwrapped(std::shared_ptr<Tx> tx, bool repla
         bool sent_from_vault = false; // whether any of the inputs belong to vault
         std::shared_ptr<Account> sending_account;
 
+        std::vector<std::string> errors;
+        Tx::signabletxins_t signabletxins = tx->signable_txins(errors);
+        std::size_t i = 0;
         for (auto& txin: tx->txins())
         {
+            std::shared_ptr<CoinQ::Script::SignableTxIn> signabletxin = signabletxins[i++];
+
             // Check if inputs connect
             tx_r = db_->query<Tx>(odb::query<Tx>::hash == txin->outhash());
             if (tx_r.empty())
@@ -2448,8 +2670,7 @@ std::shared_ptr<Tx> Vault::insertTx_unwrapped(std::shared_ptr<Tx> tx, bool repla
                 bytes_t txoutscript;
                 try
                 {
-                    CoinQ::Script::SignableTxIn signabletxin(cointx, txin->txindex(), 0);
-                    txoutscript = signabletxin.txoutscript();
+                    if (signabletxin) { txoutscript = signabletxin->txoutscript(); }
 LOGGER(trace) << "txoutscript!!! " << uchar_vector(txoutscript).getHex() << std::endl;
                 }
                 catch (const std::exception& e)
@@ -2600,6 +2821,7 @@ LOGGER(trace) << "txoutscript!!! " << uchar_vector(txoutscript).getHex() << std:
             db_->persist(*tx);
             for (auto& txin:        tx->txins())    { db_->persist(txin);       }
             for (auto& txout:       tx->txouts())   { db_->persist(txout);      }
+            addBloomFilterTxOuts_unwrapped(tx);
 
             // Update other affected objects
             for (auto& txin:        updated_txins)  { db_->update(txin);        }
@@ -2702,6 +2924,8 @@ std::shared_ptr<Tx> Vault::insertNewTx_unwrapped(const Coin::Transaction& cointx
         tx->blockheader(blockheader);
 //LOGGER(trace) << "Vault::insertNewTx_unwrapped: tx->blockheader(blockheader) returned" << std::endl;
 
+        refreshScriptIndex_unwrapped();
+
         std::set<std::shared_ptr<SigningScript>>    updated_scripts;
         std::set<std::shared_ptr<TxIn>>             updated_txins;
         std::set<std::shared_ptr<TxOut>>            updated_txouts;
@@ -2712,28 +2936,27 @@ std::shared_ptr<Tx> Vault::insertNewTx_unwrapped(const Coin::Transaction& cointx
 //LOGGER(trace) << "Vault::insertNewTx_unwrapped: isCoinbase: " << (isCoinbase ? "TRUE" : "FALSE") << std::endl;
         if (!isCoinbase)
         {
+            std::vector<std::string> errors;
+            Tx::signabletxins_t signabletxins = tx->signable_txins(errors);
+            std::size_t i = 0;
             for (auto& txin: tx->txins())
             {
 //LOGGER(trace) << "Vault::insertNewTx_unwrapped: Checking txin" << std::endl;
-                bytes_t unsigned_script;
-                try
+                std::shared_ptr<SignableTxIn> signabletxin = signabletxins[i];
+                const std::string& error = errors[i++];
+                if (!signabletxin)
                 {
-//LOGGER(trace) << "Vault::insertNewTx_unwrapped: txin->unsigned_script()" << std::endl;
-                    unsigned_script = txin->unsigned_script();
-//LOGGER(trace) << "Vault::insertNewTx_unwrapped: txin->unsigned_script() returned" << std::endl;
-                }
-                catch (const std::exception& e)
-                {
-                    LOGGER(error) << "Vault::insertNewTx_unwrapped() - unrecognized input script type: " << e.what() << std::endl;
+                    LOGGER(error) << "Vault::insertNewTx_unwrapped() - unrecognized input script type: " << error << std::endl;
                     signalQueue.push(notifyTxInsertionError.bind(tx, "Unrecognized input script type."));
                     continue;
                 }
+                signabletxin->clearsigs();
+                bytes_t unsigned_script = signabletxin->txinscript();
 
-                odb::result<SigningScript> r(db_->query<SigningScript>(odb::query<SigningScript>::txinscript == unsigned_script));
-                if (!r.empty())
+                std::shared_ptr<SigningScript> signingscript = findTxInSigningScript_unwrapped(unsigned_script);
+                if (signingscript)
                 {
                     // TODO: support sending from multiple accounts in one transaction
-                    std::shared_ptr<SigningScript> signingscript(r.begin().load());
                     signingscript->markUsed();
                     updated_scripts.insert(signingscript);
 
@@ -2761,12 +2984,11 @@ std::shared_ptr<Tx> Vault::insertNewTx_unwrapped(const Coin::Transaction& cointx
 //LOGGER(trace) << "Vault::insertNewTx_unwrapped: Checking txout" << std::endl;
             txout->sending_account(sending_account);
 
-            odb::result<SigningScript> r(db_->query<SigningScript>(odb::query<SigningScript>::txoutscript == txout->script()));
-            if (!r.empty())
+            std::shared_ptr<SigningScript> signingscript = findTxOutSigningScript_unwrapped(txout->script());
+            if (signingscript)
             {
                 receive = true;
 
-                std::shared_ptr<SigningScript> signingscript(r.begin().load());
                 signingscript->markUsed();
                 updated_scripts.insert(signingscript);
 
@@ -2801,6 +3023,7 @@ std::shared_ptr<Tx> Vault::insertNewTx_unwrapped(const Coin::Transaction& cointx
             tx->updateTotals(); db_->persist(tx);
             for (auto& txin:    tx->txins())            { db_->persist(txin);                   }
             for (auto& txout:   tx->txouts())           { db_->persist(txout);                  }
+            addBloomFilterTxOuts_unwrapped(tx);
 
             for (auto& txin:    updated_txins)          { db_->update(txin);                    }
             for (auto& txout:   updated_txouts)         { db_->update(txout);                   }
@@ -3887,6 +4110,7 @@ unsigned int Vault::signTx_unwrapped(std::shared_ptr<Tx> tx, std::vector<std::st
 
     for (auto& keychain: keychains_signed) { keychain_names.push_back(keychain->name()); }
     tx->updateStatus(Tx::NO_STATUS, true);
+    addBloomFilterTxOuts_unwrapped(tx);
     return sigsadded;
 }
 
@@ -4179,6 +4403,129 @@ std::shared_ptr<SigningScript> Vault::getSigningScript_unwrapped(const bytes_t&
     return r.begin().load(); 
 }
 
+std::size_t Vault::ScriptHasher::operator()(const bytes_t& script) const
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (auto byte: script) { hash = (hash ^ byte) * 1099511628211ull; }
+    return (std::size_t)hash;
+}
+
+std::shared_ptr<SigningScript> Vault::findTxInSigningScript_unwrapped(const bytes_t& txinscript) const
+{
+    if (!scriptIndexLoaded_) { loadScriptIndex_unwrapped(); }
+
+    auto it = txinScriptIndex_.find(txinscript);
+    if (it == txinScriptIndex_.end()) return nullptr;
+
+    std::shared_ptr<SigningScript> script(db_->find<SigningScript>(it->second));
+    if (script && script->txinscript() == txinscript) return script;
+
+    // Left behind by a rolled back transaction. The script might have been stored again since.
+    typedef odb::query<SigningScript> query_t;
+    odb::result<SigningScript> r(db_->query<SigningScript>(query_t::txinscript == txinscript));
+    if (r.empty())
+    {
+        txinScriptIndex_.erase(it);
+        return nullptr;
+    }
+
+    script = r.begin().load();
+    it->second = script->id();
+    return script;
+}
+
+std::shared_ptr<SigningScript> Vault::findTxOutSigningScript_unwrapped(const bytes_t& txoutscript) const
+{
+    if (!scriptIndexLoaded_) { loadScriptIndex_unwrapped(); }
+
+    auto it = txoutScriptIndex_.find(txoutscript);
+    if (it == txoutScriptIndex_.end()) return nullptr;
+
+    std::shared_ptr<SigningScript> script(db_->find<SigningScript>(it->second));
+    if (script && script->txoutscript() == txoutscript) return script;
+
+    // Left behind by a rolled back transaction. The script might have been stored again since.
+    typedef odb::query<SigningScript> query_t;
+    odb::result<SigningScript> r(db_->query<SigningScript>(query_t::txoutscript == txoutscript));
+    if (r.empty())
+    {
+        txoutScriptIndex_.erase(it);
+        return nullptr;
+    }
+
+    script = r.begin().load();
+    it->second = script->id();
+    return script;
+}
+
+void Vault::loadScriptIndex_unwrapped() const
+{
+    txinScriptIndex_.clear();
+    txoutScriptIndex_.clear();
+    scriptIndexMaxId_ = 0;
+    scriptIndexMaxScript_.clear();
+
+    odb::result<SigningScriptIndexView> r(db_->query<SigningScriptIndexView>());
+    for (auto& view: r)
+    {
+        txinScriptIndex_.emplace(view.txinscript, view.id);
+        txoutScriptIndex_.emplace(view.txoutscript, view.id);
+        if (view.id > scriptIndexMaxId_)
+        {
+            scriptIndexMaxId_ = view.id;
+            scriptIndexMaxScript_ = view.txoutscript;
+        }
+    }
+    scriptIndexLoaded_ = true;
+}
+
+void Vault::refreshScriptIndex_unwrapped() const
+{
+    if (!scriptIndexLoaded_)
+    {
+        loadScriptIndex_unwrapped();
+        return;
+    }
+
+    // Scripts stored by another process writing to the same database are only found by reading
+    // them. Ids only grow, so those are the rows from the highest id we have read onwards. There
+    // are seldom more than a few, so whole objects are read rather than the index view.
+    bool stale = false;
+    {
+        typedef odb::query<SigningScript> query_t;
+        odb::result<SigningScript> r(db_->query<SigningScript>((query_t::id >= scriptIndexMaxId_) + "ORDER BY" + query_t::id));
+        auto it = r.begin();
+
+        // A rolled back transaction hands its ids out again, so the row we last read must still
+        // be there with the same script. If it is not, the ids after it cannot be trusted.
+        if (scriptIndexMaxId_ > 0)
+        {
+            stale = (it == r.end() || it->id() != scriptIndexMaxId_ || it->txoutscript() != scriptIndexMaxScript_);
+            if (!stale) { ++it; }
+        }
+
+        for (; !stale && it != r.end(); ++it)
+        {
+            txinScriptIndex_.emplace(it->txinscript(), it->id());
+            txoutScriptIndex_.emplace(it->txoutscript(), it->id());
+            scriptIndexMaxId_ = it->id();
+            scriptIndexMaxScript_ = it->txoutscript();
+        }
+    }
+
+    if (stale) { loadScriptIndex_unwrapped(); }
+}
+
+void Vault::addScriptIndex_unwrapped(std::shared_ptr<SigningScript> script) const
+{
+    // Until it is loaded the database has them all.
+    if (!scriptIndexLoaded_) return;
+
+    txinScriptIndex_.emplace(script->txinscript(), script->id());
+    txoutScriptIndex_.emplace(script->txoutscript(), script->id());
+}
+
 ///////////////////////////
 // BLOCKCHAIN OPERATIONS //
 ///////////////////////////
@@ -4376,6 +4723,54 @@ std::shared_ptr<MerkleBlock> Vault::insertMerkleBlock_unwrapped(std::shared_ptr<
     }
 }
 
+void Vault::insertMerkleUpdates(const merkleupdates_t& updates)
+{
+    LOGGER(trace) << "Vault::insertMerkleUpdates(" << updates.size() << " update(s))" << std::endl;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        odb::core::session s;
+        odb::core::transaction t(db_->begin());
+        insertMerkleUpdates_unwrapped(updates);
+        t.commit();
+    }
+
+    signalQueue.flush();
+}
+
+void Vault::insertMerkleUpdates_unwrapped(const merkleupdates_t& updates)
+{
+    try
+    {
+        for (auto& update: updates)
+        {
+            switch (update.type)
+            {
+            case MerkleUpdate::MERKLE_TX:
+                insertMerkleTx_unwrapped(update.chainmerkleblock, update.cointx, update.txindex, update.txcount);
+                break;
+
+            case MerkleUpdate::TX_CONFIRMED:
+                confirmMerkleTx_unwrapped(update.chainmerkleblock, update.txhash, update.txindex, update.txcount);
+                break;
+
+            case MerkleUpdate::MERKLE_BLOCK:
+            {
+                std::shared_ptr<MerkleBlock> merkleblock(new MerkleBlock(update.chainmerkleblock));
+                merkleblock->txsinserted(true);
+                insertMerkleBlock_unwrapped(merkleblock);
+                break;
+            }
+            }
+        }
+    }
+    catch (...)
+    {
+        signalQueue.clear();
+        throw;
+    }
+}
+
 unsigned int Vault::deleteMerkleBlock(const bytes_t& hash)
 {
     return 0;
@@ -15,6 +15,7 @@
 #include "VaultExceptions.h"
 #include "SigningRequest.h"
 #include "SignatureInfo.h"
+#include "StorageProfile.h"
 
 #include <Signals/Signals.h>
 #include <Signals/SignalQueue.h>
@@ -25,6 +26,8 @@
 
 #include <boost/thread.hpp>
 
+#include <unordered_map>
+
 // support for boost serialization
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -43,13 +46,46 @@ typedef Signals::Signal<std::shared_ptr<MerkleBlock>, const std::string& /*descr
 
 typedef Signals::Signal<std::shared_ptr<MerkleBlock>, bytes_t> TxConfirmationErrorSignal;
 
+// What NetworkSync hands over for a synched block, one call at a time, so it can be stored later
+// with insertMerkleUpdates().
+struct MerkleUpdate
+{
+    enum type_t
+    {
+        MERKLE_TX,      // insertMerkleTx()
+        TX_CONFIRMED,   // confirmMerkleTx()
+        MERKLE_BLOCK    // insertMerkleBlock() of a block with no transactions for us
+    };
+
+    explicit MerkleUpdate(const ChainMerkleBlock& chainmerkleblock_)
+        : type(MERKLE_BLOCK), chainmerkleblock(chainmerkleblock_), txindex(0), txcount(0) { }
+
+    MerkleUpdate(const ChainMerkleBlock& chainmerkleblock_, const Coin::Transaction& cointx_, unsigned int txindex_, unsigned int txcount_)
+        : type(MERKLE_TX), chainmerkleblock(chainmerkleblock_), cointx(cointx_), txindex(txindex_), txcount(txcount_) { }
+
+    MerkleUpdate(const ChainMerkleBlock& chainmerkleblock_, const bytes_t& txhash_, unsigned int txindex_, unsigned int txcount_)
+        : type(TX_CONFIRMED), chainmerkleblock(chainmerkleblock_), txhash(txhash_), txindex(txindex_), txcount(txcount_) { }
+
+    // True for the last update of a block.
+    bool isBlockEnd() const { return type == MERKLE_BLOCK || txindex + 1 == txcount; }
+
+    type_t type;
+    ChainMerkleBlock chainmerkleblock;
+    Coin::Transaction cointx;   // MERKLE_TX
+    bytes_t txhash;             // TX_CONFIRMED
+    unsigned int txindex;
+    unsigned int txcount;
+};
+
+typedef std::vector<MerkleUpdate> merkleupdates_t;
+
 class Vault
 {
 public:
-    Vault() : db_(nullptr) { }
+    Vault() : db_(nullptr), concurrentReads_(false), bloomElementsLoaded_(false), bloomFalsePositiveRate_(0.0), bloomScriptMaxId_(0), scriptIndexLoaded_(false), scriptIndexMaxId_(0) { }
     Vault(int argc, char** argv, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
-    Vault(const std::string& dbname, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
-    Vault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
+    Vault(const std::string& dbname, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false, const StorageProfile& profile = StorageProfile());
+    Vault(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false, const StorageProfile& profile = StorageProfile());
 
     virtual ~Vault();
 
@@ -65,7 +101,7 @@ public:
     // GLOBAL OPERATIONS //
     ///////////////////////
     void                                    open(int argc, char** argv, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
-    void                                    open(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false);
+    void                                    open(const std::string& dbuser, const std::string& dbpasswd, const std::string& dbname, bool create = false, uint32_t version = SCHEMA_VERSION, const std::string& network = "", bool migrate = false, const StorageProfile& profile = StorageProfile());
     void                                    close();
 
     const std::string&                      getName() const { return name_; }
@@ -80,6 +116,8 @@ public:
     uint32_t                                getHorizonHeight() const;
     std::vector<bytes_t>                    getLocatorHashes() const;
     Coin::BloomFilter                       getBloomFilter(double falsePositiveRate, uint32_t nTweak, uint32_t nFlags) const;
+    bool                                    getBloomFilterAdditions(std::vector<bytes_t>& additions) const; // elements added since the last filter was handed out, false if it should be rebuilt instead
+    void                                    getFilterElements(std::vector<bytes_t>& scripts, std::vector<bytes_t>& outpoints) const; // output scripts and unspent serialized outpoints to match compact block filters against
     hashvector_t                            getIncompleteBlockHashes() const;
 
     void                                    exportVault(const std::string& filepath, bool exportprivkeys = true) const;
@@ -216,6 +254,7 @@ public:
     std::shared_ptr<BlockHeader>            getBlockHeader(uint32_t height) const;
     std::shared_ptr<BlockHeader>            getBestBlockHeader() const;
     std::shared_ptr<MerkleBlock>            insertMerkleBlock(std::shared_ptr<MerkleBlock> merkleblock);
+    void                                    insertMerkleUpdates(const merkleupdates_t& updates); // In a single database transaction. If one throws, none are stored.
     unsigned int                            deleteMerkleBlock(const bytes_t& hash);
     unsigned int                            deleteMerkleBlock(uint32_t height);
     void                                    exportMerkleBlocks(const std::string& filepath) const;
@@ -281,6 +320,12 @@ protected:
     uint32_t                                getHorizonHeight_unwrapped() const;
     std::vector<bytes_t>                    getLocatorHashes_unwrapped() const;
     Coin::BloomFilter                       getBloomFilter_unwrapped(double falsePositiveRate, uint32_t nTweak, uint32_t nFlags) const;
+    bool                                    getBloomFilterAdditions_unwrapped(std::vector<bytes_t>& additions) const;
+    void                                    loadBloomFilterElements_unwrapped() const;
+    bool                                    loadNewBloomFilterScripts_unwrapped() const; // false if the elements must be read again
+    void                                    addBloomFilterScript_unwrapped(std::shared_ptr<SigningScript> script) const;
+    void                                    addBloomFilterTxOuts_unwrapped(std::shared_ptr<Tx> tx) const;
+    void                                    getFilterElements_unwrapped(std::vector<bytes_t>& scripts, std::vector<bytes_t>& outpoints) const;
     hashvector_t                            getIncompleteBlockHashes_unwrapped() const;
 
     ////////////////////////
@@ -371,6 +416,11 @@ protected:
     // SIGNINGSCRIPT OPERATIONS //
     //////////////////////////////
     std::shared_ptr<SigningScript>          getSigningScript_unwrapped(const bytes_t& script) const;
+    std::shared_ptr<SigningScript>          findTxInSigningScript_unwrapped(const bytes_t& txinscript) const; // nullptr if not ours
+    std::shared_ptr<SigningScript>          findTxOutSigningScript_unwrapped(const bytes_t& txoutscript) const; // nullptr if not ours
+    void                                    loadScriptIndex_unwrapped() const;
+    void                                    refreshScriptIndex_unwrapped() const;
+    void                                    addScriptIndex_unwrapped(std::shared_ptr<SigningScript> script) const;
 
     ///////////////////////////
     // BLOCKCHAIN OPERATIONS //
@@ -380,6 +430,7 @@ protected:
     std::shared_ptr<BlockHeader>            getBlockHeader_unwrapped(uint32_t height) const;
     std::shared_ptr<BlockHeader>            getBestBlockHeader_unwrapped() const;
     std::shared_ptr<MerkleBlock>            insertMerkleBlock_unwrapped(std::shared_ptr<MerkleBlock> merkleblock);
+    void                                    insertMerkleUpdates_unwrapped(const merkleupdates_t& updates);
     unsigned int                            deleteMerkleBlock_unwrapped(std::shared_ptr<MerkleBlock> merkleblock);
     unsigned int                            deleteMerkleBlock_unwrapped(uint32_t height);
     unsigned int                            updateConfirmations_unwrapped(std::shared_ptr<Tx> tx = nullptr); // If parameter is null, updates all unconfirmed transactions.
@@ -417,7 +468,50 @@ private:
     std::shared_ptr<odb::core::database> db_;
     std::string name_;
 
+    // The read-only queries that take a ReadLock run beside writes and each other when every
+    // transaction reads its own snapshot on its own connection, as with a SQLite write-ahead log.
+    // Otherwise they take mutex like everything else. Either way they hold dbMutex_ shared so the
+    // database is not closed under them.
+    class ReadLock
+    {
+    public:
+        explicit ReadLock(const Vault& vault);
+
+    private:
+        boost::shared_lock<boost::shared_mutex> dbLock_;
+        boost::unique_lock<boost::mutex> lock_;
+    };
+
+    mutable boost::shared_mutex dbMutex_; // taken before mutex
+    bool concurrentReads_;
+
     mutable std::map<std::string, secure_bytes_t> mapPrivateKeyUnlock;
+
+    // Bloom filter elements are read from the database for each whole filter and then kept up to
+    // date as signing scripts are created and coins are sent, so the filter can be topped up rather
+    // than rebuilt. Scripts other writers store are read before each top up.
+    mutable bool bloomElementsLoaded_;
+    mutable std::set<bytes_t> bloomElements_;
+    mutable std::vector<bytes_t> bloomAdditions_; // not in bloomFilter_ yet
+    mutable Coin::BloomFilter bloomFilter_; // as last handed out
+    mutable double bloomFalsePositiveRate_; // bloomFilter_ was built for
+    mutable unsigned long bloomScriptMaxId_; // highest signing script id read for the elements
+    mutable bytes_t bloomScriptMaxScript_; // txoutscript stored under it
+
+    // Signing script ids by txinscript and txoutscript, so scripts in synched transactions that
+    // are not ours are turned away without a query. Read from the database on first use, added to
+    // as scripts are created, and caught up with scripts stored by other writers once per inserted
+    // transaction.
+    struct ScriptHasher
+    {
+        std::size_t operator()(const bytes_t& script) const;
+    };
+    typedef std::unordered_map<bytes_t, unsigned long, ScriptHasher> script_index_t;
+    mutable bool scriptIndexLoaded_;
+    mutable unsigned long scriptIndexMaxId_; // highest id read from the database
+    mutable bytes_t scriptIndexMaxScript_; // txoutscript stored under it
+    mutable script_index_t txinScriptIndex_;
+    mutable script_index_t txoutScriptIndex_;
 };
 
 }
@@ -0,0 +1,330 @@
+#include <sqlite3.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using boost::property_tree::ptree;
+
+// Builds the SQLite schema from the ODB changelog, fills it with a few hundred thousand rows of
+// vault data and checks with EXPLAIN QUERY PLAN that none of the queries run for each synched
+// transaction or block, or when choosing coins, scans a whole table. The queries are written the
+// way ODB generates them for the Vault calls named above each one.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+static void exec(sqlite3* db, const string& sql)
+{
+    char* error = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error) != SQLITE_OK)
+    {
+        string message = error ? error : "unknown error";
+        sqlite3_free(error);
+        throw runtime_error(message + " in: " + sql);
+    }
+}
+
+static string quote(const string& name) { return "\"" + name + "\""; }
+
+// Schema
+struct Column
+{
+    string name;
+    string type;
+    bool null;
+};
+
+struct Table
+{
+    vector<Column> columns;
+    string primaryKey;
+    vector<string> indexes;
+};
+
+typedef map<string, Table> tables_t;
+
+static string indexSql(const string& table, const ptree& index)
+{
+    string columns;
+    for (auto& child: index)
+    {
+        if (child.first != "column") continue;
+        if (!columns.empty()) columns += ", ";
+        columns += quote(child.second.get<string>("<xmlattr>.name"));
+    }
+    bool unique = index.get<string>("<xmlattr>.type", "") == "UNIQUE";
+    return string(unique ? "CREATE UNIQUE INDEX " : "CREATE INDEX ") + quote(index.get<string>("<xmlattr>.name")) + " ON " + quote(table) + " (" + columns + ")";
+}
+
+static void addColumn(Table& table, const ptree& column)
+{
+    table.columns.push_back(Column{column.get<string>("<xmlattr>.name"), column.get<string>("<xmlattr>.type"), column.get<string>("<xmlattr>.null") == "true"});
+}
+
+static void addTable(tables_t& tables, const string& name, const ptree& node)
+{
+    Table& table = tables[name];
+    for (auto& child: node)
+    {
+        if (child.first == "column") { addColumn(table, child.second); }
+        else if (child.first == "primary-key") { table.primaryKey = child.second.get<string>("column.<xmlattr>.name"); }
+        else if (child.first == "index") { table.indexes.push_back(indexSql(name, child.second)); }
+    }
+}
+
+// The model, then each changeset from the oldest. Foreign keys are left out.
+static tables_t loadSchema(const string& filename)
+{
+    ptree changelog;
+    read_xml(filename, changelog);
+
+    tables_t tables;
+    vector<pair<int, const ptree*>> changesets;
+    for (auto& child: changelog.get_child("changelog"))
+    {
+        if (child.first == "model")
+        {
+            for (auto& table: child.second)
+            {
+                if (table.first == "table") { addTable(tables, table.second.get<string>("<xmlattr>.name"), table.second); }
+            }
+        }
+        else if (child.first == "changeset")
+        {
+            changesets.push_back(make_pair(child.second.get<int>("<xmlattr>.version"), &child.second));
+        }
+    }
+
+    sort(changesets.begin(), changesets.end(), [](const pair<int, const ptree*>& a, const pair<int, const ptree*>& b) { return a.first < b.first; });
+    for (auto& changeset: changesets)
+    {
+        for (auto& change: *changeset.second)
+        {
+            if (change.first == "<xmlattr>") continue;
+            string name = change.second.get<string>("<xmlattr>.name");
+            if (change.first == "add-table") { addTable(tables, name, change.second); continue; }
+            if (change.first != "alter-table") throw runtime_error("Unexpected changelog element " + change.first);
+
+            Table& table = tables.at(name);
+            for (auto& alteration: change.second)
+            {
+                if (alteration.first == "add-column") { addColumn(table, alteration.second); }
+                else if (alteration.first == "add-index") { table.indexes.push_back(indexSql(name, alteration.second)); }
+            }
+        }
+    }
+
+    return tables;
+}
+
+static void createSchema(sqlite3* db, const tables_t& tables)
+{
+    for (auto& entry: tables)
+    {
+        string sql = "CREATE TABLE " + quote(entry.first) + " (";
+        for (size_t i = 0; i < entry.second.columns.size(); i++)
+        {
+            const Column& column = entry.second.columns[i];
+            if (i > 0) sql += ", ";
+            sql += quote(column.name) + " " + column.type;
+            if (!column.null) sql += " NOT NULL";
+            if (column.name == entry.second.primaryKey) sql += " PRIMARY KEY AUTOINCREMENT";
+        }
+        exec(db, sql + ")");
+        for (auto& index: entry.second.indexes) { exec(db, index); }
+    }
+}
+
+// Inserts rows 1 to count, numbered i. Columns not in values are NULL if they can be, or else
+// zero or empty.
+static void fill(sqlite3* db, const tables_t& tables, const string& name, unsigned int count, const map<string, string>& values)
+{
+    string columns, expressions;
+    for (auto& column: tables.at(name).columns)
+    {
+        if (!columns.empty()) { columns += ", "; expressions += ", "; }
+        columns += quote(column.name);
+
+        auto it = values.find(column.name);
+        if (it != values.end())         { expressions += it->second; }
+        else if (column.name == "id")   { expressions += "i"; }
+        else if (column.null)           { expressions += "NULL"; }
+        else if (column.type == "BLOB") { expressions += "x''"; }
+        else if (column.type == "TEXT") { expressions += "''"; }
+        else                            { expressions += "0"; }
+    }
+
+    exec(db, "INSERT INTO " + quote(name) + " (" + columns + ") WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < " + to_string(count) + ") SELECT " + expressions + " FROM n");
+}
+
+// Shaped like a vault that has synched a while: most scripts used, most outputs spent, every
+// block stored with its transactions.
+static void fillVault(sqlite3* db, const tables_t& tables)
+{
+    const unsigned int ACCOUNTS = 10, BINS = 20, SCRIPTS = 100000, BLOCKS = 100000, TXS = 200000, TXINS = 400000, TXOUTS = 500000;
+
+    exec(db, "BEGIN");
+    fill(db, tables, "Account", ACCOUNTS, { { "name", "'account' || i" }, { "hash", "randomblob(20)" } });
+    fill(db, tables, "AccountBin", BINS, { { "account", "(i - 1) / 2 + 1" }, { "name", "'bin' || i" }, { "hash", "randomblob(20)" } });
+    fill(db, tables, "SigningScript", SCRIPTS, {
+        { "account", "(i - 1) % " + to_string(BINS) + " / 2 + 1" },
+        { "account_bin", "(i - 1) % " + to_string(BINS) + " + 1" },
+        { "index", "(i - 1) / " + to_string(BINS) + " + 1" },
+        { "status", "CASE WHEN i > " + to_string(SCRIPTS - 25 * BINS) + " THEN 1 WHEN i % 3 = 0 THEN 4 ELSE 8 END" },
+        { "txinscript", "randomblob(71)" },
+        { "txoutscript", "randomblob(23)" } });
+    fill(db, tables, "BlockHeader", BLOCKS, { { "hash", "randomblob(32)" }, { "height", "i" }, { "prevhash", "randomblob(32)" } });
+    fill(db, tables, "MerkleBlock", BLOCKS, { { "blockheader", "i" }, { "txcount", "2" }, { "txsinserted", "1" } });
+    fill(db, tables, "Tx", TXS, {
+        { "hash", "randomblob(32)" }, { "unsigned_hash", "randomblob(32)" }, { "timestamp", "i" },
+        { "status", "CASE WHEN i > " + to_string(TXS - 100) + " THEN 2 ELSE 16 END" },
+        { "blockheader", "CASE WHEN i > " + to_string(TXS - 100) + " THEN NULL ELSE (i + 1) / 2 END" } });
+    fill(db, tables, "TxIn", TXINS, { { "outhash", "randomblob(32)" }, { "outindex", "i % 3" }, { "tx", "(i + 1) / 2" }, { "txindex", "(i + 1) % 2" } });
+    fill(db, tables, "TxOut", TXOUTS, {
+        { "value", "100000" }, { "script", "randomblob(23)" },
+        { "tx", "(i - 1) * 2 / 5 + 1" }, { "txindex", "(i - 1) * 2 % 5 / 2" },
+        { "spent", "CASE WHEN i % 10 = 0 THEN NULL ELSE i * 4 / 5 END" },
+        { "receiving_account", "CASE WHEN i % 4 = 0 THEN NULL ELSE i % " + to_string(ACCOUNTS) + " + 1 END" },
+        { "sending_account", "CASE WHEN i % 4 = 0 THEN i % " + to_string(ACCOUNTS) + " + 1 ELSE NULL END" },
+        { "account_bin", "i % " + to_string(BINS) + " + 1" },
+        { "signingscript", "i % " + to_string(SCRIPTS) + " + 1" },
+        { "status", "CASE WHEN i % 10 = 0 THEN 1 ELSE 2 END" } });
+    exec(db, "COMMIT");
+}
+
+// Queries
+struct Query
+{
+    const char* name;
+    const char* sql;
+};
+
+static const Query QUERIES[] =
+{
+    // insertMerkleTx(), insertTx(): the transaction by signed hash, or either hash
+    { "Tx by hash",
+      "SELECT \"Tx\".\"id\" FROM \"Tx\" WHERE \"Tx\".\"hash\"=?" },
+    { "Tx by hash or unsigned hash",
+      "SELECT \"Tx\".\"id\" FROM \"Tx\" WHERE (\"Tx\".\"hash\"=? OR \"Tx\".\"unsigned_hash\"=?)" },
+    // insertMerkleBlock(): transactions confirmed by the block
+    { "Tx by hashes",
+      "SELECT \"Tx\".\"id\" FROM \"Tx\" WHERE \"Tx\".\"hash\" IN (?, ?, ?, ?)" },
+    // Loading a Tx: its inverse txins and txouts
+    { "TxIn by tx",
+      "SELECT \"TxIn\".\"id\" FROM \"TxIn\" WHERE \"TxIn\".\"tx\"=?" },
+    { "TxOut by tx",
+      "SELECT \"TxOut\".\"id\" FROM \"TxOut\" WHERE \"TxOut\".\"tx\"=?" },
+    // insertNewTx(): the output an input spends, and inputs spending a new output
+    { "TxOut by outpoint",
+      "SELECT \"TxOut\".\"id\" FROM \"TxOut\" LEFT JOIN \"Tx\" AS \"tx\" ON \"tx\".\"id\"=\"TxOut\".\"tx\" WHERE (\"tx\".\"hash\"=? AND \"TxOut\".\"txindex\"=?)" },
+    { "TxIn by outpoint",
+      "SELECT \"TxIn\".\"id\" FROM \"TxIn\" WHERE (\"TxIn\".\"outhash\"=? AND \"TxIn\".\"outindex\"=?)" },
+    // deleteTx(): outputs spent by an input
+    { "TxOut by spent",
+      "SELECT \"TxOut\".\"id\" FROM \"TxOut\" WHERE \"TxOut\".\"spent\"=?" },
+    // findTxInSigningScript(), findTxOutSigningScript()
+    { "SigningScript by txinscript",
+      "SELECT \"SigningScript\".\"id\" FROM \"SigningScript\" WHERE \"SigningScript\".\"txinscript\"=?" },
+    { "SigningScript by txoutscript",
+      "SELECT \"SigningScript\".\"id\" FROM \"SigningScript\" WHERE \"SigningScript\".\"txoutscript\"=?" },
+    // issueSigningScript(): the next unused script of a bin and the pool size
+    { "next unused SigningScript",
+      "SELECT \"SigningScript\".\"id\" FROM \"SigningScript\" LEFT JOIN \"Account\" ON \"Account\".\"id\"=\"SigningScript\".\"account\" LEFT JOIN \"AccountBin\" ON \"AccountBin\".\"id\"=\"SigningScript\".\"account_bin\" "
+      "WHERE (\"AccountBin\".\"id\"=? AND \"SigningScript\".\"status\"=?) ORDER BY \"SigningScript\".\"index\" LIMIT 1" },
+    { "ScriptCountView of a bin",
+      "SELECT count(\"SigningScript\".\"id\"), max(\"SigningScript\".\"index\") FROM \"SigningScript\" LEFT JOIN \"Account\" ON \"Account\".\"id\"=\"SigningScript\".\"account\" LEFT JOIN \"AccountBin\" ON \"AccountBin\".\"id\"=\"SigningScript\".\"account_bin\" "
+      "WHERE (\"AccountBin\".\"id\"=? AND \"SigningScript\".\"status\"!=?)" },
+    // createTx(), getAccountBalance(): unspent outputs of an account
+    { "unspent TxOutView of an account",
+      "SELECT \"TxOut\".\"id\" FROM \"TxOut\" LEFT JOIN \"Tx\" ON \"Tx\".\"id\"=\"TxOut\".\"tx\" LEFT JOIN \"BlockHeader\" ON \"BlockHeader\".\"id\"=\"Tx\".\"blockheader\" "
+      "LEFT JOIN \"Account\" AS \"sending_account\" ON \"sending_account\".\"id\"=\"TxOut\".\"sending_account\" LEFT JOIN \"Account\" AS \"receiving_account\" ON \"receiving_account\".\"id\"=\"TxOut\".\"receiving_account\" "
+      "LEFT JOIN \"AccountBin\" ON \"AccountBin\".\"id\"=\"TxOut\".\"account_bin\" LEFT JOIN \"SigningScript\" ON \"SigningScript\".\"id\"=\"TxOut\".\"signingscript\" "
+      "WHERE (\"Tx\".\"status\">? AND \"TxOut\".\"status\"=? AND \"receiving_account\".\"id\"=? AND \"BlockHeader\".\"height\"<=?)" },
+    { "BalanceView of an account",
+      "SELECT sum(\"TxOut\".\"value\") FROM \"TxOut\" LEFT JOIN \"Tx\" ON \"Tx\".\"id\"=\"TxOut\".\"tx\" LEFT JOIN \"BlockHeader\" ON \"BlockHeader\".\"id\"=\"Tx\".\"blockheader\" "
+      "LEFT JOIN \"Account\" ON \"Account\".\"id\"=\"TxOut\".\"receiving_account\" LEFT JOIN \"AccountBin\" ON \"AccountBin\".\"id\"=\"TxOut\".\"account_bin\" "
+      "LEFT JOIN \"SigningScript\" ON \"SigningScript\".\"id\"=\"TxOut\".\"signingscript\" WHERE (\"Account\".\"name\"=? AND \"TxOut\".\"status\"=? AND \"Tx\".\"status\" IN (?, ?, ?))" },
+    // insertMerkleTx(): the block, and its parent
+    { "MerkleBlock by block hash",
+      "SELECT \"MerkleBlock\".\"id\" FROM \"MerkleBlock\" LEFT JOIN \"BlockHeader\" AS \"blockheader\" ON \"blockheader\".\"id\"=\"MerkleBlock\".\"blockheader\" "
+      "WHERE (\"MerkleBlock\".\"blockheader\" IS NOT NULL AND \"blockheader\".\"hash\"=?)" },
+    // insertMerkleTx(): what a new block replaces
+    { "Tx at or above a height",
+      "SELECT \"Tx\".\"id\" FROM \"Tx\" LEFT JOIN \"BlockHeader\" AS \"blockheader\" ON \"blockheader\".\"id\"=\"Tx\".\"blockheader\" WHERE \"blockheader\".\"height\">=?" },
+    { "MerkleBlock at or above a height",
+      "SELECT \"MerkleBlock\".\"id\" FROM \"MerkleBlock\" LEFT JOIN \"BlockHeader\" AS \"blockheader\" ON \"blockheader\".\"id\"=\"MerkleBlock\".\"blockheader\" WHERE \"blockheader\".\"height\">=?" },
+    // insertMerkleBlock(), getBlockHeader()
+    { "BlockHeader by hash",
+      "SELECT \"BlockHeader\".\"id\" FROM \"BlockHeader\" WHERE \"BlockHeader\".\"hash\"=?" },
+    { "BlockHeader by height",
+      "SELECT \"BlockHeader\".\"id\" FROM \"BlockHeader\" WHERE \"BlockHeader\".\"height\"=?" },
+    // SynchedVault: blocks whose transactions are not all stored yet
+    { "IncompleteBlockCountView",
+      "SELECT count(\"MerkleBlock\".\"id\") FROM \"MerkleBlock\" WHERE (\"MerkleBlock\".\"txsinserted\"=0)" }
+};
+
+// The plan lines that read every row of a table.
+static vector<string> getScans(sqlite3* db, const string& sql)
+{
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, ("EXPLAIN QUERY PLAN " + sql).c_str(), -1, &stmt, nullptr) != SQLITE_OK) throw runtime_error(string(sqlite3_errmsg(db)) + " in: " + sql);
+
+    vector<string> scans;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        string detail = (const char*)sqlite3_column_text(stmt, 3);
+        if (detail.compare(0, 5, "SCAN ") == 0 && detail != "SCAN CONSTANT ROW") { scans.push_back(detail); }
+    }
+    sqlite3_finalize(stmt);
+    return scans;
+}
+
+static void checkQueries(sqlite3* db, const string& when)
+{
+    for (auto& query: QUERIES)
+    {
+        for (auto& scan: getScans(db, query.sql)) { check(false, string(query.name) + " " + when + ": " + scan); }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    string schemaFile = argc > 1 ? argv[1] : "../../src/Schema-sqlite.xml";
+
+    try
+    {
+        tables_t tables = loadSchema(schemaFile);
+
+        sqlite3* db;
+        if (sqlite3_open(":memory:", &db) != SQLITE_OK) throw runtime_error("Could not open database.");
+        createSchema(db, tables);
+        fillVault(db, tables);
+
+        // Vaults are never analyzed, but the plans should not depend on it.
+        checkQueries(db, "without statistics");
+        exec(db, "ANALYZE");
+        checkQueries(db, "with statistics");
+
+        sqlite3_close(db);
+    }
+    catch (const exception& e)
+    {
+        cout << "FAILED: " << e.what() << endl;
+        ok = false;
+    }
+
+    cout << (ok ? "All tests passed." : "Some tests failed.") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#include <Database.h>
+
+#include <sqlite3.h>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+using namespace CoinDB;
+using namespace std;
+
+// Opens a database with each write-ahead log profile and checks that a connection from the pool
+// can read while another one is in the middle of a write, seeing the last commit.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+static void removeDatabase(const string& filename)
+{
+    remove(filename.c_str());
+    remove((filename + "-wal").c_str());
+    remove((filename + "-shm").c_str());
+}
+
+// Returns the result of the first step, and the count if there was a row.
+static int countRows(sqlite3* handle, int& count)
+{
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(handle, "SELECT count(*) FROM probe", -1, &stmt, nullptr) != SQLITE_OK) return SQLITE_ERROR;
+    int result = sqlite3_step(stmt);
+    count = (result == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : -1;
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+static void testReadDuringWrite(const string& filename, StorageProfile::type_t type)
+{
+    StorageProfile profile(type);
+    string name = profile.getName();
+
+    removeDatabase(filename);
+    sqlite3* handle;
+    sqlite3_open_v2(filename.c_str(), &handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+    sqlite3_exec(handle, "CREATE TABLE probe (n INTEGER); INSERT INTO probe VALUES (1);", nullptr, nullptr, nullptr);
+    sqlite3_close(handle);
+
+    {
+        unique_ptr<odb::database> db = openDatabase("", "", filename, false, profile);
+        odb::sqlite::database& sqlitedb = static_cast<odb::sqlite::database&>(*db);
+        odb::sqlite::connection_ptr writer(sqlitedb.connection());
+        odb::sqlite::connection_ptr reader(sqlitedb.connection());
+
+        writer->execute("BEGIN IMMEDIATE");
+        writer->execute("INSERT INTO probe VALUES (2)");
+
+        // With a shared cache the table is locked by the writer and this fails with SQLITE_LOCKED.
+        int count;
+        int result = countRows(reader->handle(), count);
+        check(result == SQLITE_ROW, name + ": read during a write returns " + to_string(result));
+        check(count == 1, name + ": read during a write sees " + to_string(count) + " rows");
+
+        writer->execute("COMMIT");
+        result = countRows(reader->handle(), count);
+        check(result == SQLITE_ROW && count == 2, name + ": read after the commit sees " + to_string(count) + " rows");
+    }
+
+    removeDatabase(filename);
+}
+
+int main(int argc, char* argv[])
+{
+    string filename = argc > 1 ? argv[1] : "build/storageprofiletest.db";
+
+    try
+    {
+        testReadDuringWrite(filename, StorageProfile::BALANCED);
+        testReadDuringWrite(filename, StorageProfile::FAST);
+    }
+    catch (const exception& e)
+    {
+        cout << "FAILED: " << e.what() << endl;
+        ok = false;
+    }
+
+    cout << (ok ? "All tests passed." : "Some tests failed.") << endl;
+    return ok ? 0 : 1;
+}
@@ -184,7 +184,7 @@ int main(int argc, char* argv[])
     {
         cout << "Opening coin database " << dbname << endl;
         LOGGER(info) << "Opening coin database " << dbname << endl;
-        synchedVault.openVault(config.getDatabaseUser(), config.getDatabasePassword(), dbname);
+        synchedVault.openVault(config.getDatabaseUser(), config.getDatabasePassword(), dbname, false, SCHEMA_VERSION, "", false, config.getStorageProfile());
 
         cout << "Loading block tree " << blocktreefile << "..." << endl;
         LOGGER(info) << "Loading block tree " << blocktreefile << endl;
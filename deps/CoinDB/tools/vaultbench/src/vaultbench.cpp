@@ -0,0 +1,197 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// vaultbench.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+// Stores synthetic blocks with insertMerkleUpdates() on one thread while
+// others call getTxViews(), once per storage profile, and reports how many
+// reads started and finished inside a single insertMerkleUpdates() call.
+// Those reads ran while the writer held the vault's mutex.
+//
+
+#include <Vault.h>
+
+#include <CoinCore/random.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace CoinDB;
+using namespace std;
+
+typedef chrono::steady_clock clock_type;
+
+static double elapsedMs(const clock_type::time_point& start)
+{
+    return chrono::duration<double, milli>(clock_type::now() - start).count();
+}
+
+static void removeVault(const string& filename)
+{
+    remove(filename.c_str());
+    remove((filename + "-journal").c_str());
+    remove((filename + "-wal").c_str());
+    remove((filename + "-shm").c_str());
+}
+
+// Blocks that each pay txsPerBlock transactions to the vault's scripts, starting above height.
+class BlockMaker
+{
+public:
+    BlockMaker(const vector<bytes_t>& scripts) : scripts_(scripts), height_(0), prevHash_(32, 0), count_(0) { }
+
+    merkleupdates_t makeBatch(unsigned int blocks, unsigned int txsPerBlock)
+    {
+        merkleupdates_t updates;
+        for (unsigned int i = 0; i < blocks; i++)
+        {
+            vector<Coin::Transaction> txs;
+            vector<uchar_vector> hashes;
+            for (unsigned int j = 0; j < txsPerBlock; j++)
+            {
+                Coin::Transaction tx;
+                tx.addInput(Coin::TxIn(Coin::OutPoint(uchar_vector(secure_random_bytes(32)), 0), uchar_vector(), 0xffffffff));
+                tx.addOutput(Coin::TxOut(100000, scripts_[count_++ % scripts_.size()]));
+                txs.push_back(tx);
+                hashes.push_back(tx.hash());
+            }
+
+            height_++;
+            Coin::CoinBlockHeader header(2, 1231006505 + height_ * 60, 0x207fffff, height_, 0, prevHash_, uchar_vector(32, 0));
+            ChainMerkleBlock block(Coin::MerkleBlock(header, txsPerBlock, hashes, uchar_vector(1, 0xff)), true, height_);
+            prevHash_ = header.hash();
+
+            for (unsigned int j = 0; j < txsPerBlock; j++) { updates.push_back(MerkleUpdate(block, txs[j], j, txsPerBlock)); }
+        }
+        return updates;
+    }
+
+private:
+    vector<bytes_t> scripts_;
+    int height_;
+    uchar_vector prevHash_;
+    unsigned long count_;
+};
+
+static void bench(StorageProfile::type_t type, const string& filename, unsigned int seconds, unsigned int blocksPerBatch, unsigned int txsPerBlock, unsigned int readers)
+{
+    StorageProfile profile(type);
+    removeVault(filename);
+
+    {
+        Vault vault(filename, true, SCHEMA_VERSION, "", false, profile);
+        vault.newKeychain("bench", secure_random_bytes(32));
+        vault.newAccount("bench", 1, vector<string>(1, "bench"), 25, time(NULL));
+
+        vector<bytes_t> scripts;
+        for (unsigned int i = 0; i < 200; i++) { scripts.push_back(vault.issueSigningScript("bench")->txoutscript()); }
+
+        // Enough history for each read to return a full page.
+        BlockMaker maker(scripts);
+        for (unsigned int i = 0; i < 10; i++) { vault.insertMerkleUpdates(maker.makeBatch(blocksPerBatch, txsPerBlock)); }
+
+        // Odd while insertMerkleUpdates() runs, and advanced by two for each call.
+        atomic<unsigned long> writeState(0);
+        atomic<bool> done(false);
+        unsigned long writes = 0;
+        double writeMs = 0;
+
+        vector<unsigned long> reads(readers, 0), readsInsideWrite(readers, 0);
+        vector<double> worstReadMs(readers, 0);
+
+        vector<thread> threads;
+        for (unsigned int r = 0; r < readers; r++)
+        {
+            threads.push_back(thread([&, r]() {
+                while (!done)
+                {
+                    unsigned long before = writeState;
+                    clock_type::time_point start = clock_type::now();
+                    vault.getTxViews(Tx::ALL, 0, 100);
+                    double ms = elapsedMs(start);
+                    unsigned long after = writeState;
+
+                    reads[r]++;
+                    if (before == after && (before & 1)) readsInsideWrite[r]++;
+                    if (ms > worstReadMs[r]) worstReadMs[r] = ms;
+                }
+            }));
+        }
+
+        clock_type::time_point start = clock_type::now();
+        while (elapsedMs(start) < seconds * 1000.0)
+        {
+            merkleupdates_t updates = maker.makeBatch(blocksPerBatch, txsPerBlock);
+            clock_type::time_point writeStart = clock_type::now();
+            writeState++;
+            vault.insertMerkleUpdates(updates);
+            writeState++;
+            writeMs += elapsedMs(writeStart);
+            writes++;
+        }
+        double totalMs = elapsedMs(start);
+        done = true;
+        for (auto& t: threads) { t.join(); }
+
+        unsigned long totalReads = 0, totalInside = 0;
+        double worstMs = 0;
+        for (unsigned int r = 0; r < readers; r++)
+        {
+            totalReads += reads[r];
+            totalInside += readsInsideWrite[r];
+            if (worstReadMs[r] > worstMs) worstMs = worstReadMs[r];
+        }
+
+        cout << left << setw(12) << profile.getName()
+             << right << setw(10) << writes
+             << setw(12) << fixed << setprecision(1) << writes * 1000.0 / totalMs
+             << setw(12) << setprecision(0) << writeMs * 100 / totalMs
+             << setw(10) << totalReads
+             << setw(12) << setprecision(1) << totalReads * 1000.0 / totalMs
+             << setw(14) << totalInside
+             << setw(14) << worstMs << endl;
+    }
+
+    removeVault(filename);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        unsigned int seconds = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10;
+        unsigned int blocksPerBatch = (argc > 2) ? strtoul(argv[2], NULL, 0) : 50;
+        unsigned int txsPerBlock = (argc > 3) ? strtoul(argv[3], NULL, 0) : 4;
+        unsigned int readers = (argc > 4) ? strtoul(argv[4], NULL, 0) : 2;
+        string filename = (argc > 5) ? argv[5] : "vaultbench.db";
+
+        if (seconds < 1 || blocksPerBatch < 1 || txsPerBlock < 1 || readers < 1)
+        {
+            cerr << "# Usage: " << argv[0] << " [seconds] [blocks per batch] [txs per block] [readers] [scratch file]" << endl;
+            return -1;
+        }
+
+        cout << left << setw(12) << "profile"
+             << right << setw(10) << "batches" << setw(12) << "batches/s" << setw(12) << "% writing"
+             << setw(10) << "reads" << setw(12) << "reads/s" << setw(14) << "inside write" << setw(14) << "worst read ms" << endl;
+
+        bench(StorageProfile::SAFE, filename, seconds, blocksPerBatch, txsPerBlock, readers);
+        bench(StorageProfile::BALANCED, filename, seconds, blocksPerBatch, txsPerBlock, readers);
+    }
+    catch (const exception& e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return -2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// block tree benchmark program
+//
+// main.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+// Builds the same synthetic header chain in CoinQBlockTreeMem and
+// CoinQBlockTreeCompact and reports heap use, insert time, lookup times and
+// file load time for each.
+//
+
+#include <CoinQ_blocks.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+
+using namespace std;
+
+// Heap accounting. OpenSSL bignum allocations made by BigInt bypass operator new,
+// so the figures for CoinQBlockTreeMem are on the low side.
+static size_t g_heapBytes = 0;
+
+void* operator new(size_t size)
+{
+    size_t* p = (size_t*)malloc(size + sizeof(size_t));
+    if (!p) throw bad_alloc();
+    *p = size;
+    g_heapBytes += size;
+    return p + 1;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (!ptr) return;
+    size_t* p = (size_t*)ptr - 1;
+    g_heapBytes -= *p;
+    free(p);
+}
+
+typedef chrono::steady_clock clock_type;
+
+static double elapsedMs(const clock_type::time_point& start)
+{
+    return chrono::duration<double, milli>(clock_type::now() - start).count();
+}
+
+static vector<Coin::CoinBlockHeader> makeHeaders(unsigned int count)
+{
+    vector<Coin::CoinBlockHeader> headers;
+    headers.reserve(count);
+
+    uchar_vector prevHash(32, 0);
+    uchar_vector merkleRoot(32, 0);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        merkleRoot[0] = i & 0xff; merkleRoot[1] = (i >> 8) & 0xff; merkleRoot[2] = (i >> 16) & 0xff;
+        headers.push_back(Coin::CoinBlockHeader(2, 1231006505 + i * 60, 0x207fffff, i, 0, prevHash, merkleRoot));
+        prevHash = headers.back().hash();
+    }
+    return headers;
+}
+
+template<class Tree>
+static void bench(const string& name, const vector<Coin::CoinBlockHeader>& headers, unsigned int lookups, const string& filename)
+{
+    vector<uchar_vector> hashes;
+    hashes.reserve(lookups);
+    mt19937 rng(1);
+    for (unsigned int i = 0; i < lookups; i++) { hashes.push_back(headers[rng() % headers.size()].hash()); }
+
+    double insertMs, loadMs, hashLookupMs, heightLookupMs, confirmationsMs;
+    size_t heapBytes;
+    long long sum = 0;
+    {
+        size_t heapBefore = g_heapBytes;
+        Tree tree(true, false);
+
+        clock_type::time_point start = clock_type::now();
+        tree.setGenesisBlock(headers[0]);
+        for (size_t i = 1; i < headers.size(); i++) { tree.insertHeader(headers[i], false); }
+        insertMs = elapsedMs(start);
+        heapBytes = g_heapBytes - heapBefore;
+
+        start = clock_type::now();
+        for (auto& hash: hashes) { sum += tree.getHeader(hash).height; }
+        hashLookupMs = elapsedMs(start);
+
+        start = clock_type::now();
+        for (unsigned int i = 0; i < lookups; i++) { sum += tree.getHeader((int)(rng() % headers.size())).timestamp(); }
+        heightLookupMs = elapsedMs(start);
+
+        start = clock_type::now();
+        for (auto& hash: hashes) { sum += tree.getConfirmations(hash); }
+        confirmationsMs = elapsedMs(start);
+
+        tree.flushToFile(filename);
+    }
+    {
+        // Every record is checkpointed, so this measures the trusted load path.
+        Tree tree(true, false);
+        clock_type::time_point start = clock_type::now();
+        tree.loadFromFile(filename, false);
+        loadMs = elapsedMs(start);
+    }
+
+    cout << left << setw(24) << name
+         << right << setw(10) << fixed << setprecision(1) << (double)heapBytes / (1 << 20)
+         << setw(10) << setprecision(0) << (double)heapBytes / headers.size()
+         << setw(12) << insertMs
+         << setw(12) << loadMs
+         << setw(12) << setprecision(3) << hashLookupMs * 1000000 / lookups
+         << setw(12) << heightLookupMs * 1000000 / lookups
+         << setw(12) << confirmationsMs * 1000000 / lookups
+         << "   (" << sum << ")" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        unsigned int count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 500000;
+        unsigned int lookups = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1000000;
+        string filename = (argc > 3) ? argv[3] : "blocktreebench.dat";
+
+        if (count < 2 || lookups < 1)
+        {
+            cerr << "# Usage: " << argv[0] << " [header count] [lookup count] [scratch file]" << endl;
+            return -1;
+        }
+
+        cout << "Generating " << count << " headers..." << endl;
+        vector<Coin::CoinBlockHeader> headers = makeHeaders(count);
+
+        cout << left << setw(24) << "tree"
+             << right << setw(10) << "heap MB" << setw(10) << "B/header"
+             << setw(12) << "insert ms" << setw(12) << "load ms"
+             << setw(12) << "hash ns" << setw(12) << "height ns" << setw(12) << "confs ns" << endl;
+
+        bench<CoinQBlockTreeMem>("CoinQBlockTreeMem", headers, lookups, filename);
+        bench<CoinQBlockTreeCompact>("CoinQBlockTreeCompact", headers, lookups, filename);
+
+        remove(filename.c_str());
+        remove((filename + ".idx").c_str());
+    }
+    catch (const exception& e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return -2;
+    }
+
+    return 0;
+}
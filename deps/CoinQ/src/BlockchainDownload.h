@@ -47,7 +47,7 @@ public:
     void enableCheckProofOfWork(bool bCheckProofOfWork = true) { m_bCheckProofOfWork = bCheckProofOfWork; }
 
     int getBestHeight() const { return m_blockTree.getBestHeight(); }
-    const bytes_t& getBestHash() const { return m_blockTree.getBestHash(); }
+    bytes_t getBestHash() const { return m_blockTree.getBestHash(); }
 
     void start(const std::string& host, const std::string& port = std::string(), const std::vector<uchar_vector>& locatorHashes = std::vector<uchar_vector>(), const uchar_vector& hashStop = uchar_vector(32, 0));
     void start(const std::string& host, int port, const std::vector<uchar_vector>& locatorHashes = std::vector<uchar_vector>(), const uchar_vector& hashStop = uchar_vector(32, 0));
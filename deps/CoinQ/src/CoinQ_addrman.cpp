@@ -0,0 +1,294 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_addrman.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "CoinQ_addrman.h"
+#include "CoinQ_peer_io.h"
+
+#include <logger/logger.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+using namespace CoinQ;
+
+static const char* FILE_HEADER = "# CoinQ peer addresses v1";
+
+// What a peer we know nothing about is taken to manage.
+static const double DEFAULT_PING_MILLISECONDS = 500.0;
+static const double DEFAULT_BYTES_PER_SECOND = 256.0 * 1024.0;
+
+// A failed address is left alone for a minute, doubling with each failure up to a day.
+static const uint32_t RETRY_DELAY = 60; // seconds
+static const uint32_t MAX_RETRY_DELAY = 24 * 60 * 60; // seconds
+
+// New measurements count for this much of the smoothed values.
+static const double SMOOTHING = 0.25;
+
+static uint32_t now() { return (uint32_t)std::time(nullptr); }
+
+static uint64_t smooth(uint64_t value, double sample)
+{
+    return value == 0 ? (uint64_t)sample : (uint64_t)(value * (1.0 - SMOOTHING) + sample * SMOOTHING);
+}
+
+double AddressManager::Entry::cost() const
+{
+    double ping = pingMicroseconds ? pingMicroseconds / 1000.0 : DEFAULT_PING_MILLISECONDS;
+    double rate = bytesPerSecond ? (double)bytesPerSecond : DEFAULT_BYTES_PER_SECOND;
+    return ping + 1000.0 * 1024.0 * 1024.0 / rate;
+}
+
+std::string AddressManager::Entry::name() const
+{
+    return getPeerName(host, port);
+}
+
+void AddressManager::load(const std::string& filename)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_filename = filename;
+
+    std::ifstream file(filename);
+    if (!file) return;
+
+    std::string line;
+    std::size_t count = 0;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+
+        Entry entry;
+        std::istringstream ss(line);
+        if (!(ss >> entry.host >> entry.port >> entry.services >> entry.lastSeen >> entry.lastTry >> entry.lastSuccess >> entry.failures >> entry.pingMicroseconds >> entry.bytesPerSecond))
+        {
+            LOGGER(debug) << "AddressManager::load() - skipping bad line in " << filename << ": " << line << std::endl;
+            continue;
+        }
+        m_entries[entry.name()] = entry;
+        count++;
+    }
+
+    while (m_entries.size() > MAX_ADDRESSES) { evict(); }
+    LOGGER(trace) << "AddressManager::load() - " << count << " addresses from " << filename << std::endl;
+}
+
+void AddressManager::save() const
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    if (m_filename.empty()) return;
+
+    // Written next to the old file and moved over it so a crash leaves one or the other.
+    std::string tmpFilename = m_filename + ".tmp";
+    {
+        std::ofstream file(tmpFilename, std::ios::trunc);
+        if (!file)
+        {
+            LOGGER(error) << "AddressManager::save() - could not open " << tmpFilename << std::endl;
+            return;
+        }
+
+        file << FILE_HEADER << std::endl
+             << "# host port services lastSeen lastTry lastSuccess failures pingMicroseconds bytesPerSecond" << std::endl;
+        for (auto& item: m_entries)
+        {
+            const Entry& e = item.second;
+            file << e.host << " " << e.port << " " << e.services << " " << e.lastSeen << " " << e.lastTry << " " << e.lastSuccess << " "
+                 << e.failures << " " << e.pingMicroseconds << " " << e.bytesPerSecond << std::endl;
+        }
+
+        if (!file)
+        {
+            LOGGER(error) << "AddressManager::save() - could not write " << tmpFilename << std::endl;
+            return;
+        }
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmpFilename, m_filename, ec);
+    if (ec) { LOGGER(error) << "AddressManager::save() - could not replace " << m_filename << ": " << ec.message() << std::endl; }
+}
+
+void AddressManager::add(const std::string& host, const std::string& port, uint64_t services, uint32_t lastSeen)
+{
+    if (host.empty() || port.empty() || host.find_first_of(" \t\r\n") != std::string::npos) return;
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    std::string name = getPeerName(host, port);
+    Entry& entry = m_entries[name];
+    if (entry.host.empty())
+    {
+        entry.host = host;
+        entry.port = port;
+    }
+    entry.services |= services;
+    entry.lastSeen = std::max(entry.lastSeen, std::min(lastSeen, now()));
+
+    if (m_entries.size() > MAX_ADDRESSES) { evict(name); }
+}
+
+void AddressManager::add(const Coin::AddrMessage& addr)
+{
+    for (auto& netAddr: addr.addrList)
+    {
+        if (netAddr.port == 0) continue;
+
+        std::stringstream port;
+        port << netAddr.port;
+        add(netAddr.ipv6.toStringAuto(), port.str(), netAddr.services, netAddr.hasTime ? netAddr.time : 0);
+    }
+}
+
+void AddressManager::markAttempt(const std::string& name)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it != m_entries.end()) { it->second.lastTry = now(); }
+}
+
+void AddressManager::markConnected(const std::string& name)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) return;
+
+    it->second.lastSeen = it->second.lastSuccess = now();
+    it->second.failures = 0;
+}
+
+void AddressManager::markFailed(const std::string& name)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it != m_entries.end()) { it->second.failures++; }
+}
+
+void AddressManager::updatePing(const std::string& name, uint64_t pingMicroseconds)
+{
+    if (pingMicroseconds == 0) return;
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it != m_entries.end()) { it->second.pingMicroseconds = std::max<uint64_t>(smooth(it->second.pingMicroseconds, (double)pingMicroseconds), 1); }
+}
+
+void AddressManager::updateThroughput(const std::string& name, uint64_t bytes, double seconds)
+{
+    if (bytes == 0 || seconds <= 0.0) return;
+
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it != m_entries.end()) { it->second.bytesPerSecond = std::max<uint64_t>(smooth(it->second.bytesPerSecond, bytes / seconds), 1); }
+}
+
+std::vector<AddressManager::Entry> AddressManager::select(std::size_t count, const std::set<std::string>& exclude) const
+{
+    std::vector<Entry> measured;
+    std::vector<Entry> unmeasured;
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        uint32_t t = now();
+        for (auto& item: m_entries)
+        {
+            const Entry& entry = item.second;
+            if (exclude.count(item.first)) continue;
+            if (entry.failures > 0)
+            {
+                uint32_t delay = entry.failures > 10 ? MAX_RETRY_DELAY : std::min(RETRY_DELAY << entry.failures, MAX_RETRY_DELAY);
+                if (t - entry.lastTry < delay) continue;
+            }
+            (entry.isMeasured() ? measured : unmeasured).push_back(entry);
+        }
+    }
+
+    std::sort(measured.begin(), measured.end(), [](const Entry& a, const Entry& b) { return a.cost() < b.cost(); });
+
+    // Of the ones we know nothing about, those we got through to before go first, then the ones
+    // heard of most recently.
+    std::sort(unmeasured.begin(), unmeasured.end(), [](const Entry& a, const Entry& b) {
+        if ((a.lastSuccess != 0) != (b.lastSuccess != 0)) return a.lastSuccess != 0;
+        return a.lastSeen > b.lastSeen;
+    });
+
+    std::size_t explore = (count > 1 && !unmeasured.empty()) ? 1 : 0;
+    std::vector<Entry> selected(measured.begin(), measured.begin() + std::min(measured.size(), count - explore));
+    for (auto& entry: unmeasured)
+    {
+        if (selected.size() >= count) break;
+        selected.push_back(entry);
+    }
+    return selected;
+}
+
+bool AddressManager::selectReplacement(const std::vector<std::string>& picked, const std::set<std::string>& exclude, Entry& slowest, Entry& replacement) const
+{
+    Entry worst;
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        for (auto& name: picked)
+        {
+            auto it = m_entries.find(name);
+            if (it == m_entries.end() || !it->second.isMeasured()) continue;
+            if (worst.host.empty() || it->second.cost() > worst.cost()) { worst = it->second; }
+        }
+    }
+    if (worst.host.empty()) return false;
+
+    std::vector<Entry> candidates = select(1, exclude);
+    if (candidates.empty() || candidates.front().cost() * 2 >= worst.cost()) return false;
+
+    slowest = worst;
+    replacement = candidates.front();
+    return true;
+}
+
+bool AddressManager::getEntry(const std::string& name, Entry& entry) const
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) return false;
+
+    entry = it->second;
+    return true;
+}
+
+std::size_t AddressManager::size() const
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+void AddressManager::evict(const std::string& keep)
+{
+    // The address heard of longest ago that we never got through to, or failing that the one
+    // heard of longest ago.
+    auto victim = m_entries.end();
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        if (it->first == keep) continue;
+        if (victim == m_entries.end()) { victim = it; continue; }
+
+        bool bItTried = it->second.lastSuccess != 0;
+        bool bVictimTried = victim->second.lastSuccess != 0;
+        if (bItTried != bVictimTried)
+        {
+            if (!bItTried) { victim = it; }
+        }
+        else if (it->second.lastSeen < victim->second.lastSeen)
+        {
+            victim = it;
+        }
+    }
+
+    if (victim != m_entries.end()) { m_entries.erase(victim); }
+}
@@ -0,0 +1,92 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_addrman.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include <CoinCore/CoinNodeData.h>
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace CoinQ {
+
+// Peer addresses we know of and how fast each one was the last times we used it, kept in a text
+// file between runs. Addresses are keyed by host:port with IPv6 hosts in brackets, the same as
+// Peer::name().
+//
+// Thread safe.
+class AddressManager
+{
+public:
+    struct Entry
+    {
+        Entry() : services(0), lastSeen(0), lastTry(0), lastSuccess(0), failures(0), pingMicroseconds(0), bytesPerSecond(0) { }
+
+        std::string host;
+        std::string port;
+        uint64_t services;
+        uint32_t lastSeen;              // unix times, 0 if never
+        uint32_t lastTry;
+        uint32_t lastSuccess;           // last connection that got through the handshake
+        uint32_t failures;              // connection attempts in a row that did not
+        uint64_t pingMicroseconds;      // smoothed, 0 if not measured
+        uint64_t bytesPerSecond;        // smoothed download rate while busy, 0 if not measured
+
+        std::string name() const;
+        bool isMeasured() const { return pingMicroseconds != 0 || bytesPerSecond != 0; }
+
+        // Expected milliseconds to get a megabyte from the peer. What is not measured yet is taken
+        // to be middling.
+        double cost() const;
+    };
+
+    enum { MAX_ADDRESSES = 2000 };
+
+    // Reads the file if there is one. save() writes back to it.
+    void load(const std::string& filename);
+    void save() const;
+    const std::string& getFilename() const { return m_filename; }
+
+    void add(const std::string& host, const std::string& port, uint64_t services = 0, uint32_t lastSeen = 0);
+    void add(const Coin::AddrMessage& addr);
+
+    void markAttempt(const std::string& name);
+    void markConnected(const std::string& name);
+    void markFailed(const std::string& name);
+    void updatePing(const std::string& name, uint64_t pingMicroseconds);
+    void updateThroughput(const std::string& name, uint64_t bytes, double seconds);
+
+    // Up to count addresses to connect to, cheapest first. Addresses that failed lately are left
+    // out for a while. When asked for more than one, the last one is an address we have not
+    // measured yet if there is any, so better peers keep turning up.
+    std::vector<Entry> select(std::size_t count, const std::set<std::string>& exclude = std::set<std::string>()) const;
+
+    // The slowest measured address among picked and the address select() would take in its
+    // place, if that one looks at least twice as fast. False if there is nothing worth swapping.
+    bool selectReplacement(const std::vector<std::string>& picked, const std::set<std::string>& exclude, Entry& slowest, Entry& replacement) const;
+
+    bool getEntry(const std::string& name, Entry& entry) const;
+    std::size_t size() const;
+
+private:
+    mutable boost::mutex m_mutex;
+    std::string m_filename;
+    std::map<std::string, Entry> m_entries;
+
+    // Never evicts keep, so an address that was just added stays.
+    void evict(const std::string& keep = std::string());
+};
+
+}
@@ -10,13 +10,140 @@
 //
 
 #include "CoinQ_blocks.h"
+#include "CoinQ_parallel.h"
 #include "poc.h"
 
+#include <CoinCore/shabal256.h>
+
 #include <logger/logger.h>
+#include <algorithm>
 #include <functional>
 
 using namespace CoinQ;
 
+static bool verifyPowHeader(const Coin::CoinBlockHeader& header)
+{
+    if (BigInt(header.getPOWHashLittleEndian()) > header.getTarget())
+        throw std::runtime_error("Header hash is too big.");
+    return true;
+}
+
+static bool verifyPocHeader(const ChainHeader& parent, const Coin::CoinBlockHeader& header, poc::FGetPrevBlock getPrevHeader, const poc::BaseTargetWindow& window, bool bWorkPrechecked = false)
+{
+    int blockHeight = parent.height+1;
+    if(blockHeight >= BCO_FORK_BLOCK_HEIGHT) 
+    {
+        //auto start = std::clock();
+        bool bValid = bWorkPrechecked ? poc::VerifyBaseTarget(parent, header, getPrevHeader, &window) : poc::VerifyGenerationSignature(parent, header, getPrevHeader, &window);
+        if (!bValid) {
+            LOGGER(debug) << header.toString() << ",Height:" << blockHeight << "\n";
+            throw std::runtime_error("Poc header check invalid.");
+        }
+        //LOGGER(trace) << "Height:" << blockHeight <<" use " << (std::clock() - start) << "\n";
+
+        return true;
+    }
+    else if(blockHeight >= 0) 
+    {
+        return bWorkPrechecked || verifyPowHeader(header);
+    }
+    throw std::runtime_error("block height invalid");
+}
+
+// What verifyPocHeader() and verifyPowHeader() check without looking further back than the
+// parent, run by CoinQHeaderStore::load() on its worker threads. The parent is built from
+// fields only since the thread checking it may be hashing it.
+static void precheckHeader(const Coin::CoinBlockHeader& parent, const Coin::CoinBlockHeader& header, int height)
+{
+    if (header.IsBcoHeader() && height >= BCO_FORK_BLOCK_HEIGHT)
+    {
+        ChainHeader prev(parent.version(), parent.timestamp(), parent.bits(), parent.nonce(), parent.plotseed(), parent.prevBlockHash(), parent.merkleRoot(), false, height - 1);
+        if (!poc::VerifyDeadline(prev, header)) throw std::runtime_error("Poc header check invalid.");
+    }
+    else
+    {
+        verifyPowHeader(header);
+    }
+}
+
+std::size_t precheckHeaders(const ChainHeader& parent, const std::vector<Coin::CoinBlockHeader>& headers, std::exception_ptr& error, unsigned int threads)
+{
+    // Each task checks as many headers as poc::VerifyDeadlines() hashes side by side.
+    const std::size_t count = headers.size();
+    const std::size_t chunk = Shabal256Lanes();
+    std::vector<std::exception_ptr> errors(count);
+
+    CoinQ::parallelFor((count + chunk - 1) / chunk, threads, [&](std::size_t c) {
+        std::size_t begin = c * chunk;
+        std::size_t end = std::min(begin + chunk, count);
+
+        // Only this task hashes headers[begin - 1] through headers[end - 2].
+        std::vector<ChainHeader> prevs;
+        prevs.reserve(end - begin);
+        std::vector<const ChainHeader*> pocPrevs;
+        std::vector<const Coin::CoinBlockHeader*> pocHeaders;
+        std::vector<std::size_t> pocIndices;
+        for (std::size_t i = begin; i < end; i++)
+        {
+            try
+            {
+                const Coin::CoinBlockHeader& header = headers[i];
+                int height = parent.height + 1 + (int)i;
+                if (header.prevBlockHash() != (i == 0 ? parent.hash() : headers[i - 1].hash())) throw std::runtime_error("Parent not found.");
+
+                if (header.IsBcoHeader() && height >= BCO_FORK_BLOCK_HEIGHT)
+                {
+                    if (i == 0)
+                    {
+                        pocPrevs.push_back(&parent);
+                    }
+                    else
+                    {
+                        const Coin::CoinBlockHeader& p = headers[i - 1];
+                        prevs.push_back(ChainHeader(p.version(), p.timestamp(), p.bits(), p.nonce(), p.plotseed(), p.prevBlockHash(), p.merkleRoot(), false, height - 1));
+                        pocPrevs.push_back(&prevs.back());
+                    }
+                    pocHeaders.push_back(&header);
+                    pocIndices.push_back(i);
+                }
+                else
+                {
+                    verifyPowHeader(header);
+                }
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+
+        if (pocHeaders.empty()) return;
+        try
+        {
+            std::vector<bool> valid = poc::VerifyDeadlines(pocPrevs, pocHeaders);
+            for (std::size_t k = 0; k < valid.size(); k++)
+            {
+                if (!valid[k]) { errors[pocIndices[k]] = std::make_exception_ptr(std::runtime_error("Poc header check invalid.")); }
+            }
+        }
+        catch (...)
+        {
+            for (std::size_t i: pocIndices) { errors[i] = std::current_exception(); }
+        }
+    }, 1);
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (errors[i])
+        {
+            error = errors[i];
+            return i;
+        }
+    }
+    error = nullptr;
+    return count;
+}
+
 bool CoinQBlockTreeMem::setBestChain(ChainHeader& header)
 {
     if (header.inBestChain) return false;
@@ -27,7 +154,7 @@ bool CoinQBlockTreeMem::setBestChain(ChainHeader& header)
     while (!pParent->inBestChain)
     {
         newBestChain.push(pParent);
-        pParent = &mHeaderHashMap.at(pParent->prevBlockHash());
+        pParent = &mHeaderHashMap.at(Coin::hash256_t(pParent->prevBlockHash()));
     }
 
     for (auto it = pParent->childHashes.begin(); it != pParent->childHashes.end(); ++it)
@@ -50,7 +177,9 @@ bool CoinQBlockTreeMem::setBestChain(ChainHeader& header)
     {
         ChainHeader* pChild = newBestChain.top();
         pChild->inBestChain = true;
+        if (mHeaderHeightMap.size() <= (std::size_t)pChild->height) mHeaderHeightMap.resize(pChild->height + 1);
         mHeaderHeightMap[pChild->height] = pChild;
+        mBaseTargetWindow.push(pChild->height, pChild->bits(), pChild->timestamp());
         if (count == 0) notifyReorg(*pChild);
         notifyAddBestChain(*pChild);
         newBestChain.pop();
@@ -67,14 +196,17 @@ bool CoinQBlockTreeMem::unsetBestChain(ChainHeader& header)
     if (!header.inBestChain) return false;
 
     if (header.height == 0) throw std::runtime_error("Cannot remove genesis block from best chain.");
+    if (header.height < mSyncedCount) mSyncedCount = header.height;
+    mBaseTargetWindow.truncate(header.height - 1);
 
-    ChainHeader* pParent = &mHeaderHashMap.at(header.prevBlockHash());
+    ChainHeader* pParent = &mHeaderHashMap.at(Coin::hash256_t(header.prevBlockHash()));
     if (pParent->inBestChain)
     {
         mBestHeight = pParent->height;
         mTotalWork = pParent->chainWork;
     }
     header.inBestChain = false;
+    mHeaderHeightMap.resize(header.height);
     notifyRemoveBestChain(header);
 
     pParent = &header;
@@ -86,7 +218,6 @@ bool CoinQBlockTreeMem::unsetBestChain(ChainHeader& header)
             if (pChild->inBestChain)
             {
                 pParent = pChild;
-                mHeaderHeightMap.erase(pChild->height);
                 pChild->inBestChain = false;
                 notifyRemoveBestChain(*pChild);
                 break;
@@ -102,63 +233,68 @@ void CoinQBlockTreeMem::setGenesisBlock(const Coin::CoinBlockHeader& header)
     if (mHeaderHashMap.size() != 0) throw std::runtime_error("Tree is not empty.");
 
     bFlushed = false;
-    uchar_vector hash = header.hash();
-    ChainHeader& genesisHeader = mHeaderHashMap[hash] = header;
-    mHeaderHeightMap[0] = &genesisHeader;
+    ChainHeader& genesisHeader = mHeaderHashMap[Coin::hash256_t(header.hash())] = header;
+    mHeaderHeightMap.assign(1, &genesisHeader);
     genesisHeader.height = 0;
     genesisHeader.inBestChain = true;
     genesisHeader.chainWork = genesisHeader.getWork();
     mBestHeight = 0;
     mTotalWork = genesisHeader.chainWork;
     pHead = &genesisHeader;
+    mBaseTargetWindow.push(0, genesisHeader.bits(), genesisHeader.timestamp());
     notifyInsert(header);
     notifyAddBestChain(header);
 }
 
 bool CoinQBlockTreeMem::checkPowHeader(const Coin::CoinBlockHeader& header)
 {
-    if (BigInt(header.getPOWHashLittleEndian()) > header.getTarget())
-        throw std::runtime_error("Header hash is too big.");
-    return true;
+    return verifyPowHeader(header);
 }
 
-bool CoinQBlockTreeMem::checkPocHeader(const ChainHeader& parent, const Coin::CoinBlockHeader& header)
+bool CoinQBlockTreeMem::checkPocHeader(const ChainHeader& parent, const Coin::CoinBlockHeader& header, bool bWorkPrechecked)
 {
-    int blockHeight = parent.height+1;
-    if(blockHeight >= BCO_FORK_BLOCK_HEIGHT) 
-    {
-        //auto start = std::clock();
-        if (!poc::VerifyGenerationSignature(parent, header, std::bind(&CoinQBlockTreeMem::getPrevHeader, this, std::placeholders::_1))) {
-            LOGGER(debug) << header.toString() << ",Height:" << blockHeight << "\n";
-            throw std::runtime_error("Poc header check invalid.");
-        }
-        //LOGGER(trace) << "Height:" << blockHeight <<" use " << (std::clock() - start) << "\n";
-
-        return true;
-    }
-    else if(blockHeight >= 0) 
-    {
-        return checkPowHeader(header);
-    }
-    throw std::runtime_error("block height invalid");
+    return verifyPocHeader(parent, header, std::bind(&CoinQBlockTreeMem::getPrevHeader, this, std::placeholders::_1), mBaseTargetWindow, bWorkPrechecked);
 }
 
 const ChainHeader* CoinQBlockTreeMem::getPrevHeader(const uchar_vector& hash)
 {
-    header_hash_map_t::iterator it = mHeaderHashMap.find(hash);
+    header_hash_map_t::iterator it = findHeader(hash);
     if (it == mHeaderHashMap.end()) return nullptr;
 
     return &it->second;
 }
 
+CoinQBlockTreeMem::header_hash_map_t::iterator CoinQBlockTreeMem::findHeader(const uchar_vector& hash)
+{
+    if (hash.size() != Coin::hash256_t::SIZE) return mHeaderHashMap.end();
+    return mHeaderHashMap.find(Coin::hash256_t(hash));
+}
+
+CoinQBlockTreeMem::header_hash_map_t::const_iterator CoinQBlockTreeMem::findHeader(const uchar_vector& hash) const
+{
+    if (hash.size() != Coin::hash256_t::SIZE) return mHeaderHashMap.end();
+    return mHeaderHashMap.find(Coin::hash256_t(hash));
+}
+
 bool CoinQBlockTreeMem::insertHeader(const Coin::CoinBlockHeader& header, bool bCheckProofOfWork, bool bReplaceTip, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler)
 {
     if (mHeaderHashMap.size() == 0) throw std::runtime_error("No genesis block.");
 
-    uchar_vector headerHash = header.hash();
-    if (hasHeader(headerHash)) return false;
+    return addHeader(header, Coin::hash256_t(header.hash()), bCheckProofOfWork, bReplaceTip, notifyHandler);
+}
 
-    header_hash_map_t::iterator it = mHeaderHashMap.find(header.prevBlockHash());
+bool CoinQBlockTreeMem::insertPrecheckedHeader(const Coin::CoinBlockHeader& header, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler)
+{
+    if (mHeaderHashMap.size() == 0) throw std::runtime_error("No genesis block.");
+
+    return addHeader(header, Coin::hash256_t(header.hash()), true, false, notifyHandler, true);
+}
+
+bool CoinQBlockTreeMem::addHeader(const Coin::CoinBlockHeader& header, const Coin::hash256_t& headerKey, bool bCheckProofOfWork, bool bReplaceTip, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler, bool bWorkPrechecked)
+{
+    if (mHeaderHashMap.count(headerKey)) return false;
+
+    header_hash_map_t::iterator it = findHeader(header.prevBlockHash());
     if (it == mHeaderHashMap.end()) throw std::runtime_error("Parent not found.");
 
     ChainHeader& parent = it->second;
@@ -174,17 +310,17 @@ bool CoinQBlockTreeMem::insertHeader(const Coin::CoinBlockHeader& header, bool b
     if (bCheckProofOfWork)
     {
         if (header.IsBcoHeader()) { 
-            if (!checkPocHeader(parent,header)) return false;
+            if (!checkPocHeader(parent, header, bWorkPrechecked)) return false;
         }
-        else { //bitcoin
+        else if (!bWorkPrechecked) { //bitcoin
             if (!checkPowHeader(header)) return false;
         }
     }
 
-    ChainHeader& chainHeader = mHeaderHashMap[headerHash] = header;
+    ChainHeader& chainHeader = mHeaderHashMap[headerKey] = header;
     chainHeader.height = parent.height + 1;
     chainHeader.chainWork = parent.chainWork + chainHeader.getWork();
-    parent.childHashes.insert(headerHash);
+    parent.childHashes.push_back(headerKey);
     notifyInsert(chainHeader);
 
     if (!header.IsBcoHeader()) {
@@ -195,7 +331,11 @@ bool CoinQBlockTreeMem::insertHeader(const Coin::CoinBlockHeader& header, bool b
         setBestChain(chainHeader);
     }
 
-    if (notifyHandler) notifyHandler(header.IsBcoHeader() ? chainHeader.height : 0, headerHash);
+    if (notifyHandler)
+    {
+        uchar_vector headerHash = headerKey.getBytes();
+        notifyHandler(header.IsBcoHeader() ? chainHeader.height : 0, headerHash);
+    }
 
     bFlushed = false;
     return true;
@@ -203,58 +343,58 @@ bool CoinQBlockTreeMem::insertHeader(const Coin::CoinBlockHeader& header, bool b
 
 bool CoinQBlockTreeMem::deleteHeader(const uchar_vector& hash)
 {
-    header_hash_map_t::iterator it = mHeaderHashMap.find(hash);
+    header_hash_map_t::iterator it = findHeader(hash);
     if (it == mHeaderHashMap.end()) return false;
 
+    return deleteHeader(it);
+}
+
+bool CoinQBlockTreeMem::deleteHeader(header_hash_map_t::iterator it)
+{
     ChainHeader& header = it->second;
     unsetBestChain(header);
-    header_hash_map_t::iterator itParent = mHeaderHashMap.find(header.hash());
+    header_hash_map_t::iterator itParent = findHeader(header.prevBlockHash());
     if (itParent == mHeaderHashMap.end()) throw std::runtime_error("Critical error: parent for block not found.");
 
-    // Recurse through children
-    for (auto itChild = header.childHashes.begin(); itChild != header.childHashes.end(); ++itChild) { deleteHeader(*itChild); }
+    // Recurse through children. Each call unlinks the child from header.childHashes, so iterate over a copy.
+    std::vector<Coin::hash256_t> childHashes(header.childHashes);
+    for (auto& childHash: childHashes) { deleteHeader(mHeaderHashMap.find(childHash)); }
 
     // TODO: Find new best chain if this header was in best chain.
 
     // Remove header
-    ChainHeader& parent = itParent->second;
-    unsigned int nErased = parent.childHashes.erase(hash);
-    assert(nErased == 1);
+    std::vector<Coin::hash256_t>& siblingHashes = itParent->second.childHashes;
+    auto itSelf = std::find(siblingHashes.begin(), siblingHashes.end(), it->first);
+    assert(itSelf != siblingHashes.end());
+    siblingHashes.erase(itSelf);
     notifyDelete(header);
-    mHeaderHashMap.erase(hash);
+    mHeaderHashMap.erase(it);
     bFlushed = false;
     return true;
 }
 
 bool CoinQBlockTreeMem::hasHeader(const uchar_vector& hash) const
 {
-    return (mHeaderHashMap.find(hash) != mHeaderHashMap.end());
+    return (findHeader(hash) != mHeaderHashMap.end());
 }
 
-const ChainHeader& CoinQBlockTreeMem::getHeader(const uchar_vector& hash) const
+ChainHeader CoinQBlockTreeMem::getHeader(const uchar_vector& hash) const
 {
-    header_hash_map_t::const_iterator it = mHeaderHashMap.find(hash);
+    header_hash_map_t::const_iterator it = findHeader(hash);
     if (it == mHeaderHashMap.end()) throw std::runtime_error("Not found.");
 
     return it->second;
 }
 
-const ChainHeader& CoinQBlockTreeMem::getHeader(int height) const
+ChainHeader CoinQBlockTreeMem::getHeader(int height) const
 {
-    if (mHeaderHeightMap.size() > 0)
-    {
-        if (height < 0) height += mBestHeight + 1;
-        if (height >= 0)
-        {
-            header_height_map_t::const_iterator it = mHeaderHeightMap.find((unsigned int)height);
-            if (it != mHeaderHeightMap.end()) return *it->second;
-        }
-    }
+    if (height < 0) height += mBestHeight + 1;
+    if (height >= 0 && (std::size_t)height < mHeaderHeightMap.size()) return *mHeaderHeightMap[height];
 
     throw std::runtime_error("Not found.");
 }
 
-const ChainHeader& CoinQBlockTreeMem::getTip() const
+ChainHeader CoinQBlockTreeMem::getTip() const
 {
     if (!pHead) throw std::runtime_error("Tree is empty.");
 
@@ -268,18 +408,18 @@ int CoinQBlockTreeMem::getTipHeight() const
     return pHead->height;
 }
 
-const ChainHeader& CoinQBlockTreeMem::getHeaderBefore(uint32_t timestamp) const
+ChainHeader CoinQBlockTreeMem::getHeaderBefore(uint32_t timestamp) const
 {
     if (mBestHeight == -1) throw std::runtime_error("Tree is empty.");
 
     int i;
     for (i = 1; i <= mBestHeight; i++)
     {
-        ChainHeader* header = mHeaderHeightMap.at(i);
+        ChainHeader* header = mHeaderHeightMap[i];
         if (header->timestamp() > timestamp) break; 
     }
 
-    return *mHeaderHeightMap.at(i - 1);
+    return *mHeaderHeightMap[i - 1];
 }
 
 std::vector<uchar_vector> CoinQBlockTreeMem::getLocatorHashes(int maxSize = -1) const
@@ -299,133 +439,637 @@ std::vector<uchar_vector> CoinQBlockTreeMem::getLocatorHashes(int maxSize = -1)
     int step = 1;
     while ((i >= 0) && (n < maxSize))
     {
-        locatorHashes.push_back(mHeaderHeightMap.at(i)->hash());
+        locatorHashes.push_back(mHeaderHeightMap[i]->hash());
+        if (i == 0) return locatorHashes;
         i -= step;
         n++;
         if (n > 10) step *= 2;
     }
+
+    // The steps can jump past genesis, which any peer on the same network has in common with us.
+    if (n < maxSize) locatorHashes.push_back(mHeaderHeightMap[0]->hash());
     return locatorHashes;
 }
 
 int CoinQBlockTreeMem::getConfirmations(const uchar_vector& hash) const
 {
-    header_hash_map_t::const_iterator it = mHeaderHashMap.find(hash);
+    header_hash_map_t::const_iterator it = findHeader(hash);
     if (it == mHeaderHashMap.end() || !it->second.inBestChain) return 0;
 
     return mBestHeight - it->second.height + 1;
 }
 
-void CoinQBlockTreeMem::loadFromFile(const std::string& filename, bool bCheckProofOfWork, CoinQBlockTreeMem::callback_t callback)
+void CoinQBlockTreeMem::loadFromFile(const std::string& filename, bool bCheckProofOfWork, CoinQBlockTreeMem::callback_t callback, unsigned int threads)
 {
-    boost::filesystem::path p(filename);
-    if (!boost::filesystem::exists(p)) throw BlockTreeFileNotFoundException();
+    unsigned int count = 0;
+    mStore.load(filename, [&](std::size_t records) {
+        clear();
+        mHeaderHashMap.reserve(records);
+        mHeaderHeightMap.reserve(records);
+    }, [&](const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, CoinQHeaderStore::RecordStatus status) {
+        if (mBestHeight >= 0)
+        {
+            addHeader(header, hash, bCheckProofOfWork && status != CoinQHeaderStore::VERIFIED, false, nullptr, status == CoinQHeaderStore::CHECKED);
+            if (count % 10000 == 0)
+            {
+                if (callback && !callback(*this)) throw BlockTreeLoadInterruptedException();
+                // LOGGER(debug) << "CoinQBlockTreeMem::loadFromFile() - header hash: " << header.hash().getHex() << " height: " << count << std::endl;
+            }
+            count++;
+        }
+        else
+        { 
+            setGenesisBlock(header);
+            if (callback && !callback(*this)) throw BlockTreeLoadInterruptedException();
+            LOGGER(debug) << "CoinQBlockTreeMem::loadFromFile() - genesis hash: " << header.hash().getHex() << std::endl;
+            count++;
+        }
+    }, bCheckProofOfWork ? CoinQHeaderStore::check_slot_t(precheckHeader) : nullptr, threads);
 
-    if (!boost::filesystem::is_regular_file(p)) throw BlockTreeInvalidFileTypeException();
+    mSyncedCount = std::min(mStore.getCount(), mBestHeight + 1);
+    bFlushed = (mSyncedCount == mBestHeight + 1);
 
-    const unsigned int RECORD_SIZE = MIN_BCO_BLOCK_HEADER_SIZE + 4;
-    if (boost::filesystem::file_size(p) % RECORD_SIZE != 0) throw BlockTreeInvalidFileLengthException();
+    if (callback) callback(*this); // No need to interrupt since we're done.
+}
 
-#ifndef _WIN32
-    std::ifstream fs(p.native(), std::ios::binary);
-#else
-    std::ifstream fs(filename, std::ios::binary);
-#endif
-    if (!fs.good()) throw BlockTreeFailedToOpenFileForReadException();
+void CoinQBlockTreeMem::flushToFile(const std::string& filename)
+{
+    if (mBestHeight == -1) throw std::runtime_error("Tree is empty.");
 
-    clear();
-    uchar_vector headerBytes;
-    uchar_vector hash;
-    Coin::CoinBlockHeader header;
+    if (mStore.getFilename() != filename)
+    {
+        mStore.open(filename);
+        mSyncedCount = 0;
+    }
 
-    unsigned int count = 0;
+    mStore.write(mSyncedCount, mBestHeight + 1, [&](int height, uchar_vector& headerBytes, Coin::hash256_t& hash) {
+        ChainHeader* pHeader = mHeaderHeightMap[height];
+        pHeader->serializeTo(headerBytes);
+        hash = Coin::hash256_t(pHeader->hash());
+    });
+    mSyncedCount = mBestHeight + 1;
 
-    char buf[RECORD_SIZE * 64];
-    while (fs)
+    bFlushed = true;
+}
+
+// Same value as CoinBlockHeader::getWork(), 2^256 / (target + 1), without the BigInt round trips.
+static arith_uint256 getHeaderWork(const Coin::CoinBlockHeader& header)
+{
+    uint32_t nExp = header.bits() >> 24;
+    uint32_t nMantissa = header.bits() & 0x007fffff;
+    arith_uint256 target;
+    if (nExp <= 3)
+    {
+        target = nMantissa >> 8*(3 - nExp);
+    }
+    else
     {
-        fs.read(buf, RECORD_SIZE * 64);
-        if (fs.bad()) throw BlockTreeFileReadFailureException();
+        // Targets of 2^256 and up get no work.
+        uint64_t targetBits = 8*(uint64_t)(nExp - 3);
+        for (uint32_t m = nMantissa; m; m >>= 1) targetBits++;
+        if (targetBits > 256) return 0;
 
-        unsigned int nbytesread = fs.gcount();
-        unsigned int pos = 0;
-        for (; pos <= nbytesread - RECORD_SIZE; pos += RECORD_SIZE)
-        {
-            headerBytes.assign((unsigned char*)&buf[pos], (unsigned char*)&buf[pos + MIN_BCO_BLOCK_HEADER_SIZE]);
-            header.setSerialized(headerBytes);
-            hash = header.hash();
-            if (memcmp(&buf[pos + MIN_BCO_BLOCK_HEADER_SIZE], &hash[0], 4)) throw BlockTreeChecksumErrorException();
+        target = nMantissa;
+        target <<= 8*(nExp - 3);
+    }
 
-            try
-            {
-                if (mBestHeight >= 0)
-                {
-                    insertHeader(header, bCheckProofOfWork);
-                    if (count % 10000 == 0)
-                    {
-                        if (callback && !callback(*this)) throw BlockTreeLoadInterruptedException();
-                        // LOGGER(debug) << "CoinQBlockTreeMem::loadFromFile() - header hash: " << header.hash().getHex() << " height: " << count << std::endl;
-                    }
-                    count++;
-                }
-                else
-                { 
-                    setGenesisBlock(header);
-                    if (callback && !callback(*this)) throw BlockTreeLoadInterruptedException();
-                    LOGGER(debug) << "CoinQBlockTreeMem::loadFromFile() - genesis hash: " << header.hash().getHex() << std::endl;
-                    count++;
-                }
-            }
-            catch (const BlockTreeException& e)
-            {
-                throw e;
-            }
-            catch (const std::exception& e)
-            {
-                throw std::runtime_error(std::string("Block ") + hash.getHex() + ": " + e.what());
-            }
+    if (target == 0) return 0;
+    if (~target == 0) return 1;
+    return (~target / (target + 1)) + 1;
+}
+
+static BigInt toBigInt(const arith_uint256& n)
+{
+    btc_uint256 bytes = ArithToUint256(n);
+    return BigInt(bytes_t(bytes.begin(), bytes.end()), true); // little endian
+}
+
+const uint32_t CoinQBlockTreeCompact::EMPTY_SLOT;
+
+int CoinQBlockTreeCompact::findHeight(const Coin::hash256_t& hash) const
+{
+    if (mHashIndex.empty()) return -1;
+
+    std::size_t mask = mHashIndex.size() - 1;
+    for (std::size_t i = Coin::FixedHashHasher<32>()(hash) & mask;; i = (i + 1) & mask)
+    {
+        uint32_t height = mHashIndex[i];
+        if (height == EMPTY_SLOT) return -1;
+        if (mChain[height].hash == hash) return (int)height;
+    }
+}
+
+void CoinQBlockTreeCompact::indexHeight(uint32_t height)
+{
+    std::size_t mask = mHashIndex.size() - 1;
+    std::size_t i = Coin::FixedHashHasher<32>()(mChain[height].hash) & mask;
+    while (mHashIndex[i] != EMPTY_SLOT) { i = (i + 1) & mask; }
+    mHashIndex[i] = height;
+}
+
+void CoinQBlockTreeCompact::unindexHeight(uint32_t height)
+{
+    Coin::FixedHashHasher<32> hasher;
+    std::size_t mask = mHashIndex.size() - 1;
+    std::size_t i = hasher(mChain[height].hash) & mask;
+    while (mHashIndex[i] != height) { i = (i + 1) & mask; }
+
+    // Pull later entries of the probe run back into the hole so lookups don't stop short.
+    std::size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (mHashIndex[j] == EMPTY_SLOT) break;
+
+        std::size_t k = hasher(mChain[mHashIndex[j]].hash) & mask;
+        if ((i < j) ? (k <= i || k > j) : (k <= i && k > j))
+        {
+            mHashIndex[i] = mHashIndex[j];
+            i = j;
         }
+    }
+    mHashIndex[i] = EMPTY_SLOT;
+}
+
+void CoinQBlockTreeCompact::reserve(std::size_t count)
+{
+    mChain.reserve(count);
+
+    // Keep the load factor at or under one half so probe runs stay short.
+    std::size_t slots = 1024;
+    while (slots < count * 2) { slots <<= 1; }
+    if (slots <= mHashIndex.size()) return;
+
+    mHashIndex.assign(slots, EMPTY_SLOT);
+    for (uint32_t height = 0; height < mChain.size(); height++) { indexHeight(height); }
+}
+
+void CoinQBlockTreeCompact::pushBestChain(const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, const arith_uint256& chainWork)
+{
+    if ((mChain.size() + 1) * 2 > mHashIndex.size()) reserve(mChain.size() * 2 + 1);
+
+    PackedHeader packed;
+    packed.hash = hash;
+    packed.merkleRoot = Coin::hash256_t(header.merkleRoot());
+    packed.chainWork = chainWork;
+    packed.bits = header.bits();
+    packed.nonce = header.nonce();
+    packed.plotseed = header.plotseed();
+    packed.version = header.version();
+    packed.timestamp = header.timestamp();
+    mChain.push_back(packed);
+    indexHeight(mChain.size() - 1);
+    mBaseTargetWindow.push(mChain.size() - 1, packed.bits, packed.timestamp);
+}
 
-        if (pos != nbytesread) throw BlockTreeUnexpectedEndOfFileException();
+void CoinQBlockTreeCompact::popBestChain()
+{
+    int height = mChain.size() - 1;
+    if (height < mSyncedCount) mSyncedCount = height;
+    unindexHeight(height);
+    mChain.pop_back();
+    mBaseTargetWindow.truncate(height - 1);
+}
+
+void CoinQBlockTreeCompact::setBestChain(const Coin::hash256_t& forkHash)
+{
+    // Retrace back to earliest best block
+    std::vector<Coin::hash256_t> newBestChain;
+    Coin::hash256_t hash = forkHash;
+    fork_header_map_t::iterator it;
+    while ((it = mForkHeaders.find(hash)) != mForkHeaders.end())
+    {
+        newBestChain.push_back(hash);
+        hash = Coin::hash256_t(it->second.header.prevBlockHash());
     }
 
-    if (callback) callback(*this); // No need to interrupt since we're done.
+    int forkHeight = findHeight(hash);
+    if (forkHeight < 0) throw std::runtime_error("Critical error: parent for block not found.");
+
+    // Move the old branch into the side map.
+    int oldBestHeight = getBestHeight();
+    for (int height = forkHeight + 1; height <= oldBestHeight; height++)
+    {
+        const PackedHeader& packed = mChain[height];
+        ForkHeader& fork = mForkHeaders[packed.hash];
+        getBlockHeader(height, fork.header);
+        fork.height = height;
+        fork.chainWork = packed.chainWork;
+        mForkChildren.insert(std::make_pair(mChain[height - 1].hash, packed.hash));
+    }
+    std::vector<Coin::hash256_t> oldBestChain;
+    while (getBestHeight() > forkHeight)
+    {
+        oldBestChain.push_back(mChain.back().hash);
+        popBestChain();
+    }
+    for (auto itOld = oldBestChain.rbegin(); itOld != oldBestChain.rend(); ++itOld)
+    {
+        notifyRemoveBestChain(materialize(mForkHeaders.at(*itOld)));
+    }
+
+    // Pop back up stack and make this the best chain
+    for (auto itNew = newBestChain.rbegin(); itNew != newBestChain.rend(); ++itNew)
+    {
+        it = mForkHeaders.find(*itNew);
+        pushBestChain(it->second.header, *itNew, it->second.chainWork);
+        unlinkForkChild(Coin::hash256_t(it->second.header.prevBlockHash()), *itNew);
+        mForkHeaders.erase(it);
+    }
+    for (int height = forkHeight + 1; height <= getBestHeight(); height++)
+    {
+        const ChainHeader& header = materialize(height);
+        if (height == forkHeight + 1) notifyReorg(header);
+        notifyAddBestChain(header);
+    }
 }
 
-void CoinQBlockTreeMem::flushToFile(const std::string& filename)
+void CoinQBlockTreeCompact::getBlockHeader(int height, Coin::CoinBlockHeader& header) const
 {
-    if (mBestHeight == -1) throw std::runtime_error("Tree is empty.");
+    const PackedHeader& packed = mChain[height];
+    header.set(packed.version, packed.timestamp, packed.bits, packed.nonce, packed.plotseed, height > 0 ? mChain[height - 1].hash.getBytes() : mGenesisPrevHash, packed.merkleRoot.getBytes());
+}
+
+ChainHeader CoinQBlockTreeCompact::materialize(int height, bool inBestChain) const
+{
+    ChainHeader header;
+    getBlockHeader(height, header);
+    header.inBestChain = inBestChain;
+    header.height = height;
+    header.chainWork = toBigInt(mChain[height].chainWork);
+    header.childHashes.clear();
+    if (height < getBestHeight()) header.childHashes.push_back(mChain[height + 1].hash);
+    addForkChildHashes(header, mChain[height].hash);
+    return header;
+}
+
+ChainHeader CoinQBlockTreeCompact::materialize(const ForkHeader& fork) const
+{
+    ChainHeader header(fork.header, false, fork.height, toBigInt(fork.chainWork));
+    addForkChildHashes(header, Coin::hash256_t(fork.header.hash()));
+    return header;
+}
+
+void CoinQBlockTreeCompact::addForkChildHashes(ChainHeader& header, const Coin::hash256_t& hash) const
+{
+    auto range = mForkChildren.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) { header.childHashes.push_back(it->second); }
+}
+
+void CoinQBlockTreeCompact::setGenesisBlock(const Coin::CoinBlockHeader& header)
+{
+    LOGGER(trace) << "setGenesisBlock - hash: " << header.getPOWHashLittleEndian().getHex() << std::endl;
+    if (!isEmpty()) throw std::runtime_error("Tree is not empty.");
+
+    bFlushed = false;
+    mGenesisPrevHash = header.prevBlockHash();
+    pushBestChain(header, Coin::hash256_t(header.hash()), getHeaderWork(header));
+    notifyInsert(materialize(0, false));
+    notifyAddBestChain(materialize(0));
+}
+
+const ChainHeader* CoinQBlockTreeCompact::getPrevHeader(const uchar_vector& hash)
+{
+    if (hash.size() != Coin::hash256_t::SIZE) return nullptr;
+
+    Coin::hash256_t key(hash);
+    ChainHeader& header = mPrevHeaders[mPrevCursor++ % 2];
+    int height = findHeight(key);
+    if (height >= 0)
+    {
+        header = materialize(height);
+        return &header;
+    }
+
+    fork_header_map_t::const_iterator it = mForkHeaders.find(key);
+    if (it == mForkHeaders.end()) return nullptr;
+
+    header = materialize(it->second);
+    return &header;
+}
+
+bool CoinQBlockTreeCompact::insertHeader(const Coin::CoinBlockHeader& header, bool bCheckProofOfWork, bool bReplaceTip, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler)
+{
+    if (isEmpty()) throw std::runtime_error("No genesis block.");
+
+    return addHeader(header, Coin::hash256_t(header.hash()), bCheckProofOfWork, bReplaceTip, notifyHandler);
+}
+
+bool CoinQBlockTreeCompact::insertPrecheckedHeader(const Coin::CoinBlockHeader& header, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler)
+{
+    if (isEmpty()) throw std::runtime_error("No genesis block.");
+
+    return addHeader(header, Coin::hash256_t(header.hash()), true, false, notifyHandler, true);
+}
+
+bool CoinQBlockTreeCompact::addHeader(const Coin::CoinBlockHeader& header, const Coin::hash256_t& headerKey, bool bCheckProofOfWork, bool bReplaceTip, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler, bool bWorkPrechecked)
+{
+    if (findHeight(headerKey) >= 0 || mForkHeaders.count(headerKey)) return false;
 
-    boost::filesystem::path swapfile(filename + ".swp");
-    //if (boost::filesystem::exists(swapfile)) throw BlockTreeSwapfileAlreadyExistsException();
+    if (header.prevBlockHash().size() != Coin::hash256_t::SIZE) throw std::runtime_error("Parent not found.");
+    Coin::hash256_t parentKey(header.prevBlockHash());
 
+    int parentHeight = findHeight(parentKey);
+    bool bParentInBestChain = (parentHeight >= 0);
+    arith_uint256 parentWork;
+    fork_header_map_t::const_iterator itParent = mForkHeaders.end();
+    if (bParentInBestChain)
     {
-#ifndef _WIN32
-        std::ofstream fs(swapfile.native(), std::ios::binary | std::ios::trunc);
-#else
-        std::ofstream fs(filename + ".swp", std::ios::binary | std::ios::trunc);
-#endif
+        parentWork = mChain[parentHeight].chainWork;
+    }
+    else
+    {
+        itParent = mForkHeaders.find(parentKey);
+        if (itParent == mForkHeaders.end()) throw std::runtime_error("Parent not found.");
+        parentHeight = itParent->second.height;
+        parentWork = itParent->second.chainWork;
+    }
 
-        uchar_vector headerBytes, hash;
+    // TODO: Check version, compute work required.
+
+    // Check proof of work
+    if (bCheckProofOfWork)
+    {
+        if (header.IsBcoHeader()) { 
+            const ChainHeader& parent = bParentInBestChain ? materialize(parentHeight) : materialize(itParent->second);
+            if (!verifyPocHeader(parent, header, std::bind(&CoinQBlockTreeCompact::getPrevHeader, this, std::placeholders::_1), mBaseTargetWindow, bWorkPrechecked)) return false;
+        }
+        else if (!bWorkPrechecked) { //bitcoin
+            if (!verifyPowHeader(header)) return false;
+        }
+    }
 
-        for (int i = 0; i <= mBestHeight; i++)
+    int height = parentHeight + 1;
+    arith_uint256 chainWork = parentWork + getHeaderWork(header);
+    const arith_uint256& totalWork = mChain.back().chainWork;
+    bool bBestChain = header.IsBcoHeader() || (bReplaceTip && chainWork >= totalWork) || chainWork > totalWork;
+
+    if (bBestChain && parentHeight == getBestHeight() && bParentInBestChain)
+    {
+        // Extends the tip, which is what nearly every header does.
+        pushBestChain(header, headerKey, chainWork);
+        notifyInsert(materialize(height, false));
+
+        const ChainHeader& chainHeader = materialize(height);
+        notifyReorg(chainHeader);
+        notifyAddBestChain(chainHeader);
+    }
+    else
+    {
+        ForkHeader& fork = mForkHeaders[headerKey];
+        fork.header = header;
+        fork.height = height;
+        fork.chainWork = chainWork;
+        mForkChildren.insert(std::make_pair(parentKey, headerKey));
+        notifyInsert(materialize(fork));
+
+        if (bBestChain) setBestChain(headerKey);
+    }
+
+    if (notifyHandler)
+    {
+        uchar_vector headerHash = headerKey.getBytes();
+        notifyHandler(header.IsBcoHeader() ? height : 0, headerHash);
+    }
+
+    bFlushed = false;
+    return true;
+}
+
+void CoinQBlockTreeCompact::unlinkForkChild(const Coin::hash256_t& parentHash, const Coin::hash256_t& hash)
+{
+    auto range = mForkChildren.equal_range(parentHash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second == hash)
         {
-            ChainHeader* pHeader = mHeaderHeightMap.at(i);
+            mForkChildren.erase(it);
+            return;
+        }
+    }
+}
+
+void CoinQBlockTreeCompact::deleteForkHeader(const Coin::hash256_t& hash)
+{
+    fork_header_map_t::iterator it = mForkHeaders.find(hash);
+
+    std::vector<Coin::hash256_t> childHashes;
+    auto range = mForkChildren.equal_range(hash);
+    for (auto itChild = range.first; itChild != range.second; ++itChild) { childHashes.push_back(itChild->second); }
+    for (auto& childHash: childHashes) { deleteForkHeader(childHash); }
+
+    notifyDelete(materialize(it->second));
+    unlinkForkChild(Coin::hash256_t(it->second.header.prevBlockHash()), hash);
+    mForkHeaders.erase(it);
+}
+
+bool CoinQBlockTreeCompact::deleteHeader(const uchar_vector& hash)
+{
+    if (hash.size() != Coin::hash256_t::SIZE) return false;
+
+    Coin::hash256_t key(hash);
+    if (mForkHeaders.count(key))
+    {
+        deleteForkHeader(key);
+        bFlushed = false;
+        return true;
+    }
+
+    int height = findHeight(key);
+    if (height < 0) return false;
+    if (height == 0) throw std::runtime_error("Cannot remove genesis block from best chain.");
+
+    int bestHeight = getBestHeight();
+    for (int i = height; i <= bestHeight; i++) { notifyRemoveBestChain(materialize(i, false)); }
+
+    // Children go before their parents.
+    for (int i = bestHeight; i >= height; i--)
+    {
+        std::vector<Coin::hash256_t> childHashes;
+        auto range = mForkChildren.equal_range(mChain[i].hash);
+        for (auto it = range.first; it != range.second; ++it) { childHashes.push_back(it->second); }
+        for (auto& childHash: childHashes) { deleteForkHeader(childHash); }
+
+        notifyDelete(materialize(i, false));
+        popBestChain();
+    }
+
+    // TODO: Find new best chain if this header was in best chain.
+
+    bFlushed = false;
+    return true;
+}
+
+bool CoinQBlockTreeCompact::hasHeader(const uchar_vector& hash) const
+{
+    if (hash.size() != Coin::hash256_t::SIZE) return false;
+
+    Coin::hash256_t key(hash);
+    return findHeight(key) >= 0 || mForkHeaders.count(key);
+}
+
+ChainHeader CoinQBlockTreeCompact::getHeader(const uchar_vector& hash) const
+{
+    if (hash.size() != Coin::hash256_t::SIZE) throw std::runtime_error("Not found.");
+
+    Coin::hash256_t key(hash);
+    int height = findHeight(key);
+    if (height >= 0) return materialize(height);
+
+    fork_header_map_t::const_iterator it = mForkHeaders.find(key);
+    if (it == mForkHeaders.end()) throw std::runtime_error("Not found.");
+
+    return materialize(it->second);
+}
+
+ChainHeader CoinQBlockTreeCompact::getHeader(int height) const
+{
+    if (height < 0) height += getBestHeight() + 1;
+    if (height < 0 || height > getBestHeight()) throw std::runtime_error("Not found.");
+
+    return materialize(height);
+}
+
+ChainHeader CoinQBlockTreeCompact::getTip() const
+{
+    if (isEmpty()) throw std::runtime_error("Tree is empty.");
+
+    return materialize(getBestHeight());
+}
+
+uchar_vector CoinQBlockTreeCompact::getBestHash() const
+{
+    if (isEmpty()) throw std::runtime_error("Tree is empty.");
+
+    return mChain.back().hash.getBytes();
+}
+
+int CoinQBlockTreeCompact::getTipHeight() const
+{
+    if (isEmpty()) throw std::runtime_error("Tree is empty.");
+
+    return getBestHeight();
+}
+
+ChainHeader CoinQBlockTreeCompact::getHeaderBefore(uint32_t timestamp) const
+{
+    if (isEmpty()) throw std::runtime_error("Tree is empty.");
+
+    int i;
+    for (i = 1; i <= getBestHeight(); i++)
+    {
+        if (mChain[i].timestamp > timestamp) break;
+    }
+
+    return materialize(i - 1);
+}
+
+BigInt CoinQBlockTreeCompact::getTotalWork() const
+{
+    if (isEmpty()) return 0;
 
-            headerBytes = pHeader->getSerialized();
-            hash = pHeader->hash();
+    return toBigInt(mChain.back().chainWork);
+}
+
+std::vector<uchar_vector> CoinQBlockTreeCompact::getLocatorHashes(int maxSize) const
+{
+    std::vector<uchar_vector> locatorHashes;
+
+    if (isEmpty())
+    {
+        locatorHashes.push_back(g_zero32bytes);
+        return locatorHashes;
+    }
 
-            fs.write((const char*)&headerBytes[0], MIN_BCO_BLOCK_HEADER_SIZE);
-            if (fs.bad()) throw BlockTreeFileWriteFailureException();
+    if (maxSize < 0) maxSize = getBestHeight() + 1;
+
+    int i = getBestHeight();
+    int n = 0;
+    int step = 1;
+    while ((i >= 0) && (n < maxSize))
+    {
+        locatorHashes.push_back(mChain[i].hash.getBytes());
+        if (i == 0) return locatorHashes;
+        i -= step;
+        n++;
+        if (n > 10) step *= 2;
+    }
+
+    // The steps can jump past genesis, which any peer on the same network has in common with us.
+    if (n < maxSize) locatorHashes.push_back(mChain[0].hash.getBytes());
+    return locatorHashes;
+}
+
+int CoinQBlockTreeCompact::getConfirmations(const uchar_vector& hash) const
+{
+    if (hash.size() != Coin::hash256_t::SIZE) return 0;
 
-            fs.write((const char*)&hash[0], 4);
-            if (fs.bad()) throw BlockTreeFileWriteFailureException();
+    int height = findHeight(Coin::hash256_t(hash));
+    if (height < 0) return 0;
+
+    return getBestHeight() - height + 1;
+}
+
+void CoinQBlockTreeCompact::clear()
+{
+    mChain.clear();
+    mGenesisPrevHash.clear();
+    mHashIndex.clear();
+    mForkHeaders.clear();
+    mForkChildren.clear();
+    mStore.close();
+    mSyncedCount = 0;
+    mBaseTargetWindow.clear();
+}
+
+void CoinQBlockTreeCompact::loadFromFile(const std::string& filename, bool bCheckProofOfWork, CoinQBlockTreeCompact::callback_t callback, unsigned int threads)
+{
+    unsigned int count = 0;
+    mStore.load(filename, [&](std::size_t records) {
+        clear();
+        reserve(records);
+    }, [&](const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, CoinQHeaderStore::RecordStatus status) {
+        if (!isEmpty())
+        {
+            addHeader(header, hash, bCheckProofOfWork && status != CoinQHeaderStore::VERIFIED, false, nullptr, status == CoinQHeaderStore::CHECKED);
+            if (count % 10000 == 0)
+            {
+                if (callback && !callback(*this)) throw BlockTreeLoadInterruptedException();
+            }
+            count++;
         }
+        else
+        {
+            setGenesisBlock(header);
+            if (callback && !callback(*this)) throw BlockTreeLoadInterruptedException();
+            LOGGER(debug) << "CoinQBlockTreeCompact::loadFromFile() - genesis hash: " << header.hash().getHex() << std::endl;
+            count++;
+        }
+    }, bCheckProofOfWork ? CoinQHeaderStore::check_slot_t(precheckHeader) : nullptr, threads);
+
+    mSyncedCount = std::min(mStore.getCount(), getBestHeight() + 1);
+    bFlushed = (mSyncedCount == getBestHeight() + 1);
+
+    if (callback) callback(*this); // No need to interrupt since we're done.
+}
+
+void CoinQBlockTreeCompact::flushToFile(const std::string& filename)
+{
+    if (isEmpty()) throw std::runtime_error("Tree is empty.");
+
+    if (mStore.getFilename() != filename)
+    {
+        mStore.open(filename);
+        mSyncedCount = 0;
     }
 
-    boost::system::error_code ec;
-    boost::filesystem::path p(filename);
-    boost::filesystem::rename(swapfile, p, ec);
-    if (!!ec) throw std::runtime_error(ec.message());
+    mStore.write(mSyncedCount, getBestHeight() + 1, [&](int height, uchar_vector& headerBytes, Coin::hash256_t& hash) {
+        Coin::CoinBlockHeader header;
+        getBlockHeader(height, header);
+        header.serializeTo(headerBytes);
+        hash = mChain[height].hash;
+    });
+    mSyncedCount = getBestHeight() + 1;
 
     bFlushed = true;
 }
-
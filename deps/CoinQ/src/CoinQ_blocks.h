@@ -12,13 +12,19 @@
 #pragma once
 
 #include "CoinQ_exceptions.h"
+#include "CoinQ_headerstore.h"
 #include "CoinQ_signals.h"
 #include "CoinQ_slots.h"
+#include "poc.h"
 
 #include <CoinCore/CoinNodeData.h>
+#include <CoinCore/fixedhash.h>
+#include <CoinCore/arith_uint256.h>
 
+#include <exception>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <stack>
 #include <stdexcept>
 #include <fstream>
@@ -34,7 +40,7 @@ public:
     bool inBestChain;
     int height;
     BigInt chainWork; // total work for the chain with this header as its leaf
-    std::set<uchar_vector> childHashes;
+    std::vector<Coin::hash256_t> childHashes; // almost always zero or one entry
 
     ChainHeader() : Coin::CoinBlockHeader(), inBestChain(false), height(-1), chainWork(0) { }
     ChainHeader(const Coin::CoinBlockHeader& header, bool _inBestChain = false, int _height = -1, const BigInt& _chainWork = 0) : Coin::CoinBlockHeader(header), inBestChain(_inBestChain), height(_height), chainWork(_chainWork) { }
@@ -77,6 +83,12 @@ public:
     ChainHeader getHeader() const { return ChainHeader(blockHeader, inBestChain, height, chainWork); }
 };
 
+// Checks each of headers for what insertHeader() checks that needs no more than its parent: the
+// PoC deadline, or the proof of work hash before the fork. parent is the parent of headers[0]
+// and each header is the parent of the next. Runs on threads threads (0 for one per core).
+// Returns how many leading headers passed; error is set to why the next one did not.
+std::size_t precheckHeaders(const ChainHeader& parent, const std::vector<Coin::CoinBlockHeader>& headers, std::exception_ptr& error, unsigned int threads = 0);
+
 typedef std::function<void(const ChainHeader&)>      chain_header_slot_t;
 typedef std::function<void(const ChainBlock&)>       chain_block_slot_t;
 typedef std::function<void(const ChainMerkleBlock&)> chain_merkle_block_slot_t;
@@ -110,14 +122,16 @@ public:
     // returns true if header removed, false if header unknown
     virtual bool deleteHeader(const uchar_vector& hash) = 0;
  
+    // Lookups return copies, so they stay valid while the tree changes and an implementation
+    // need not keep ChainHeaders around to hand out.
     virtual bool hasHeader(const uchar_vector& hash) const = 0;
-    virtual const ChainHeader& getHeader(const uchar_vector& hash) const = 0;
-    virtual const ChainHeader& getHeader(int height) const = 0; // Use -1 to get top block
-    virtual const ChainHeader& getTip() const = 0;
+    virtual ChainHeader getHeader(const uchar_vector& hash) const = 0;
+    virtual ChainHeader getHeader(int height) const = 0; // Use -1 to get top block
+    virtual ChainHeader getTip() const = 0;
     virtual int getTipHeight() const = 0;
-    virtual const ChainHeader& getHeaderBefore(uint32_t timestamp) const = 0;
+    virtual ChainHeader getHeaderBefore(uint32_t timestamp) const = 0;
 
-    virtual const uchar_vector& getBestHash() const = 0;
+    virtual uchar_vector getBestHash() const = 0;
     virtual int getBestHeight() const = 0;
     virtual BigInt getTotalWork() const = 0;
 
@@ -132,10 +146,12 @@ class CoinQBlockTreeMem : public ICoinQBlockTree
 private:
     bool bFlushed;
 
-    typedef std::map<uchar_vector, ChainHeader> header_hash_map_t;
+    // Node based so the ChainHeader pointers below stay valid as the map grows.
+    typedef std::unordered_map<Coin::hash256_t, ChainHeader> header_hash_map_t;
     header_hash_map_t mHeaderHashMap;
 
-    typedef std::map<unsigned int, ChainHeader*> header_height_map_t;
+    // Best chain by height, so height lookups and locators index straight in.
+    typedef std::vector<ChainHeader*> header_height_map_t;
     header_height_map_t mHeaderHeightMap;
 
     int mBestHeight;
@@ -143,6 +159,11 @@ private:
 
     ChainHeader* pHead;    
 
+    CoinQHeaderStore mStore;
+    int mSyncedCount; // leading best chain headers already in mStore
+
+    poc::BaseTargetWindow mBaseTargetWindow; // follows the best chain
+
     bool bCheckTimestamp;
     bool bCheckProofOfWork;
 
@@ -157,14 +178,24 @@ protected:
     bool unsetBestChain(ChainHeader& header);
 
     bool checkPowHeader(const Coin::CoinBlockHeader& header);
-    bool checkPocHeader(const ChainHeader& parent, const Coin::CoinBlockHeader& header);
+    bool checkPocHeader(const ChainHeader& parent, const Coin::CoinBlockHeader& header, bool bWorkPrechecked = false);
     const ChainHeader* getPrevHeader(const uchar_vector&);
 
+    // insertHeader() for a header whose hash is already known. bWorkPrechecked means the part of
+    // the proof of work check that only needs the parent was done while loading, which leaves
+    // the PoC base target.
+    bool addHeader(const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, bool bCheckProofOfWork, bool bReplaceTip, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler, bool bWorkPrechecked = false);
+
+    // Hashes of the wrong size are simply not found.
+    header_hash_map_t::iterator findHeader(const uchar_vector& hash);
+    header_hash_map_t::const_iterator findHeader(const uchar_vector& hash) const;
+    bool deleteHeader(header_hash_map_t::iterator it);
+
 public:
     CoinQBlockTreeMem(bool _bCheckTimestamp = true, bool _bCheckProofOfWork = true)
-        : bFlushed(true), mBestHeight(-1), mTotalWork(0), pHead(NULL), bCheckTimestamp(_bCheckTimestamp), bCheckProofOfWork(_bCheckProofOfWork) { }
+        : bFlushed(true), mBestHeight(-1), mTotalWork(0), pHead(NULL), mSyncedCount(0), bCheckTimestamp(_bCheckTimestamp), bCheckProofOfWork(_bCheckProofOfWork) { }
     CoinQBlockTreeMem(const Coin::CoinBlockHeader& header, bool _bCheckTimestamp = true, bool _bCheckProofOfWork = true)
-        : bFlushed(true), mBestHeight(-1), mTotalWork(0), pHead(NULL), bCheckTimestamp(_bCheckTimestamp), bCheckProofOfWork(_bCheckProofOfWork) { setGenesisBlock(header); }
+        : bFlushed(true), mBestHeight(-1), mTotalWork(0), pHead(NULL), mSyncedCount(0), bCheckTimestamp(_bCheckTimestamp), bCheckProofOfWork(_bCheckProofOfWork) { setGenesisBlock(header); }
 
     void subscribeAddBestChain(chain_header_slot_t slot) { notifyAddBestChain.connect(slot); }
     void subscribeRemoveBestChain(chain_header_slot_t slot) { notifyRemoveBestChain.connect(slot); }
@@ -181,29 +212,171 @@ public:
     void setGenesisBlock(const Coin::CoinBlockHeader& header);
     bool isEmpty() const { return pHead == nullptr; }
     bool insertHeader(const Coin::CoinBlockHeader& header, bool bCheckProofOfWork = true, bool bReplaceTip = false, std::function<void(uint32_t height, bytes_t& hash)> = nullptr);
+    // insertHeader() for a header that passed precheckHeaders(), which leaves the PoC base target.
+    bool insertPrecheckedHeader(const Coin::CoinBlockHeader& header, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler = nullptr);
     bool deleteHeader(const uchar_vector& hash);
 
     bool hasHeader(const uchar_vector& hash) const;
-    const ChainHeader& getHeader(const uchar_vector& hash) const;
-    const ChainHeader& getHeader(int height) const;
-    const ChainHeader& getTip() const;
+    ChainHeader getHeader(const uchar_vector& hash) const;
+    ChainHeader getHeader(int height) const;
+    ChainHeader getTip() const;
     int getTipHeight() const;
-    const ChainHeader& getHeaderBefore(uint32_t timestamp) const;
+    ChainHeader getHeaderBefore(uint32_t timestamp) const;
 
-    const uchar_vector& getBestHash() const { return getHeader(-1).hash(); }
+    uchar_vector getBestHash() const { return getHeader(-1).hash(); }
     int getBestHeight() const { return mBestHeight; }
     BigInt getTotalWork() const { return mTotalWork; }
 
     std::vector<uchar_vector> getLocatorHashes(int maxSize) const;
 
     int getConfirmations(const uchar_vector& hash) const;
-    void clear() { mHeaderHashMap.clear(); mHeaderHeightMap.clear(); mBestHeight = -1; mTotalWork = 0; pHead = NULL; }
+    void clear() { mHeaderHashMap.clear(); mHeaderHeightMap.clear(); mBestHeight = -1; mTotalWork = 0; pHead = NULL; mStore.close(); mSyncedCount = 0; mBaseTargetWindow.clear(); }
 
+    // Headers covered by the file's checkpoint are trusted and skip the proof of work check.
+    // The other headers are hashed and checked on threads threads (0 for one per core); only
+    // linking them into the tree and the PoC base target are done one header at a time.
+    // callback is called on the calling thread.
     typedef std::function<bool(const CoinQBlockTreeMem&)> callback_t;
-    void loadFromFile(const std::string& filename, bool bCheckProofOfWork = true, callback_t callback = nullptr); 
+    void loadFromFile(const std::string& filename, bool bCheckProofOfWork = true, callback_t callback = nullptr, unsigned int threads = 0);
 
+    // Only writes what changed in the best chain since the last flush to the same file.
     void flushToFile(const std::string& filename);
 
     bool flushed() const { return bFlushed; }
 };
 
+// Block tree sized for long header chains. The best chain is a height-indexed vector of
+// packed records carrying 256-bit chain work, located by hash through an open-addressing
+// table of heights. Headers off the best chain go in a side map, which stays small since
+// forks are short.
+//
+// Nothing is stored as a ChainHeader, so lookups build the one they return. Const members
+// don't write to the tree, so concurrent lookups are safe as long as nothing modifies it.
+class CoinQBlockTreeCompact : public ICoinQBlockTree
+{
+public:
+    // Everything but the parent hash, which is the hash of the record one height down. BCO
+    // headers carry 64-bit bits, nonce and plotseed, so that leaves 64 of the 96 serialized
+    // bytes. The hash stays because the hash index compares against it on every probe.
+    struct PackedHeader
+    {
+        Coin::hash256_t hash;
+        Coin::hash256_t merkleRoot;
+        arith_uint256 chainWork;
+        Coin::bits_t bits;
+        Coin::nonce_t nonce;
+        Coin::plotseed_t plotseed;
+        uint32_t version;
+        uint32_t timestamp;
+    };
+    static_assert(sizeof(PackedHeader) == 128, "PackedHeader has padding.");
+
+private:
+    struct ForkHeader
+    {
+        Coin::CoinBlockHeader header;
+        int height;
+        arith_uint256 chainWork;
+    };
+
+    bool bFlushed;
+
+    std::vector<PackedHeader> mChain;
+    uchar_vector mGenesisPrevHash;
+
+    // Heights into mChain, linear probing, EMPTY_SLOT marks a free slot.
+    static const uint32_t EMPTY_SLOT = 0xffffffff;
+    std::vector<uint32_t> mHashIndex;
+
+    typedef std::unordered_map<Coin::hash256_t, ForkHeader> fork_header_map_t;
+    fork_header_map_t mForkHeaders;
+    std::unordered_multimap<Coin::hash256_t, Coin::hash256_t> mForkChildren; // parent hash -> fork header hash
+
+    // getPrevHeader() alternates between these since the caller passes in a hash from the
+    // header it got last time.
+    ChainHeader mPrevHeaders[2];
+    unsigned int mPrevCursor;
+
+    CoinQHeaderStore mStore;
+    int mSyncedCount; // leading best chain headers already in mStore
+
+    poc::BaseTargetWindow mBaseTargetWindow; // follows the best chain
+
+    bool bCheckTimestamp;
+    bool bCheckProofOfWork;
+
+    CoinQSignal<const ChainHeader&> notifyAddBestChain;
+    CoinQSignal<const ChainHeader&> notifyRemoveBestChain;
+    CoinQSignal<const ChainHeader&> notifyInsert;
+    CoinQSignal<const ChainHeader&> notifyDelete;
+    CoinQSignal<const ChainHeader&> notifyReorg;
+
+protected:
+    int findHeight(const Coin::hash256_t& hash) const; // -1 if not in the best chain
+    void indexHeight(uint32_t height);
+    void unindexHeight(uint32_t height);
+    void reserve(std::size_t count);
+
+    void pushBestChain(const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, const arith_uint256& chainWork);
+    void popBestChain();
+    void setBestChain(const Coin::hash256_t& forkHash);
+
+    void getBlockHeader(int height, Coin::CoinBlockHeader& header) const;
+    ChainHeader materialize(int height, bool inBestChain = true) const;
+    ChainHeader materialize(const ForkHeader& fork) const;
+    void addForkChildHashes(ChainHeader& header, const Coin::hash256_t& hash) const;
+
+    const ChainHeader* getPrevHeader(const uchar_vector& hash);
+    bool addHeader(const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, bool bCheckProofOfWork, bool bReplaceTip, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler, bool bWorkPrechecked = false);
+    void unlinkForkChild(const Coin::hash256_t& parentHash, const Coin::hash256_t& hash);
+    void deleteForkHeader(const Coin::hash256_t& hash);
+
+public:
+    CoinQBlockTreeCompact(bool _bCheckTimestamp = true, bool _bCheckProofOfWork = true)
+        : bFlushed(true), mPrevCursor(0), mSyncedCount(0), bCheckTimestamp(_bCheckTimestamp), bCheckProofOfWork(_bCheckProofOfWork) { }
+    CoinQBlockTreeCompact(const Coin::CoinBlockHeader& header, bool _bCheckTimestamp = true, bool _bCheckProofOfWork = true)
+        : bFlushed(true), mPrevCursor(0), mSyncedCount(0), bCheckTimestamp(_bCheckTimestamp), bCheckProofOfWork(_bCheckProofOfWork) { setGenesisBlock(header); }
+
+    void subscribeAddBestChain(chain_header_slot_t slot) { notifyAddBestChain.connect(slot); }
+    void subscribeRemoveBestChain(chain_header_slot_t slot) { notifyRemoveBestChain.connect(slot); }
+    void subscribeInsert(chain_header_slot_t slot) { notifyInsert.connect(slot); }
+    void subscribeDelete(chain_header_slot_t slot) { notifyDelete.connect(slot); }
+    void subscribeReorg(chain_header_slot_t slot) { notifyReorg.connect(slot); }
+
+    void clearAddBestChain() { notifyAddBestChain.clear(); }
+    void clearRemoveBestChain() { notifyRemoveBestChain.clear(); }
+    void clearInsert() { notifyInsert.clear(); }
+    void clearDelete() { notifyDelete.clear(); }
+    void clearReorg() { notifyReorg.clear(); }
+
+    void setGenesisBlock(const Coin::CoinBlockHeader& header);
+    bool isEmpty() const { return mChain.empty(); }
+    bool insertHeader(const Coin::CoinBlockHeader& header, bool bCheckProofOfWork = true, bool bReplaceTip = false, std::function<void(uint32_t height, bytes_t& hash)> = nullptr);
+    // insertHeader() for a header that passed precheckHeaders(), which leaves the PoC base target.
+    bool insertPrecheckedHeader(const Coin::CoinBlockHeader& header, std::function<void(uint32_t height, bytes_t& hash)> notifyHandler = nullptr);
+    bool deleteHeader(const uchar_vector& hash);
+
+    bool hasHeader(const uchar_vector& hash) const;
+    ChainHeader getHeader(const uchar_vector& hash) const;
+    ChainHeader getHeader(int height) const; // Use -1 to get top block
+    ChainHeader getTip() const;
+    int getTipHeight() const;
+    ChainHeader getHeaderBefore(uint32_t timestamp) const;
+
+    uchar_vector getBestHash() const;
+    int getBestHeight() const { return (int)mChain.size() - 1; }
+    BigInt getTotalWork() const;
+
+    std::vector<uchar_vector> getLocatorHashes(int maxSize) const;
+
+    int getConfirmations(const uchar_vector& hash) const;
+    void clear();
+
+    // Same file handling as CoinQBlockTreeMem.
+    typedef std::function<bool(const CoinQBlockTreeCompact&)> callback_t;
+    void loadFromFile(const std::string& filename, bool bCheckProofOfWork = true, callback_t callback = nullptr, unsigned int threads = 0);
+
+    void flushToFile(const std::string& filename);
+
+    bool flushed() const { return bFlushed; }
+};
@@ -0,0 +1,337 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_blockscheduler.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "CoinQ_blockscheduler.h"
+
+#include <CoinCore/MerkleTree.h>
+
+#include <logger/logger.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace CoinQ::Network;
+
+void MerkleBlockScheduler::addPeer(const std::string& peer)
+{
+    m_peers[peer];
+}
+
+void MerkleBlockScheduler::removePeer(const std::string& peer)
+{
+    auto it = m_peers.find(peer);
+    if (it == m_peers.end()) return;
+
+    requeue(it->second, peer);
+    m_peers.erase(it);
+}
+
+void MerkleBlockScheduler::addBlock(int height, const uchar_vector& hash)
+{
+    if (isIdle())
+    {
+        m_nextHeight = height;
+    }
+    else if (height != m_lastHeight + 1)
+    {
+        throw std::runtime_error("MerkleBlockScheduler::addBlock() - heights must follow each other.");
+    }
+
+    m_queue[height] = hash;
+    m_lastHeight = height;
+}
+
+void MerkleBlockScheduler::expectBlock(const std::string& peer, int height, const uchar_vector& hash)
+{
+    if (m_blocks.count(height)) return;
+
+    if (isIdle()) { m_nextHeight = height; }
+    m_lastHeight = std::max(m_lastHeight, height);
+    m_queue.erase(height);
+
+    Block& block = m_blocks[height];
+    block.height = height;
+    block.hash = hash;
+    block.peer = peer;
+
+    Peer& p = m_peers[peer];
+    if (p.requested.empty() && p.pings.empty()) { p.lastProgress = clock_t::now(); }
+    p.requested.push_back(height);
+    p.pings.push_back(std::make_pair(++m_nonce, std::vector<int>(1, height)));
+    m_requestSlot(peer, std::vector<uchar_vector>(), m_nonce);
+}
+
+void MerkleBlockScheduler::clear()
+{
+    m_queue.clear();
+    m_blocks.clear();
+    for (auto& item: m_peers)
+    {
+        Peer& peer = item.second;
+        peer.requested.clear();
+        peer.current = -1;
+        peer.pings.clear();
+    }
+    m_nextHeight = -1;
+    m_lastHeight = -1;
+}
+
+void MerkleBlockScheduler::requestBlocks()
+{
+    // Hand out the lowest heights one per peer in turn so each peer gets a share.
+    std::map<std::string, std::vector<int>> requests;
+    bool bAssigned = true;
+    while (bAssigned)
+    {
+        bAssigned = false;
+        for (auto& item: m_peers)
+        {
+            if (m_queue.empty() || m_queue.begin()->first >= m_nextHeight + MAX_BLOCKS_AHEAD) break;
+
+            Peer& peer = item.second;
+            std::vector<int>& heights = requests[item.first];
+            if (peer.bStalled || peer.requested.size() + heights.size() >= m_blocksPerPeer) continue;
+
+            Block& block = m_blocks[m_queue.begin()->first];
+            block.height = m_queue.begin()->first;
+            block.hash = m_queue.begin()->second;
+            block.peer = item.first;
+            m_queue.erase(m_queue.begin());
+
+            heights.push_back(block.height);
+            bAssigned = true;
+        }
+    }
+
+    for (auto& item: requests)
+    {
+        if (item.second.empty()) continue;
+
+        Peer& peer = m_peers[item.first];
+        if (peer.requested.empty() && peer.pings.empty()) { peer.lastProgress = clock_t::now(); }
+
+        std::vector<uchar_vector> hashes;
+        for (int height: item.second)
+        {
+            peer.requested.push_back(height);
+            hashes.push_back(m_blocks[height].hash);
+        }
+
+        peer.pings.push_back(std::make_pair(++m_nonce, item.second));
+        LOGGER(trace) << "MerkleBlockScheduler - requesting " << hashes.size() << " blocks from " << item.first << " starting at height " << item.second.front() << std::endl;
+        m_requestSlot(item.first, hashes, m_nonce);
+    }
+}
+
+bool MerkleBlockScheduler::onMerkleBlock(const std::string& peer, const Coin::MerkleBlock& merkleBlock)
+{
+    auto peerIt = m_peers.find(peer);
+    if (peerIt == m_peers.end()) return false;
+    Peer& p = peerIt->second;
+
+    uchar_vector hash = merkleBlock.hash();
+    auto it = std::find_if(p.requested.begin(), p.requested.end(), [&](int height) {
+        auto blockIt = m_blocks.find(height);
+        return blockIt != m_blocks.end() && blockIt->second.hash == hash;
+    });
+    if (it == p.requested.end()) return false;
+
+    // Constructing the partial tree validates the merkle root - throws exception if invalid.
+    Coin::PartialMerkleTree merkleTree(merkleBlock.merkleTree());
+
+    Block& block = m_blocks[*it];
+    p.requested.erase(it);
+
+    // The peer answers in order, so the block it sent before this one has all its transactions.
+    auto currentIt = m_blocks.find(p.current);
+    if (currentIt != m_blocks.end() && currentIt->second.peer == peer && !currentIt->second.bClosed) { close(currentIt->second); }
+    p.current = block.height;
+    p.lastProgress = clock_t::now();
+
+    block.bReceived = true;
+    block.merkleBlock = merkleBlock;
+
+    // The byte order of the tx hashes must be reversed when moving between merkle trees and the block chain
+    bool bInMempool = true;
+    for (auto& reversedTxHash: merkleTree.getTxHashes())
+    {
+        block.txHashes.push_back(reversedTxHash.getReverse());
+        bInMempool = bInMempool && m_mempoolSlot(block.txHashes.back());
+    }
+
+    // Nothing left to wait for.
+    if (bInMempool) { close(block); }
+
+    deliver();
+    requestBlocks();
+    return true;
+}
+
+bool MerkleBlockScheduler::onTx(const std::string& peer, const Coin::Transaction& tx)
+{
+    auto peerIt = m_peers.find(peer);
+    if (peerIt == m_peers.end() || peerIt->second.current < 0) return false;
+    Peer& p = peerIt->second;
+
+    auto blockIt = m_blocks.find(p.current);
+    if (blockIt == m_blocks.end() || blockIt->second.bClosed) return false;
+    Block& block = blockIt->second;
+
+    Coin::hash256_t txHash(tx.hash());
+    if (std::find(block.txHashes.begin(), block.txHashes.end(), txHash) == block.txHashes.end()) return false;
+
+    block.txs[txHash] = tx;
+    p.lastProgress = clock_t::now();
+    return true;
+}
+
+bool MerkleBlockScheduler::onBlock(const std::string& peer, const Coin::CoinBlock& coinBlock)
+{
+    uchar_vector hash = coinBlock.hash();
+    auto it = std::find_if(m_blocks.begin(), m_blocks.end(), [&](const std::pair<const int, Block>& item) {
+        return item.second.bFullBlockRequested && item.second.peer == peer && item.second.hash == hash;
+    });
+    if (it == m_blocks.end()) return false;
+    Block& block = it->second;
+
+    for (auto& tx: coinBlock.txs)
+    {
+        Coin::hash256_t txHash(tx.hash());
+        if (std::find(block.txHashes.begin(), block.txHashes.end(), txHash) != block.txHashes.end()) { block.txs[txHash] = tx; }
+    }
+
+    for (auto& txHash: block.txHashes)
+    {
+        // In principle this should never happen. If it does we missed some earlier check.
+        if (!block.txs.count(txHash) && !m_mempoolSlot(txHash)) throw std::runtime_error("Block is missing some transactions.");
+    }
+
+    block.bFullBlockRequested = false;
+    auto peerIt = m_peers.find(peer);
+    if (peerIt != m_peers.end()) { peerIt->second.lastProgress = clock_t::now(); }
+
+    deliver();
+    return true;
+}
+
+bool MerkleBlockScheduler::onPong(const std::string& peer, uint64_t nonce)
+{
+    auto peerIt = m_peers.find(peer);
+    if (peerIt == m_peers.end()) return false;
+    Peer& p = peerIt->second;
+
+    auto pingIt = std::find_if(p.pings.begin(), p.pings.end(), [&](const std::pair<uint64_t, std::vector<int>>& ping) { return ping.first == nonce; });
+    if (pingIt == p.pings.end()) return false;
+
+    // Pongs come back in order, so earlier pings are answered too.
+    std::vector<int> heights;
+    for (auto it = p.pings.begin(); it != pingIt + 1; ++it) { heights.insert(heights.end(), it->second.begin(), it->second.end()); }
+    p.pings.erase(p.pings.begin(), pingIt + 1);
+    p.lastProgress = clock_t::now();
+
+    for (int height: heights)
+    {
+        auto blockIt = m_blocks.find(height);
+        if (blockIt == m_blocks.end() || blockIt->second.peer != peer) continue;
+        Block& block = blockIt->second;
+
+        if (!block.bReceived)
+        {
+            // The peer did not send it and is not going to.
+            LOGGER(debug) << "MerkleBlockScheduler - " << peer << " did not send block " << block.hash.getHex() << std::endl;
+            p.requested.erase(std::remove(p.requested.begin(), p.requested.end(), height), p.requested.end());
+            m_queue[height] = block.hash;
+            m_blocks.erase(blockIt);
+            p.bStalled = true;
+            continue;
+        }
+
+        if (p.current == height) { p.current = -1; }
+        if (!block.bClosed) { close(block); }
+    }
+
+    deliver();
+    requestBlocks();
+    return true;
+}
+
+std::vector<std::string> MerkleBlockScheduler::removeStalledPeers(clock_t::duration timeout)
+{
+    clock_t::time_point now = clock_t::now();
+    std::vector<std::string> stalled;
+    for (auto& item: m_peers)
+    {
+        Peer& peer = item.second;
+        bool bBusy = !peer.requested.empty() || !peer.pings.empty() || std::any_of(m_blocks.begin(), m_blocks.end(), [&](const std::pair<const int, Block>& block) {
+            return block.second.bFullBlockRequested && block.second.peer == item.first;
+        });
+        if (peer.bStalled || (bBusy && now - peer.lastProgress > timeout)) { stalled.push_back(item.first); }
+    }
+
+    for (auto& peer: stalled)
+    {
+        LOGGER(debug) << "MerkleBlockScheduler - dropping stalled peer " << peer << std::endl;
+        removePeer(peer);
+    }
+
+    if (!stalled.empty()) { requestBlocks(); }
+    return stalled;
+}
+
+void MerkleBlockScheduler::requeue(Peer& peer, const std::string& name)
+{
+    for (auto it = m_blocks.begin(); it != m_blocks.end();)
+    {
+        const Block& block = it->second;
+        if (block.peer == name && (!block.bClosed || block.bFullBlockRequested))
+        {
+            m_queue[block.height] = block.hash;
+            it = m_blocks.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    peer.requested.clear();
+    peer.current = -1;
+    peer.pings.clear();
+}
+
+void MerkleBlockScheduler::close(Block& block)
+{
+    block.bClosed = true;
+    for (auto& txHash: block.txHashes)
+    {
+        if (!block.txs.count(txHash) && !m_mempoolSlot(txHash))
+        {
+            LOGGER(trace) << "MerkleBlockScheduler - missing transactions in block " << block.hash.getHex() << ", asking for the full block." << std::endl;
+            block.bFullBlockRequested = true;
+            m_requestBlockSlot(block.peer, block.hash);
+            return;
+        }
+    }
+}
+
+void MerkleBlockScheduler::deliver()
+{
+    while (!m_blocks.empty() && m_blocks.begin()->first == m_nextHeight)
+    {
+        Block& front = m_blocks.begin()->second;
+        if (!front.bClosed || front.bFullBlockRequested) break;
+
+        Block block = std::move(front);
+        m_blocks.erase(m_blocks.begin());
+        m_nextHeight++;
+
+        m_blockSlot(block.height, block.merkleBlock, block.txHashes, block.txs);
+    }
+}
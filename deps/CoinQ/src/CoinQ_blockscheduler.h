@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_blockscheduler.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include <CoinCore/CoinNodeData.h>
+#include <CoinCore/fixedhash.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CoinQ {
+    namespace Network {
+
+// Downloads filtered blocks from several peers at once and hands them back in height order.
+//
+// Each peer keeps up to a window of blocks in flight, topped up with a getdata followed by a ping
+// as blocks come in, so a slow link is not left idle between blocks. A peer answers in order and
+// sends the transactions matching a merkle block right after it, so a block is complete once the
+// next merkle block from that peer arrives, or the pong for its request. Matching transactions a
+// peer leaves out because it thinks we have them must be in our mempool; if one is not, the full
+// block is asked for instead.
+//
+// A peer that makes no progress for a while is dropped and its blocks go to the other peers.
+//
+// Not thread safe. Callbacks are called from inside the methods below.
+class MerkleBlockScheduler
+{
+public:
+    typedef std::chrono::steady_clock clock_t;
+
+    // Sends a getdata for the filtered blocks to the peer, then a ping with nonce.
+    typedef std::function<void(const std::string& peer, const std::vector<uchar_vector>& hashes, uint64_t nonce)> request_slot_t;
+
+    // Sends a getdata for the full block to the peer.
+    typedef std::function<void(const std::string& peer, const uchar_vector& hash)> request_block_slot_t;
+
+    // A downloaded block, in height order. txs holds the matching transactions the peer sent;
+    // the rest of txHashes were in the mempool.
+    typedef std::function<void(int height, const Coin::MerkleBlock& merkleBlock, const std::vector<Coin::hash256_t>& txHashes, const std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs)> block_slot_t;
+
+    typedef std::function<bool(const Coin::hash256_t& txHash)> mempool_slot_t;
+
+    enum { MAX_BLOCKS_AHEAD = 1000 }; // beyond the next block to deliver
+    enum { DEFAULT_BLOCKS_PER_PEER = 16 };
+
+    MerkleBlockScheduler(request_slot_t requestSlot, request_block_slot_t requestBlockSlot, block_slot_t blockSlot, mempool_slot_t mempoolSlot)
+        : m_requestSlot(requestSlot), m_requestBlockSlot(requestBlockSlot), m_blockSlot(blockSlot), m_mempoolSlot(mempoolSlot), m_blocksPerPeer(DEFAULT_BLOCKS_PER_PEER), m_nextHeight(-1), m_lastHeight(-1), m_nonce(0) { }
+
+    // Merkle blocks asked for from a peer and not received yet. 1 waits for each block before
+    // asking for the next.
+    void setBlocksPerPeer(std::size_t blocksPerPeer) { m_blocksPerPeer = std::max<std::size_t>(blocksPerPeer, 1); }
+    std::size_t getBlocksPerPeer() const { return m_blocksPerPeer; }
+
+    void addPeer(const std::string& peer);
+    void removePeer(const std::string& peer);  // its blocks are requested again from the others
+    bool hasPeer(const std::string& peer) const { return m_peers.count(peer) != 0; }
+    std::size_t peerCount() const { return m_peers.size(); }
+
+    // Adds a block to download. Heights have to follow each other.
+    void addBlock(int height, const uchar_vector& hash);
+
+    // A block the peer is about to send without being asked, such as a new tip it announced.
+    void expectBlock(const std::string& peer, int height, const uchar_vector& hash);
+
+    // Highest height added, -1 if none.
+    int lastHeight() const { return m_lastHeight; }
+
+    // Next height to deliver, -1 if none added.
+    int nextHeight() const { return m_nextHeight; }
+
+    // True if nothing is waiting to be requested, downloaded or delivered.
+    bool isIdle() const { return m_queue.empty() && m_blocks.empty(); }
+
+    // Forgets all blocks. Peers are kept.
+    void clear();
+
+    // Sends requests to peers with room for more.
+    void requestBlocks();
+
+    // Each returns false if the message is not for the scheduler.
+    bool onMerkleBlock(const std::string& peer, const Coin::MerkleBlock& merkleBlock);
+    bool onTx(const std::string& peer, const Coin::Transaction& tx);
+    bool onBlock(const std::string& peer, const Coin::CoinBlock& block);
+    bool onPong(const std::string& peer, uint64_t nonce);
+
+    // Drops and returns peers with outstanding requests that made no progress for timeout.
+    std::vector<std::string> removeStalledPeers(clock_t::duration timeout);
+
+private:
+    struct Block
+    {
+        Block() : height(-1), bReceived(false), bClosed(false), bFullBlockRequested(false) { }
+
+        int height;
+        uchar_vector hash;
+        std::string peer;
+        bool bReceived;                 // merkle block is in
+        bool bClosed;                   // all transactions the peer will send are in
+        bool bFullBlockRequested;
+        Coin::MerkleBlock merkleBlock;
+        std::vector<Coin::hash256_t> txHashes;
+        std::unordered_map<Coin::hash256_t, Coin::Transaction> txs;
+    };
+
+    struct Peer
+    {
+        Peer() : current(-1), bStalled(false), lastProgress(clock_t::now()) { }
+
+        std::deque<int> requested;                      // heights whose merkle block is not in yet
+        int current;                                    // height of the block taking transactions, -1 if none
+        std::deque<std::pair<uint64_t, std::vector<int>>> pings; // heights each pong closes
+        bool bStalled;
+        clock_t::time_point lastProgress;
+    };
+
+    request_slot_t m_requestSlot;
+    request_block_slot_t m_requestBlockSlot;
+    block_slot_t m_blockSlot;
+    mempool_slot_t m_mempoolSlot;
+
+    std::size_t m_blocksPerPeer;
+    std::map<int, uchar_vector> m_queue;    // not requested yet, by height
+    std::map<int, Block> m_blocks;          // requested and not delivered yet, by height
+    std::map<std::string, Peer> m_peers;
+    int m_nextHeight;                       // next block to deliver
+    int m_lastHeight;
+    uint64_t m_nonce;
+
+    void requeue(Peer& peer, const std::string& name);
+    void close(Block& block);
+    void deliver();
+};
+
+    }
+}
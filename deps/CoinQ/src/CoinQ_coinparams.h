@@ -23,6 +23,9 @@ namespace CoinQ {
 
 typedef std::vector<std::string> SeedParams;
 
+// Known best chain hashes by height. Header sync downloads the stretches between them in parallel.
+typedef std::map<int, uchar_vector> CheckpointParams;
+
 class CoinParams
 {
 public:
@@ -48,7 +51,8 @@ public:
         Coin::hashfunc_t block_header_pow_hash_function,
         const Coin::CoinBlockHeader& genesis_block,
         const SeedParams& seeds,
-        bool segwit_enabled = false) :
+        bool segwit_enabled = false,
+        const CheckpointParams& checkpoints = CheckpointParams()) :
     magic_bytes_(magic_bytes),
     protocol_version_(protocol_version),
     default_port_(default_port),
@@ -68,7 +72,8 @@ public:
     block_header_pow_hash_function_(block_header_pow_hash_function),
     genesis_block_(genesis_block),
     seeds_(seeds),
-    segwit_enabled_(segwit_enabled)
+    segwit_enabled_(segwit_enabled),
+    checkpoints_(checkpoints)
     {
         address_versions_[0] = pay_to_pubkey_hash_version_;
         address_versions_[1] = pay_to_script_hash_version_;
@@ -104,6 +109,7 @@ public:
     const Coin::CoinBlockHeader&    genesis_block() const { return genesis_block_; }
     const CoinQ::SeedParams&        get_seeds() const { return seeds_; }
     bool                            segwit_enabled() const { return segwit_enabled_; }
+    const CoinQ::CheckpointParams&  checkpoints() const { return checkpoints_; }
 
 private:
     uint32_t                 magic_bytes_;
@@ -128,6 +134,7 @@ private:
     Coin::CoinBlockHeader    genesis_block_;
     SeedParams               seeds_;
     bool                     segwit_enabled_;
+    CheckpointParams         checkpoints_;
 };
 
 typedef std::pair<std::string, const CoinParams&> NetworkPair;
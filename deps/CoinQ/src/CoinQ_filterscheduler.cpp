@@ -0,0 +1,387 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_filterscheduler.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "CoinQ_filterscheduler.h"
+
+#include <CoinCore/BlockFilter.h>
+#include <CoinCore/MerkleTree.h>
+
+#include <logger/logger.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace CoinQ::Network;
+
+void CompactFilterScheduler::setWatched(const std::vector<uchar_vector>& scripts, const std::vector<uchar_vector>& outpoints)
+{
+    m_scriptSet = std::set<uchar_vector>(scripts.begin(), scripts.end());
+    m_scriptSet.erase(uchar_vector());
+    m_scripts.assign(m_scriptSet.begin(), m_scriptSet.end());
+    m_outpoints = std::set<uchar_vector>(outpoints.begin(), outpoints.end());
+}
+
+bool CompactFilterScheduler::isWatched(const Coin::Transaction& tx) const
+{
+    for (auto& txIn: tx.inputs)
+    {
+        if (m_outpoints.count(txIn.previousOut.getSerialized())) return true;
+    }
+    for (auto& txOut: tx.outputs)
+    {
+        if (m_scriptSet.count(txOut.scriptPubKey)) return true;
+    }
+    return false;
+}
+
+void CompactFilterScheduler::addPeer(const std::string& peer)
+{
+    m_peers[peer];
+}
+
+void CompactFilterScheduler::removePeer(const std::string& peer)
+{
+    auto it = m_peers.find(peer);
+    if (it == m_peers.end()) return;
+
+    release(peer, it->second);
+    m_peers.erase(it);
+}
+
+void CompactFilterScheduler::addBlock(int height, const Coin::CoinBlockHeader& header)
+{
+    if (isIdle())
+    {
+        m_nextHeight = height;
+
+        // Filter headers chain on from the last block delivered. Anywhere else they start over
+        // from the one the next cfheaders gives.
+        if (m_headersHeight != height - 1)
+        {
+            m_headersHeight = height - 1;
+            m_lastFilterHeader.clear();
+            m_headersPeer.clear();
+        }
+    }
+    else if (height != m_lastHeight + 1)
+    {
+        throw std::runtime_error("CompactFilterScheduler::addBlock() - heights must follow each other.");
+    }
+
+    Block& block = m_blocks[height];
+    block.height = height;
+    block.header = header;
+    block.hash = header.hash();
+    m_lastHeight = height;
+}
+
+void CompactFilterScheduler::clear()
+{
+    m_blocks.clear();
+    m_filterQueue.clear();
+    m_blockQueue.clear();
+    for (auto& item: m_peers)
+    {
+        item.second.filters.clear();
+        item.second.blocks.clear();
+    }
+    m_nextHeight = -1;
+    m_lastHeight = -1;
+    m_headersHeight = -1;
+    m_lastFilterHeader.clear();
+    m_headersPeer.clear();
+    m_headersStopHeight = -1;
+}
+
+void CompactFilterScheduler::request()
+{
+    requestHeaders();
+    requestFilters();
+    requestBlocks();
+}
+
+bool CompactFilterScheduler::onCFHeaders(const std::string& peer, const Coin::CFHeadersMessage& cfheaders)
+{
+    if (peer != m_headersPeer || cfheaders.filterType != Coin::BlockFilter::BASIC_FILTER_TYPE) return false;
+
+    auto stopIt = m_blocks.find(m_headersStopHeight);
+    if (stopIt == m_blocks.end() || cfheaders.stopHash != stopIt->second.hash) return false;
+
+    Peer& p = m_peers[peer];
+    if (cfheaders.filterHashes.size() != (std::size_t)(m_headersStopHeight - m_headersHeight))
+    {
+        p.bStalled = true;
+        release(peer, p);
+        throw std::runtime_error("CompactFilterScheduler::onCFHeaders() - wrong number of filter hashes.");
+    }
+
+    if (!m_lastFilterHeader.empty() && cfheaders.prevFilterHeader != m_lastFilterHeader)
+    {
+        p.bStalled = true;
+        release(peer, p);
+        throw std::runtime_error("CompactFilterScheduler::onCFHeaders() - filter headers do not connect.");
+    }
+
+    uchar_vector filterHeader = cfheaders.prevFilterHeader;
+    int height = m_headersHeight;
+    for (auto& filterHash: cfheaders.filterHashes)
+    {
+        Block& block = m_blocks[++height];
+        block.filterHash = filterHash;
+        filterHeader = Coin::BlockFilter::getHeader(filterHash, filterHeader);
+        m_filterQueue.insert(height);
+    }
+
+    LOGGER(trace) << "CompactFilterScheduler - " << peer << " sent filter hashes up to height " << m_headersStopHeight << std::endl;
+    m_headersHeight = m_headersStopHeight;
+    m_lastFilterHeader = filterHeader;
+    m_headersPeer.clear();
+    p.lastProgress = clock_t::now();
+
+    request();
+    return true;
+}
+
+bool CompactFilterScheduler::onCFilter(const std::string& peer, const Coin::CFilterMessage& cfilter)
+{
+    auto peerIt = m_peers.find(peer);
+    if (peerIt == m_peers.end() || peerIt->second.filters.empty()) return false;
+    Peer& p = peerIt->second;
+
+    // The peer answers in order.
+    Block& block = m_blocks[p.filters.front()];
+    if (cfilter.filterType != Coin::BlockFilter::BASIC_FILTER_TYPE || cfilter.blockHash != block.hash) return false;
+
+    Coin::BlockFilter filter;
+    try
+    {
+        filter = Coin::BlockFilter(block.hash, cfilter.filter);
+        if (filter.getHash() != block.filterHash) throw std::runtime_error("CompactFilterScheduler::onCFilter() - filter does not match its hash.");
+        block.bMatched = filter.matchAny(m_scripts);
+    }
+    catch (...)
+    {
+        p.bStalled = true;
+        release(peer, p);
+        throw;
+    }
+
+    p.filters.pop_front();
+    p.lastProgress = clock_t::now();
+    block.bFilterChecked = true;
+    block.peer.clear();
+
+    if (block.bMatched)
+    {
+        LOGGER(trace) << "CompactFilterScheduler - filter for block " << block.hash.getHex() << " matches, asking for the full block." << std::endl;
+        m_blockQueue.insert(block.height);
+    }
+
+    deliver();
+    request();
+    return true;
+}
+
+bool CompactFilterScheduler::onBlock(const std::string& peer, const Coin::CoinBlock& coinBlock)
+{
+    auto peerIt = m_peers.find(peer);
+    if (peerIt == m_peers.end()) return false;
+    Peer& p = peerIt->second;
+
+    uchar_vector hash = coinBlock.hash();
+    auto it = std::find_if(p.blocks.begin(), p.blocks.end(), [&](int height) { return m_blocks[height].hash == hash; });
+    if (it == p.blocks.end()) return false;
+
+    if (!coinBlock.isValidMerkleRoot())
+    {
+        p.bStalled = true;
+        release(peer, p);
+        throw std::runtime_error("CompactFilterScheduler::onBlock() - invalid merkle root.");
+    }
+
+    Block& block = m_blocks[*it];
+    p.blocks.erase(it);
+    p.lastProgress = clock_t::now();
+
+    block.block = coinBlock;
+    block.bHaveBlock = true;
+    block.peer.clear();
+
+    deliver();
+    request();
+    return true;
+}
+
+std::vector<std::string> CompactFilterScheduler::removeStalledPeers(clock_t::duration timeout)
+{
+    clock_t::time_point now = clock_t::now();
+    std::vector<std::string> stalled;
+    for (auto& item: m_peers)
+    {
+        Peer& peer = item.second;
+        bool bBusy = peer.isBusy() || item.first == m_headersPeer;
+        if (peer.bStalled || (bBusy && now - peer.lastProgress > timeout)) { stalled.push_back(item.first); }
+    }
+
+    for (auto& peer: stalled)
+    {
+        LOGGER(debug) << "CompactFilterScheduler - dropping stalled peer " << peer << std::endl;
+        removePeer(peer);
+    }
+
+    if (!stalled.empty()) { request(); }
+    return stalled;
+}
+
+void CompactFilterScheduler::requestHeaders()
+{
+    if (!m_headersPeer.empty() || m_headersHeight >= m_lastHeight) return;
+
+    // From whichever peer has the least to do.
+    auto best = m_peers.end();
+    for (auto it = m_peers.begin(); it != m_peers.end(); ++it)
+    {
+        if (it->second.bStalled) continue;
+        if (best == m_peers.end() || it->second.filters.size() + it->second.blocks.size() < best->second.filters.size() + best->second.blocks.size()) { best = it; }
+    }
+    if (best == m_peers.end()) return;
+
+    if (!best->second.isBusy()) { best->second.lastProgress = clock_t::now(); }
+    m_headersPeer = best->first;
+    m_headersStopHeight = std::min(m_headersHeight + MAX_GET_CFHEADERS_BLOCKS, m_lastHeight);
+
+    LOGGER(trace) << "CompactFilterScheduler - requesting filter hashes from " << m_headersPeer << " for heights " << m_headersHeight + 1 << " to " << m_headersStopHeight << std::endl;
+    m_requestHeadersSlot(m_headersPeer, m_headersHeight + 1, m_blocks[m_headersStopHeight].hash);
+}
+
+void CompactFilterScheduler::requestFilters()
+{
+    for (auto& item: m_peers)
+    {
+        Peer& peer = item.second;
+        if (peer.bStalled || !peer.filters.empty()) continue;
+        if (m_filterQueue.empty() || *m_filterQueue.begin() >= m_nextHeight + MAX_BLOCKS_AHEAD) break;
+
+        // A run of heights that follow each other, so one getcfilters covers them.
+        int startHeight = *m_filterQueue.begin();
+        int stopHeight = startHeight;
+        while (!m_filterQueue.empty() && *m_filterQueue.begin() == stopHeight && stopHeight < startHeight + FILTERS_PER_REQUEST && stopHeight < m_nextHeight + MAX_BLOCKS_AHEAD)
+        {
+            m_filterQueue.erase(m_filterQueue.begin());
+            m_blocks[stopHeight].peer = item.first;
+            peer.filters.push_back(stopHeight);
+            stopHeight++;
+        }
+        stopHeight--;
+
+        if (peer.blocks.empty() && item.first != m_headersPeer) { peer.lastProgress = clock_t::now(); }
+        LOGGER(trace) << "CompactFilterScheduler - requesting " << stopHeight - startHeight + 1 << " filters from " << item.first << " starting at height " << startHeight << std::endl;
+        m_requestFiltersSlot(item.first, startHeight, m_blocks[stopHeight].hash);
+    }
+}
+
+void CompactFilterScheduler::requestBlocks()
+{
+    while (!m_blockQueue.empty())
+    {
+        auto best = m_peers.end();
+        for (auto it = m_peers.begin(); it != m_peers.end(); ++it)
+        {
+            if (it->second.bStalled) continue;
+            if (best == m_peers.end() || it->second.blocks.size() < best->second.blocks.size()) { best = it; }
+        }
+        if (best == m_peers.end()) return;
+
+        Block& block = m_blocks[*m_blockQueue.begin()];
+        m_blockQueue.erase(m_blockQueue.begin());
+
+        Peer& peer = best->second;
+        if (!peer.isBusy() && best->first != m_headersPeer) { peer.lastProgress = clock_t::now(); }
+        peer.blocks.insert(block.height);
+        block.peer = best->first;
+        block.bBlockRequested = true;
+        m_requestBlockSlot(best->first, block.hash);
+    }
+}
+
+void CompactFilterScheduler::release(const std::string& name, Peer& peer)
+{
+    for (int height: peer.filters)
+    {
+        m_blocks[height].peer.clear();
+        m_filterQueue.insert(height);
+    }
+    peer.filters.clear();
+
+    for (int height: peer.blocks)
+    {
+        Block& block = m_blocks[height];
+        block.peer.clear();
+        block.bBlockRequested = false;
+        m_blockQueue.insert(height);
+    }
+    peer.blocks.clear();
+
+    if (m_headersPeer == name) { m_headersPeer.clear(); }
+}
+
+void CompactFilterScheduler::selectTxs(Block& block, std::vector<Coin::hash256_t>& txHashes, std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs, Coin::MerkleBlock& merkleBlock)
+{
+    // The byte order of the tx hashes must be reversed when moving between merkle trees and the block chain
+    if (!block.bMatched)
+    {
+        Coin::PartialMerkleTree tree(std::vector<Coin::MerkleLeaf>(1, Coin::MerkleLeaf(block.header.merkleRoot().getReverse(), false)));
+        merkleBlock = Coin::MerkleBlock(block.header, tree.getNTxs(), tree.getMerkleHashesVector(), tree.getFlags());
+        return;
+    }
+
+    std::vector<Coin::MerkleLeaf> leaves;
+    leaves.reserve(block.block.txs.size());
+    for (auto& tx: block.block.txs)
+    {
+        uchar_vector txHash = tx.hash();
+        bool bWatched = isWatched(tx);
+        if (bWatched)
+        {
+            // Later transactions in this block or the next may spend what this one pays us.
+            for (uint32_t i = 0; i < tx.outputs.size(); i++)
+            {
+                if (m_scriptSet.count(tx.outputs[i].scriptPubKey)) { m_outpoints.insert(Coin::OutPoint(txHash, i).getSerialized()); }
+            }
+
+            txHashes.push_back(Coin::hash256_t(txHash));
+            txs[txHashes.back()] = tx;
+        }
+        leaves.push_back(Coin::MerkleLeaf(txHash.getReverse(), bWatched));
+    }
+
+    Coin::PartialMerkleTree tree(leaves);
+    merkleBlock = Coin::MerkleBlock(block.header, tree.getNTxs(), tree.getMerkleHashesVector(), tree.getFlags());
+}
+
+void CompactFilterScheduler::deliver()
+{
+    while (!m_blocks.empty() && m_blocks.begin()->first == m_nextHeight)
+    {
+        Block& front = m_blocks.begin()->second;
+        if (!front.bFilterChecked || (front.bMatched && !front.bHaveBlock)) break;
+
+        Block block = std::move(front);
+        m_blocks.erase(m_blocks.begin());
+        m_nextHeight++;
+
+        Coin::MerkleBlock merkleBlock;
+        std::vector<Coin::hash256_t> txHashes;
+        std::unordered_map<Coin::hash256_t, Coin::Transaction> txs;
+        selectTxs(block, txHashes, txs, merkleBlock);
+
+        m_blockSlot(block.height, merkleBlock, txHashes, txs);
+    }
+}
@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_filterscheduler.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include "CoinQ_blockscheduler.h"
+
+#include <CoinCore/CoinNodeData.h>
+#include <CoinCore/fixedhash.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CoinQ {
+    namespace Network {
+
+// Syncs blocks with BIP157/158 compact block filters instead of bloom filtered blocks, and hands
+// them back in height order the same way MerkleBlockScheduler does.
+//
+// Filter hashes come first, one cfheaders message at a time, and are chained into filter headers
+// from the one the first message gives for the block before. Filters are then asked for in runs
+// spread over the peers and each is checked against its hash. All the watched scripts are matched
+// against a filter at once. For a block that matches, the full block is downloaded and the
+// transactions paying a watched script or spending a watched outpoint are picked out of it;
+// outputs they pay to watched scripts are watched from then on. Any other block is handed back
+// with no transactions, as a merkle block of a single unmatched leaf.
+//
+// The filter headers are taken from the peers on trust, as bloom filtered blocks are.
+//
+// Not thread safe. Callbacks are called from inside the methods below.
+class CompactFilterScheduler
+{
+public:
+    typedef std::chrono::steady_clock clock_t;
+
+    // Sends a getcfheaders or a getcfilters for the blocks from startHeight up to stopHash.
+    typedef std::function<void(const std::string& peer, uint32_t startHeight, const uchar_vector& stopHash)> request_slot_t;
+
+    // Sends a getdata for the full block to the peer.
+    typedef MerkleBlockScheduler::request_block_slot_t request_block_slot_t;
+
+    // A block, in height order. txs holds all the matching transactions.
+    typedef MerkleBlockScheduler::block_slot_t block_slot_t;
+
+    enum { MAX_BLOCKS_AHEAD = 1000 };       // beyond the next block to deliver
+    enum { FILTERS_PER_REQUEST = 100 };
+
+    CompactFilterScheduler(request_slot_t requestHeadersSlot, request_slot_t requestFiltersSlot, request_block_slot_t requestBlockSlot, block_slot_t blockSlot)
+        : m_requestHeadersSlot(requestHeadersSlot), m_requestFiltersSlot(requestFiltersSlot), m_requestBlockSlot(requestBlockSlot), m_blockSlot(blockSlot),
+          m_nextHeight(-1), m_lastHeight(-1), m_headersHeight(-1), m_headersStopHeight(-1) { }
+
+    // Outpoints are serialized.
+    void setWatched(const std::vector<uchar_vector>& scripts, const std::vector<uchar_vector>& outpoints);
+    bool isWatching() const { return !m_scripts.empty(); }
+
+    // True if the transaction pays a watched script or spends a watched outpoint.
+    bool isWatched(const Coin::Transaction& tx) const;
+
+    void addPeer(const std::string& peer);
+    void removePeer(const std::string& peer);  // its requests go to the others
+    bool hasPeer(const std::string& peer) const { return m_peers.count(peer) != 0; }
+    std::size_t peerCount() const { return m_peers.size(); }
+
+    // Adds a block to download. Heights have to follow each other.
+    void addBlock(int height, const Coin::CoinBlockHeader& header);
+
+    // Highest height added, -1 if none.
+    int lastHeight() const { return m_lastHeight; }
+
+    // Next height to deliver, -1 if none added.
+    int nextHeight() const { return m_nextHeight; }
+
+    // True if nothing is waiting to be requested, downloaded or delivered.
+    bool isIdle() const { return m_blocks.empty(); }
+
+    // Forgets all blocks and filter headers. Peers and watched scripts are kept.
+    void clear();
+
+    // Sends requests to peers with nothing to do.
+    void request();
+
+    // Each returns false if the message is not for the scheduler. They throw if a peer sends
+    // something that does not check out; its requests go to the other peers first.
+    bool onCFHeaders(const std::string& peer, const Coin::CFHeadersMessage& cfheaders);
+    bool onCFilter(const std::string& peer, const Coin::CFilterMessage& cfilter);
+    bool onBlock(const std::string& peer, const Coin::CoinBlock& coinBlock);
+
+    // Drops and returns peers with outstanding requests that made no progress for timeout.
+    std::vector<std::string> removeStalledPeers(clock_t::duration timeout);
+
+private:
+    struct Block
+    {
+        Block() : height(-1), bFilterChecked(false), bMatched(false), bBlockRequested(false), bHaveBlock(false) { }
+
+        int height;
+        Coin::CoinBlockHeader header;
+        uchar_vector hash;
+        uchar_vector filterHash;        // empty until the cfheaders for it are in
+        std::string peer;               // the filter or full block is asked for from
+        bool bFilterChecked;
+        bool bMatched;
+        bool bBlockRequested;
+        bool bHaveBlock;
+        Coin::CoinBlock block;
+    };
+
+    struct Peer
+    {
+        Peer() : bStalled(false), lastProgress(clock_t::now()) { }
+
+        std::deque<int> filters;        // heights whose filter is not in yet, in order
+        std::set<int> blocks;           // heights whose full block is not in yet
+        bool bStalled;
+        clock_t::time_point lastProgress;
+
+        bool isBusy() const { return !filters.empty() || !blocks.empty(); }
+    };
+
+    request_slot_t m_requestHeadersSlot;
+    request_slot_t m_requestFiltersSlot;
+    request_block_slot_t m_requestBlockSlot;
+    block_slot_t m_blockSlot;
+
+    std::vector<uchar_vector> m_scripts;
+    std::set<uchar_vector> m_scriptSet;
+    std::set<uchar_vector> m_outpoints;
+
+    std::map<int, Block> m_blocks;          // added and not delivered yet, by height
+    std::set<int> m_filterQueue;            // filter hash in, filter not asked for
+    std::set<int> m_blockQueue;             // filter matched, full block not asked for
+    std::map<std::string, Peer> m_peers;
+    int m_nextHeight;                       // next block to deliver
+    int m_lastHeight;
+
+    int m_headersHeight;                    // filter hashes are in up to here
+    uchar_vector m_lastFilterHeader;        // at m_headersHeight, empty before the first cfheaders
+    std::string m_headersPeer;              // cfheaders asked for from, empty if none
+    int m_headersStopHeight;
+
+    void requestHeaders();
+    void requestFilters();
+    void requestBlocks();
+    void release(const std::string& name, Peer& peer);
+    void selectTxs(Block& block, std::vector<Coin::hash256_t>& txHashes, std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs, Coin::MerkleBlock& merkleBlock);
+    void deliver();
+};
+
+    }
+}
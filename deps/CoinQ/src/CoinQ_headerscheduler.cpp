@@ -0,0 +1,194 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_headerscheduler.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "CoinQ_headerscheduler.h"
+
+#include <logger/logger.h>
+
+#include <algorithm>
+#include <sstream>
+
+using namespace CoinQ::Network;
+
+void HeaderRangeScheduler::addPeer(const std::string& peer)
+{
+    m_peers[peer];
+}
+
+void HeaderRangeScheduler::removePeer(const std::string& peer)
+{
+    Range* range = findRange(peer);
+    if (range) { range->peer.clear(); }
+    m_peers.erase(peer);
+}
+
+void HeaderRangeScheduler::start(int height)
+{
+    m_ranges.clear();
+
+    auto it = m_checkpoints.upper_bound(height);
+    if (it == m_checkpoints.end()) return;
+
+    for (auto next = std::next(it); next != m_checkpoints.end(); it = next++)
+    {
+        Range range;
+        range.startHeight = range.lastHeight = it->first;
+        range.startHash = range.lastHash = it->second;
+        range.endHeight = next->first;
+        range.endHash = next->second;
+        m_ranges.push_back(range);
+    }
+
+    if (!m_ranges.empty())
+    {
+        LOGGER(trace) << "HeaderRangeScheduler - " << m_ranges.size() << " ranges from height " << m_ranges.front().startHeight << " to " << m_ranges.back().endHeight << std::endl;
+    }
+}
+
+void HeaderRangeScheduler::requestRanges()
+{
+    std::size_t count = std::min<std::size_t>(m_ranges.size(), MAX_RANGES_AHEAD + 1);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        Range& range = m_ranges[i];
+        if (!range.peer.empty() || range.isComplete()) continue;
+
+        auto peerIt = std::find_if(m_peers.begin(), m_peers.end(), [&](const std::pair<const std::string, Peer>& item) {
+            return !item.second.bStalled && !findRange(item.first);
+        });
+        if (peerIt == m_peers.end()) return;
+
+        range.peer = peerIt->first;
+        peerIt->second.lastProgress = clock_t::now();
+        LOGGER(trace) << "HeaderRangeScheduler - requesting headers " << range.lastHeight + 1 << " to " << range.endHeight << " from " << range.peer << std::endl;
+        m_requestSlot(range.peer, range.lastHash, range.endHash);
+    }
+}
+
+bool HeaderRangeScheduler::onHeaders(const std::string& peer, const headers_t& headers)
+{
+    Range* range = findRange(peer);
+    if (!range) return false;
+
+    Peer& p = m_peers[peer];
+    if (headers.empty())
+    {
+        // It does not have the range.
+        LOGGER(debug) << "HeaderRangeScheduler - " << peer << " has no headers after height " << range->lastHeight << std::endl;
+        range->peer.clear();
+        p.bStalled = true;
+        requestRanges();
+        return true;
+    }
+
+    // Anything else is an answer to a request made before the range was taken away.
+    if (headers.front().prevBlockHash() != range->lastHash) return false;
+
+    for (std::size_t i = 1; i < headers.size(); i++)
+    {
+        if (headers[i].prevBlockHash() != headers[i - 1].hash())
+        {
+            LOGGER(debug) << "HeaderRangeScheduler - " << peer << " sent headers that do not connect." << std::endl;
+            range->peer.clear();
+            p.bStalled = true;
+            requestRanges();
+            return true;
+        }
+    }
+
+    int height = range->lastHeight + (int)headers.size();
+    if (height > range->endHeight || (height == range->endHeight && headers.back().hash() != range->endHash))
+    {
+        std::stringstream reason;
+        reason << peer << " does not have checkpoint " << range->endHash.getHex() << " at height " << range->endHeight;
+        abandon(reason.str());
+        return true;
+    }
+
+    range->headers.push_back(headers);
+    range->lastHeight = height;
+    range->lastHash = headers.back().hash();
+    p.lastProgress = clock_t::now();
+
+    if (range->isComplete())
+    {
+        range->peer.clear();
+        requestRanges();
+    }
+    else
+    {
+        m_requestSlot(peer, range->lastHash, range->endHash);
+    }
+    return true;
+}
+
+std::vector<HeaderRangeScheduler::headers_t> HeaderRangeScheduler::advance(int& height, uchar_vector& hash)
+{
+    std::vector<headers_t> headers;
+    while (!m_ranges.empty() && height >= m_ranges.front().startHeight)
+    {
+        Range& range = m_ranges.front();
+        if (height > range.startHeight || hash != range.startHash)
+        {
+            std::stringstream reason;
+            reason << "main peer does not have checkpoint " << range.startHash.getHex() << " at height " << range.startHeight;
+            abandon(reason.str());
+            break;
+        }
+
+        for (auto& message: range.headers) { headers.push_back(std::move(message)); }
+        height = range.lastHeight;
+        hash = range.lastHash;
+
+        // Whoever is working on an incomplete range gets something else, the main peer goes on from here.
+        bool bComplete = range.isComplete();
+        m_ranges.pop_front();
+        if (!bComplete) break;
+    }
+
+    requestRanges();
+    return headers;
+}
+
+std::vector<std::string> HeaderRangeScheduler::releaseStalledPeers(clock_t::duration timeout)
+{
+    clock_t::time_point now = clock_t::now();
+    std::vector<std::string> stalled;
+    for (auto& range: m_ranges)
+    {
+        if (range.peer.empty()) continue;
+
+        Peer& peer = m_peers[range.peer];
+        if (now - peer.lastProgress <= timeout) continue;
+
+        LOGGER(debug) << "HeaderRangeScheduler - " << range.peer << " stalled at height " << range.lastHeight << std::endl;
+        stalled.push_back(range.peer);
+        peer.bStalled = true;
+        range.peer.clear();
+    }
+
+    if (!stalled.empty()) { requestRanges(); }
+    return stalled;
+}
+
+HeaderRangeScheduler::Range* HeaderRangeScheduler::findRange(const std::string& peer)
+{
+    for (auto& range: m_ranges)
+    {
+        if (range.peer == peer) return &range;
+    }
+    return nullptr;
+}
+
+void HeaderRangeScheduler::abandon(const std::string& reason)
+{
+    LOGGER(debug) << "HeaderRangeScheduler - dropping ranges, " << reason << std::endl;
+    m_ranges.clear();
+}
@@ -0,0 +1,118 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_headerscheduler.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include "CoinQ_coinparams.h"
+
+#include <CoinCore/CoinNodeData.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace CoinQ {
+    namespace Network {
+
+// Downloads the stretches of the header chain between checkpoints from several peers at once
+// while the main peer works its way up from our tip, and hands each stretch back once the main
+// peer's headers reach its start.
+//
+// A range is asked for one getheaders at a time from its last hash, stopping at the checkpoint
+// that ends it. Ranges are only handed out a few ahead of the one the main peer is working toward
+// so what is held here stays bounded. When the main peer gets to a range that is not complete it
+// takes over the rest of it.
+//
+// Checkpoints only mark where ranges start and stop. If headers do not agree with one, the ranges
+// are dropped and the main peer syncs the rest on its own.
+//
+// Not thread safe. Callbacks are called from inside the methods below.
+class HeaderRangeScheduler
+{
+public:
+    typedef std::chrono::steady_clock clock_t;
+    typedef std::vector<Coin::CoinBlockHeader> headers_t;
+
+    // Sends a getheaders for the headers after locatorHash up to hashStop to the peer.
+    typedef std::function<void(const std::string& peer, const uchar_vector& locatorHash, const uchar_vector& hashStop)> request_slot_t;
+
+    enum { MAX_RANGES_AHEAD = 4 }; // handed out beyond the one the main peer is working toward
+
+    explicit HeaderRangeScheduler(request_slot_t requestSlot) : m_requestSlot(requestSlot) { }
+
+    void setCheckpoints(const CheckpointParams& checkpoints) { m_checkpoints = checkpoints; }
+
+    void addPeer(const std::string& peer);
+    void removePeer(const std::string& peer);   // its range goes to another peer
+    bool hasPeer(const std::string& peer) const { return m_peers.count(peer) != 0; }
+
+    // Lays out a range between each pair of checkpoints above height. The main peer is to fetch
+    // the headers up to the first of them.
+    void start(int height);
+
+    // Forgets all ranges. Peers are kept.
+    void clear() { m_ranges.clear(); }
+
+    bool isIdle() const { return m_ranges.empty(); }
+
+    // Hash the main peer should stop at, zero if it should go to its tip.
+    const uchar_vector& hashStop() const { return m_ranges.empty() ? g_zero32bytes : m_ranges.front().startHash; }
+
+    // Sends requests to peers without a range.
+    void requestRanges();
+
+    // Returns false if the message is not for the scheduler.
+    bool onHeaders(const std::string& peer, const headers_t& headers);
+
+    // The main peer's headers now reach height and hash. Returns the messages of the ranges that
+    // follow on from there, in order, and moves height and hash to the end of them.
+    std::vector<headers_t> advance(int& height, uchar_vector& hash);
+
+    // Ranges of peers that made no progress for timeout go to other peers. Returns those peers.
+    std::vector<std::string> releaseStalledPeers(clock_t::duration timeout);
+
+private:
+    struct Range
+    {
+        int startHeight;
+        uchar_vector startHash;
+        int endHeight;
+        uchar_vector endHash;
+        int lastHeight;                 // of the last header in
+        uchar_vector lastHash;
+        std::vector<headers_t> headers; // messages in, in order
+        std::string peer;               // empty if nobody is working on it
+
+        bool isComplete() const { return lastHeight == endHeight; }
+    };
+
+    struct Peer
+    {
+        Peer() : bStalled(false), lastProgress(clock_t::now()) { }
+
+        bool bStalled;                  // not given ranges any more
+        clock_t::time_point lastProgress;
+    };
+
+    request_slot_t m_requestSlot;
+
+    CheckpointParams m_checkpoints;
+    std::deque<Range> m_ranges;         // in height order, each starting where the one before ends
+    std::map<std::string, Peer> m_peers;
+
+    Range* findRange(const std::string& peer);
+    void abandon(const std::string& reason);
+};
+
+    }
+}
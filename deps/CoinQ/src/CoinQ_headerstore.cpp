@@ -0,0 +1,436 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_headerstore.cpp
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "CoinQ_headerstore.h"
+#include "CoinQ_parallel.h"
+
+#include <logger/logger.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread.hpp>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace CoinQ;
+
+// Index layout: magic, little endian record count, then one 32-byte hash per record.
+static const char INDEX_MAGIC[4] = { 'H', 'I', 'D', 'X' };
+static const std::size_t INDEX_HEADER_SIZE = 8;
+static const std::size_t INDEX_ENTRY_SIZE = Coin::hash256_t::SIZE;
+
+typedef std::unique_ptr<FILE, int(*)(FILE*)> file_ptr_t;
+
+static std::string getIndexFilename(const std::string& filename)
+{
+    return filename + ".idx";
+}
+
+// Opens for reading and writing, creating the file if it does not exist.
+static file_ptr_t openForUpdate(const std::string& filename)
+{
+    FILE* f = fopen(filename.c_str(), "r+b");
+    if (!f) f = fopen(filename.c_str(), "w+b");
+    if (!f) throw BlockTreeFileWriteFailureException();
+    return file_ptr_t(f, fclose);
+}
+
+static void syncFile(FILE* f)
+{
+    if (fflush(f) != 0) throw BlockTreeFileWriteFailureException();
+#ifdef _WIN32
+    if (_commit(_fileno(f)) != 0) throw BlockTreeFileWriteFailureException();
+#else
+    if (fsync(fileno(f)) != 0) throw BlockTreeFileWriteFailureException();
+#endif
+}
+
+static void truncateFile(FILE* f, uint64_t size)
+{
+    if (fflush(f) != 0) throw BlockTreeFileWriteFailureException();
+#ifdef _WIN32
+    if (_chsize_s(_fileno(f), size) != 0) throw BlockTreeFileWriteFailureException();
+#else
+    if (ftruncate(fileno(f), size) != 0) throw BlockTreeFileWriteFailureException();
+#endif
+    if (fseek(f, 0, SEEK_END) != 0) throw BlockTreeFileWriteFailureException();
+}
+
+static void writeIndexCount(FILE* f, uint32_t count)
+{
+    unsigned char header[INDEX_HEADER_SIZE];
+    memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    for (int i = 0; i < 4; i++) { header[4 + i] = (count >> (8 * i)) & 0xff; }
+
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), f) != sizeof(header)) throw BlockTreeFileWriteFailureException();
+    syncFile(f);
+}
+
+namespace {
+
+// Reads the mapped records a batch at a time. Parsing, hashing and the checks run on the
+// worker threads. Whatever depends on the records before a batch, the checkpoint and the
+// linkage to the previous record, is settled in file order in between.
+class RecordReader
+{
+public:
+    enum { BATCH_SIZE = 8192 };
+
+    struct Batch
+    {
+        Batch() : begin(0), count(0) { }
+
+        std::size_t begin;
+        std::size_t count;
+        std::vector<Coin::CoinBlockHeader> headers;
+        std::vector<Coin::hash256_t> hashes;
+        std::vector<CoinQHeaderStore::RecordStatus> status;
+        std::vector<char> check;
+        std::vector<std::exception_ptr> errors;
+    };
+
+    RecordReader(const unsigned char* records, std::size_t count, const unsigned char* verifiedHashes, std::size_t verified, CoinQHeaderStore::check_slot_t checkHeader, unsigned int threads)
+        : mRecords(records), mCount(count), mVerifiedHashes(verifiedHashes), mVerified(verified), mCheckHeader(checkHeader), mThreads(threads), bLinked(true), bAbort(false) { }
+
+    // Fills batch with up to BATCH_SIZE records starting at begin. Batches have to be read in order.
+    void read(Batch& batch, std::size_t begin);
+
+    // Records covered by the checkpoint, once every batch has been read.
+    std::size_t getVerified() const { return mVerified; }
+
+    // Makes a read in progress skip the records it has not started on.
+    void abort() { bAbort = true; }
+
+private:
+    const unsigned char* mRecords;
+    std::size_t mCount;
+    const unsigned char* mVerifiedHashes;
+    std::size_t mVerified;
+    CoinQHeaderStore::check_slot_t mCheckHeader;
+    unsigned int mThreads;
+
+    // Every record so far has been the child of the one before it.
+    bool bLinked;
+    Coin::CoinBlockHeader mLastHeader;
+    Coin::hash256_t mLastHash;
+
+    std::atomic<bool> bAbort;
+
+    const unsigned char* getRecord(std::size_t pos) const { return mRecords + pos * CoinQHeaderStore::RECORD_SIZE; }
+    void hashRecord(Batch& batch, std::size_t i) const;
+};
+
+void RecordReader::hashRecord(Batch& batch, std::size_t i) const
+{
+    batch.hashes[i] = Coin::hash256_t(batch.headers[i].hash());
+    batch.status[i] = CoinQHeaderStore::UNCHECKED;
+    if (memcmp(getRecord(batch.begin + i) + CoinQHeaderStore::HEADER_SIZE, batch.hashes[i].data(), 4))
+    {
+        batch.errors[i] = std::make_exception_ptr(BlockTreeChecksumErrorException());
+    }
+}
+
+void RecordReader::read(Batch& batch, std::size_t begin)
+{
+    std::size_t count = std::min<std::size_t>(BATCH_SIZE, mCount - begin);
+    batch.begin = begin;
+    batch.count = count;
+    batch.headers.resize(count);
+    batch.hashes.resize(count);
+    batch.status.assign(count, CoinQHeaderStore::UNCHECKED);
+    batch.check.assign(count, false);
+    batch.errors.assign(count, nullptr);
+
+    parallelFor(count, mThreads, [&](std::size_t i) {
+        if (bAbort) return;
+        try
+        {
+            const unsigned char* record = getRecord(begin + i);
+            Coin::ByteReader reader(record, CoinQHeaderStore::HEADER_SIZE);
+            batch.headers[i].setSerialized(reader);
+
+            const unsigned char* verifiedHash = begin + i < mVerified ? mVerifiedHashes + (begin + i) * INDEX_ENTRY_SIZE : nullptr;
+            if (verifiedHash && !memcmp(record + CoinQHeaderStore::HEADER_SIZE, verifiedHash, 4))
+            {
+                batch.hashes[i] = Coin::hash256_t(verifiedHash);
+                batch.status[i] = CoinQHeaderStore::VERIFIED;
+            }
+            else
+            {
+                hashRecord(batch, i);
+            }
+        }
+        catch (...)
+        {
+            batch.errors[i] = std::current_exception();
+        }
+    });
+
+    bool bCheck = false;
+    for (std::size_t i = 0; i < count && !bAbort; i++)
+    {
+        std::size_t pos = begin + i;
+        if (batch.errors[i])
+        {
+            bLinked = false;
+            break;
+        }
+
+        if (batch.status[i] == CoinQHeaderStore::VERIFIED && pos >= mVerified)
+        {
+            // Matched its own checkpoint entry, but an earlier one did not.
+            hashRecord(batch, i);
+            if (batch.errors[i])
+            {
+                bLinked = false;
+                break;
+            }
+        }
+        else if (pos < mVerified && batch.status[i] != CoinQHeaderStore::VERIFIED)
+        {
+            // Stop trusting the checkpoint as soon as it disagrees with the file.
+            LOGGER(warning) << "CoinQHeaderStore::load() - checkpoint does not match record " << pos << std::endl;
+            mVerified = pos;
+        }
+
+        if (pos == 0) continue;
+
+        // The checks are only good for a record at its position in the chain, so once a record
+        // is not the child of the one before it the rest are left to onHeader.
+        const Coin::hash256_t& parentHash = i ? batch.hashes[i - 1] : mLastHash;
+        bLinked = bLinked && parentHash == batch.headers[i].prevBlockHash();
+        if (mCheckHeader && bLinked && batch.status[i] == CoinQHeaderStore::UNCHECKED)
+        {
+            batch.check[i] = true;
+            bCheck = true;
+        }
+    }
+
+    if (bCheck)
+    {
+        parallelFor(count, mThreads, [&](std::size_t i) {
+            if (bAbort || !batch.check[i]) return;
+            try
+            {
+                mCheckHeader(i ? batch.headers[i - 1] : mLastHeader, batch.headers[i], (int)(begin + i));
+                batch.status[i] = CoinQHeaderStore::CHECKED;
+            }
+            catch (...)
+            {
+                batch.errors[i] = std::current_exception();
+            }
+        });
+    }
+
+    if (count > 0)
+    {
+        mLastHeader = batch.headers[count - 1];
+        mLastHash = batch.hashes[count - 1];
+    }
+}
+
+}
+
+void CoinQHeaderStore::load(const std::string& filename, std::function<void(std::size_t)> reserve, header_slot_t onHeader, check_slot_t checkHeader, unsigned int threads)
+{
+    using namespace boost::interprocess;
+
+    boost::filesystem::path p(filename);
+    if (!boost::filesystem::exists(p)) throw BlockTreeFileNotFoundException();
+
+    if (!boost::filesystem::is_regular_file(p)) throw BlockTreeInvalidFileTypeException();
+
+    close();
+
+    uint64_t fileSize = boost::filesystem::file_size(p);
+    std::size_t records = fileSize / RECORD_SIZE;
+    if (records == 0) throw BlockTreeInvalidFileLengthException();
+    if (fileSize % RECORD_SIZE != 0)
+    {
+        LOGGER(warning) << "CoinQHeaderStore::load() - ignoring partial record at end of " << filename << std::endl;
+    }
+
+    file_mapping headerMapping;
+    mapped_region headerRegion;
+    try
+    {
+        file_mapping(filename.c_str(), read_only).swap(headerMapping);
+        mapped_region(headerMapping, read_only, 0, records * RECORD_SIZE).swap(headerRegion);
+        headerRegion.advise(mapped_region::advice_sequential);
+    }
+    catch (const interprocess_exception& e)
+    {
+        LOGGER(error) << "CoinQHeaderStore::load() - " << e.what() << std::endl;
+        throw BlockTreeFailedToOpenFileForReadException();
+    }
+
+    // A missing or unreadable checkpoint only means every record gets checked.
+    std::size_t verified = 0;
+    std::size_t indexCount = 0;
+    const unsigned char* verifiedHashes = nullptr;
+    file_mapping indexMapping;
+    mapped_region indexRegion;
+    boost::system::error_code ec;
+    boost::filesystem::path indexPath(getIndexFilename(filename));
+    uint64_t indexSize = boost::filesystem::exists(indexPath, ec) ? boost::filesystem::file_size(indexPath, ec) : 0;
+    if (!ec && indexSize >= INDEX_HEADER_SIZE)
+    {
+        try
+        {
+            file_mapping(indexPath.string().c_str(), read_only).swap(indexMapping);
+            mapped_region(indexMapping, read_only, 0, indexSize).swap(indexRegion);
+
+            const unsigned char* index = (const unsigned char*)indexRegion.get_address();
+            if (!memcmp(index, INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+            {
+                indexCount = index[4] | (index[5] << 8) | (index[6] << 16) | ((uint32_t)index[7] << 24);
+                verified = std::min(indexCount, std::min(records, (std::size_t)((indexSize - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE)));
+                verifiedHashes = index + INDEX_HEADER_SIZE;
+            }
+        }
+        catch (const interprocess_exception& e)
+        {
+            LOGGER(warning) << "CoinQHeaderStore::load() - checkpoint not used: " << e.what() << std::endl;
+        }
+    }
+
+    if (threads == 0) threads = std::max(1u, boost::thread::hardware_concurrency());
+
+    LOGGER(debug) << "CoinQHeaderStore::load() - " << records << " records, " << verified << " checkpointed, " << threads << " threads." << std::endl;
+
+    reserve(records);
+
+    // The next batch is read while onHeader goes through this one.
+    RecordReader reader((const unsigned char*)headerRegion.get_address(), records, verifiedHashes, verified, checkHeader, threads);
+    RecordReader::Batch batches[2];
+    reader.read(batches[0], 0);
+    for (int current = 0; batches[current].count > 0; current ^= 1)
+    {
+        const RecordReader::Batch& batch = batches[current];
+        RecordReader::Batch& next = batches[current ^ 1];
+        std::size_t nextBegin = batch.begin + batch.count;
+        next.count = 0;
+
+        std::exception_ptr readError;
+        boost::thread readAhead;
+        if (nextBegin < records)
+        {
+            readAhead = boost::thread([&reader, &next, &readError, nextBegin]() {
+                try
+                {
+                    reader.read(next, nextBegin);
+                }
+                catch (...)
+                {
+                    readError = std::current_exception();
+                }
+            });
+        }
+
+        try
+        {
+            for (std::size_t i = 0; i < batch.count; i++)
+            {
+                try
+                {
+                    if (batch.errors[i]) std::rethrow_exception(batch.errors[i]);
+                    onHeader(batch.headers[i], batch.hashes[i], batch.status[i]);
+                }
+                catch (const BlockTreeException&)
+                {
+                    throw;
+                }
+                catch (const std::exception& e)
+                {
+                    throw std::runtime_error(std::string("Block ") + batch.hashes[i].getHex() + ": " + e.what());
+                }
+            }
+        }
+        catch (...)
+        {
+            reader.abort();
+            if (readAhead.joinable()) readAhead.join();
+            throw;
+        }
+
+        if (readAhead.joinable()) readAhead.join();
+        if (readError) std::rethrow_exception(readError);
+    }
+
+    mFilename = filename;
+    mCount = reader.getVerified();
+    bTrimmed = indexCount == (std::size_t)mCount && fileSize == (uint64_t)mCount * RECORD_SIZE && indexSize == INDEX_HEADER_SIZE + (uint64_t)mCount * INDEX_ENTRY_SIZE;
+}
+
+void CoinQHeaderStore::write(int from, int to, record_slot_t getRecord)
+{
+    if (mFilename.empty()) throw std::runtime_error("CoinQHeaderStore::write() - no file open.");
+
+    from = std::max(0, std::min(from, std::min(mCount, to)));
+
+    // Nothing to cut: the checkpoint already ends at from.
+    bool bAppend = bTrimmed && from == mCount;
+    if (bAppend && to == from) return;
+
+    file_ptr_t index = openForUpdate(getIndexFilename(mFilename));
+    file_ptr_t headers = openForUpdate(mFilename);
+
+    if (bAppend)
+    {
+        if (fseek(headers.get(), 0, SEEK_END) != 0 || fseek(index.get(), 0, SEEK_END) != 0) throw BlockTreeFileWriteFailureException();
+    }
+    else
+    {
+        // Pull the checkpoint back first so a crash part way through never vouches for records
+        // that were cut or only partly written.
+        bTrimmed = false;
+        writeIndexCount(index.get(), from);
+        mCount = from;
+
+        truncateFile(headers.get(), (uint64_t)from * RECORD_SIZE);
+        truncateFile(index.get(), INDEX_HEADER_SIZE + (uint64_t)from * INDEX_ENTRY_SIZE);
+        bTrimmed = true;
+        if (to == from) return;
+    }
+
+    bTrimmed = false;
+
+    uchar_vector record;
+    Coin::hash256_t hash;
+    for (int height = from; height < to; height++)
+    {
+        record.clear();
+        getRecord(height, record, hash);
+        record.resize(HEADER_SIZE, 0);
+        record.insert(record.end(), hash.begin(), hash.begin() + 4);
+
+        if (fwrite(&record[0], 1, RECORD_SIZE, headers.get()) != RECORD_SIZE) throw BlockTreeFileWriteFailureException();
+        if (fwrite(hash.data(), 1, INDEX_ENTRY_SIZE, index.get()) != INDEX_ENTRY_SIZE) throw BlockTreeFileWriteFailureException();
+    }
+
+    // Headers and their hashes have to be on disk before the checkpoint covers them.
+    syncFile(headers.get());
+    syncFile(index.get());
+    writeIndexCount(index.get(), to);
+    mCount = to;
+    bTrimmed = true;
+}
@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_headerstore.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include "CoinQ_exceptions.h"
+
+#include <CoinCore/CoinNodeData.h>
+#include <CoinCore/fixedhash.h>
+
+#include <functional>
+#include <string>
+
+// Best chain headers on disk, one fixed-size record per height starting at the genesis block:
+// the header zero-padded to MIN_BCO_BLOCK_HEADER_SIZE followed by the first four bytes of its
+// hash. The file is memory-mapped read-only to load it. After that it only grows by appending
+// fsync'd records, and a reorg truncates it back to the fork point.
+//
+// A checkpoint index next to it (filename + ".idx") holds the full hash of every record that
+// was verified before it was written. Loading trusts those records, so they are neither
+// rehashed nor checked for proof of work again. Records past the checkpoint, such as the ones
+// in a file written by an older version, are checked as usual.
+class CoinQHeaderStore
+{
+public:
+    enum { HEADER_SIZE = MIN_BCO_BLOCK_HEADER_SIZE, RECORD_SIZE = MIN_BCO_BLOCK_HEADER_SIZE + 4 };
+
+    // VERIFIED records are covered by the checkpoint. CHECKED records passed check_slot_t.
+    enum RecordStatus { UNCHECKED, CHECKED, VERIFIED };
+
+    typedef std::function<void(const Coin::CoinBlockHeader& header, const Coin::hash256_t& hash, RecordStatus status)> header_slot_t;
+
+    // Checks that only need a header and its parent, such as proof of work. Called on worker
+    // threads for records past the checkpoint whose parent is the record before them, with
+    // height being the header's position in the file. Throws if the header is invalid.
+    // parent can be in use on another thread at the same time: read its fields but do not
+    // hash or copy it.
+    typedef std::function<void(const Coin::CoinBlockHeader& parent, const Coin::CoinBlockHeader& header, int height)> check_slot_t;
+
+    // Fills in the serialized header and its hash for a height.
+    typedef std::function<void(int height, uchar_vector& headerBytes, Coin::hash256_t& hash)> record_slot_t;
+
+    CoinQHeaderStore() : mCount(0), bTrimmed(false) { }
+
+    // Maps filename and passes each record to onHeader in height order. reserve is called
+    // first with the number of records. A torn record at the end, left by a crash during an
+    // append, is ignored and gets overwritten by the next write.
+    //
+    // Records are hashed and passed to checkHeader on a pool of threads (0 for one per core),
+    // a batch at a time and one batch ahead of onHeader, which always runs on the calling
+    // thread. Errors surface at the record they belong to, as they would loading one by one.
+    void load(const std::string& filename, std::function<void(std::size_t)> reserve, header_slot_t onHeader, check_slot_t checkHeader = nullptr, unsigned int threads = 0);
+
+    // Points the store at filename without reading it. The next write starts from height 0.
+    void open(const std::string& filename) { mFilename = filename; mCount = 0; bTrimmed = false; }
+    void close() { mFilename.clear(); mCount = 0; bTrimmed = false; }
+
+    const std::string& getFilename() const { return mFilename; }
+
+    // Records on disk that are also in the checkpoint.
+    int getCount() const { return mCount; }
+
+    // Cuts the file back to the first min(from, getCount()) records and appends the records
+    // up to but not including height to. The headers are synced to disk before the
+    // checkpoint is moved past them. Nothing is written when there is nothing to cut or
+    // append, and appending to a file that holds only checkpointed records leaves the
+    // checkpoint alone until the new records are on disk.
+    void write(int from, int to, record_slot_t getRecord);
+
+private:
+    std::string mFilename;
+    int mCount;
+
+    // The file and the index hold exactly the mCount checkpointed records.
+    bool bTrimmed;
+};
@@ -13,18 +13,33 @@
 
 #include "CoinQ_typedefs.h"
 
+#include <CoinCore/BlockFilter.h>
 #include <CoinCore/MerkleTree.h>
 
 #include <stdint.h>
 
 #include <logger/logger.h>
 
+#include <algorithm>
 #include <thread>
 #include <chrono>
 
 using namespace CoinQ::Network;
 using namespace std;
 
+// Download peers that make no progress for this long are dropped
+static const int BLOCK_STALL_TIMEOUT = 30; // seconds
+static const int BLOCK_STALL_CHECK_INTERVAL = 5; // seconds
+
+// Peer stats go into the address manager every interval, and the picked download peers are
+// looked over every few of them.
+static const int PEER_UPDATE_INTERVAL = 10; // seconds
+static const unsigned int PEER_ROTATE_UPDATES = 12;
+static const uint64_t MIN_THROUGHPUT_SAMPLE_BYTES = 128 * 1024; // less than this in an interval says the peer was idle, not slow
+
+// Nonces of pings sent only to time the link. The block scheduler's never get this high.
+static const uint64_t PROBE_PING_NONCE = 1ull << 63;
+
 NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOfWork) :
     m_coinParams(coinParams),
     m_bCheckProofOfWork(bCheckProofOfWork),
@@ -33,14 +48,64 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
     m_work(m_ioService),
     m_bConnected(false),
     m_peer(m_ioService),
+    m_autoDownloadPeers(0),
+    m_peerUpdates(0),
+    m_probePings(0),
+    m_peerTimer(m_ioService),
     m_bFlushingToFile(false),
+    m_bValidatingHeaders(false),
+    m_lastQueuedHeaderHeight(-1),
+    m_headerScheduler(
+        [this](const std::string& peername, const uchar_vector& locatorHash, const uchar_vector& hashStop)
+        {
+            sendToPeer(peername, [&](CoinQ::Peer& peer) { peer.getHeaders(std::vector<uchar_vector>(1, locatorHash), hashStop); });
+        }),
     m_bHeadersSynched(false),
-    m_bMissingTxs(false)
+    m_blockScheduler(
+        [this](const std::string& peername, const std::vector<uchar_vector>& hashes, uint64_t nonce)
+        {
+            sendToPeer(peername, [&](CoinQ::Peer& peer) { peer.getFilteredBlocks(hashes); peer.ping(nonce); });
+        },
+        [this](const std::string& peername, const uchar_vector& hash)
+        {
+            sendToPeer(peername, [&](CoinQ::Peer& peer) { peer.getBlock(hash); });
+        },
+        [this](int height, const Coin::MerkleBlock& merkleBlock, const std::vector<Coin::hash256_t>& txHashes, const std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs)
+        {
+            deliverMerkleBlock(height, merkleBlock, txHashes, txs);
+        },
+        [this](const Coin::hash256_t& txHash)
+        {
+            boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
+            return m_mempoolTxs.count(txHash) != 0;
+        }),
+    m_filterScheduler(
+        [this](const std::string& peername, uint32_t startHeight, const uchar_vector& stopHash)
+        {
+            sendToPeer(peername, [&](CoinQ::Peer& peer) { peer.getCFHeaders(Coin::BlockFilter::BASIC_FILTER_TYPE, startHeight, stopHash); });
+        },
+        [this](const std::string& peername, uint32_t startHeight, const uchar_vector& stopHash)
+        {
+            sendToPeer(peername, [&](CoinQ::Peer& peer) { peer.getCFilters(Coin::BlockFilter::BASIC_FILTER_TYPE, startHeight, stopHash); });
+        },
+        [this](const std::string& peername, const uchar_vector& hash)
+        {
+            sendToPeer(peername, [&](CoinQ::Peer& peer) { peer.getBlock(hash); });
+        },
+        [this](int height, const Coin::MerkleBlock& merkleBlock, const std::vector<Coin::hash256_t>& txHashes, const std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs)
+        {
+            deliverMerkleBlock(height, merkleBlock, txHashes, txs);
+        }),
+    m_bCompactFilters(false),
+    m_bSynchingBlocks(false),
+    m_stallTimer(m_ioService)
 {
     // Select hash functions
     Coin::CoinBlockHeader::setHashFunc(m_coinParams.block_header_hash_function());
     Coin::CoinBlockHeader::setPOWHashFunc(m_coinParams.block_header_pow_hash_function());
 
+    m_headerScheduler.setCheckpoints(m_coinParams.checkpoints());
+
 /*
     // Subscribe block tree handlers 
     m_blockTree.subscribeRemoveBestChain([&](const ChainHeader& header)
@@ -64,10 +129,13 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
     m_peer.subscribeOpen([&](CoinQ::Peer& /*peer*/)
     {
         m_bConnected = true;
+        m_addressManager.markConnected(m_peer.name());
         notifyOpen();
         try
         {
-            if (m_bloomFilter.isSet())
+            m_peer.getAddr();
+
+            if (m_bloomFilter.isSet() && !m_bCompactFilters)
             {
                 Coin::FilterLoadMessage filterLoad(m_bloomFilter.getNHashFuncs(), m_bloomFilter.getNTweak(), m_bloomFilter.getNFlags(), m_bloomFilter.getFilter());
                 m_peer.send(filterLoad);
@@ -75,7 +143,22 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
             }
 
             LOGGER(trace) << "Peer connection opened." << endl;
-            m_peer.getHeaders(m_blockTree.getLocatorHashes(-1));
+            {
+                // m_peer syncs up to the first checkpoint above our tip while the download peers
+                // start on the ranges between the checkpoints after it.
+                boost::lock_guard<boost::mutex> queueLock(m_headerQueueMutex);
+                std::vector<uchar_vector> locatorHashes;
+                {
+                    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+                    locatorHashes = m_blockTree.getLocatorHashes(-1);
+                    m_headerScheduler.start(m_blockTree.getBestHeight());
+                }
+                m_peer.getHeaders(locatorHashes, m_headerScheduler.hashStop());
+                m_headerScheduler.requestRanges();
+            }
+
+            boost::lock_guard<boost::mutex> syncLock(m_syncMutex);
+            addBlockPeer(m_peer);
         }
         catch (const std::exception& e)
         {
@@ -98,6 +181,7 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
 
     m_peer.subscribeConnectionError([&](CoinQ::Peer& /*peer*/, const std::string& error, int code)
     {
+        if (!m_bConnected) { m_addressManager.markFailed(m_peer.name()); }
         notifyConnectionError(error, code);
     });
 
@@ -113,6 +197,7 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
 
         using namespace Coin;
         GetDataMessage getData;
+        bool bNewBlock = false;
         for (auto& item: inv.items)
         {
             switch (item.itemType)
@@ -121,7 +206,15 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
                 getData.items.push_back(InventoryItem(MSG_TX | peer.inv_flags(), item.hash));
                 break;
             case MSG_BLOCK:
-                getData.items.push_back(InventoryItem(MSG_FILTERED_BLOCK | peer.inv_flags(), item.hash));
+                if (m_bCompactFilters)
+                {
+                    // New blocks come in as headers and are then synched like the rest.
+                    bNewBlock = true;
+                }
+                else
+                {
+                    getData.items.push_back(InventoryItem(MSG_FILTERED_BLOCK | peer.inv_flags(), item.hash));
+                }
                 break;
             default:
                 break;
@@ -129,30 +222,55 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
         }
 
         if (!getData.items.empty()) { m_peer.send(getData); }
-    });
-
-    m_peer.subscribeTx([&](CoinQ::Peer& /*peer*/, const Coin::Transaction& tx)
-    {
-        LOGGER(trace) << "Received transaction: " << tx.hash().getHex() << endl;
 
-        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
-        if (m_currentMerkleTxHashes.empty())
+        if (bNewBlock)
         {
+            try
             {
-                boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
-                m_mempoolTxs.insert(tx.hash());
+                std::vector<uchar_vector> locatorHashes;
+                {
+                    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+                    locatorHashes = m_blockTree.getLocatorHashes(-1);
+                }
+                m_peer.getHeaders(locatorHashes);
+            }
+            catch (const std::exception& e)
+            {
+                LOGGER(error) << "Block tree error: " << e.what() << std::endl;
+                // TODO: propagate code
+                notifyBlockTreeError(e.what(), -1);
             }
-
-            syncLock.unlock();
-            notifyNewTx(tx);
-        }
-        else if (!m_bMissingTxs)
-        {
-            syncLock.unlock();
-            processBlockTx(tx);
         }
     });
 
+    m_peer.subscribeAddr([&](CoinQ::Peer& /*peer*/, const Coin::AddrMessage& addr)
+    {
+        m_addressManager.add(addr);
+    });
+
+    m_peer.subscribeTx([&](CoinQ::Peer& peer, const Coin::Transaction& tx)
+    {
+        onTx(peer, tx);
+    });
+
+    m_peer.subscribePong([&](CoinQ::Peer& peer, uint64_t nonce)
+    {
+        if (!m_bConnected) return;
+        onPong(peer, nonce);
+    });
+
+    m_peer.subscribeCFHeaders([&](CoinQ::Peer& peer, const Coin::CFHeadersMessage& cfheaders)
+    {
+        if (!m_bConnected) return;
+        onCFHeaders(peer, cfheaders);
+    });
+
+    m_peer.subscribeCFilter([&](CoinQ::Peer& peer, const Coin::CFilterMessage& cfilter)
+    {
+        if (!m_bConnected) return;
+        onCFilter(peer, cfilter);
+    });
+
     m_peer.subscribeHeaders([&](CoinQ::Peer& peer, const Coin::HeadersMessage& headersMessage)
     {
         if (!m_bConnected) return;
@@ -160,73 +278,63 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
 
         try
         {
+            if (headersMessage.headers.size() > 0) { notifySynchingHeaders(); }
+
+            boost::unique_lock<boost::mutex> queueLock(m_headerQueueMutex);
             if (headersMessage.headers.size() > 0)
             {
-                notifySynchingHeaders();
-                std::clock_t start = std::clock();
-                boost::unique_lock<boost::mutex> fileFlushLock(m_fileFlushMutex);
-                for (auto& item: headersMessage.headers)
+                // A message that follows the last one queued, or the tree, is queued without
+                // waiting for the headers before it to be checked.
+                const Coin::CoinBlockHeader& first = headersMessage.headers.front();
+                int parentHeight = m_lastQueuedHeaderHeight;
+                bool bConnects = !m_lastQueuedHeaderHash.empty() && first.prevBlockHash() == m_lastQueuedHeaderHash;
+                if (!bConnects)
                 {
-                    try
-                    {
-                        if (m_blockTree.insertHeader(item, true, false, [&](uint32_t height,bytes_t& hash) {
-                            std::clock_t now = std::clock();
-                            if (height > 0 && now - start > 1000 ) {
-                                start = now;
-                                notifyBlockHeaderValidate(height, hash);
-                            }
-                        })) {
-                            m_bHeadersSynched = false; 
-                        }
-                    }
-                    catch (const std::exception& e)
-                    {
-                        std::stringstream err;
-                        err << "Block tree insertion error for block " << item.hash().getHex() << ": " << e.what(); // TODO: localization
-                        LOGGER(error) << err.str() << std::endl;
-                        // TODO: propagate code
-                        notifyBlockTreeError(err.str(), -1);
-                        throw e;
-                    }
+                    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+                    bConnects = m_blockTree.hasHeader(first.prevBlockHash());
+                    if (bConnects) { parentHeight = m_blockTree.getHeader(first.prevBlockHash()).height; }
+                }
+                if (!bConnects)
+                {
+                    queueLock.unlock();
+                    std::stringstream err;
+                    err << "Block tree insertion error for block " << first.hash().getHex() << ": Parent not found."; // TODO: localization
+                    LOGGER(error) << err.str() << std::endl;
+                    // TODO: propagate code
+                    notifyBlockTreeError(err.str(), -1);
+                    return;
                 }
 
-                LOGGER(trace)   << "Processed " << headersMessage.headers.size() << " headers."
-                                << " mBestHeight: " << m_blockTree.getBestHeight()
-                                << " mTotalWork: " << m_blockTree.getTotalWork().getDec()
-                                << " Attempting to fetch more headers..." << std::endl;
-
-                notifyBlockTreeChanged();
-
-                std::stringstream status;
-                status << "Best Height: " << m_blockTree.getBestHeight() << " / " << "Total Work: " << m_blockTree.getTotalWork().getDec();
-                notifyStatus(status.str());
+                m_headerQueue.push(headersMessage.headers);
+                m_lastQueuedHeaderHash = headersMessage.headers.back().hash();
+                m_lastQueuedHeaderHeight = parentHeight + (int)headersMessage.headers.size();
 
-                vector<uchar_vector> locatorHashes = m_blockTree.getLocatorHashes(1);
-                if (locatorHashes.empty()) throw runtime_error("Blocktree is empty.");
-                if (headersMessage.headers[headersMessage.headers.size() - 1].hash() != locatorHashes[0])
+                // Ranges the download peers fetched that follow on go in right behind.
+                std::size_t rangeMessages = 0;
+                for (auto& headers: m_headerScheduler.advance(m_lastQueuedHeaderHeight, m_lastQueuedHeaderHash))
                 {
-                    throw runtime_error("Blocktree conflicts with peer.");
+                    m_headerQueue.push(std::move(headers));
+                    rangeMessages++;
                 }
- 
-                peer.getHeaders(locatorHashes);
+
+                vector<uchar_vector> locatorHashes(1, m_lastQueuedHeaderHash);
+                uchar_vector hashStop = m_headerScheduler.hashStop();
+                queueLock.unlock();
+                m_headerQueueCond.notify_one();
+
+                LOGGER(trace)   << "Queued " << headersMessage.headers.size() << " headers and " << rangeMessages << " messages from download peers."
+                                << " Attempting to fetch more headers..." << std::endl;
+
+                peer.getHeaders(locatorHashes, hashStop);
             }
             else
             {
-                m_fileFlushCond.notify_one();
-/*
-                if (!m_blockTree.flushed())
-                {
-                    notifyStatus("Flushing block chain to file...");
-                    m_blockTree.flushToFile(m_blockTreeFile);
-                    notifyStatus("Done flushing block chain to file");
-                }
-*/
-                notifyBlockTreeChanged();
-                if (!m_bHeadersSynched)
-                {
-                    m_bHeadersSynched = true;
-                    notifyHeadersSynched();
-                }
+                // Synched once everything queued before it is in the tree. Ranges m_peer does not
+                // have are of no use.
+                m_headerScheduler.clear();
+                m_headerQueue.push(std::vector<Coin::CoinBlockHeader>());
+                queueLock.unlock();
+                m_headerQueueCond.notify_one();
             }
         }
         catch (const std::exception& e)
@@ -235,98 +343,24 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
         }
     });
 
-    m_peer.subscribeBlock([&](CoinQ::Peer& /*peer*/, const Coin::CoinBlock& block)
+    m_peer.subscribeBlock([&](CoinQ::Peer& peer, const Coin::CoinBlock& block)
     {
         if (!m_bConnected) return;
-
-        LOGGER(trace) << "Received block: " << block.hash().getHex() << endl;
-
-        try
-        {
-            boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
-            if (!m_bMissingTxs || m_currentMerkleBlock.hash() != block.hash()) return;    // Not the block we're working on.
-
-            LOGGER(trace) << "Processing " << block.txs.size() << " block transactions..." << endl;
-            for (auto& tx: block.txs)
-            {
-                if (m_currentMerkleTxHashes.empty()) break; // We got all our transactions.
-
-                if (tx.hash() == m_currentMerkleTxHashes.front())
-                {
-                    LOGGER(trace) << "New merkle transaction (" << (m_currentMerkleTxIndex + 1) << " of " << m_currentMerkleTxCount << "): " << tx.hash().getHex() << endl;
-
-                    notifyMerkleTx(m_currentMerkleBlock, tx, m_currentMerkleTxIndex++, m_currentMerkleTxCount);
-                    m_currentMerkleTxHashes.pop();
-
-                    {
-                        boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
-                        m_mempoolTxs.erase(tx.hash());
-                    }
-                }
-            }
-
-            if (!m_currentMerkleTxHashes.empty())
-            {
-                // In principle this should never happen. If it does we missed some earlier check.
-                throw runtime_error("Block is missing some transactions.");
-            }
-
-            m_bMissingTxs = false;
-
-            // Once the queue is empty, if we're at the tip signal completion of block sync.
-            uchar_vector currentMerkleBlockHash = m_currentMerkleBlock.hash();
-            const ChainHeader& chainTip = m_blockTree.getTip();
-            if (chainTip.hash() == currentMerkleBlockHash)
-            {
-                LOGGER(trace) << "Block sync detected from block handler." << endl;
-                m_lastRequestedMerkleBlockHash.clear();
-                m_lastSynchedMerkleBlockHash = currentMerkleBlockHash;
-                syncLock.unlock();
-                notifyBlocksSynched();
-                return;
-            }
-
-            // Ask for the next block
-            const ChainHeader& nextHeader = m_blockTree.getHeader(m_currentMerkleBlock.height + 1);
-            m_lastRequestedMerkleBlockHash = nextHeader.hash();
-            LOGGER(trace) << "Asking for filtered block from block handler: " << m_lastRequestedMerkleBlockHash.getHex() << std::endl;
-            
-            try
-            {
-                m_peer.getFilteredBlock(m_lastRequestedMerkleBlockHash);
-            }
-            catch (const exception& e)
-            {
-                // TODO: Propagate code
-                syncLock.unlock();
-                notifyConnectionError(e.what(), -1);
-            }
-        }
-        catch (const exception& e)
-        {
-            // TODO: Propagate code
-            notifyProtocolError(e.what(), -1);
-        }
+        onBlock(peer, block);
     });
 
-    m_peer.subscribeMerkleBlock([&](CoinQ::Peer& /*peer*/, const Coin::MerkleBlock& merkleBlock)
+    m_peer.subscribeMerkleBlock([&](CoinQ::Peer& peer, const Coin::MerkleBlock& merkleBlock)
     {
         if (!m_bConnected) return;
+        if (onMerkleBlock(peer, merkleBlock)) return;   // One we asked for.
 
         uchar_vector merkleBlockHash = merkleBlock.hash();
-        LOGGER(trace) << "Received merkle block: " << merkleBlockHash.getHex() << endl;
-
-        const ChainHeader& chainTip = m_blockTree.getHeader(-1);
+        ChainHeader chainTip = getBestHeader();
         uchar_vector chainTipHash = chainTip.hash();
         LOGGER(trace) << "Current chain tip: " << chainTipHash.getHex() << " Height: " << chainTip.height << endl;
 
         try
         {
-            // Constructing the partial tree will validate the merkle root - throws exception if invalid.
-            Coin::PartialMerkleTree merkleTree(merkleBlock.merkleTree());
-
-            LOGGER(debug) << "Last requested merkle block: " << m_lastRequestedMerkleBlockHash.getHex() << endl;
-
             if (!m_bHeadersSynched)
             {
                 LOGGER(trace) << "NetworkSync merkle block handler  - Headers are still not synched." << endl;
@@ -334,7 +368,7 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
                 LOGGER(trace) << "REORG - attempting again to resync block headers from peer..." << endl;
                 try
                 {
-                    m_peer.getHeaders(m_blockTree.getLocatorHashes(-1));
+                    m_peer.getHeaders(getLocatorHashes());
                 }
                 catch (const exception& e)
                 {
@@ -345,43 +379,7 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
             }
 
             boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
-            if (merkleBlockHash == m_lastRequestedMerkleBlockHash)
-            {
-                // It's the block we requested - sync it and continue requesting the next until we're at the tip
-                const ChainHeader& merkleHeader = m_blockTree.getHeader(merkleBlockHash);
-                syncMerkleBlock(ChainMerkleBlock(merkleBlock, true, merkleHeader.height, merkleHeader.chainWork), merkleTree);
-
-                if (!m_currentMerkleTxHashes.empty()) return; // We need to wait for some transactions
-
-                if (merkleBlockHash == chainTipHash)
-                {
-                    // We're at the tip
-                    LOGGER(trace) << "Block sync detected from merkle block handler." << endl;
-                    m_lastRequestedMerkleBlockHash.clear();
-                    m_lastSynchedMerkleBlockHash = chainTipHash;
-                    syncLock.unlock();
-                    notifyBlocksSynched();
-                }
-                else
-                {
-                    // Ask for the next block
-                    const ChainHeader& nextHeader = m_blockTree.getHeader(merkleHeader.height + 1);
-                    m_lastRequestedMerkleBlockHash = nextHeader.hash();
-                    LOGGER(trace) << "Asking for filtered block (2) " << m_lastRequestedMerkleBlockHash.getHex() << endl;
-    
-                    try
-                    {
-                        m_peer.getFilteredBlock(m_lastRequestedMerkleBlockHash);
-                    }
-                    catch (const exception& e)
-                    {
-                        syncLock.unlock();
-                        // TODO: propagate code
-                        notifyConnectionError(e.what(), -1);
-                    }
-                }
-            }
-            else if ((merkleBlock.prevBlockHash() == chainTipHash) ||
+            if ((merkleBlock.prevBlockHash() == chainTipHash) ||
                 (merkleBlock.prevBlockHash() == chainTip.prevBlockHash() && merkleBlock.getWork() > chainTip.getWork()))
             {
                 // The merkle block either connects to the current tip or it replaces the current tip (depth 1 reorg)
@@ -390,6 +388,7 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
                 // Try inserting into block tree. If it fails it throws a protocol error exception which is caught below.
                 boost::unique_lock<boost::mutex> fileFlushLock(m_fileFlushMutex);
                 m_blockTree.insertHeader(merkleBlock.blockHeader, m_bCheckProofOfWork);
+                int merkleHeight = m_blockTree.getHeader(merkleBlockHash).height;
                 fileFlushLock.unlock();
 
                 // Start flushing to file
@@ -399,19 +398,18 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
 
                 if (m_lastSynchedMerkleBlockHash == chainTipHash)
                 {
-                    // We were synched prior to this block - we need to process this merkle block and we'll be synched again
+                    // We were synched prior to this block - we need to process this merkle block and we'll be synched again.
+                    // Its transactions are on their way, so the scheduler takes it as if it had asked for it.
                     notifySynchingBlocks();
-                    const ChainHeader& merkleHeader = m_blockTree.getHeader(merkleBlockHash);
-                    syncMerkleBlock(ChainMerkleBlock(merkleBlock, true, merkleHeader.height, merkleHeader.chainWork), merkleTree);
-                    if (m_currentMerkleTxHashes.empty())
-                    {
-                        m_lastSynchedMerkleBlockHash = m_blockTree.getTip().hash();
-                        syncLock.unlock();
-                        notifyBlocksSynched();
-                    }
+                    m_bSynchingBlocks = true;
+                    m_blockScheduler.expectBlock(peer.name(), merkleHeight, merkleBlockHash);
+                    m_blockScheduler.onMerkleBlock(peer.name(), merkleBlock);
                 }
+
+                // Blocks being synched go up to the new tip.
+                updateBlockSync(syncLock);
             }
-            else if (!m_blockTree.hasHeader(merkleBlockHash))
+            else if (!hasHeader(merkleBlockHash))
             {
                 // A reorg of depth 2 or greater has occurred - update block headers
                 LOGGER(trace) << "NetworkSync merkle block handler - block rejected: " << merkleBlockHash.getHex() << endl;
@@ -420,7 +418,7 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
                 m_bHeadersSynched = false;
                 try
                 {
-                    m_peer.getHeaders(m_blockTree.getLocatorHashes(-1));
+                    m_peer.getHeaders(getLocatorHashes());
                 }
                 catch (const exception& e)
                 {
@@ -437,6 +435,18 @@ NetworkSync::NetworkSync(const CoinQ::CoinParams& coinParams, bool bCheckProofOf
             notifyProtocolError(e.what(), -1);
         }
     });
+
+    // Subscribe download peer handlers
+    m_peerManager.subscribeOpen([&](CoinQ::Peer& peer) { onDownloadPeerOpen(peer); });
+    m_peerManager.subscribeClose([&](CoinQ::Peer& peer) { onDownloadPeerClose(peer); });
+    m_peerManager.subscribeTx([&](CoinQ::Peer& peer, const Coin::Transaction& tx) { onTx(peer, tx); });
+    m_peerManager.subscribeMerkleBlock([&](CoinQ::Peer& peer, const Coin::MerkleBlock& merkleBlock) { onMerkleBlock(peer, merkleBlock); });
+    m_peerManager.subscribeBlock([&](CoinQ::Peer& peer, const Coin::CoinBlock& block) { onBlock(peer, block); });
+    m_peerManager.subscribePong([&](CoinQ::Peer& peer, uint64_t nonce) { onPong(peer, nonce); });
+    m_peerManager.subscribeCFHeaders([&](CoinQ::Peer& peer, const Coin::CFHeadersMessage& cfheaders) { onCFHeaders(peer, cfheaders); });
+    m_peerManager.subscribeCFilter([&](CoinQ::Peer& peer, const Coin::CFilterMessage& cfilter) { onCFilter(peer, cfilter); });
+    m_peerManager.subscribeHeaders([&](CoinQ::Peer& peer, const Coin::HeadersMessage& headersMessage) { onDownloadPeerHeaders(peer, headersMessage); });
+    m_peerManager.subscribeAddr([&](CoinQ::Peer& /*peer*/, const Coin::AddrMessage& addr) { m_addressManager.add(addr); });
 }
 
 NetworkSync::~NetworkSync()
@@ -451,6 +461,7 @@ void NetworkSync::setCoinParams(const CoinQ::CoinParams& coinParams)
     if (m_bStarted) throw std::runtime_error("NetworkSync::setCoinParams() - must be stopped to set coin parameters.");
 
     m_coinParams = coinParams;    
+    m_headerScheduler.setCheckpoints(m_coinParams.checkpoints());
 }
 
 void NetworkSync::loadHeaders(const std::string& blockTreeFile, bool bCheckProofOfWork, CoinQBlockTreeMem::callback_t callback)
@@ -463,9 +474,12 @@ void NetworkSync::loadHeaders(const std::string& blockTreeFile, bool bCheckProof
         m_blockTree.loadFromFile(blockTreeFile, bCheckProofOfWork, callback);
 
         std::stringstream status;
-        status << "Best Height: " << m_blockTree.getBestHeight() << " / " << "Total Work: " << m_blockTree.getTotalWork().getDec();
+        {
+            boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+            status << "Best Height: " << m_blockTree.getBestHeight() << " / " << "Total Work: " << m_blockTree.getTotalWork().getDec();
+        }
         notifyStatus(status.str());
-        notifyAddBestChain(m_blockTree.getHeader(-1));
+        notifyAddBestChain(getBestHeader());
         return;
     }
     catch (const std::exception& e)
@@ -475,22 +489,89 @@ void NetworkSync::loadHeaders(const std::string& blockTreeFile, bool bCheckProof
         notifyBlockTreeError(e.what(), -1);
     }
 
-    m_blockTree.clear();
-    m_blockTree.setGenesisBlock(m_coinParams.genesis_block());
+    {
+        boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        m_blockTree.clear();
+        m_blockTree.setGenesisBlock(m_coinParams.genesis_block());
+    }
     notifyStatus("Block tree file not found. A new one will be created.");
-    notifyAddBestChain(m_blockTree.getHeader(-1));
+    notifyAddBestChain(getBestHeader());
 }
 
 int NetworkSync::getBestHeight() const
 {
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
     return m_blockTree.getBestHeight();
 }
 
-const bytes_t& NetworkSync::getBestHash() const
+bytes_t NetworkSync::getBestHash() const
 {
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
     return m_blockTree.getBestHash();
 }
 
+ChainHeader NetworkSync::getBestHeader() const
+{
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    return m_blockTree.getHeader(-1);
+}
+
+ChainHeader NetworkSync::getHeader(const bytes_t& hash) const
+{
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    return m_blockTree.getHeader(hash);
+}
+
+ChainHeader NetworkSync::getHeader(int height) const
+{
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    return m_blockTree.getHeader(height);
+}
+
+ChainHeader NetworkSync::getHeaderBefore(uint32_t timestamp) const
+{
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    return m_blockTree.getHeaderBefore(timestamp);
+}
+
+std::vector<uchar_vector> NetworkSync::getLocatorHashes() const
+{
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    return m_blockTree.getLocatorHashes(-1);
+}
+
+bool NetworkSync::hasHeader(const bytes_t& hash) const
+{
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    return m_blockTree.hasHeader(hash);
+}
+
+void NetworkSync::addDownloadPeer(const std::string& host, const std::string& port)
+{
+    if (m_bStarted) throw std::runtime_error("NetworkSync::addDownloadPeer() - must be stopped to add download peers.");
+    boost::lock_guard<boost::mutex> lock(m_startMutex);
+    if (m_bStarted) throw std::runtime_error("NetworkSync::addDownloadPeer() - must be stopped to add download peers.");
+
+    std::pair<std::string, std::string> downloadPeer(host, port);
+    if (std::find(m_downloadPeers.begin(), m_downloadPeers.end(), downloadPeer) == m_downloadPeers.end()) { m_downloadPeers.push_back(downloadPeer); }
+}
+
+void NetworkSync::setAutoDownloadPeers(unsigned int count)
+{
+    if (m_bStarted) throw std::runtime_error("NetworkSync::setAutoDownloadPeers() - must be stopped to set download peers.");
+    boost::lock_guard<boost::mutex> lock(m_startMutex);
+    if (m_bStarted) throw std::runtime_error("NetworkSync::setAutoDownloadPeers() - must be stopped to set download peers.");
+
+    m_autoDownloadPeers = count;
+}
+
+void NetworkSync::setBlocksPerPeer(unsigned int blocksPerPeer)
+{
+    boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+    m_blockScheduler.setBlocksPerPeer(blocksPerPeer);
+    updateBlockSync(syncLock);
+}
+
 void NetworkSync::syncBlocks(const std::vector<bytes_t>& locatorHashes, uint32_t startTime)
 {
     if (!m_bConnected) throw runtime_error("NetworkSync::syncBlocks() - must connect before synching.");
@@ -499,69 +580,95 @@ void NetworkSync::syncBlocks(const std::vector<bytes_t>& locatorHashes, uint32_t
     LOGGER(trace) << "NetworkSync::syncBlocks - locatorHashes: " << locatorHashes.size() << " startTime: " << startTime << endl;
     int startHeight;
 
-    boost::lock_guard<boost::mutex> syncLock(m_syncMutex);
+    boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
 
-    const ChainHeader* pMostRecentHeader = nullptr;
-    for (auto& hash: locatorHashes)
+    // Copied out under the lock, since headers can be inserted meanwhile.
+    ChainHeader mostRecentHeader;
+    bool bFound = false;
+    int tipHeight;
+    std::vector<std::string> errors;
     {
-        try
-        {
-            pMostRecentHeader = &m_blockTree.getHeader(hash);
-            if (pMostRecentHeader && pMostRecentHeader->inBestChain) break;
-            pMostRecentHeader = nullptr;
-        }
-        catch (const std::exception& e)
+        boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        for (auto& hash: locatorHashes)
         {
-            LOGGER(error) << "Block tree error: " << e.what() << endl;
-            // TODO: propagate code
-            notifyBlockTreeError(e.what(), -1);
+            try
+            {
+                mostRecentHeader = m_blockTree.getHeader(hash);
+                if (mostRecentHeader.inBestChain) { bFound = true; break; }
+            }
+            catch (const std::exception& e)
+            {
+                errors.push_back(e.what());
+            }
         }
+
+        tipHeight = m_blockTree.getTipHeight();
+        if (!bFound) { startHeight = m_blockTree.getHeaderBefore(startTime).height; }
     }
 
+    for (auto& error: errors)
+    {
+        LOGGER(error) << "Block tree error: " << error << endl;
+        // TODO: propagate code
+        notifyBlockTreeError(error, -1);
+    }
 
-    if (pMostRecentHeader)
+    if (bFound)
     {
-        if (m_blockTree.getTipHeight() == pMostRecentHeader->height)
+        if (tipHeight == mostRecentHeader.height)
         {
-            m_lastSynchedMerkleBlockHash = pMostRecentHeader->hash();
+            m_lastSynchedMerkleBlockHash = mostRecentHeader.hash();
+            syncLock.unlock();
             notifyBlocksSynched();
             return;
         } 
         else
         {
-            startHeight = pMostRecentHeader->height + 1;
+            startHeight = mostRecentHeader.height + 1;
         }
     }
-    else
-    {
-        startHeight = m_blockTree.getHeaderBefore(startTime).height;
-    }
 
-    do_syncBlocks(startHeight);
+    do_syncBlocks(startHeight, syncLock);
 }
 
 void NetworkSync::syncBlocks(int startHeight)
 {
-    boost::lock_guard<boost::mutex> syncLock(m_syncMutex);
-    do_syncBlocks(startHeight);
+    boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+    do_syncBlocks(startHeight, syncLock);
 }
 
-void NetworkSync::do_syncBlocks(int startHeight)
+void NetworkSync::do_syncBlocks(int startHeight, boost::unique_lock<boost::mutex>& syncLock)
 {
     m_lastSynchedMerkleBlockHash.clear();
-    m_lastRequestedMerkleBlockHash = m_blockTree.getHeader(startHeight).hash();
+    m_blockScheduler.clear();
+    m_filterScheduler.clear();
+    m_bSynchingBlocks = true;
+    int tipHeight;
+    {
+        boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        if (m_bCompactFilters)
+        {
+            m_filterScheduler.addBlock(startHeight, m_blockTree.getHeader(startHeight));
+        }
+        else
+        {
+            m_blockScheduler.addBlock(startHeight, m_blockTree.getHeader(startHeight).hash());
+        }
+        tipHeight = m_blockTree.getTipHeight();
+    }
 
-    LOGGER(trace) "Resynching blocks " << startHeight << " - " << m_blockTree.getTipHeight() << endl;
+    LOGGER(trace) << "Resynching blocks " << startHeight << " - " << tipHeight << " from " << (m_bCompactFilters ? m_filterScheduler.peerCount() : m_blockScheduler.peerCount()) << " peers" << endl;
     notifySynchingBlocks();
 
-    LOGGER(trace) << "Asking for filtered block (3) " << m_lastRequestedMerkleBlockHash.getHex() << endl;
-    m_peer.getFilteredBlock(m_lastRequestedMerkleBlockHash);
+    updateBlockSync(syncLock);
 }
 
 void NetworkSync::stopSynchingBlocks(bool bClearFilter)
 {
     boost::lock_guard<boost::mutex> lock(m_syncMutex);
-    m_lastRequestedMerkleBlockHash.clear();
+    m_blockScheduler.clear();
+    m_filterScheduler.clear();
+    m_bSynchingBlocks = false;
     m_lastSynchedMerkleBlockHash.clear();
     if (bClearFilter) { clearBloomFilter(); }
 }
@@ -569,14 +676,14 @@ void NetworkSync::stopSynchingBlocks(bool bClearFilter)
 void NetworkSync::addToMempool(const uchar_vector& txHash)
 {
     boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
-    m_mempoolTxs.insert(txHash);
+    m_mempoolTxs.insert(Coin::hash256_t(txHash));
 }
 
 void NetworkSync::insertTx(const Coin::Transaction& tx)
 {
     {
         boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
-        m_mempoolTxs.insert(tx.hash());
+        m_mempoolTxs.insert(Coin::hash256_t(tx.hash()));
     }
 
     notifyNewTx(tx);
@@ -587,7 +694,7 @@ void NetworkSync::insertMerkleBlock(const Coin::MerkleBlock& merkleBlock, const
     boost::unique_lock<boost::mutex> fileFlushLock(m_fileFlushMutex);
     m_blockTree.insertHeader(merkleBlock.blockHeader, m_bCheckProofOfWork);
 
-    const ChainHeader& merkleHeader = m_blockTree.getHeader(merkleBlock.hash());
+    ChainHeader merkleHeader = m_blockTree.getHeader(merkleBlock.hash());
 
     fileFlushLock.unlock();
     m_fileFlushCond.notify_one();
@@ -607,17 +714,25 @@ void NetworkSync::insertMerkleBlock(const Coin::MerkleBlock& merkleBlock, const
         int i = 0;
         for (auto& tx: txs)
         {
-            LOGGER(trace) << "New merkle transaction (" << (m_currentMerkleTxIndex + 1) << " of " << m_currentMerkleTxCount << "): " << tx.hash().getHex() << endl;
+            LOGGER(trace) << "New merkle transaction (" << (i + 1) << " of " << n << "): " << tx.hash().getHex() << endl;
             notifyMerkleTx(chainMerkleBlock, tx, i++, n);
 
             {
                 boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
-                m_mempoolTxs.erase(tx.hash());
+                m_mempoolTxs.erase(Coin::hash256_t(tx.hash()));
             }
         }
     }
 }
 
+void NetworkSync::start()
+{
+    std::vector<AddressManager::Entry> entries = m_addressManager.select(1);
+    if (entries.empty()) throw runtime_error("NetworkSync::start() - no peer addresses known.");
+
+    start(entries.front().host, entries.front().port);
+}
+
 void NetworkSync::start(const std::string& host, const std::string& port)
 {
     {
@@ -627,16 +742,26 @@ void NetworkSync::start(const std::string& host, const std::string& port)
     
         LOGGER(trace) << "NetworkSync::start(" << host << ", " << port << ")" << std::endl;
         startFileFlushThread();
+        startHeaderValidationThread();
         startIOServiceThread();
+        startStallTimer();
 
         m_bStarted = true;
+        m_lastPeerUpdate = std::chrono::steady_clock::now();
+        m_peerUpdates = 0;
+        startPeerTimer();
 
         std::string port_ = port.empty() ? m_coinParams.default_port() : port;
-        m_peer.set(host, port_, m_coinParams.magic_bytes(), m_coinParams.protocol_version(), "Wallet v0.1", 0, false);
+        // With no bloom filter to load, transactions are only relayed if asked for up front.
+        m_peer.set(host, port_, m_coinParams.magic_bytes(), m_coinParams.protocol_version(), "Wallet v0.1", 0, m_bCompactFilters);
+        m_addressManager.add(host, port_, 0, time(NULL));
+        m_addressManager.markAttempt(m_peer.name());
 
         LOGGER(trace) << "Starting peer " << host << ":" << port_ << "..." << endl;
         m_peer.start();
         LOGGER(trace) << "Peer started." << endl;
+
+        startDownloadPeers();
     }
 
     notifyStarted();
@@ -657,14 +782,31 @@ void NetworkSync::stop()
         if (!m_bStarted) return;
 
         m_bConnected = false;
+        {
+            // Download peers still connecting now did not fail.
+            boost::lock_guard<boost::mutex> autoPeerLock(m_autoPeerMutex);
+            m_autoPeers.clear();
+        }
         m_peer.stop();
+        m_peerManager.stop();
         stopIOServiceThread();
+        m_stallTimer.cancel();
+        m_peerTimer.cancel();
+        stopHeaderValidationThread();
         stopFileFlushThread();
 
         m_bStarted = false;
         m_bHeadersSynched = false;
-        m_lastRequestedMerkleBlockHash.clear();
-        while (!m_currentMerkleTxHashes.empty()) { m_currentMerkleTxHashes.pop(); }
+
+        boost::lock_guard<boost::mutex> syncLock(m_syncMutex);
+        m_blockScheduler.clear();
+        m_blockScheduler.removePeer(m_peer.name());
+        m_filterScheduler.clear();
+        m_filterScheduler.removePeer(m_peer.name());
+        m_bSynchingBlocks = false;
+
+        m_peerBytesRead.clear();
+        m_addressManager.save();
     }
 
     notifyStopped();
@@ -692,25 +834,66 @@ void NetworkSync::getMempool()
 
 void NetworkSync::getFilteredBlock(const bytes_t& hash)
 {
-    LOGGER(trace) << "Asking for block filtered (4) " << m_lastRequestedMerkleBlockHash.getHex() << endl;
+    LOGGER(trace) << "Asking for filtered block " << uchar_vector(hash).getHex() << endl;
     m_peer.getFilteredBlock(hash);
 }
 
 void NetworkSync::setBloomFilter(const Coin::BloomFilter& bloomFilter)
 {
     m_bloomFilter = bloomFilter;
-    if (!m_bloomFilter.isSet()) return;
+    if (!m_bloomFilter.isSet() || m_bCompactFilters) return;
 
-    LOGGER(trace) << "Sending new bloom filter to peer." << endl;
+    LOGGER(trace) << "Sending new bloom filter to peers." << endl;
     Coin::FilterLoadMessage filterLoad(m_bloomFilter.getNHashFuncs(), m_bloomFilter.getNTweak(), m_bloomFilter.getNFlags(), m_bloomFilter.getFilter());
     m_peer.send(filterLoad);
+    m_peerManager.send(filterLoad);
+}
+
+bool NetworkSync::addToBloomFilter(const std::vector<bytes_t>& elements)
+{
+    if (!m_bloomFilter.isSet() || m_bCompactFilters) return false;
+
+    LOGGER(trace) << "Adding " << elements.size() << " elements to the bloom filter." << endl;
+    for (auto& element: elements)
+    {
+        m_bloomFilter.insert(element);
+
+        Coin::FilterAddMessage filterAdd;
+        filterAdd.data = element;
+        m_peer.send(filterAdd);
+        m_peerManager.send(filterAdd);
+    }
+    return true;
 }
 
 void NetworkSync::clearBloomFilter()
 {
+    // Peers that serve compact filters may not take bloom filter messages at all.
+    if (m_bCompactFilters) return;
+
     LOGGER(trace) << "Clearing bloom filter." << endl;
+    m_bloomFilter = Coin::BloomFilter();
     Coin::FilterClearMessage filterClear;
     m_peer.send(filterClear);
+    m_peerManager.send(filterClear);
+}
+
+void NetworkSync::enableCompactFilters(bool bEnable)
+{
+    if (m_bStarted) throw std::runtime_error("NetworkSync::enableCompactFilters() - must be stopped to change the sync mode.");
+    boost::lock_guard<boost::mutex> lock(m_startMutex);
+    if (m_bStarted) throw std::runtime_error("NetworkSync::enableCompactFilters() - must be stopped to change the sync mode.");
+
+    m_bCompactFilters = bEnable;
+}
+
+void NetworkSync::setWatchedScripts(const std::vector<bytes_t>& scripts, const std::vector<bytes_t>& outpoints)
+{
+    std::vector<uchar_vector> scriptVector(scripts.begin(), scripts.end());
+    std::vector<uchar_vector> outpointVector(outpoints.begin(), outpoints.end());
+
+    boost::lock_guard<boost::mutex> syncLock(m_syncMutex);
+    m_filterScheduler.setWatched(scriptVector, outpointVector);
 }
 
 void NetworkSync::startIOServiceThread()
@@ -803,133 +986,631 @@ void NetworkSync::fileFlushLoop()
     }
 }
 
-void NetworkSync::syncMerkleBlock(const ChainMerkleBlock& merkleBlock, const Coin::PartialMerkleTree& merkleTree)
+void NetworkSync::startHeaderValidationThread()
 {
-    LOGGER(trace) << "Synchronizing merkle block: " << merkleBlock.hash().getHex() << " height: " << merkleBlock.height << endl;
-
-    while (!m_currentMerkleTxHashes.empty()) { m_currentMerkleTxHashes.pop(); }
+    if (m_bValidatingHeaders) throw std::runtime_error("NetworkSync - header validation thread already started.");
+    boost::unique_lock<boost::mutex> lock(m_headerQueueMutex);
+    if (m_bValidatingHeaders) throw std::runtime_error("NetworkSync - header validation thread already started.");
+
+    LOGGER(trace) << "Starting header validation thread..." << endl;
+    m_bValidatingHeaders = true;
+    m_headerValidationThread = boost::thread(&NetworkSync::headerValidationLoop, this);
+    LOGGER(trace) << "Header validation thread started." << endl;
+}
 
-    // The byte order of the tx hashes must be reversed when moving between merkle trees and the block chain
-    const std::list<uchar_vector>& reversedTxHashes = merkleTree.getTxHashes();
+void NetworkSync::stopHeaderValidationThread()
+{
+    if (!m_bValidatingHeaders) return;
+    boost::unique_lock<boost::mutex> lock(m_headerQueueMutex);
+    if (!m_bValidatingHeaders) return;
+
+    LOGGER(trace) << "Stopping header validation thread..." << endl;
+    m_bValidatingHeaders = false;
+    while (!m_headerQueue.empty()) { m_headerQueue.pop(); }
+    m_lastQueuedHeaderHash.clear();
+    m_headerScheduler.clear();
+    lock.unlock();
+    m_headerQueueCond.notify_all();
+    m_headerValidationThread.join();
+    LOGGER(trace) << "Header validation thread stopped." << endl;
+}
 
-    if (reversedTxHashes.empty())
+void NetworkSync::headerValidationLoop()
+{
+    while (true)
     {
-        notifyMerkleBlock(merkleBlock);
-        return;
-    }
+        boost::unique_lock<boost::mutex> lock(m_headerQueueMutex);
+        while (m_bValidatingHeaders && m_headerQueue.empty()) { m_headerQueueCond.wait(lock); }
+        if (!m_bValidatingHeaders) break;
 
-    m_currentMerkleTxCount = reversedTxHashes.size();
-    int i = 0;
-    for (auto& reversedTxHash: merkleTree.getTxHashes())
-    {
-        uchar_vector txHash = reversedTxHash.getReverse();
-        m_currentMerkleTxHashes.push(txHash);
-        LOGGER(trace) << "  Added tx to queue (" << ++i << " of " << m_currentMerkleTxCount << "): " << txHash.getHex() << endl;
-    }
-    
-    // Set up merkle confirmation state
-    m_currentMerkleBlock = merkleBlock;
-    m_currentMerkleTxIndex = 0;
+        std::vector<Coin::CoinBlockHeader> headers;
+        headers.swap(m_headerQueue.front());
+        m_headerQueue.pop();
+        lock.unlock();
 
-    // Confirm any transactions already in our mempool before letting tx handler do anything
-    processMempoolConfirmations();
+        if (headers.empty())
+        {
+            finishHeaderSync();
+        }
+        else if (!processHeaders(headers))
+        {
+            // Nothing queued after a bad header can connect. Messages already asked for will
+            // be turned away by the headers handler.
+            lock.lock();
+            while (!m_headerQueue.empty()) { m_headerQueue.pop(); }
+            m_lastQueuedHeaderHash.clear();
+            m_headerScheduler.clear();
+        }
+    }
 }
 
-void NetworkSync::processBlockTx(const Coin::Transaction& tx)
+bool NetworkSync::processHeaders(const std::vector<Coin::CoinBlockHeader>& headers)
 {
-    string txHashHex = tx.hash().getHex();
-    LOGGER(trace) << "NetworkSync::processBlockTx(" << txHashHex << ")" << endl;
     try
     {
-        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        ChainHeader parent;
+        {
+            boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+            parent = m_blockTree.getHeader(headers.front().prevBlockHash());
+        }
 
-        // Notify of confirmations of previously received transactions as well as the current one
-        processMempoolConfirmations();
-        if (!m_currentMerkleTxHashes.empty())
+        // The deadlines only need the parent, so they are all checked before taking the lock.
+        std::exception_ptr error;
+        std::size_t prechecked = precheckHeaders(parent, headers, error);
+
+        std::clock_t start = std::clock();
+        boost::unique_lock<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        for (std::size_t i = 0; i < headers.size(); i++)
         {
-            if (tx.hash() == m_currentMerkleTxHashes.front())
+            const Coin::CoinBlockHeader& item = headers[i];
+            try
             {
-                LOGGER(trace) << "NetworkSync::processBlockTx - New merkle transaction (" << (m_currentMerkleTxIndex + 1) << " of " << m_currentMerkleTxCount << "): " << txHashHex << endl;
-                notifyMerkleTx(m_currentMerkleBlock, tx, m_currentMerkleTxIndex++, m_currentMerkleTxCount);
-                m_currentMerkleTxHashes.pop();
+                if (i == prechecked) std::rethrow_exception(error);
+                if (m_blockTree.insertPrecheckedHeader(item, [&](uint32_t height, bytes_t& hash) {
+                    std::clock_t now = std::clock();
+                    if (height > 0 && now - start > 1000 ) {
+                        start = now;
+                        notifyBlockHeaderValidate(height, hash);
+                    }
+                })) {
+                    m_bHeadersSynched = false;
+                }
             }
-            else if ((!m_lastRequestedMerkleBlockHash.empty()) && (m_lastRequestedBlockHash != m_lastRequestedMerkleBlockHash))
+            catch (const std::exception& e)
             {
-                m_bMissingTxs = true;
-                m_lastRequestedBlockHash = m_lastRequestedMerkleBlockHash;
-                LOGGER(trace) << "We are missing some transactions in the mempool - perhaps due to reorg." << endl;
-                LOGGER(trace) << "Asking for block " << m_lastRequestedBlockHash.getHex() << endl;
-                try
-                {
-                    m_peer.getBlock(m_lastRequestedBlockHash);
-                    LOGGER(debug) << "Got block " << m_lastRequestedBlockHash.getHex() << endl;
-                }
-                catch (const exception& e)
+                fileFlushLock.unlock();
+                std::stringstream err;
+                err << "Block tree insertion error for block " << item.hash().getHex() << ": " << e.what(); // TODO: localization
+                LOGGER(error) << err.str() << std::endl;
+                // TODO: propagate code
+                notifyBlockTreeError(err.str(), -1);
+                return false;
+            }
+        }
+
+        LOGGER(trace)   << "Processed " << headers.size() << " headers."
+                        << " mBestHeight: " << m_blockTree.getBestHeight()
+                        << " mTotalWork: " << m_blockTree.getTotalWork().getDec() << std::endl;
+
+        vector<uchar_vector> locatorHashes = m_blockTree.getLocatorHashes(1);
+        if (locatorHashes.empty()) throw runtime_error("Blocktree is empty.");
+        if (headers.back().hash() != locatorHashes[0]) throw runtime_error("Blocktree conflicts with peer.");
+
+        std::stringstream status;
+        status << "Best Height: " << m_blockTree.getBestHeight() << " / " << "Total Work: " << m_blockTree.getTotalWork().getDec();
+        fileFlushLock.unlock();
+
+        notifyBlockTreeChanged();
+        notifyStatus(status.str());
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        LOGGER(error) << "block tree exception: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void NetworkSync::finishHeaderSync()
+{
+    m_fileFlushCond.notify_one();
+    notifyBlockTreeChanged();
+    if (!m_bHeadersSynched)
+    {
+        m_bHeadersSynched = true;
+        notifyHeadersSynched();
+    }
+
+    // Blocks being synched go up to the new tip.
+    boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+    if (m_bCompactFilters && !m_bSynchingBlocks && !m_lastSynchedMerkleBlockHash.empty())
+    {
+        // We were synched before these headers, which is how new blocks come in with compact
+        // filters, so we pick up again from there. The filter scheduler is idle and carries on
+        // its filter headers from where it got to.
+        int startHeight = -1;
+        {
+            boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+            if (m_blockTree.hasHeader(m_lastSynchedMerkleBlockHash))
+            {
+                const ChainHeader& lastHeader = m_blockTree.getHeader(m_lastSynchedMerkleBlockHash);
+                if (lastHeader.inBestChain && lastHeader.height < m_blockTree.getTipHeight())
                 {
-                    m_lastRequestedBlockHash.clear();
-                    // TODO: Propagate code
-                    syncLock.unlock();
-                    notifyConnectionError(e.what(), -1);
+                    startHeight = lastHeader.height + 1;
+                    m_filterScheduler.addBlock(startHeight, m_blockTree.getHeader(startHeight));
                 }
-
-                return;
             }
         }
-        processMempoolConfirmations();
 
-        if (!m_currentMerkleTxHashes.empty()) return; // we're still missing transactions
+        if (startHeight >= 0)
+        {
+            m_lastSynchedMerkleBlockHash.clear();
+            m_bSynchingBlocks = true;
+            notifySynchingBlocks();
+        }
+    }
+    updateBlockSync(syncLock);
+}
+
+void NetworkSync::startDownloadPeers()
+{
+    if (m_downloadPeers.empty() && m_autoDownloadPeers == 0) return;
+
+    m_peerManager.start();
+    for (auto& downloadPeer: m_downloadPeers)
+    {
+        std::string port = downloadPeer.second.empty() ? m_coinParams.default_port() : downloadPeer.second;
+        if (CoinQ::getPeerName(downloadPeer.first, port) == m_peer.name()) continue;
+
+        LOGGER(trace) << "Starting download peer " << downloadPeer.first << ":" << port << "..." << endl;
+        m_addressManager.add(downloadPeer.first, port, 0, time(NULL));
+        m_addressManager.markAttempt(CoinQ::getPeerName(downloadPeer.first, port));
+        m_peerManager.createPeer(downloadPeer.first, port, m_coinParams.magic_bytes(), m_coinParams.protocol_version(), "Wallet v0.1", 0, false);
+    }
+
+    connectAutoPeers();
+}
 
-        // Once the queue is empty, if we're at the tip signal completion of block sync.
-        uchar_vector currentMerkleBlockHash = m_currentMerkleBlock.hash();
-        const ChainHeader& chainTip = m_blockTree.getTip();
-        if (chainTip.hash() == currentMerkleBlockHash)
+void NetworkSync::startPeerTimer()
+{
+    m_peerTimer.expires_from_now(boost::posix_time::seconds(PEER_UPDATE_INTERVAL));
+    m_peerTimer.async_wait([this](const boost::system::error_code& ec)
+    {
+        if (ec || !m_bStarted) return;
+        updatePeerStats();
+        if (++m_peerUpdates % PEER_ROTATE_UPDATES == 0)
         {
-            LOGGER(trace) << "Block sync detected from tx handler." << endl;
-            m_lastRequestedMerkleBlockHash.clear();
-            m_lastSynchedMerkleBlockHash = currentMerkleBlockHash;
-            syncLock.unlock();
-            notifyBlocksSynched();
-            return;
+            rotateAutoPeers();
+            m_addressManager.save();
         }
+        startPeerTimer();
+    });
+}
 
-        // Ask for the next block
-        const ChainHeader& nextHeader = m_blockTree.getHeader(m_currentMerkleBlock.height + 1);
-        m_lastRequestedMerkleBlockHash = nextHeader.hash();
-        LOGGER(trace) << "Asking for filtered block (1) " << m_lastRequestedMerkleBlockHash.getHex() << std::endl;
-        
-        try
+void NetworkSync::updatePeerStats()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - m_lastPeerUpdate).count();
+    m_lastPeerUpdate = now;
+
+    std::vector<std::shared_ptr<CoinQ::Peer>> peers = m_peerManager.getPeers();
+    std::vector<CoinQ::Peer*> allPeers;
+    if (m_bConnected) { allPeers.push_back(&m_peer); }
+    for (auto& peer: peers) { allPeers.push_back(peer.get()); }
+
+    std::map<std::string, uint64_t> bytesRead;
+    for (CoinQ::Peer* peer: allPeers)
+    {
+        // The fastest pong so far is the best guess at the link's latency. Only a busy interval
+        // says anything about its download rate.
+        CoinQ::Peer::ReadStats stats = peer->getReadStats();
+        auto it = m_peerBytesRead.find(peer->name());
+        uint64_t bytes = (it != m_peerBytesRead.end() && it->second <= stats.bytesRead) ? stats.bytesRead - it->second : stats.bytesRead;
+        if (bytes >= MIN_THROUGHPUT_SAMPLE_BYTES) { m_addressManager.updateThroughput(peer->name(), bytes, seconds); }
+        m_addressManager.updatePing(peer->name(), stats.minPingMicroseconds);
+        bytesRead[peer->name()] = stats.bytesRead;
+
+        peer->ping(PROBE_PING_NONCE | ++m_probePings);
+    }
+    m_peerBytesRead.swap(bytesRead);
+}
+
+void NetworkSync::rotateAutoPeers()
+{
+    if (m_autoDownloadPeers == 0) return;
+
+    // The slowest picked peer makes way if a known address looks at least twice as fast.
+    AddressManager::Entry slowest;
+    AddressManager::Entry replacement;
+    bool bReplace;
+    {
+        boost::lock_guard<boost::mutex> autoPeerLock(m_autoPeerMutex);
+        std::vector<std::string> picked;
+        for (auto& autoPeer: m_autoPeers)
         {
-            m_peer.getFilteredBlock(m_lastRequestedMerkleBlockHash);
+            if (autoPeer.second) { picked.push_back(autoPeer.first); }
         }
-        catch (const exception& e)
+        bReplace = m_addressManager.selectReplacement(picked, getConnectedPeerNames(), slowest, replacement);
+    }
+
+    if (bReplace)
+    {
+        LOGGER(debug) << "NetworkSync - replacing download peer " << slowest.name() << " with " << replacement.name() << endl;
+
+        // The close handler takes it out of m_autoPeers and hands its blocks to the others.
+        m_peerManager.deletePeer(slowest.name());
+    }
+
+    connectAutoPeers();
+}
+
+void NetworkSync::connectAutoPeers()
+{
+    if (m_autoDownloadPeers == 0 || !m_peerManager.isRunning()) return;
+
+    std::vector<AddressManager::Entry> entries;
+    {
+        boost::lock_guard<boost::mutex> autoPeerLock(m_autoPeerMutex);
+        if (m_autoPeers.size() >= m_autoDownloadPeers) return;
+
+        entries = m_addressManager.select(m_autoDownloadPeers - m_autoPeers.size(), getConnectedPeerNames());
+        for (auto& entry: entries) { m_autoPeers[entry.name()] = false; }
+    }
+
+    for (auto& entry: entries)
+    {
+        LOGGER(trace) << "Starting download peer " << entry.name() << " from known addresses..." << endl;
+        m_addressManager.markAttempt(entry.name());
+        m_peerManager.createPeer(entry.host, entry.port, m_coinParams.magic_bytes(), m_coinParams.protocol_version(), "Wallet v0.1", 0, false);
+    }
+}
+
+// Called with m_autoPeerMutex held.
+std::set<std::string> NetworkSync::getConnectedPeerNames()
+{
+    std::set<std::string> names;
+    names.insert(m_peer.name());
+    for (auto& peer: m_peerManager.getPeers()) { names.insert(peer->name()); }
+    for (auto& autoPeer: m_autoPeers) { names.insert(autoPeer.first); }
+    return names;
+}
+
+void NetworkSync::scheduleBlocks()
+{
+    // Heights are added as the scheduler is ready for them rather than all the way to the tip
+    // at once, which for a rescan from genesis would be a lot of hashes to hold.
+    if (m_bCompactFilters)
+    {
+        int lastHeight = m_filterScheduler.lastHeight();
+        if (lastHeight < 0) return;
+
+        boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        int endHeight = std::min(m_blockTree.getTipHeight(), m_filterScheduler.nextHeight() + CompactFilterScheduler::MAX_BLOCKS_AHEAD - 1);
+        for (int height = lastHeight + 1; height <= endHeight; height++)
         {
-            // TODO: Propagate code
-            syncLock.unlock();
-            notifyConnectionError(e.what(), -1);
+            m_filterScheduler.addBlock(height, m_blockTree.getHeader(height));
         }
+        return;
+    }
+
+    int lastHeight = m_blockScheduler.lastHeight();
+    if (lastHeight < 0) return;
+
+    boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+    int endHeight = std::min(m_blockTree.getTipHeight(), m_blockScheduler.nextHeight() + MerkleBlockScheduler::MAX_BLOCKS_AHEAD - 1);
+    for (int height = lastHeight + 1; height <= endHeight; height++)
+    {
+        m_blockScheduler.addBlock(height, m_blockTree.getHeader(height).hash());
+    }
+}
+
+void NetworkSync::updateBlockSync(boost::unique_lock<boost::mutex>& syncLock)
+{
+    if (!m_bSynchingBlocks) return;
+
+    scheduleBlocks();
+    if (m_bCompactFilters)
+    {
+        m_filterScheduler.request();
+        if (!m_filterScheduler.isIdle()) return;
+    }
+    else
+    {
+        m_blockScheduler.requestBlocks();
+        if (!m_blockScheduler.isIdle()) return;
+    }
+
+    // Everything up to the tip is in.
+    LOGGER(trace) << "Block sync complete." << endl;
+    m_bSynchingBlocks = false;
+    {
+        boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        m_lastSynchedMerkleBlockHash = m_blockTree.getTip().hash();
+    }
+    syncLock.unlock();
+    notifyBlocksSynched();
+}
+
+void NetworkSync::deliverMerkleBlock(int height, const Coin::MerkleBlock& merkleBlock, const std::vector<Coin::hash256_t>& txHashes, const std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs)
+{
+    ChainMerkleBlock chainMerkleBlock;
+    {
+        boost::lock_guard<boost::mutex> fileFlushLock(m_fileFlushMutex);
+        const ChainHeader& merkleHeader = m_blockTree.getHeader(merkleBlock.hash());
+        chainMerkleBlock = ChainMerkleBlock(merkleBlock, true, merkleHeader.height, merkleHeader.chainWork);
+    }
+
+    LOGGER(trace) << "Synchronizing merkle block: " << chainMerkleBlock.hash().getHex() << " height: " << height << endl;
+    if (txHashes.empty())
+    {
+        notifyMerkleBlock(chainMerkleBlock);
+        return;
+    }
+
+    // Transactions the peer sent are new to us, the rest were in our mempool.
+    unsigned int txCount = txHashes.size();
+    for (unsigned int i = 0; i < txCount; i++)
+    {
+        const Coin::hash256_t& txHash = txHashes[i];
+        auto it = txs.find(txHash);
+        if (it != txs.end())
+        {
+            LOGGER(trace) << "New merkle transaction (" << (i + 1) << " of " << txCount << "): " << txHash.getHex() << endl;
+            notifyMerkleTx(chainMerkleBlock, it->second, i, txCount);
+        }
+        else
+        {
+            LOGGER(trace) << "  Confirming tx (" << (i + 1) << " of " << txCount << "): " << txHash.getHex() << endl;
+            notifyTxConfirmed(chainMerkleBlock, txHash.getBytes(), i, txCount);
+        }
+
+        boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
+        m_mempoolTxs.erase(txHash);
+    }
+}
+
+void NetworkSync::startStallTimer()
+{
+    m_stallTimer.expires_from_now(boost::posix_time::seconds(BLOCK_STALL_CHECK_INTERVAL));
+    m_stallTimer.async_wait([this](const boost::system::error_code& ec)
+    {
+        if (ec || !m_bStarted) return;
+        removeStalledPeers();
+        startStallTimer();
+    });
+}
+
+void NetworkSync::removeStalledPeers()
+{
+    {
+        // Header ranges go to other peers but the connection is kept for blocks.
+        boost::lock_guard<boost::mutex> queueLock(m_headerQueueMutex);
+        m_headerScheduler.releaseStalledPeers(std::chrono::seconds(BLOCK_STALL_TIMEOUT));
+    }
+
+    std::vector<std::string> stalled;
+    {
+        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        if (m_bCompactFilters)
+        {
+            stalled = m_filterScheduler.removeStalledPeers(std::chrono::seconds(BLOCK_STALL_TIMEOUT));
+        }
+        else
+        {
+            stalled = m_blockScheduler.removeStalledPeers(std::chrono::seconds(BLOCK_STALL_TIMEOUT));
+        }
+        if (stalled.empty()) return;
+
+        // m_peer also brings us headers and new transactions so it is not dropped. It starts over
+        // with no requests instead.
+        if (m_bConnected && std::find(stalled.begin(), stalled.end(), m_peer.name()) != stalled.end())
+        {
+            addBlockPeer(m_peer);
+        }
+
+        updateBlockSync(syncLock);
+    }
+
+    // Deleting a peer calls the close handler, which takes m_syncMutex.
+    for (auto& peername: stalled)
+    {
+        if (peername != m_peer.name()) { m_peerManager.deletePeer(peername); }
+    }
+}
+
+void NetworkSync::sendToPeer(const std::string& peername, const std::function<void(CoinQ::Peer&)>& fn)
+{
+    if (peername == m_peer.name())
+    {
+        fn(m_peer);
+        return;
+    }
+
+    std::shared_ptr<CoinQ::Peer> peer = m_peerManager.getPeer(peername);
+    if (peer) { fn(*peer); }
+}
+
+void NetworkSync::onDownloadPeerOpen(CoinQ::Peer& peer)
+{
+    LOGGER(trace) << "Download peer " << peer.name() << " connection opened." << endl;
+    m_addressManager.markConnected(peer.name());
+    {
+        boost::lock_guard<boost::mutex> autoPeerLock(m_autoPeerMutex);
+        auto it = m_autoPeers.find(peer.name());
+        if (it != m_autoPeers.end()) { it->second = true; }
+    }
+
+    if (m_bloomFilter.isSet() && !m_bCompactFilters)
+    {
+        Coin::FilterLoadMessage filterLoad(m_bloomFilter.getNHashFuncs(), m_bloomFilter.getNTweak(), m_bloomFilter.getNFlags(), m_bloomFilter.getFilter());
+        peer.send(filterLoad);
+    }
+
+    {
+        boost::lock_guard<boost::mutex> queueLock(m_headerQueueMutex);
+        m_headerScheduler.addPeer(peer.name());
+        m_headerScheduler.requestRanges();
+    }
+
+    boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+    addBlockPeer(peer);
+    updateBlockSync(syncLock);
+}
+
+void NetworkSync::onDownloadPeerClose(CoinQ::Peer& peer)
+{
+    LOGGER(trace) << "Download peer " << peer.name() << " connection closed." << endl;
+    {
+        // A replacement is picked at the next rotation.
+        boost::lock_guard<boost::mutex> autoPeerLock(m_autoPeerMutex);
+        auto it = m_autoPeers.find(peer.name());
+        if (it != m_autoPeers.end())
+        {
+            if (!it->second) { m_addressManager.markFailed(peer.name()); }
+            m_autoPeers.erase(it);
+        }
+    }
+
+    {
+        boost::lock_guard<boost::mutex> queueLock(m_headerQueueMutex);
+        m_headerScheduler.removePeer(peer.name());
+        m_headerScheduler.requestRanges();
+    }
+
+    boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+    m_blockScheduler.removePeer(peer.name());
+    m_filterScheduler.removePeer(peer.name());
+    updateBlockSync(syncLock);
+}
+
+void NetworkSync::onDownloadPeerHeaders(CoinQ::Peer& peer, const Coin::HeadersMessage& headersMessage)
+{
+    LOGGER(trace) << "Received " << headersMessage.headers.size() << " headers from " << peer.name() << endl;
+    boost::lock_guard<boost::mutex> queueLock(m_headerQueueMutex);
+    if (!m_bValidatingHeaders) return;
+
+    // Held until m_peer gets to them.
+    m_headerScheduler.onHeaders(peer.name(), headersMessage.headers);
+}
+
+bool NetworkSync::onMerkleBlock(CoinQ::Peer& peer, const Coin::MerkleBlock& merkleBlock)
+{
+    LOGGER(trace) << "Received merkle block from " << peer.name() << ": " << merkleBlock.hash().getHex() << endl;
+    try
+    {
+        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        if (!m_blockScheduler.onMerkleBlock(peer.name(), merkleBlock)) return false;
+        updateBlockSync(syncLock);
     }
     catch (const exception& e)
     {
-        LOGGER(error) << "Protocol error processing merkle transactions: " << e.what() << endl;
+        LOGGER(error) << "NetworkSync - protocol error: " << e.what() << std::endl;
         // TODO: propagate code
         notifyProtocolError(e.what(), -1);
     }
+    return true;
 }
 
-void NetworkSync::processMempoolConfirmations()
+void NetworkSync::onTx(CoinQ::Peer& peer, const Coin::Transaction& tx)
 {
-    boost::unique_lock<boost::mutex> mempoolLock(m_mempoolMutex);
-    LOGGER(trace) << "Confirming " << m_currentMerkleTxHashes.size() << " merkle block transactions from " << m_mempoolTxs.size() << " mempool transactions..." << endl;
-    while (!m_currentMerkleTxHashes.empty() && m_mempoolTxs.count(m_currentMerkleTxHashes.front()))
+    LOGGER(trace) << "Received transaction from " << peer.name() << ": " << tx.hash().getHex() << endl;
     {
-        const uchar_vector& txHash = m_currentMerkleTxHashes.front();
-        LOGGER(trace) << "  Confirming tx (" << (m_currentMerkleTxIndex + 1) << " of " << m_currentMerkleTxCount << "): " << txHash.getHex() << endl;
-        mempoolLock.unlock();
-        notifyTxConfirmed(m_currentMerkleBlock, txHash, m_currentMerkleTxIndex++, m_currentMerkleTxCount);
+        boost::lock_guard<boost::mutex> syncLock(m_syncMutex);
+        if (m_blockScheduler.onTx(peer.name(), tx)) return;
 
-        mempoolLock.lock();
-        m_mempoolTxs.erase(txHash);
-        m_currentMerkleTxHashes.pop();
+        // Peers relay every transaction when there is no bloom filter.
+        if (m_bCompactFilters && !m_filterScheduler.isWatched(tx)) return;
+    }
+
+    bool bNew;
+    {
+        boost::lock_guard<boost::mutex> mempoolLock(m_mempoolMutex);
+        bNew = m_mempoolTxs.insert(Coin::hash256_t(tx.hash())).second;
+    }
+
+    // Download peers relay the same transactions as m_peer.
+    if (bNew || &peer == &m_peer) { notifyNewTx(tx); }
+}
+
+void NetworkSync::onBlock(CoinQ::Peer& peer, const Coin::CoinBlock& block)
+{
+    LOGGER(trace) << "Received block from " << peer.name() << ": " << block.hash().getHex() << endl;
+    try
+    {
+        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        bool bOurs = m_bCompactFilters ? m_filterScheduler.onBlock(peer.name(), block) : m_blockScheduler.onBlock(peer.name(), block);
+        if (!bOurs) return;    // Not a block we're working on.
+        updateBlockSync(syncLock);
+    }
+    catch (const exception& e)
+    {
+        LOGGER(error) << "NetworkSync - protocol error: " << e.what() << std::endl;
+        // TODO: propagate code
+        notifyProtocolError(e.what(), -1);
+    }
+}
+
+void NetworkSync::onPong(CoinQ::Peer& peer, uint64_t nonce)
+{
+    try
+    {
+        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        if (!m_blockScheduler.onPong(peer.name(), nonce)) return;
+        updateBlockSync(syncLock);
+    }
+    catch (const exception& e)
+    {
+        LOGGER(error) << "NetworkSync - protocol error: " << e.what() << std::endl;
+        // TODO: propagate code
+        notifyProtocolError(e.what(), -1);
+    }
+}
+
+void NetworkSync::onCFHeaders(CoinQ::Peer& peer, const Coin::CFHeadersMessage& cfheaders)
+{
+    LOGGER(trace) << "Received " << cfheaders.filterHashes.size() << " filter hashes from " << peer.name() << endl;
+    try
+    {
+        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        if (!m_filterScheduler.onCFHeaders(peer.name(), cfheaders)) return;
+        updateBlockSync(syncLock);
+    }
+    catch (const exception& e)
+    {
+        LOGGER(error) << "NetworkSync - protocol error: " << e.what() << std::endl;
+        // TODO: propagate code
+        notifyProtocolError(e.what(), -1);
+    }
+}
+
+void NetworkSync::onCFilter(CoinQ::Peer& peer, const Coin::CFilterMessage& cfilter)
+{
+    try
+    {
+        boost::unique_lock<boost::mutex> syncLock(m_syncMutex);
+        if (!m_filterScheduler.onCFilter(peer.name(), cfilter)) return;
+        updateBlockSync(syncLock);
+    }
+    catch (const exception& e)
+    {
+        LOGGER(error) << "NetworkSync - protocol error: " << e.what() << std::endl;
+        // TODO: propagate code
+        notifyProtocolError(e.what(), -1);
+    }
+}
+
+void NetworkSync::addBlockPeer(CoinQ::Peer& peer)
+{
+    if (!m_bCompactFilters)
+    {
+        m_blockScheduler.addPeer(peer.name());
+    }
+    else if (peer.services() & NODE_COMPACT_FILTERS)
+    {
+        m_filterScheduler.addPeer(peer.name());
+    }
+    else
+    {
+        LOGGER(debug) << "NetworkSync - " << peer.name() << " does not serve compact filters, not synching blocks from it." << endl;
     }
-    LOGGER(trace) << "Done processing mempool confirmations." << endl;
 }
@@ -16,6 +16,11 @@
 #endif
 
 #include "CoinQ_peer_io.h"
+#include "CoinQ_peermanager.h"
+#include "CoinQ_addrman.h"
+#include "CoinQ_blockscheduler.h"
+#include "CoinQ_filterscheduler.h"
+#include "CoinQ_headerscheduler.h"
 #include "CoinQ_blocks.h"
 #include "CoinQ_filter.h"
 
@@ -29,19 +34,19 @@
 
 #include <CoinCore/typedefs.h>
 #include <CoinCore/BloomFilter.h>
+#include <CoinCore/fixedhash.h>
 
+#include <atomic>
+#include <map>
 #include <queue>
+#include <set>
+#include <unordered_set>
 
 typedef Coin::Transaction coin_tx_t;
 typedef ChainHeader chain_header_t;
 typedef ChainBlock chain_block_t;
 typedef ChainMerkleBlock chain_merkle_block_t;
 
-namespace Coin
-{
-    class PartialMerkleTree;
-}
-
 namespace CoinQ {
     namespace Network {
 
@@ -61,26 +66,58 @@ namespace CoinQ {
 
         void loadHeaders(const std::string& blockTreeFile, bool bCheckProofOfWork = true, CoinQBlockTreeMem::callback_t callback = nullptr);
         bool headersSynched() const { return m_bHeadersSynched; }
+
+        // Headers are inserted on the header validation thread, so these return copies.
         int getBestHeight() const;
-        const bytes_t& getBestHash() const;
-        const ChainHeader& getBestHeader() const { return m_blockTree.getHeader(-1); }
-        const ChainHeader& getHeader(const bytes_t& hash) const { return m_blockTree.getHeader(hash); }
-        const ChainHeader& getHeader(int height) const { return m_blockTree.getHeader(height); }
-        const ChainHeader& getHeaderBefore(uint32_t timestamp) const { return m_blockTree.getHeaderBefore(timestamp); }
+        bytes_t getBestHash() const;
+        ChainHeader getBestHeader() const;
+        ChainHeader getHeader(const bytes_t& hash) const;
+        ChainHeader getHeader(int height) const;
+        ChainHeader getHeaderBefore(uint32_t timestamp) const;
 
-    /*
+        // Connects to the fastest known peer address.
         void start();
-        void stop();
-        bool isStarted() const { return m_bPeerStarted; }
-    */
         void start(const std::string& host, const std::string& port = "");
         void start(const std::string& host, int port);
         void stop();
         bool connected() const { return m_bConnected; }
 
+        // Extra peers filtered blocks, and headers between checkpoints, are downloaded from alongside
+        // the main one. Connected on start.
+        void addDownloadPeer(const std::string& host, const std::string& port = "");
+
+        // Filtered blocks asked for from each peer ahead of the ones it has sent. Defaults to
+        // MerkleBlockScheduler::DEFAULT_BLOCKS_PER_PEER; 1 asks for one block at a time.
+        void setBlocksPerPeer(unsigned int blocksPerPeer);
+
+        // Peer addresses we know of and how fast each was, kept in filename between runs.
+        // Addresses peers tell us about are added as they come in.
+        void loadPeerAddresses(const std::string& filename) { m_addressManager.load(filename); }
+        AddressManager& getAddressManager() { return m_addressManager; }
+
+        // Download peers picked from the known addresses, fastest first, on top of the ones added
+        // with addDownloadPeer. Now and then the slowest is swapped for a clearly faster one, and
+        // ones that go away are replaced. Must be stopped.
+        void setAutoDownloadPeers(unsigned int count);
+
         void setBloomFilter(const Coin::BloomFilter& bloomFilter);
         void clearBloomFilter();
 
+        // Adds elements to the filter the peers already have with filteradd. Returns false, and
+        // sends nothing, if there is no such filter.
+        bool addToBloomFilter(const std::vector<bytes_t>& elements);
+
+        // Blocks are synched with BIP157/158 compact filters from the peers that serve them
+        // instead of bloom filtered blocks, and no bloom filter is sent to peers. Blocks are
+        // matched against the scripts and outpoints passed to setWatchedScripts, and so are new
+        // transactions, which peers relay all of. Must be stopped.
+        void enableCompactFilters(bool bEnable = true);
+        bool compactFiltersEnabled() const { return m_bCompactFilters; }
+
+        // Output scripts to watch and the serialized outpoints of the outputs to them we have not
+        // spent yet.
+        void setWatchedScripts(const std::vector<bytes_t>& scripts, const std::vector<bytes_t>& outpoints);
+
         void syncBlocks(const std::vector<bytes_t>& locatorHashes, uint32_t startTime);
         void syncBlocks(int startHeight);
         void stopSynchingBlocks(bool bClearFilter = true);
@@ -148,8 +185,32 @@ namespace CoinQ {
         bool m_bConnected;
         CoinQ::Peer m_peer;
 
+        CoinQ::PeerManager m_peerManager;
+        std::vector<std::pair<std::string, std::string>> m_downloadPeers;
+
+        void startDownloadPeers();
+
+        // Every peer's ping and download rate go into m_addressManager on the io thread.
+        AddressManager m_addressManager;
+        unsigned int m_autoDownloadPeers;
+        boost::mutex m_autoPeerMutex;
+        std::map<std::string, bool> m_autoPeers;            // picked download peers, true once open
+        std::map<std::string, uint64_t> m_peerBytesRead;    // at the last update
+        std::chrono::steady_clock::time_point m_lastPeerUpdate;
+        unsigned int m_peerUpdates;
+        uint64_t m_probePings;
+        boost::asio::deadline_timer m_peerTimer;
+
+        void startPeerTimer();
+        void updatePeerStats();
+        void rotateAutoPeers();
+        void connectAutoPeers();
+        std::set<std::string> getConnectedPeerNames();
+
+        // Guards m_blockTree as well as the flush, since headers are inserted on the validation
+        // thread and read on the others.
         bool m_bFlushingToFile;
-        boost::mutex m_fileFlushMutex;
+        mutable boost::mutex m_fileFlushMutex;
         boost::condition_variable m_fileFlushCond;
         boost::thread m_fileFlushThread;
 
@@ -157,34 +218,78 @@ namespace CoinQ {
         void stopFileFlushThread();
         void fileFlushLoop();
 
+        // Header validation pipeline. The io thread queues each headers message that connects
+        // and asks the peer for the next one right away. The validation thread checks the
+        // deadlines of a whole message on a pool of threads and then inserts the headers in
+        // order. An empty message in the queue means the peer had nothing more to send.
+        //
+        // Meanwhile the download peers fetch the headers between checkpoints further up. The
+        // io thread queues those right behind m_peer's once m_peer reaches them.
+        bool m_bValidatingHeaders;
+        boost::mutex m_headerQueueMutex; // taken before m_fileFlushMutex if both are needed
+        boost::condition_variable m_headerQueueCond;
+        std::queue<std::vector<Coin::CoinBlockHeader>> m_headerQueue;
+        uchar_vector m_lastQueuedHeaderHash;
+        int m_lastQueuedHeaderHeight;
+        HeaderRangeScheduler m_headerScheduler; // guarded by m_headerQueueMutex
+        boost::thread m_headerValidationThread;
+
+        void startHeaderValidationThread();
+        void stopHeaderValidationThread();
+        void headerValidationLoop();
+        bool processHeaders(const std::vector<Coin::CoinBlockHeader>& headers);
+        void finishHeaderSync();
+
         mutable boost::mutex m_syncMutex;
         std::string m_blockTreeFile;
         CoinQBlockTreeMem m_blockTree;
         bool m_blockTreeLoaded;
-        bool m_bHeadersSynched;
 
-        uchar_vector m_lastRequestedBlockHash;
-        uchar_vector m_lastRequestedMerkleBlockHash;
+        std::vector<uchar_vector> getLocatorHashes() const;
+        bool hasHeader(const bytes_t& hash) const;
+        std::atomic<bool> m_bHeadersSynched;
+
         uchar_vector m_lastSynchedMerkleBlockHash;
 
-        void do_syncBlocks(int startHeight);
+        void do_syncBlocks(int startHeight, boost::unique_lock<boost::mutex>& syncLock);
 
         Coin::BloomFilter m_bloomFilter;
 
         void initBlockFilter();
 
-        // Merkle block state
         mutable boost::mutex m_mempoolMutex;
-        std::set<bytes_t> m_mempoolTxs;
-        ChainMerkleBlock m_currentMerkleBlock;
-        std::queue<bytes_t> m_currentMerkleTxHashes;
-        unsigned int m_currentMerkleTxIndex;
-        unsigned int m_currentMerkleTxCount;
-        bool m_bMissingTxs;
-
-        void syncMerkleBlock(const ChainMerkleBlock& merkleBlock, const Coin::PartialMerkleTree& merkleTree);
-        void processBlockTx(const Coin::Transaction& tx);
-        void processMempoolConfirmations();
+        std::unordered_set<Coin::hash256_t> m_mempoolTxs;
+
+        // Merkle block state, guarded by m_syncMutex. While synching, every block from the last
+        // one scheduled up to the tip is scheduled, and the scheduler spreads them over m_peer
+        // and the download peers.
+        MerkleBlockScheduler m_blockScheduler;
+
+        // Used instead of m_blockScheduler with compact filters, only with peers that serve them.
+        CompactFilterScheduler m_filterScheduler;
+        bool m_bCompactFilters;
+
+        bool m_bSynchingBlocks;
+        boost::asio::deadline_timer m_stallTimer;
+
+        void scheduleBlocks();
+        void updateBlockSync(boost::unique_lock<boost::mutex>& syncLock);
+        void deliverMerkleBlock(int height, const Coin::MerkleBlock& merkleBlock, const std::vector<Coin::hash256_t>& txHashes, const std::unordered_map<Coin::hash256_t, Coin::Transaction>& txs);
+        void startStallTimer();
+        void removeStalledPeers();
+
+        // Handlers shared by m_peer and the download peers
+        void sendToPeer(const std::string& peername, const std::function<void(CoinQ::Peer&)>& fn);
+        void onDownloadPeerOpen(CoinQ::Peer& peer);
+        void onDownloadPeerClose(CoinQ::Peer& peer);
+        void onDownloadPeerHeaders(CoinQ::Peer& peer, const Coin::HeadersMessage& headersMessage);
+        bool onMerkleBlock(CoinQ::Peer& peer, const Coin::MerkleBlock& merkleBlock);
+        void onTx(CoinQ::Peer& peer, const Coin::Transaction& tx);
+        void onBlock(CoinQ::Peer& peer, const Coin::CoinBlock& block);
+        void onPong(CoinQ::Peer& peer, uint64_t nonce);
+        void onCFHeaders(CoinQ::Peer& peer, const Coin::CFHeadersMessage& cfheaders);
+        void onCFilter(CoinQ::Peer& peer, const Coin::CFilterMessage& cfilter);
+        void addBlockPeer(CoinQ::Peer& peer);
 
         // Sync signals
         CoinQSignal<void> notifyStarted;
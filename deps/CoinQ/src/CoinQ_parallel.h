@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// CoinQ_parallel.h
+//
+// Copyright (c) 2011-2016 Ciphrex Corp.
+//
+// Distributed under the MIT software license, see the accompanying
+// file LICENSE or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#pragma once
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+namespace CoinQ {
+
+// Calls fn for every index in [0, count) from threads threads (0 for one per core), the calling
+// thread being one of them. Indices are handed out grain at a time so a slow stretch does not
+// hold up the rest. fn must not throw.
+inline void parallelFor(std::size_t count, unsigned int threads, const std::function<void(std::size_t)>& fn, std::size_t grain = 64)
+{
+    if (threads == 0) threads = std::max(1u, boost::thread::hardware_concurrency());
+
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+        for (std::size_t begin; (begin = next.fetch_add(grain)) < count;)
+        {
+            std::size_t end = std::min(begin + grain, count);
+            for (std::size_t i = begin; i < end; i++) { fn(i); }
+        }
+    };
+
+    boost::thread_group group;
+    try
+    {
+        for (unsigned int i = 1; i < threads && i * grain < count; i++) { group.create_thread(worker); }
+        worker();
+    }
+    catch (...)
+    {
+        group.join_all();
+        throw;
+    }
+    group.join_all();
+}
+
+}
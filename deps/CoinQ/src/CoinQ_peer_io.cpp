@@ -11,6 +11,8 @@
 
 #include "CoinQ_peer_io.h"
 
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 
 using namespace CoinQ;
@@ -26,10 +28,8 @@ void Peer::do_handshake()
     Coin::NetworkAddress peerAddress;
     peerAddress.set(NODE_NETWORK, DEFAULT_Ipv6, strtoul(port_.c_str(), NULL, 0));
     Coin::VersionMessage versionMessage(protocol_version_, NODE_NETWORK, time(NULL), peerAddress, peerAddress, getRandomNonce64(), user_agent_.c_str(), start_height_, relay_);
-    Coin::CoinNodeMessage msg(magic_bytes_, &versionMessage);
-
     LOGGER(trace) << "Sending version message." << endl;
-    do_send(msg);
+    do_send(versionMessage);
 
     // Give peer 5 seconds to respond
     timer_.expires_from_now(boost::posix_time::seconds(5));
@@ -48,10 +48,36 @@ void Peer::do_handshake()
     });
 }
 
+void Peer::reset_read_buffer()
+{
+    if (read_buffer.size() > READ_BUFFER_SIZE) { std::vector<unsigned char>(READ_BUFFER_SIZE).swap(read_buffer); }
+    read_begin = 0;
+    read_end = 0;
+    min_read_bytes = MIN_MESSAGE_HEADER_SIZE;
+    read_hasher.Reset();
+    read_hashed = 0;
+}
+
 void Peer::do_read()
 {
+    // Make room for at least min_read_bytes, and for a decent sized read unless the buffer has
+    // to grow anyway.
+    if (read_begin == read_end)
+    {
+        std::size_t min_bytes = min_read_bytes;
+        reset_read_buffer();
+        min_read_bytes = min_bytes;
+    }
+    else if (read_buffer.size() - read_end < std::max<std::size_t>(min_read_bytes, READ_BUFFER_SIZE / 2))
+    {
+        std::memmove(&read_buffer[0], &read_buffer[read_begin], read_end - read_begin);
+        read_end -= read_begin;
+        read_begin = 0;
+    }
+    if (read_buffer.size() - read_end < min_read_bytes) { read_buffer.resize(read_end + min_read_bytes); }
+
 //     LOGGER(trace) << "Peer::do_read() - waiting for " << min_read_bytes << " bytes..." << endl;
-    boost::asio::async_read(socket_, boost::asio::buffer(read_buffer, READ_BUFFER_SIZE),
+    boost::asio::async_read(socket_, boost::asio::buffer(&read_buffer[read_end], read_buffer.size() - read_end),
         //boost::asio::transfer_at_least(MIN_MESSAGE_HEADER_SIZE),
         boost::asio::transfer_at_least(min_read_bytes),
     strand_.wrap([this](const boost::system::error_code& ec, std::size_t bytes_read) {
@@ -61,7 +87,7 @@ void Peer::do_read()
         {
             if (ec == boost::asio::error::operation_aborted) return;
 
-            read_message.clear();
+            reset_read_buffer();
             do_stop();
 
             stringstream err;
@@ -71,60 +97,94 @@ void Peer::do_read()
             return;
         }
 
-        read_message += uchar_vector(read_buffer, bytes_read);
+        read_end += bytes_read;
+        {
+            boost::lock_guard<boost::mutex> statsLock(statsMutex);
+            readStats.bytesRead += bytes_read;
+        }
 
         while (true)
         {
-            if (read_message.size() < MIN_MESSAGE_HEADER_SIZE)
+            const unsigned char* data = &read_buffer[read_begin];
+            std::size_t available = read_end - read_begin;
+            if (available < MIN_MESSAGE_HEADER_SIZE)
             {
-                min_read_bytes = MIN_MESSAGE_HEADER_SIZE - read_message.size();
+                min_read_bytes = MIN_MESSAGE_HEADER_SIZE - available;
                 break;
             }
 
             // Find the first occurrence of the magic bytes, discard anything before it.
-            // If magic bytes are not found, read new buffer. 
+            // If magic bytes are not found, keep what could be the start of them and read more.
             // TODO: detect misbehaving node and disconnect.
-            uchar_vector::iterator it = std::search(read_message.begin(), read_message.end(), magic_bytes_vector_.begin(), magic_bytes_vector_.end());
-            if (it == read_message.end())
-            {
-                read_message.clear();
-                min_read_bytes = MIN_MESSAGE_HEADER_SIZE;
-                break;
-            }
-
-            read_message.assign(it, read_message.end());
-            if (read_message.size() < MIN_MESSAGE_HEADER_SIZE)
+            const unsigned char* magic = std::search(data, data + available, magic_bytes_vector_.begin(), magic_bytes_vector_.end());
+            if (magic != data)
             {
-                min_read_bytes = MIN_MESSAGE_HEADER_SIZE - read_message.size();
-                break;
+                std::size_t skipped = (magic == data + available) ? available - (magic_bytes_vector_.size() - 1) : magic - data;
+                read_begin += skipped;
+                read_hasher.Reset();
+                read_hashed = 0;
+                continue;
             }
 
             // Get command
-            unsigned char command[13];
+            char command[13];
             command[12] = 0;
-            uchar_vector(read_message.begin() + 4, read_message.begin() + 16).copyToArray(command);
+            std::memcpy(command, data + 4, 12);
             LOGGER(debug) << "Peer read handler - command: " << command << endl;
 
             // Get payload size
-            unsigned int payloadSize = vch_to_uint<uint32_t>(uchar_vector(read_message.begin() + 16, read_message.begin() + 20), LITTLE_ENDIAN_);
+            uint32_t payloadSize = (uint32_t)data[16] | ((uint32_t)data[17] << 8) | ((uint32_t)data[18] << 16) | ((uint32_t)data[19] << 24);
 //             LOGGER(debug) << "Peer read handler - payload size: " << payloadSize << endl;
-//             LOGGER(debug) << "Peer read handler - read_message size: " << read_message.size() << endl;
+//             LOGGER(debug) << "Peer read handler - available: " << available << endl;
 
-            if (read_message.size() < MIN_MESSAGE_HEADER_SIZE  + payloadSize)
+            if (payloadSize > MAX_PAYLOAD_SIZE)
             {
-                min_read_bytes = MIN_MESSAGE_HEADER_SIZE + payloadSize - read_message.size();
+                std::stringstream err;
+                err << "Message decode error: payload too large for " << command << ": " << payloadSize;
+                LOGGER(error) << "Peer read handler error: " << err.str() << std::endl;
+                notifyProtocolError(*this, err.str(), -1);
+
+                // Look for the next message after these magic bytes.
+                read_begin += magic_bytes_vector_.size();
+                continue;
+            }
+
+            // Hash whatever part of the payload arrived since last time.
+            std::size_t payloadAvailable = std::min<std::size_t>(available - MIN_MESSAGE_HEADER_SIZE, payloadSize);
+            if (payloadAvailable > read_hashed)
+            {
+                read_hasher.Write(data + MIN_MESSAGE_HEADER_SIZE + read_hashed, payloadAvailable - read_hashed);
+                read_hashed = payloadAvailable;
+            }
+
+            if (payloadAvailable < payloadSize)
+            {
+                min_read_bytes = payloadSize - payloadAvailable;
                 break;
             }
 
+            unsigned char checksum[CSHA256::OUTPUT_SIZE];
+            read_hasher.Finalize(checksum);
+            CSHA256().Write(checksum, sizeof(checksum)).Finalize(checksum);
+            read_hasher.Reset();
+            read_hashed = 0;
+
+            std::size_t messageSize = MIN_MESSAGE_HEADER_SIZE + payloadSize;
             try
             {
-                Coin::CoinNodeMessage peerMessage(read_message);
-
-                if (!peerMessage.isChecksumValid()) {
+                if (!std::equal(checksum, checksum + 4, data + 20)) {
                     LOGGER(debug) << "ChecksumValid fail! " << command << std::endl;
                     throw std::runtime_error("Invalid checksum.");
                 }
 
+                // The payload is parsed straight out of read_buffer.
+                Coin::ByteReader reader(data, messageSize);
+                Coin::CoinNodeMessage peerMessage(reader);
+                {
+                    boost::lock_guard<boost::mutex> statsLock(statsMutex);
+                    readStats.messagesRead++;
+                }
+
                 std::string command = peerMessage.getCommand();
                 if (command == "verack") {
                     LOGGER(trace) << "Peer read handler - VERACK" << std::endl;
@@ -144,9 +204,9 @@ void Peer::do_read()
                     LOGGER(trace) << "Peer read handler - VERSION" << std::endl;
 
                     // TODO: Check version information
+                    services_ = static_cast<Coin::VersionMessage*>(peerMessage.getPayload())->services();
                     Coin::VerackMessage verackMessage;
-                    Coin::CoinNodeMessage msg(magic_bytes_, &verackMessage);
-                    do_send(msg);
+                    do_send(verackMessage);
                 }
                 else if (command == "inv")
                 {
@@ -196,8 +256,29 @@ void Peer::do_read()
 
                     Coin::PingMessage* pPing = static_cast<Coin::PingMessage*>(peerMessage.getPayload());
                     Coin::PongMessage pongMessage(pPing->nonce);
-                    Coin::CoinNodeMessage msg(magic_bytes_, &pongMessage);
-                    do_send(msg);
+                    do_send(pongMessage);
+                }
+                else if (command == "pong")
+                {
+                    LOGGER(trace) << "Peer read handler - PONG" << std::endl;
+
+                    Coin::PongMessage* pPong = static_cast<Coin::PongMessage*>(peerMessage.getPayload());
+                    do_pong(pPong->nonce);
+                    notifyPong(*this, pPong->nonce);
+                }
+                else if (command == "cfilter")
+                {
+                    LOGGER(trace) << "Peer read handler - CFILTER" << std::endl;
+
+                    Coin::CFilterMessage* pCFilter = static_cast<Coin::CFilterMessage*>(peerMessage.getPayload());
+                    notifyCFilter(*this, *pCFilter);
+                }
+                else if (command == "cfheaders")
+                {
+                    LOGGER(trace) << "Peer read handler - CFHEADERS" << std::endl;
+
+                    Coin::CFHeadersMessage* pCFHeaders = static_cast<Coin::CFHeadersMessage*>(peerMessage.getPayload());
+                    notifyCFHeaders(*this, *pCFHeaders);
                 }
                 else
                 {
@@ -216,25 +297,65 @@ void Peer::do_read()
                 err << "Message decode error: " << e.what();
                 LOGGER(error) << "Peer read handler error: " << err.str() << std::endl;
                 notifyProtocolError(*this, err.str(), -1);
-                min_read_bytes = MIN_MESSAGE_HEADER_SIZE;
             }
 
-            read_message.assign(read_message.begin() + MIN_MESSAGE_HEADER_SIZE + payloadSize, read_message.end());
-//             LOGGER(debug) << "Peer read handler - remaining message bytes: " << read_message.size() << endl;
+            // A handler may have stopped us.
+            if (!bRunning) return;
+
+            read_begin += messageSize;
+//             LOGGER(debug) << "Peer read handler - remaining message bytes: " << (read_end - read_begin) << endl;
         }
 
         do_read();
     }));
 }
 
-void Peer::do_write(boost::shared_ptr<uchar_vector> data)
+void Peer::do_write()
 {
     if (!bRunning) return;
 
-    boost::asio::async_write(socket_, boost::asio::buffer(*data), boost::asio::transfer_all(),
-    strand_.wrap([this](const boost::system::error_code& ec, std::size_t bytes_written) {
+    // Everything queued so far, up to a limit, goes out in one write. The batch owns the
+    // messages until the write completes.
+    boost::shared_ptr<write_batch_t> batch(new write_batch_t());
+    std::vector<boost::asio::const_buffer> buffers;
+    {
+        boost::lock_guard<boost::mutex> sendLock(sendMutex);
+        std::size_t batchBytes = 0;
+        while (!sendQueue.empty() && batch->size() < MAX_WRITE_BATCH_MESSAGES)
+        {
+            std::size_t messageBytes = MIN_MESSAGE_HEADER_SIZE + sendQueue.front().payload->size();
+            if (!batch->empty() && batchBytes + messageBytes > MAX_WRITE_BATCH_BYTES) break;
+
+            batch->push_back(sendQueue.front());
+            sendQueue.pop_front();
+            batchBytes += messageBytes;
+        }
+
+        if (batch->empty())
+        {
+            bWriting = false;
+            return;
+        }
+
+        writeStats.queuedMessages -= batch->size();
+        writeStats.queuedBytes -= batchBytes;
+        writeStats.writes++;
+        writeStats.messagesWritten += batch->size();
+        writeStats.bytesWritten += batchBytes;
+        writeStats.maxBatchMessages = std::max(writeStats.maxBatchMessages, batch->size());
+    }
+
+    buffers.reserve(2 * batch->size());
+    for (auto& message: *batch)
+    {
+        buffers.push_back(boost::asio::buffer(message.header));
+        if (!message.payload->empty()) { buffers.push_back(boost::asio::buffer(*message.payload)); }
+    }
+
+    boost::asio::async_write(socket_, buffers, boost::asio::transfer_all(),
+    strand_.wrap([this, batch](const boost::system::error_code& ec, std::size_t bytes_written) {
         if (!bRunning) return;
-        LOGGER(trace) << "Peer write handler." << std::endl;
+        LOGGER(trace) << "Peer write handler - " << batch->size() << " messages, " << bytes_written << " bytes." << std::endl;
 
         if (ec)
         {
@@ -246,19 +367,42 @@ void Peer::do_write(boost::shared_ptr<uchar_vector> data)
             return;
         }
 
-        boost::lock_guard<boost::mutex> sendLock(sendMutex);
-        sendQueue.pop();
-        if (!sendQueue.empty()) { do_write(sendQueue.front()); }
+        do_write();
     }));
 }
 
-void Peer::do_send(const Coin::CoinNodeMessage& message)
+void Peer::do_send(const Coin::CoinNodeStructure& payload)
 {
-    boost::shared_ptr<uchar_vector> data(new uchar_vector(message.getSerialized()));
-    // LOGGER(trace) << "do_send() - data: " << data->getHex() << std::endl;
+    // The payload is serialized once and its checksum taken from those bytes.
+    OutgoingMessage message;
+    message.payload.reset(new uchar_vector());
+    message.payload->reserve(payload.getSize());
+    payload.serializeTo(*message.payload);
+
+    unsigned char checksum[CSHA256::OUTPUT_SIZE];
+    SHA256D(checksum, message.payload->data(), message.payload->size());
+
+    uint32_t length = message.payload->size();
+    const char* command = payload.getCommand();
+    std::memset(message.header, 0, MIN_MESSAGE_HEADER_SIZE);
+    for (int i = 0; i < 4; i++)
+    {
+        message.header[i] = (magic_bytes_ >> (8 * i)) & 0xff;
+        message.header[16 + i] = (length >> (8 * i)) & 0xff;
+    }
+    std::memcpy(message.header + 4, command, std::min<std::size_t>(std::strlen(command), 12));
+    std::memcpy(message.header + 20, checksum, 4);
+    // LOGGER(trace) << "do_send() - data: " << message.payload->getHex() << std::endl;
+
     boost::lock_guard<boost::mutex> sendLock(sendMutex);
-    sendQueue.push(data);
-    if (sendQueue.size() == 1) { strand_.post(boost::bind(&Peer::do_write, this, data)); }
+    sendQueue.push_back(message);
+    writeStats.queuedMessages++;
+    writeStats.queuedBytes += MIN_MESSAGE_HEADER_SIZE + length;
+    if (!bWriting)
+    {
+        bWriting = true;
+        strand_.post(boost::bind(&Peer::do_write, this));
+    }
 }
 
 void Peer::do_connect(tcp::resolver::iterator iter)
@@ -318,8 +462,17 @@ void Peer::start()
     bRunning = true;
     bHandshakeComplete = false;
     bWriteReady = false;
-    read_message.clear();
-    min_read_bytes = MIN_MESSAGE_HEADER_SIZE;
+    services_ = 0;
+    reset_read_buffer();
+    {
+        boost::lock_guard<boost::mutex> sendLock(sendMutex);
+        writeStats = WriteStats();
+    }
+    {
+        boost::lock_guard<boost::mutex> statsLock(statsMutex);
+        readStats = ReadStats();
+        pingTimes.clear();
+    }
 
     tcp::resolver::query query(host_, port_);
 
@@ -377,15 +530,44 @@ bool Peer::send(Coin::CoinNodeStructure& message)
     boost::shared_lock<boost::shared_mutex> runLock(mutex);
     if (!bRunning || !bWriteReady) return false;
 
-    Coin::CoinNodeMessage wrappedMessage(magic_bytes_, &message);
     // LOGGER(trace) << "message: " << message.getSerialized().getHex() << std::endl;
-    do_send(wrappedMessage);
+    do_send(message);
     return true;
 }
 
+Peer::ReadStats Peer::getReadStats() const
+{
+    boost::lock_guard<boost::mutex> statsLock(statsMutex);
+    return readStats;
+}
+
+void Peer::do_pong(uint64_t nonce)
+{
+    boost::lock_guard<boost::mutex> statsLock(statsMutex);
+    auto it = std::find_if(pingTimes.begin(), pingTimes.end(), [&](const std::pair<uint64_t, std::chrono::steady_clock::time_point>& ping) { return ping.first == nonce; });
+    if (it == pingTimes.end()) return;
+
+    uint64_t rtt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - it->second).count();
+    readStats.pongs++;
+    readStats.lastPingMicroseconds = rtt;
+    if (readStats.minPingMicroseconds == 0 || rtt < readStats.minPingMicroseconds) { readStats.minPingMicroseconds = rtt; }
+
+    // Pongs come back in order, so the pings before it went unanswered.
+    pingTimes.erase(pingTimes.begin(), it + 1);
+}
+
+Peer::WriteStats Peer::getWriteStats() const
+{
+    boost::lock_guard<boost::mutex> sendLock(sendMutex);
+    return writeStats;
+}
+
 void Peer::do_clearSendQueue()
 {
     boost::lock_guard<boost::mutex> sendLock(sendMutex);
-    while (!sendQueue.empty()) { sendQueue.pop(); }
+    sendQueue.clear();
+    bWriting = false;
+    writeStats.queuedMessages = 0;
+    writeStats.queuedBytes = 0;
 }
 
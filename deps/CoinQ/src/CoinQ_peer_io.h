@@ -16,9 +16,12 @@
 
 #include <CoinCore/typedefs.h>
 #include <CoinCore/numericdata.h>
+#include <CoinCore/sha256.h>
 
 #include <logger/logger.h>
 
+#include <chrono>
+#include <deque>
 #include <queue>
 
 #include <boost/shared_ptr.hpp>
@@ -50,6 +53,13 @@ typedef boost::asio::ip::tcp tcp;
 
 class Peer;
 
+// host:port, with IPv6 hosts in brackets so the port can be told apart from the address.
+inline std::string getPeerName(const std::string& host, const std::string& port)
+{
+    if (host.find(':') != std::string::npos && host[0] != '[') return "[" + host + "]:" + port;
+    return host + ":" + port;
+}
+
 typedef std::function<void(Peer&)>                                  peer_slot_t;
 typedef std::function<void(Peer&, const std::string&, int)>         peer_error_slot_t;
 
@@ -60,6 +70,9 @@ typedef std::function<void(Peer&, const Coin::MerkleBlock&)>        peer_merkle_
 typedef std::function<void(Peer&, const Coin::Transaction&)>        peer_tx_slot_t;
 typedef std::function<void(Peer&, const Coin::AddrMessage&)>        peer_addr_slot_t;
 typedef std::function<void(Peer&, const Coin::Inventory&)>          peer_inv_slot_t; 
+typedef std::function<void(Peer&, uint64_t /*nonce*/)>              peer_pong_slot_t;
+typedef std::function<void(Peer&, const Coin::CFilterMessage&)>     peer_cfilter_slot_t;
+typedef std::function<void(Peer&, const Coin::CFHeadersMessage&)>   peer_cfheaders_slot_t;
 
 
 class Peer
@@ -79,7 +92,16 @@ public:
         start_height_(start_height),
         relay_(relay),
         invFlags_(invFlags),
-        bRunning(false)
+        bRunning(false),
+        services_(0),
+        read_buffer(READ_BUFFER_SIZE),
+        read_begin(0),
+        read_end(0),
+        min_read_bytes(MIN_MESSAGE_HEADER_SIZE),
+        read_hashed(0),
+        readStats(),
+        bWriting(false),
+        writeStats()
     {
         magic_bytes_vector_ = uint_to_vch(magic_bytes_, LITTLE_ENDIAN_);
     }
@@ -109,6 +131,9 @@ public:
     void subscribeTx(peer_tx_slot_t slot) { notifyTx.connect(slot); }
     void subscribeAddr(peer_addr_slot_t slot) { notifyAddr.connect(slot); }
     void subscribeInv(peer_inv_slot_t slot) { notifyInv.connect(slot); }
+    void subscribePong(peer_pong_slot_t slot) { notifyPong.connect(slot); }
+    void subscribeCFilter(peer_cfilter_slot_t slot) { notifyCFilter.connect(slot); }
+    void subscribeCFHeaders(peer_cfheaders_slot_t slot) { notifyCFHeaders.connect(slot); }
     void subscribeProtocolError(peer_error_slot_t slot) { notifyProtocolError.connect(slot); }
 
     void subscribeStart(peer_slot_t slot) { notifyStart.connect(slot); }
@@ -124,15 +149,43 @@ public:
     void stop();
     bool send(Coin::CoinNodeStructure& message);
 
+    // Messages waiting to be handed to the socket go out together in one gathered write.
+    struct WriteStats
+    {
+        std::size_t queuedMessages;     // waiting now, not counting the write in progress
+        uint64_t queuedBytes;
+        uint64_t writes;                // since start
+        uint64_t messagesWritten;
+        uint64_t bytesWritten;
+        std::size_t maxBatchMessages;   // most messages in one write
+    };
+    WriteStats getWriteStats() const;
+
+    // Pings are timed from when ping() queues them, so one held up behind a long write or
+    // answered after a lot of data counts as slow. The fastest round trip seen is about as close
+    // to the link's latency as we get.
+    struct ReadStats
+    {
+        uint64_t bytesRead;             // since start
+        uint64_t messagesRead;
+        uint64_t pongs;                 // pongs to pings sent with ping()
+        uint64_t lastPingMicroseconds;
+        uint64_t minPingMicroseconds;   // 0 until the first pong
+    };
+    ReadStats getReadStats() const;
+
     bool isRunning() const { return bRunning; }
 
     uint32_t magic_bytes() const { return magic_bytes_; }
     const endpoint_t& endpoint() const { return endpoint_; }
     std::string resolved_name() const { std::stringstream ss; ss << endpoint_.address().to_string() << ":" << endpoint_.port(); return ss.str(); }
-    std::string name() const { std::stringstream ss; ss << host_ << ":" << port_; return ss.str(); }
+    std::string name() const { return getPeerName(host_, port_); }
 
     uint32_t inv_flags() const { return invFlags_; }
 
+    // Service bits from the peer's version message, 0 until it comes in.
+    uint64_t services() const { return services_; }
+
     void getTx(const bytes_t& hash)
     {
         if (hash.size() != 32)
@@ -210,6 +263,28 @@ public:
         send(getData);
     }
 
+    // One getdata for all of them. The peer answers in order.
+    void getFilteredBlocks(const std::vector<uchar_vector>& hashes)
+    {
+        if (hashes.empty()) return;
+        Coin::Inventory inv;
+        for (auto& hash: hashes)
+        {
+            if (hash.size() != 32)
+            {
+                std::stringstream err;
+                err << "Invalid block hash requested: " << uchar_vector(hash).getHex();
+                LOGGER(error) << "Peer::getFilteredBlocks() - " << err.str() << std::endl;
+                notifyProtocolError(*this, err.str(), -1);
+                return;
+            }
+
+            inv.addItem(Coin::InventoryItem(MSG_FILTERED_BLOCK | invFlags_, hash));
+        }
+        Coin::GetDataMessage getData(inv);
+        send(getData);
+    }
+
     void getHeaders(const std::vector<uchar_vector>& locatorHashes, const uchar_vector& hashStop = g_zero32bytes)
     {
         for (auto& hash: locatorHashes)
@@ -278,6 +353,38 @@ public:
         getBlocks(locatorHashes);
     }
 
+    // Filters of the blocks from startHeight up to stopHash, at most MAX_GET_CFILTERS_BLOCKS.
+    void getCFilters(uint8_t filterType, uint32_t startHeight, const uchar_vector& stopHash)
+    {
+        if (stopHash.size() != 32)
+        {
+            std::stringstream err;
+            err << "Invalid hash stop: " << uchar_vector(stopHash).getHex();
+            LOGGER(error) << "Peer::getCFilters() - " << err.str() << std::endl;
+            notifyProtocolError(*this, err.str(), -1);
+            return;
+        }
+
+        Coin::GetCFiltersMessage getCFilters(filterType, startHeight, stopHash);
+        send(getCFilters);
+    }
+
+    // Filter hashes of the blocks from startHeight up to stopHash, at most MAX_GET_CFHEADERS_BLOCKS.
+    void getCFHeaders(uint8_t filterType, uint32_t startHeight, const uchar_vector& stopHash)
+    {
+        if (stopHash.size() != 32)
+        {
+            std::stringstream err;
+            err << "Invalid hash stop: " << uchar_vector(stopHash).getHex();
+            LOGGER(error) << "Peer::getCFHeaders() - " << err.str() << std::endl;
+            notifyProtocolError(*this, err.str(), -1);
+            return;
+        }
+
+        Coin::GetCFHeadersMessage getCFHeaders(filterType, startHeight, stopHash);
+        send(getCFHeaders);
+    }
+
     void getMempool()
     {
         Coin::BlankMessage mempool("mempool");
@@ -290,6 +397,20 @@ public:
         send(getAddr);
     }
 
+    // The pong comes back after the answers to everything sent before the ping.
+    void ping(uint64_t nonce)
+    {
+        {
+            boost::lock_guard<boost::mutex> statsLock(statsMutex);
+            if (pingTimes.size() >= MAX_TIMED_PINGS) { pingTimes.pop_front(); }
+            pingTimes.push_back(std::make_pair(nonce, std::chrono::steady_clock::now()));
+        }
+
+        Coin::PingMessage ping;
+        ping.nonce = nonce;
+        send(ping);
+    }
+
 private:
     // ASIO environment
     //io_service_t& io_service_;
@@ -317,6 +438,7 @@ private:
     // State members
     boost::shared_mutex mutex;
     bool bRunning;
+    uint64_t services_;
 
     bool bWriteReady;
 
@@ -331,6 +453,9 @@ private:
     CoinQSignal<Peer&, const Coin::Transaction&>        notifyTx;
     CoinQSignal<Peer&, const Coin::AddrMessage&>        notifyAddr;
     CoinQSignal<Peer&, const Coin::Inventory&>          notifyInv;
+    CoinQSignal<Peer&, uint64_t>                        notifyPong;
+    CoinQSignal<Peer&, const Coin::CFilterMessage&>     notifyCFilter;
+    CoinQSignal<Peer&, const Coin::CFHeadersMessage&>   notifyCFHeaders;
     CoinQSignal<Peer&, const std::string&, int>         notifyProtocolError;
 
     CoinQSignal<Peer&>                                  notifyStart;
@@ -341,19 +466,51 @@ private:
 
     CoinQSignal<Peer&>                                  notifyTimeout;
 
-    static const unsigned int READ_BUFFER_SIZE = 262144;
-    unsigned char read_buffer[READ_BUFFER_SIZE];
+    // Received bytes not parsed yet are read_buffer[read_begin, read_end). Messages are framed
+    // and parsed where they lie; the unparsed tail is only moved to the front when the room
+    // after it runs low, and the buffer only grows for a message that does not fit.
+    static const std::size_t READ_BUFFER_SIZE = 262144;
+    static const uint32_t MAX_PAYLOAD_SIZE = 0x02000000;
+    std::vector<unsigned char> read_buffer;
+    std::size_t read_begin;
+    std::size_t read_end;
     std::size_t min_read_bytes;
 
-    uchar_vector read_message;
-    uchar_vector write_message;
-    std::queue<boost::shared_ptr<uchar_vector>> sendQueue;
-    boost::mutex sendMutex;
+    // Checksum of the payload at read_begin, hashed as its bytes come in.
+    CSHA256 read_hasher;
+    std::size_t read_hashed;
+
+    void reset_read_buffer();
+
+    static const std::size_t MAX_TIMED_PINGS = 64;
+
+    ReadStats readStats;
+    std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> pingTimes; // unanswered, in order sent
+    mutable boost::mutex statsMutex;
+
+    void do_pong(uint64_t nonce);
+
+    // Header and payload are kept apart so a batch is written as a list of buffers without
+    // copying the payloads together.
+    struct OutgoingMessage
+    {
+        unsigned char header[MIN_MESSAGE_HEADER_SIZE];
+        boost::shared_ptr<uchar_vector> payload;
+    };
+    typedef std::vector<OutgoingMessage> write_batch_t;
+
+    static const std::size_t MAX_WRITE_BATCH_MESSAGES = 256;
+    static const std::size_t MAX_WRITE_BATCH_BYTES = 1048576;
+
+    std::deque<OutgoingMessage> sendQueue;
+    bool bWriting;                  // a write is in progress or posted
+    WriteStats writeStats;
+    mutable boost::mutex sendMutex;
 
     void do_connect(tcp::resolver::iterator iter);
     void do_read();
-    void do_write(boost::shared_ptr<uchar_vector> data);
-    void do_send(const Coin::CoinNodeMessage& message); // calls do_write from the strand thread 
+    void do_write();
+    void do_send(const Coin::CoinNodeStructure& payload); // calls do_write from the strand thread 
     void do_handshake();
     void do_stop();
     void do_clearSendQueue();
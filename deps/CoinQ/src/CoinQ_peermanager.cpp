@@ -40,16 +40,20 @@ void PeerManager::createPeer(
     peer->subscribeTx([&](Peer& peer, const Coin::Transaction& tx) { notifyTx(peer, tx); });
     peer->subscribeAddr([&](Peer& peer, const Coin::AddrMessage& addr) { notifyAddr(peer, addr); });
     peer->subscribeInv([&](Peer& peer, const Coin::Inventory& inv) { notifyInv(peer, inv); });
+    peer->subscribePong([&](Peer& peer, uint64_t nonce) { notifyPong(peer, nonce); });
+    peer->subscribeCFilter([&](Peer& peer, const Coin::CFilterMessage& cfilter) { notifyCFilter(peer, cfilter); });
+    peer->subscribeCFHeaders([&](Peer& peer, const Coin::CFHeadersMessage& cfheaders) { notifyCFHeaders(peer, cfheaders); });
 
     peer->subscribeStart([&](Peer& peer) { notifyStart(peer); });
     peer->subscribeStop([&](Peer& peer) { notifyStop(peer); });
     peer->subscribeOpen([&](Peer& peer) { notifyOpen(peer); });
     peer->subscribeTimeout([&](Peer& peer) { notifyTimeout(peer); deletePeer(peer.name()); });
-    peer->subscribeClose([&](Peer& peer, int code, const std::string& message) { notifyClose(peer, code, message); deletePeer(peer.name()); });
+    peer->subscribeClose([&](Peer& peer) { notifyClose(peer); deletePeer(peer.name()); });
+    peer->subscribeConnectionError([&](Peer& peer, const std::string& error, int code) { notifyConnectionError(peer, error, code); });
 
     {
         boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
-        peermap_[host + ":" + port] = peer; // TODO: Resolve the endpoint before adding to peermap (perhaps on notifyOpen).
+        peermap_[peer->name()] = peer; // TODO: Resolve the endpoint before adding to peermap (perhaps on notifyOpen).
     }
 
     peer->start();
@@ -57,8 +61,21 @@ void PeerManager::createPeer(
 
 bool PeerManager::deletePeer(const std::string& peername)
 {
-    boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
-    return (peermap_.erase(peername) == 1);
+    std::shared_ptr<Peer> peer;
+    {
+        boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
+        peermap_t::iterator it = peermap_.find(peername);
+        if (it == peermap_.end()) return false;
+        peer = it->second;
+        peermap_.erase(it);
+    }
+
+    // Stopping the peer calls the close handler, which comes back here, so it is done without
+    // the lock. The handlers of its aborted operations still run on io_service_, so the peer is
+    // released after them.
+    peer->stop();
+    io_service_.post([peer]() { });
+    return true;
 }
 
 bool PeerManager::hasPeer(const std::string& peername) const
@@ -67,6 +84,26 @@ bool PeerManager::hasPeer(const std::string& peername) const
     return (peermap_.count(peername) != 0);
 }
 
+std::shared_ptr<Peer> PeerManager::getPeer(const std::string& peername) const
+{
+    boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
+    peermap_t::const_iterator it = peermap_.find(peername);
+    return it == peermap_.end() ? nullptr : it->second;
+}
+
+std::vector<std::shared_ptr<Peer>> PeerManager::getPeers() const
+{
+    std::vector<std::shared_ptr<Peer>> peers;
+    boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
+    for (auto& item: peermap_) { peers.push_back(item.second); }
+    return peers;
+}
+
+void PeerManager::send(Coin::CoinNodeStructure& message)
+{
+    for (auto& peer: getPeers()) { peer->send(message); }
+}
+
 size_t PeerManager::peerCount() const
 {
     boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
@@ -98,9 +135,18 @@ void PeerManager::stop()
     io_service_.stop();
     for (auto& thread: threads_) { thread->join(); }
 
-    boost::lock_guard<boost::mutex> threads_lock(threads_mutex_);
-    threads_.clear();
+    {
+        boost::lock_guard<boost::mutex> threads_lock(threads_mutex_);
+        threads_.clear();
+    }
 
-    boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
-    peermap_.clear();
+    // The close handlers delete peers, so they are stopped without the lock.
+    peermap_t peermap;
+    {
+        boost::lock_guard<boost::mutex> peermap_lock(peermap_mutex_);
+        peermap.swap(peermap_);
+    }
+    for (auto& item: peermap) { item.second->stop(); }
+
+    io_service_.reset();
 }
@@ -21,6 +21,7 @@
 #include "CoinQ_peer_io.h"
 
 #include <map>
+#include <vector>
 
 #include <boost/thread/mutex.hpp>
 
@@ -39,12 +40,16 @@ public:
     void subscribeTx(peer_tx_slot_t slot) { notifyTx.connect(slot); }
     void subscribeAddr(peer_addr_slot_t slot) { notifyAddr.connect(slot); }
     void subscribeInv(peer_inv_slot_t slot) { notifyInv.connect(slot); }
+    void subscribePong(peer_pong_slot_t slot) { notifyPong.connect(slot); }
+    void subscribeCFilter(peer_cfilter_slot_t slot) { notifyCFilter.connect(slot); }
+    void subscribeCFHeaders(peer_cfheaders_slot_t slot) { notifyCFHeaders.connect(slot); }
 
     void subscribeStart(peer_slot_t slot) { notifyStart.connect(slot); }
     void subscribeStop(peer_slot_t slot) { notifyStop.connect(slot); }
     void subscribeOpen(peer_slot_t slot) { notifyOpen.connect(slot); }
     void subscribeTimeout(peer_slot_t slot) { notifyTimeout.connect(slot); }
-    void subscribeClose(peer_closed_slot_t slot) { notifyClose.connect(slot); }
+    void subscribeClose(peer_slot_t slot) { notifyClose.connect(slot); }
+    void subscribeConnectionError(peer_error_slot_t slot) { notifyConnectionError.connect(slot); }
 
     void createPeer(
         const std::string& host,
@@ -60,6 +65,13 @@ public:
 
     bool hasPeer(const std::string& peername) const;
 
+    // Null if there is no such peer.
+    std::shared_ptr<Peer> getPeer(const std::string& peername) const;
+    std::vector<std::shared_ptr<Peer>> getPeers() const;
+
+    // Sends the message to every peer with a completed handshake.
+    void send(Coin::CoinNodeStructure& message);
+
     std::size_t peerCount() const;
 
     void start();
@@ -87,12 +99,16 @@ private:
     CoinQSignal<Peer&, const Coin::Transaction&>        notifyTx;
     CoinQSignal<Peer&, const Coin::AddrMessage&>        notifyAddr;
     CoinQSignal<Peer&, const Coin::Inventory&>          notifyInv;
+    CoinQSignal<Peer&, uint64_t>                        notifyPong;
+    CoinQSignal<Peer&, const Coin::CFilterMessage&>     notifyCFilter;
+    CoinQSignal<Peer&, const Coin::CFHeadersMessage&>   notifyCFHeaders;
 
     CoinQSignal<Peer&>                                  notifyStart;
     CoinQSignal<Peer&>                                  notifyStop;
     CoinQSignal<Peer&>                                  notifyOpen;
     CoinQSignal<Peer&>                                  notifyTimeout;
-    CoinQSignal<Peer&, int, const std::string&>         notifyClose;
+    CoinQSignal<Peer&>                                  notifyClose;
+    CoinQSignal<Peer&, const std::string&, int>         notifyConnectionError;
 };
 
 }
@@ -979,6 +979,7 @@ void SignableTxIn::setTxIn(const Coin::Transaction& tx, std::size_t nIn, uint64_
     // Validate signatures.
     unsigned int iSig = 0;
     unsigned int nValidSigs = 0;
+    bytes_t sighash; // same for every pubkey, computed on first use
     for (auto& pubkey: pubkeys_)
     {
         // If we already have enough valid signatures or there are no more signatures or signature is a placeholder
@@ -999,7 +1000,7 @@ void SignableTxIn::setTxIn(const Coin::Transaction& tx, std::size_t nIn, uint64_
             bytes_t signature(sigs[iSig].begin(), sigs[iSig].end() - 1);
 
             // Verify signature.
-            bytes_t sighash = tx.getSigHash(SIGHASH_ALL | SIGHASH_FORKID_BCO, nIn, redeemscript_, outpointamount);
+            if (sighash.empty()) { sighash = tx.getSigHash(SIGHASH_ALL | SIGHASH_FORKID_BCO, nIn, redeemscript_, outpointamount); }
             secp256k1_key key;
             key.setPubKey(pubkey);
             if (secp256k1_verify(key, sighash, signature))
@@ -2,7 +2,9 @@
 #include <CoinQ/CoinQ_blocks.h>
 #include <CoinCore/shabal256.h>
 #include <CoinCore/arith_uint256.h>
+#include <CoinCore/common.h>
 #include <logger/logger.h>
+#include <algorithm>
 #include <iostream>
 using namespace std;
 
@@ -19,7 +21,27 @@ namespace poc {
     /** Burst max target */
     static const uint64_t MAX_BASE_TARGET = 18325193796L;
 
-    uint64_t CalculateBaseTarget(const ChainHeader& prev, const Coin::CoinBlockHeader &block, FGetPrevBlock getPrevBlock)
+    void BaseTargetWindow::push(int height, Coin::bits_t bits, uint32_t timestamp)
+    {
+        if (height != mTipHeight + 1) mCount = 0;
+
+        Entry& entry = mEntries[height % SIZE];
+        entry.bits = bits;
+        entry.timestamp = timestamp;
+        mTipHeight = height;
+        if (mCount < SIZE) mCount++;
+    }
+
+    void BaseTargetWindow::truncate(int height)
+    {
+        if (height >= mTipHeight) return;
+
+        mCount -= mTipHeight - height;
+        if (mCount < 0) mCount = 0;
+        mTipHeight = height;
+    }
+
+    uint64_t CalculateBaseTarget(const ChainHeader& prev, const Coin::CoinBlockHeader &block, FGetPrevBlock getPrevBlock, const BaseTargetWindow* window)
     {
         assert(prev.height + 1 >= BCO_FORK_BLOCK_HEIGHT);
         int nPocGenesisBlockHeight = BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount;
@@ -32,23 +54,41 @@ namespace poc {
             // < 4
             return INITIAL_BASE_TARGET;
         }
-        else if (nHeight < nPocGenesisBlockHeight + 2700) {
-            // < 2700
-            // [N-1,N-2,N-3,N-4]
-            uint64_t avgBaseTarget = prev.bits();
+
+        // Bits of [N-1,N-2,...], newest first, and the timestamp of the oldest of them.
+        int nCount = (nHeight < nPocGenesisBlockHeight + 2700) ? 4 : 25;
+        uint64_t ancestorBits[BaseTargetWindow::SIZE];
+        uint32_t nLastTimestamp;
+        if (window && prev.inBestChain && window->covers(prev.height, nCount)) {
+            for (int i = 0; i < nCount; i++) {
+                ancestorBits[i] = window->bits(prev.height - i);
+            }
+            nLastTimestamp = window->timestamp(prev.height - nCount + 1);
+        }
+        else {
             const ChainHeader *pLastindex = &prev;
-            for (int i = nHeight - 2; i >= nHeight - 4; i--) {
+            ancestorBits[0] = prev.bits();
+            for (int i = 1; i < nCount; i++) {
                 pLastindex = getPrevBlock(pLastindex->prevBlockHash());
                 if (pLastindex == nullptr) {
-                    break;
+                    throw std::runtime_error("Base target ancestor not found.");
                 }
-                avgBaseTarget += pLastindex->bits();
+                ancestorBits[i] = pLastindex->bits();
+            }
+            nLastTimestamp = pLastindex->timestamp();
+        }
+
+        if (nCount == 4) {
+            // < 2700
+            // [N-1,N-2,N-3,N-4]
+            uint64_t avgBaseTarget = 0;
+            for (int i = 0; i < nCount; i++) {
+                avgBaseTarget += ancestorBits[i];
             }
             avgBaseTarget /= 4;
-            assert(pLastindex != nullptr);
 
             uint64_t curBaseTarget = avgBaseTarget;
-            int64_t diffTime = block.timestamp() - pLastindex->timestamp();
+            int64_t diffTime = block.timestamp() - nLastTimestamp;
 
             uint64_t newBaseTarget = (curBaseTarget * diffTime) / (300 * 4); // 5m * 60s * 4blocks
             if (newBaseTarget > MAX_BASE_TARGET) {
@@ -70,18 +110,13 @@ namespace poc {
         }
         else {
             // [N-1,N-2,N-3,...,N-25]
-            uint64_t avgBaseTarget = prev.bits();
-            const ChainHeader *pLastindex = &prev;
-            for (int i = nHeight - 2, blockCounter = 1; i >= nHeight - 25; i--, blockCounter++) {
-                pLastindex = getPrevBlock(pLastindex->prevBlockHash());
-                if (pLastindex == nullptr) {
-                    break;
-                }
-                avgBaseTarget = (avgBaseTarget * blockCounter + pLastindex->bits()) / (blockCounter + 1);
+            // Each step of the average truncates, so it can't be kept as a running sum.
+            uint64_t avgBaseTarget = ancestorBits[0];
+            for (int blockCounter = 1; blockCounter < nCount; blockCounter++) {
+                avgBaseTarget = (avgBaseTarget * blockCounter + ancestorBits[blockCounter]) / (blockCounter + 1);
             }
-            assert(pLastindex != nullptr);
 
-            int64_t diffTime = block.timestamp() - pLastindex->timestamp();
+            int64_t diffTime = block.timestamp() - nLastTimestamp;
             int64_t targetTimespan = 5 * 60 * 24; // 5m * 60s * 24blocks
 
             if (diffTime < targetTimespan / 2) {
@@ -147,80 +182,110 @@ namespace poc {
         return result;
     }
 
-    uint64_t CalculateDeadline(const ChainHeader &prev, const Coin::CoinBlockHeader &block)
+    // Plots of lanes blocks, generated side by side with one block per Shabal256Interleaved() lane.
+    // Word w of block l's plot is at words[w * lanes + l].
+    static void calculateDeadlines(const ChainHeader* const* prevs, const Coin::CoinBlockHeader* const* blocks, uint64_t* deadlines, size_t count, size_t lanes)
     {
-        if (prev.height + 1 <= BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount) {
-            // genesis block & god mode block
-            return 0;
+        static const int PLOT_WORDS = (PLOT_SIZE + 16) / 4;
+        std::vector<uint32_t> gendata((size_t)PLOT_WORDS * lanes);
+
+        // The unused lanes hash zeros.
+        for (size_t lane = 0; lane < count; lane++) {
+            unsigned char seed[16];
+            WriteBE64(seed, blocks[lane]->plotseed());
+            WriteBE64(seed + 8, blocks[lane]->nonce());
+            for (int w = 0; w < 4; w++) {
+                gendata[(PLOT_SIZE / 4 + w) * lanes + lane] = ReadLE32(seed + 4 * w);
+            }
         }
 
-        btc_uint256 genSig = poc::GetBlockGenerationSignature(prev);
-        const uint32_t scopeNum = poc::GetBlockScoopNum(genSig, prev.height + 1);
-        const uint64_t addr = htobe64( block.plotseed());
-        const uint64_t nonce = htobe64(block.nonce());
-        
-//         if (prev.height == 502706) {
-//             LOGGER(trace) << "\n   genSig:" << genSig.GetHex() ;
-//             LOGGER(trace) << "\n   scopeNum:" << scopeNum ;
-//             LOGGER(trace) << "\n   addr:" << addr ;
-//             LOGGER(trace) << "\n   nonce:" << nonce ;
-//         }
-
-        std::unique_ptr<uint8_t> _gendata(new uint8_t[PLOT_SIZE + 16]);
-        uint8_t *const gendata = _gendata.get();
-        memcpy(gendata + PLOT_SIZE, (const unsigned char*)&addr, 8);
-        memcpy(gendata + PLOT_SIZE + 8, (const unsigned char*)&nonce, 8);
         for (int i = PLOT_SIZE; i > 0; i -= HASH_SIZE) {
             int len = PLOT_SIZE + 16 - i;
             if (len > HASH_CAP) {
                 len = HASH_CAP;
             }
+            Shabal256Interleaved(&gendata[(i - HASH_SIZE) / 4 * lanes], &gendata[i / 4 * lanes], len / 4, lanes);
+        }
 
-            btc_uint256 temp;
-            CShabal256()
-                .Write((const unsigned char*)gendata + i, len)
-                .Finalize((unsigned char*)temp.begin());
+        std::vector<uint32_t> base(8 * lanes);
+        Shabal256Interleaved(&base[0], &gendata[0], PLOT_WORDS, lanes);
 
-//             if (prev.height == 502706 && i== PLOT_SIZE) {
-//                 LOGGER(trace) << "\n   for i=" << i << "  temp:" << temp.GetHex() ;
-//             }
+        // Only the scoop that gets hashed needs the plot xor'ed with base.
+        for (size_t lane = 0; lane < count; lane++) {
+            const ChainHeader& prev = *prevs[lane];
+            btc_uint256 genSig = poc::GetBlockGenerationSignature(prev);
+            const uint32_t scoopNum = poc::GetBlockScoopNum(genSig, prev.height + 1);
 
-            memcpy((uint8_t*)gendata + i - HASH_SIZE, (const uint8_t*)temp.begin(), HASH_SIZE);
+            unsigned char scoop[SCOOP_SIZE];
+            for (int w = 0; w < SCOOP_SIZE / 4; w++) {
+                WriteLE32(scoop + 4 * w, gendata[(scoopNum * SCOOP_SIZE / 4 + w) * lanes + lane] ^ base[(w % 8) * lanes + lane]);
+            }
+
+            btc_uint256 result;
+            CShabal256()
+                .Write((const unsigned char*)genSig.begin(), genSig.size())
+                .Write(scoop, SCOOP_SIZE)
+                .Finalize((unsigned char*)result.begin());
+            deadlines[lane] = result.GetUint64(0) / prev.bits();
         }
-        btc_uint256 base;
-        CShabal256()
-            .Write((const unsigned char*)gendata, PLOT_SIZE + 16)
-            .Finalize((unsigned char*)base.begin());
-//         if (prev.height == 502706) {
-//             LOGGER(trace) << "\n   base:" << base.GetHex() ;
-//         }
-
-        uint8_t data[PLOT_SIZE];
-        for (int i = 0; i < PLOT_SIZE; i++) {
-            data[i] = (uint8_t)(gendata[i] ^ (base.begin()[i % HASH_SIZE]));
+    }
+
+    uint64_t CalculateDeadline(const ChainHeader &prev, const Coin::CoinBlockHeader &block)
+    {
+        if (prev.height + 1 <= BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount) {
+            // genesis block & god mode block
+            return 0;
         }
-        _gendata.reset(nullptr);
 
-        CShabal256()
-            .Write((const unsigned char*)genSig.begin(), genSig.size())
-            .Write((const unsigned char*)data + scopeNum * SCOOP_SIZE, SCOOP_SIZE)
-            .Finalize((unsigned char*)base.begin());
+        // A single plot is one chain of hashes, so it can't use more than one lane.
+        const ChainHeader* pPrev = &prev;
+        const Coin::CoinBlockHeader* pBlock = &block;
+        uint64_t deadline;
+        calculateDeadlines(&pPrev, &pBlock, &deadline, 1, 1);
+        return deadline;
+    }
+
+    std::vector<uint64_t> CalculateDeadlines(const std::vector<const ChainHeader*>& prevs, const std::vector<const Coin::CoinBlockHeader*>& blocks)
+    {
+        assert(prevs.size() == blocks.size());
+        std::vector<uint64_t> deadlines(blocks.size(), 0);
 
-//         if (prev.height == 502706) {
-//             LOGGER(trace) << "\n   base:" << base.GetHex() << ", prev bits:" << prev.bits() ;
-//             LOGGER(trace) << "\n   result:" << base.GetUint64(0) / prev.bits();
-//         }
+        std::vector<size_t> plots;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (prevs[i]->height + 1 > BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount) {
+                plots.push_back(i);
+            }
+        }
 
-        return base.GetUint64(0) / prev.bits();
+        size_t maxLanes = Shabal256Lanes();
+        for (size_t begin = 0; begin < plots.size(); begin += maxLanes) {
+            size_t count = std::min(maxLanes, plots.size() - begin);
+
+            // The narrowest kernel that still fits what is left.
+            size_t lanes = count == 1 ? 1 : count <= 4 ? 4 : count <= 8 ? 8 : 16;
+            const ChainHeader* groupPrevs[16];
+            const Coin::CoinBlockHeader* groupBlocks[16];
+            uint64_t groupDeadlines[16];
+            for (size_t lane = 0; lane < count; lane++) {
+                groupPrevs[lane] = prevs[plots[begin + lane]];
+                groupBlocks[lane] = blocks[plots[begin + lane]];
+            }
+            calculateDeadlines(groupPrevs, groupBlocks, groupDeadlines, count, lanes);
+            for (size_t lane = 0; lane < count; lane++) {
+                deadlines[plots[begin + lane]] = groupDeadlines[lane];
+            }
+        }
+        return deadlines;
     }
 
-    bool VerifyGenerationSignature(const ChainHeader& prev, const Coin::CoinBlockHeader& block, FGetPrevBlock getPrevBlock)
+    bool VerifyBaseTarget(const ChainHeader& prev, const Coin::CoinBlockHeader& block, FGetPrevBlock getPrevBlock, const BaseTargetWindow* window)
     {
-        if (block.timestamp() < BCO_BLOCK_UNIXTIME_MIN ||
-            block.bits() != CalculateBaseTarget(prev, block, getPrevBlock)) {
-            return false;
-        }
+        return block.timestamp() >= BCO_BLOCK_UNIXTIME_MIN &&
+            block.bits() == CalculateBaseTarget(prev, block, getPrevBlock, window);
+    }
 
+    bool VerifyDeadline(const ChainHeader& prev, const Coin::CoinBlockHeader& block)
+    {
         if (prev.height + 1 < BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount) {
             // God Mode
             return true;
@@ -230,4 +295,21 @@ namespace poc {
         return block.timestamp() > prev.timestamp() + deadline;
     }
 
+    std::vector<bool> VerifyDeadlines(const std::vector<const ChainHeader*>& prevs, const std::vector<const Coin::CoinBlockHeader*>& blocks)
+    {
+        std::vector<uint64_t> deadlines = CalculateDeadlines(prevs, blocks);
+        std::vector<bool> valid(blocks.size());
+        for (size_t i = 0; i < blocks.size(); i++) {
+            // God Mode blocks pass whatever their deadline.
+            valid[i] = prevs[i]->height + 1 < BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount ||
+                blocks[i]->timestamp() > prevs[i]->timestamp() + deadlines[i];
+        }
+        return valid;
+    }
+
+    bool VerifyGenerationSignature(const ChainHeader& prev, const Coin::CoinBlockHeader& block, FGetPrevBlock getPrevBlock, const BaseTargetWindow* window)
+    {
+        return VerifyBaseTarget(prev, block, getPrevBlock, window) && VerifyDeadline(prev, block);
+    }
+
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <functional>
+#include <vector>
 #include <CoinCore/CoinNodeData.h>
 #include <CoinCore/btc_uint256.h>
 
@@ -11,6 +12,42 @@ namespace poc {
 
     typedef std::function<const ChainHeader*(const uchar_vector&)>  FGetPrevBlock;
 
+    // Bits and timestamps of the last SIZE headers of a block tree's best chain, which the tree
+    // updates as its tip moves. CalculateBaseTarget() reads a best chain parent's ancestors from
+    // here instead of looking each one up by hash.
+    class BaseTargetWindow
+    {
+    public:
+        enum { SIZE = 25 };
+
+        BaseTargetWindow() : mTipHeight(-1), mCount(0) { }
+
+        // height should be one above the tip. Anything else starts the window over.
+        void push(int height, Coin::bits_t bits, uint32_t timestamp);
+
+        // Drops the headers above height.
+        void truncate(int height);
+
+        void clear() { mTipHeight = -1; mCount = 0; }
+
+        // True if the window holds height and the count - 1 headers below it.
+        bool covers(int height, int count) const { return height <= mTipHeight && height - count + 1 > mTipHeight - mCount; }
+
+        Coin::bits_t bits(int height) const { return mEntries[height % SIZE].bits; }
+        uint32_t timestamp(int height) const { return mEntries[height % SIZE].timestamp; }
+
+    private:
+        struct Entry
+        {
+            Coin::bits_t bits;
+            uint32_t timestamp;
+        };
+
+        Entry mEntries[SIZE];
+        int mTipHeight;
+        int mCount;
+    };
+
     uint64_t getCurDeadline();
 
     uint32_t GetBlockScoopNum(const btc_uint256 &genSig, int nHeight);
@@ -19,7 +56,27 @@ namespace poc {
 
     btc_uint256 GetBlockGenerationSignature(const Coin::CoinBlockHeader &prevBlock);
 
-    uint64_t CalculateBaseTarget(const ChainHeader& prev, const Coin::CoinBlockHeader &block, FGetPrevBlock getPrevBlock);
-
-    bool VerifyGenerationSignature(const ChainHeader& prev, const Coin::CoinBlockHeader& block, FGetPrevBlock getPrev);
+    // window, if given, is used when prev is in the best chain it follows. Otherwise the
+    // ancestors come from getPrevBlock.
+    uint64_t CalculateBaseTarget(const ChainHeader& prev, const Coin::CoinBlockHeader &block, FGetPrevBlock getPrevBlock, const BaseTargetWindow* window = nullptr);
+
+    // Timestamp and base target. The base target averages the blocks before prev, so this part
+    // has to run in chain order.
+    bool VerifyBaseTarget(const ChainHeader& prev, const Coin::CoinBlockHeader& block, FGetPrevBlock getPrev, const BaseTargetWindow* window = nullptr);
+
+    // Deadline of block's plot. Generating the plot takes thousands of chained Shabal-256 hashes.
+    uint64_t CalculateDeadline(const ChainHeader& prev, const Coin::CoinBlockHeader& block);
+
+    // CalculateDeadline() for each blocks[i] with parent prevs[i]. A single plot can't be
+    // spread over SIMD lanes, so the plots of up to Shabal256Lanes() blocks are generated
+    // together instead.
+    std::vector<uint64_t> CalculateDeadlines(const std::vector<const ChainHeader*>& prevs, const std::vector<const Coin::CoinBlockHeader*>& blocks);
+
+    // Deadline of the plot. Only needs prev, so it can be checked for many blocks in parallel.
+    bool VerifyDeadline(const ChainHeader& prev, const Coin::CoinBlockHeader& block);
+
+    // VerifyDeadline() for each blocks[i] with parent prevs[i], using CalculateDeadlines().
+    std::vector<bool> VerifyDeadlines(const std::vector<const ChainHeader*>& prevs, const std::vector<const Coin::CoinBlockHeader*>& blocks);
+
+    bool VerifyGenerationSignature(const ChainHeader& prev, const Coin::CoinBlockHeader& block, FGetPrevBlock getPrev, const BaseTargetWindow* window = nullptr);
 }
\ No newline at end of file
@@ -0,0 +1,442 @@
+#include <CoinQ_addrman.h>
+#include <CoinQ_peer_io.h>
+
+#include <CoinCore/CoinNodeData.h>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace CoinQ;
+using namespace std;
+
+// Checks that AddressManager keeps what it learned across a save and load, scores and orders
+// addresses by ping and download rate, never evicts the address it just added, and names IPv6
+// hosts in brackets. Then connects Peers to two stand-in nodes on localhost, one slow and one
+// fast, feeds what the Peers measured into the scores the way NetworkSync does, and checks which
+// one gets picked and which one gets rotated out.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+static const uint32_t MAGIC = 0xd9b4bef9;
+static const uint32_t PROTOCOL_VERSION = 70015;
+
+static const unsigned char LOCALHOST[] = {0,0,0,0,0,0,0,0,0,0,255,255,127,0,0,1};
+
+static string tempFilename()
+{
+    return (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("addrmantest-%%%%-%%%%.txt")).string();
+}
+
+static void testNames()
+{
+    check(getPeerName("127.0.0.1", "8333") == "127.0.0.1:8333", "IPv4 name");
+    check(getPeerName("seed.example.org", "8333") == "seed.example.org:8333", "host name");
+    check(getPeerName("2001:db8::1", "8333") == "[2001:db8::1]:8333", "IPv6 name in brackets");
+    check(getPeerName("[2001:db8::1]", "8333") == "[2001:db8::1]:8333", "IPv6 already in brackets");
+
+    AddressManager addrman;
+    addrman.add("2001:db8::1", "8333");
+    AddressManager::Entry entry;
+    check(addrman.getEntry("[2001:db8::1]:8333", entry), "IPv6 entry found by its bracketed name");
+    check(entry.host == "2001:db8::1" && entry.port == "8333", "IPv6 entry keeps the bare host");
+    check(entry.name() == "[2001:db8::1]:8333", "IPv6 entry name");
+}
+
+static void testPersistence()
+{
+    string filename = tempFilename();
+    {
+        AddressManager addrman;
+        addrman.load(filename);
+        check(addrman.size() == 0, "load of a missing file is empty");
+
+        addrman.add("10.0.0.1", "8333", 1, 1000);
+        addrman.add("2001:db8::2", "18333", 9, 2000);
+        addrman.markAttempt("10.0.0.1:8333");
+        addrman.markConnected("10.0.0.1:8333");
+        addrman.updatePing("10.0.0.1:8333", 40000);
+        addrman.updateThroughput("10.0.0.1:8333", 4 * 1024 * 1024, 2.0);
+        addrman.markAttempt("[2001:db8::2]:18333");
+        addrman.markFailed("[2001:db8::2]:18333");
+        addrman.markFailed("[2001:db8::2]:18333");
+        addrman.save();
+    }
+
+    AddressManager addrman;
+    addrman.load(filename);
+    check(addrman.size() == 2, "both addresses reloaded");
+
+    AddressManager::Entry entry;
+    check(addrman.getEntry("10.0.0.1:8333", entry), "IPv4 entry reloaded");
+    check(entry.services == 1 && entry.lastSuccess != 0 && entry.failures == 0, "IPv4 entry state reloaded");
+    check(entry.pingMicroseconds == 40000 && entry.bytesPerSecond == 2 * 1024 * 1024, "IPv4 entry measurements reloaded");
+
+    check(addrman.getEntry("[2001:db8::2]:18333", entry), "IPv6 entry reloaded");
+    check(entry.host == "2001:db8::2" && entry.services == 9 && entry.lastSeen == 2000, "IPv6 entry state reloaded");
+    check(entry.failures == 2 && entry.lastTry != 0 && entry.lastSuccess == 0, "IPv6 entry failures reloaded");
+    check(!entry.isMeasured(), "IPv6 entry still unmeasured");
+
+    boost::filesystem::remove(filename);
+}
+
+static void testEviction()
+{
+    AddressManager addrman;
+    for (int i = 0; i < AddressManager::MAX_ADDRESSES; i++)
+    {
+        addrman.add("10.1." + to_string(i / 256) + "." + to_string(i % 256), "8333", 0, 100000 + i);
+    }
+    check(addrman.size() == AddressManager::MAX_ADDRESSES, "filled up");
+
+    // Heard of longer ago than everything else, so it would be the first to go.
+    addrman.add("10.2.0.1", "8333", 0, 1);
+    AddressManager::Entry entry;
+    check(addrman.size() == AddressManager::MAX_ADDRESSES, "still full after adding one more");
+    check(addrman.getEntry("10.2.0.1:8333", entry), "the address just added is kept");
+    check(!addrman.getEntry("10.1.0.0:8333", entry), "the oldest address before it is evicted");
+}
+
+static void testScoring()
+{
+    AddressManager addrman;
+    addrman.add("10.0.0.1", "8333", 0, 1000);  // close but slow
+    addrman.add("10.0.0.2", "8333", 0, 1000);  // far but fast
+    addrman.add("10.0.0.3", "8333", 0, 1000);  // fast both ways
+    addrman.add("10.0.0.4", "8333", 0, 2000);  // not measured yet
+
+    addrman.updatePing("10.0.0.1:8333", 10000);
+    addrman.updateThroughput("10.0.0.1:8333", 100 * 1024, 1.0);
+    addrman.updatePing("10.0.0.2:8333", 300000);
+    addrman.updateThroughput("10.0.0.2:8333", 8 * 1024 * 1024, 1.0);
+    addrman.updatePing("10.0.0.3:8333", 20000);
+    addrman.updateThroughput("10.0.0.3:8333", 4 * 1024 * 1024, 1.0);
+
+    AddressManager::Entry slow, far, fast, unknown;
+    addrman.getEntry("10.0.0.1:8333", slow);
+    addrman.getEntry("10.0.0.2:8333", far);
+    addrman.getEntry("10.0.0.3:8333", fast);
+    addrman.getEntry("10.0.0.4:8333", unknown);
+    check(fast.cost() < far.cost() && far.cost() < slow.cost(), "download rate outweighs ping for a megabyte");
+    check(unknown.cost() > fast.cost() && unknown.cost() < slow.cost(), "unmeasured address taken to be middling");
+
+    // A quarter of each new sample goes in.
+    addrman.updatePing("10.0.0.3:8333", 60000);
+    addrman.getEntry("10.0.0.3:8333", fast);
+    check(fast.pingMicroseconds == 30000, "ping smoothed");
+
+    vector<AddressManager::Entry> selected = addrman.select(1);
+    check(selected.size() == 1 && selected[0].name() == "10.0.0.3:8333", "cheapest selected alone");
+
+    selected = addrman.select(3);
+    check(selected.size() == 3, "three selected");
+    if (selected.size() == 3)
+    {
+        check(selected[0].name() == "10.0.0.3:8333" && selected[1].name() == "10.0.0.2:8333", "measured ones cheapest first");
+        check(selected[2].name() == "10.0.0.4:8333", "last slot explores an unmeasured address");
+    }
+
+    set<string> exclude;
+    exclude.insert("10.0.0.3:8333");
+    selected = addrman.select(1, exclude);
+    check(selected.size() == 1 && selected[0].name() == "10.0.0.2:8333", "excluded address skipped");
+
+    addrman.markAttempt("10.0.0.2:8333");
+    addrman.markFailed("10.0.0.2:8333");
+    selected = addrman.select(1, exclude);
+    check(selected.size() == 1 && selected[0].name() == "10.0.0.1:8333", "failed address backed off");
+
+    addrman.markConnected("10.0.0.2:8333");
+    selected = addrman.select(1, exclude);
+    check(selected.size() == 1 && selected[0].name() == "10.0.0.2:8333", "address back once it connects");
+
+    // The slow one makes way for one at least twice as fast, but not the other way around.
+    AddressManager::Entry slowest, replacement;
+    vector<string> picked;
+    picked.push_back("10.0.0.1:8333");
+    exclude.clear();
+    exclude.insert("10.0.0.1:8333");
+    check(addrman.selectReplacement(picked, exclude, slowest, replacement), "slow address replaced");
+    check(slowest.name() == "10.0.0.1:8333" && replacement.name() == "10.0.0.3:8333", "replaced by the cheapest");
+
+    picked[0] = "10.0.0.3:8333";
+    exclude.clear();
+    exclude.insert("10.0.0.3:8333");
+    check(!addrman.selectReplacement(picked, exclude, slowest, replacement), "fast address kept");
+
+    picked[0] = "10.0.0.4:8333";
+    check(!addrman.selectReplacement(picked, exclude, slowest, replacement), "unmeasured address kept");
+}
+
+// Enough of a node to get through the handshake, answer pings after a delay, and answer getaddr
+// with addresses written a piece at a time.
+class StandInNode
+{
+public:
+    StandInNode(int pingDelayMilliseconds, int writeDelayMilliseconds, const vector<Coin::NetworkAddress>& addrs) :
+        m_acceptor(m_io_service, tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 0)),
+        m_socket(m_io_service),
+        m_pingDelay(pingDelayMilliseconds),
+        m_writeDelay(writeDelayMilliseconds),
+        m_addrs(addrs)
+    {
+        m_thread = thread([this]() { run(); });
+    }
+
+    ~StandInNode() { m_thread.join(); }
+
+    string port() const { return to_string(m_acceptor.local_endpoint().port()); }
+
+private:
+    boost::asio::io_service m_io_service;
+    tcp::acceptor m_acceptor;
+    tcp::socket m_socket;
+    int m_pingDelay;
+    int m_writeDelay;
+    vector<Coin::NetworkAddress> m_addrs;
+    thread m_thread;
+
+    void write(Coin::CoinNodeStructure& payload, size_t pieces = 1)
+    {
+        uchar_vector bytes = Coin::CoinNodeMessage(MAGIC, &payload).getSerialized();
+        size_t pieceSize = (bytes.size() + pieces - 1) / pieces;
+        for (size_t i = 0; i < bytes.size(); i += pieceSize)
+        {
+            if (i > 0) { this_thread::sleep_for(chrono::milliseconds(m_writeDelay)); }
+            boost::asio::write(m_socket, boost::asio::buffer(&bytes[i], min(pieceSize, bytes.size() - i)));
+        }
+    }
+
+    // Runs until the Peer hangs up.
+    void run()
+    {
+        try
+        {
+            m_acceptor.accept(m_socket);
+            while (true)
+            {
+                uchar_vector message(MIN_MESSAGE_HEADER_SIZE);
+                boost::asio::read(m_socket, boost::asio::buffer(&message[0], message.size()));
+                uint32_t size = message[16] | (message[17] << 8) | (message[18] << 16) | ((uint32_t)message[19] << 24);
+                message.resize(message.size() + size);
+                if (size > 0) { boost::asio::read(m_socket, boost::asio::buffer(&message[MIN_MESSAGE_HEADER_SIZE], size)); }
+
+                Coin::CoinNodeMessage request(message);
+                string command = request.getCommand();
+                if (command == "version")
+                {
+                    Coin::NetworkAddress address(NODE_NETWORK, LOCALHOST, 0);
+                    Coin::VersionMessage version(PROTOCOL_VERSION, NODE_NETWORK, time(NULL), address, address, 1, "/standin/", 0, false);
+                    write(version);
+                    Coin::VerackMessage verack;
+                    write(verack);
+                }
+                else if (command == "ping")
+                {
+                    this_thread::sleep_for(chrono::milliseconds(m_pingDelay));
+                    Coin::PongMessage pong(static_cast<Coin::PingMessage*>(request.getPayload())->nonce);
+                    write(pong);
+                }
+                else if (command == "getaddr")
+                {
+                    Coin::AddrMessage addr(m_addrs);
+                    write(addr, 8);
+                }
+            }
+        }
+        catch (const exception&)
+        {
+        }
+    }
+};
+
+// A Peer connected to a stand-in node, with what it got back.
+class TestPeer
+{
+public:
+    TestPeer(io_service_t& io_service, const string& port, AddressManager& addrman) :
+        m_peer(io_service, "127.0.0.1", port, MAGIC, PROTOCOL_VERSION, "addrmantest", 0, false),
+        m_bOpen(false),
+        m_bAddr(false),
+        m_pongs(0)
+    {
+        m_peer.subscribeOpen([&](Peer& peer) {
+            lock_guard<mutex> lock(m_mutex);
+            m_bOpen = true;
+            m_cond.notify_all();
+        });
+        m_peer.subscribeAddr([&](Peer& peer, const Coin::AddrMessage& addr) {
+            addrman.add(addr);
+            lock_guard<mutex> lock(m_mutex);
+            m_bAddr = true;
+            m_cond.notify_all();
+        });
+        m_peer.subscribePong([&](Peer& peer, uint64_t nonce) {
+            lock_guard<mutex> lock(m_mutex);
+            m_pongs++;
+            m_cond.notify_all();
+        });
+    }
+
+    Peer& peer() { return m_peer; }
+
+    bool waitOpen() { return wait([this]() { return m_bOpen; }); }
+    bool waitAddr() { return wait([this]() { return m_bAddr; }); }
+    bool waitPongs(int pongs) { return wait([&]() { return m_pongs >= pongs; }); }
+
+private:
+    Peer m_peer;
+    mutex m_mutex;
+    condition_variable m_cond;
+    bool m_bOpen;
+    bool m_bAddr;
+    int m_pongs;
+
+    template<typename Predicate>
+    bool wait(Predicate predicate)
+    {
+        unique_lock<mutex> lock(m_mutex);
+        return m_cond.wait_for(lock, chrono::seconds(10), predicate);
+    }
+};
+
+static void testLocalPeers()
+{
+    // The nodes pass on a few addresses, one of them IPv6.
+    vector<Coin::NetworkAddress> addrs;
+    for (int i = 1; i <= 200; i++)
+    {
+        unsigned char ip[] = {0,0,0,0,0,0,0,0,0,0,255,255,10,3,(unsigned char)(i / 256),(unsigned char)(i % 256)};
+        addrs.push_back(Coin::NetworkAddress((uint32_t)time(NULL), NODE_NETWORK, ip, 8333));
+    }
+    unsigned char ipv6[] = {0x20,0x01,0x0d,0xb8,0,0,0,0,0,0,0,0,0,0,0,0x07};
+    addrs.push_back(Coin::NetworkAddress((uint32_t)time(NULL), NODE_NETWORK, ipv6, 8333));
+
+    AddressManager addrman;
+    StandInNode slowNode(200, 50, addrs);
+    StandInNode fastNode(0, 0, addrs);
+    addrman.add("127.0.0.1", slowNode.port());
+    addrman.add("127.0.0.1", fastNode.port());
+
+    io_service_t io_service;
+    io_service_t::work work(io_service);
+    thread ioThread([&]() { io_service.run(); });
+
+    {
+        TestPeer slow(io_service, slowNode.port(), addrman);
+        TestPeer fast(io_service, fastNode.port(), addrman);
+        string slowName = slow.peer().name();
+        string fastName = fast.peer().name();
+
+        // Picked the way NetworkSync picks: two unmeasured addresses, the one heard of first
+        // going first.
+        vector<AddressManager::Entry> selected = addrman.select(2);
+        check(selected.size() == 2, "both nodes selected before they are measured");
+
+        slow.peer().start();
+        fast.peer().start();
+        check(slow.waitOpen() && fast.waitOpen(), "handshake with both nodes");
+        addrman.markConnected(slowName);
+        addrman.markConnected(fastName);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        slow.peer().getAddr();
+        fast.peer().getAddr();
+        bool bFastAddr = fast.waitAddr();
+        double fastSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool bSlowAddr = slow.waitAddr();
+        double slowSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        check(bSlowAddr && bFastAddr, "addresses from both nodes");
+
+        for (int i = 1; i <= 3; i++)
+        {
+            slow.peer().ping(i);
+            fast.peer().ping(i);
+        }
+        check(slow.waitPongs(3) && fast.waitPongs(3), "pongs from both nodes");
+
+        Peer::ReadStats slowStats = slow.peer().getReadStats();
+        Peer::ReadStats fastStats = fast.peer().getReadStats();
+        check(slowStats.minPingMicroseconds >= 200000, "slow node ping measured");
+        check(fastStats.minPingMicroseconds > 0 && fastStats.minPingMicroseconds < slowStats.minPingMicroseconds, "fast node ping measured");
+
+        addrman.updatePing(slowName, slowStats.minPingMicroseconds);
+        addrman.updatePing(fastName, fastStats.minPingMicroseconds);
+        addrman.updateThroughput(slowName, slowStats.bytesRead, slowSeconds);
+        addrman.updateThroughput(fastName, fastStats.bytesRead, fastSeconds);
+
+        AddressManager::Entry entry;
+        check(addrman.size() == 2 + addrs.size(), "addresses from the nodes added once each");
+        check(addrman.getEntry("[2001:0db8:0000:0000:0000:0000:0000:0007]:8333", entry), "IPv6 address from the nodes added in brackets");
+
+        selected = addrman.select(2);
+        check(selected.size() == 2, "two selected after measuring");
+        if (selected.size() == 2)
+        {
+            check(selected[0].name() == fastName, "fast node picked first");
+            check(selected[1].name() != slowName, "slow node loses the last slot to an unmeasured address");
+        }
+
+        // With both picked and connected, an address we know nothing about is still taken to be
+        // faster than the slow node.
+        vector<string> picked;
+        picked.push_back(slowName);
+        picked.push_back(fastName);
+        set<string> exclude(picked.begin(), picked.end());
+        AddressManager::Entry slowest, replacement;
+        check(addrman.selectReplacement(picked, exclude, slowest, replacement), "slow node rotated out");
+        check(slowest.name() == slowName && !replacement.isMeasured(), "unmeasured address rotated in");
+
+        // Once the fast node is free, it is the one that takes the slow node's place.
+        picked.pop_back();
+        exclude.erase(fastName);
+        check(addrman.selectReplacement(picked, exclude, slowest, replacement), "slow node rotated out for the fast one");
+        check(slowest.name() == slowName && replacement.name() == fastName, "fast node rotated in");
+
+        picked[0] = fastName;
+        exclude.clear();
+        exclude.insert(fastName);
+        check(!addrman.selectReplacement(picked, exclude, slowest, replacement), "fast node kept");
+
+        // The handlers of the aborted reads still run on io_service, so it is stopped before
+        // the peers go away.
+        slow.peer().stop();
+        fast.peer().stop();
+        io_service.stop();
+        ioThread.join();
+    }
+}
+
+int main()
+{
+    try
+    {
+        testNames();
+        testPersistence();
+        testEviction();
+        testScoring();
+        testLocalPeers();
+    }
+    catch (const exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        ok = false;
+    }
+
+    cout << (ok ? "All tests passed." : "Some tests failed.") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,390 @@
+#include <CoinQ_blockscheduler.h>
+
+#include <CoinCore/MerkleTree.h>
+
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace CoinQ::Network;
+using namespace Coin;
+using namespace std;
+
+// Drives MerkleBlockScheduler through fake request and delivery slots, with no peers or sockets:
+// the window is refilled as blocks come in, blocks from several peers come out in height order,
+// a stalled peer's blocks go to the others, and a pong closes a block whose transactions the
+// peer has finished sending. Then times downloads over a simulated slow link with windows of
+// several sizes.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+// A block with its transactions, some of them matching the filter.
+struct TestBlock
+{
+    MerkleBlock merkleBlock;
+    CoinBlock block;
+    vector<Transaction> matched;
+};
+
+static TestBlock makeBlock(int height, int txCount, const set<int>& matches)
+{
+    static uint32_t lockTime = 0;
+
+    TestBlock testBlock;
+    vector<MerkleLeaf> leaves;
+    for (int i = 0; i < txCount; i++)
+    {
+        Transaction tx;
+        tx.lockTime = ++lockTime;
+        testBlock.block.txs.push_back(tx);
+        if (matches.count(i)) { testBlock.matched.push_back(tx); }
+        leaves.push_back(MerkleLeaf(uchar_vector(tx.hash()).getReverse(), matches.count(i) != 0));
+    }
+
+    PartialMerkleTree merkleTree(leaves);
+    testBlock.merkleBlock = MerkleBlock(merkleTree, 1, g_zero32bytes, 1300000000 + height, 0x1d00ffff, height, 0);
+    testBlock.block.blockHeader = testBlock.merkleBlock.blockHeader;
+    return testBlock;
+}
+
+// What the scheduler asked for and handed back.
+struct Harness
+{
+    struct Request
+    {
+        string peer;
+        vector<uchar_vector> hashes;
+        uint64_t nonce;
+    };
+
+    vector<Request> requests;
+    vector<pair<string, uchar_vector>> blockRequests;
+    vector<int> delivered;
+    map<int, size_t> deliveredTxs;
+    set<Coin::hash256_t> mempool;
+    MerkleBlockScheduler scheduler;
+
+    Harness() : scheduler(
+        [this](const string& peer, const vector<uchar_vector>& hashes, uint64_t nonce) { requests.push_back(Request{peer, hashes, nonce}); },
+        [this](const string& peer, const uchar_vector& hash) { blockRequests.push_back(make_pair(peer, hash)); },
+        [this](int height, const MerkleBlock& /*merkleBlock*/, const vector<Coin::hash256_t>& /*txHashes*/, const unordered_map<Coin::hash256_t, Transaction>& txs) {
+            delivered.push_back(height);
+            deliveredTxs[height] = txs.size();
+        },
+        [this](const Coin::hash256_t& txHash) { return mempool.count(txHash) != 0; })
+    { }
+
+    // Blocks from height 0 with no matching transactions.
+    vector<TestBlock> addBlocks(int count)
+    {
+        vector<TestBlock> blocks;
+        for (int height = 0; height < count; height++)
+        {
+            blocks.push_back(makeBlock(height, 3, set<int>()));
+            scheduler.addBlock(height, blocks.back().merkleBlock.hash());
+        }
+        return blocks;
+    }
+
+    // Hashes asked for from peer since request first.
+    size_t requestedFrom(const string& peer, size_t first = 0) const
+    {
+        size_t count = 0;
+        for (size_t i = first; i < requests.size(); i++)
+        {
+            if (requests[i].peer == peer) { count += requests[i].hashes.size(); }
+        }
+        return count;
+    }
+};
+
+static bool isIncreasing(const vector<int>& heights)
+{
+    for (size_t i = 0; i < heights.size(); i++)
+    {
+        if (heights[i] != (int)i) return false;
+    }
+    return true;
+}
+
+static void testWindow()
+{
+    Harness h;
+    h.scheduler.setBlocksPerPeer(4);
+    h.scheduler.addPeer("a");
+    vector<TestBlock> blocks = h.addBlocks(10);
+
+    h.scheduler.requestBlocks();
+    check(h.requests.size() == 1 && h.requests[0].hashes.size() == 4, "window of 4 requested at once");
+    if (h.requests.empty()) return;
+    check(h.requests[0].hashes[0] == blocks[0].merkleBlock.hash() && h.requests[0].hashes[3] == blocks[3].merkleBlock.hash(), "lowest heights requested first");
+
+    h.scheduler.requestBlocks();
+    check(h.requests.size() == 1, "nothing more while the window is full");
+
+    // Each block that comes in makes room for one more.
+    for (int height = 0; height < 10; height++)
+    {
+        size_t before = h.requests.size();
+        check(h.scheduler.onMerkleBlock("a", blocks[height].merkleBlock), "merkle block taken");
+        size_t requested = h.requestedFrom("a", before);
+        check(requested == (height + 4 < 10 ? 1u : 0u), "window refilled by one");
+    }
+
+    check(h.delivered.size() == 10 && isIncreasing(h.delivered), "all blocks delivered in order");
+    check(h.scheduler.isIdle(), "idle once everything is delivered");
+
+    // A merkle block nobody asked for is not the scheduler's.
+    check(!h.scheduler.onMerkleBlock("a", blocks[0].merkleBlock), "unrequested merkle block ignored");
+    check(!h.scheduler.onMerkleBlock("b", blocks[0].merkleBlock), "merkle block from unknown peer ignored");
+}
+
+static void testHeightOrder()
+{
+    Harness h;
+    h.scheduler.setBlocksPerPeer(2);
+    h.scheduler.addPeer("a");
+    h.scheduler.addPeer("b");
+    vector<TestBlock> blocks = h.addBlocks(4);
+
+    // The lowest heights go out one per peer in turn.
+    h.scheduler.requestBlocks();
+    check(h.requests.size() == 2, "one request per peer");
+    check(h.requestedFrom("a") == 2 && h.requestedFrom("b") == 2, "blocks shared out");
+    for (auto& request: h.requests)
+    {
+        bool bFirst = request.hashes.front() == blocks[request.peer == "a" ? 0 : 1].merkleBlock.hash();
+        check(bFirst, "peer " + request.peer + " starts at its turn");
+    }
+
+    // b is faster, but its blocks wait for the one before them.
+    h.scheduler.onMerkleBlock("b", blocks[1].merkleBlock);
+    h.scheduler.onMerkleBlock("b", blocks[3].merkleBlock);
+    check(h.delivered.empty(), "nothing delivered ahead of height 0");
+
+    h.scheduler.onMerkleBlock("a", blocks[0].merkleBlock);
+    check(h.delivered.size() == 2 && isIncreasing(h.delivered), "heights 0 and 1 delivered once 0 is in");
+
+    h.scheduler.onMerkleBlock("a", blocks[2].merkleBlock);
+    check(h.delivered.size() == 4 && isIncreasing(h.delivered), "all heights delivered in order");
+}
+
+static void testStalledPeer()
+{
+    // A peer that answers a pong without sending the block is dropped straight away.
+    {
+        Harness h;
+        h.scheduler.setBlocksPerPeer(2);
+        h.scheduler.addPeer("a");
+        h.scheduler.addPeer("b");
+        vector<TestBlock> blocks = h.addBlocks(4);
+        h.scheduler.requestBlocks();
+
+        uint64_t nonceA = 0;
+        for (auto& request: h.requests)
+        {
+            if (request.peer == "a") { nonceA = request.nonce; }
+        }
+
+        h.scheduler.onMerkleBlock("a", blocks[0].merkleBlock);
+        h.scheduler.onPong("a", nonceA);
+        check(h.delivered.size() == 1, "block a sent is delivered");
+
+        size_t before = h.requests.size();
+        vector<string> stalled = h.scheduler.removeStalledPeers(chrono::hours(1));
+        check(stalled.size() == 1 && stalled[0] == "a", "peer that skipped a block dropped");
+        check(!h.scheduler.hasPeer("a") && h.scheduler.hasPeer("b"), "only that peer dropped");
+        check(h.requestedFrom("b", before) == 0, "b's window is still full");
+
+        h.scheduler.onMerkleBlock("b", blocks[1].merkleBlock);
+        check(h.requestedFrom("b", before) == 1 && h.requests.back().hashes[0] == blocks[2].merkleBlock.hash(), "skipped block asked of b");
+        h.scheduler.onMerkleBlock("b", blocks[3].merkleBlock);
+        h.scheduler.onMerkleBlock("b", blocks[2].merkleBlock);
+        check(h.delivered.size() == 4 && isIncreasing(h.delivered), "all heights delivered after reassignment");
+    }
+
+    // A peer that goes quiet is dropped after the timeout. One that has nothing to do is not.
+    {
+        Harness h;
+        h.scheduler.setBlocksPerPeer(2);
+        h.scheduler.addPeer("a");
+        h.scheduler.addPeer("b");
+        vector<TestBlock> blocks = h.addBlocks(4);
+        h.scheduler.requestBlocks();
+        h.scheduler.addPeer("c");
+
+        uint64_t nonceB = 0;
+        for (auto& request: h.requests)
+        {
+            if (request.peer == "b") { nonceB = request.nonce; }
+        }
+        h.scheduler.onMerkleBlock("b", blocks[1].merkleBlock);
+        h.scheduler.onMerkleBlock("b", blocks[3].merkleBlock);
+        h.scheduler.onPong("b", nonceB);
+
+        this_thread::sleep_for(chrono::milliseconds(20));
+        check(h.scheduler.removeStalledPeers(chrono::seconds(10)).empty(), "nobody dropped before the timeout");
+
+        size_t before = h.requests.size();
+        vector<string> stalled = h.scheduler.removeStalledPeers(chrono::milliseconds(10));
+        check(stalled.size() == 1 && stalled[0] == "a", "quiet peer dropped after the timeout, idle ones kept");
+        check(h.requestedFrom("b", before) == 1 && h.requestedFrom("c", before) == 1, "its blocks shared out among the others");
+
+        for (size_t i = before; i < h.requests.size(); i++)
+        {
+            for (auto& hash: h.requests[i].hashes)
+            {
+                int height = hash == blocks[0].merkleBlock.hash() ? 0 : 2;
+                h.scheduler.onMerkleBlock(h.requests[i].peer, blocks[height].merkleBlock);
+            }
+        }
+        check(h.delivered.size() == 4 && isIncreasing(h.delivered), "all heights delivered after the timeout");
+    }
+}
+
+static void testPongClosing()
+{
+    Harness h;
+    h.scheduler.setBlocksPerPeer(4);
+    h.scheduler.addPeer("a");
+
+    // Heights 0 and 1 each match two transactions; one of the second block's is in the mempool.
+    vector<TestBlock> blocks;
+    blocks.push_back(makeBlock(0, 5, set<int>{1, 3}));
+    blocks.push_back(makeBlock(1, 4, set<int>{0, 2}));
+    blocks.push_back(makeBlock(2, 4, set<int>{3}));
+    for (int height = 0; height < 3; height++) { h.scheduler.addBlock(height, blocks[height].merkleBlock.hash()); }
+    h.mempool.insert(Coin::hash256_t(blocks[1].matched[0].hash()));
+
+    h.scheduler.requestBlocks();
+    check(h.requests.size() == 1 && h.requests[0].hashes.size() == 3, "all three requested");
+    if (h.requests.empty()) return;
+    uint64_t nonce = h.requests[0].nonce;
+
+    // The transactions follow their merkle block. The block stays open until something says
+    // the peer is done with it.
+    h.scheduler.onMerkleBlock("a", blocks[0].merkleBlock);
+    check(h.scheduler.onTx("a", blocks[0].matched[0]), "first matching tx taken");
+    check(h.scheduler.onTx("a", blocks[0].matched[1]), "second matching tx taken");
+    check(!h.scheduler.onTx("a", blocks[0].block.txs[0]), "unmatched tx ignored");
+    check(h.delivered.empty(), "block waits while transactions may still come");
+
+    // The next merkle block closes the one before.
+    h.scheduler.onMerkleBlock("a", blocks[1].merkleBlock);
+    check(h.delivered.size() == 1 && h.deliveredTxs[0] == 2, "next merkle block closes height 0");
+
+    // The peer leaves out the transaction we have, and sends nothing for height 2's.
+    h.scheduler.onTx("a", blocks[1].matched[1]);
+    h.scheduler.onMerkleBlock("a", blocks[2].merkleBlock);
+    check(h.delivered.size() == 2 && h.deliveredTxs[1] == 1, "height 1 delivered with the tx from the mempool left out");
+    check(h.blockRequests.empty(), "no full block asked for yet");
+
+    // The pong says height 2 is done. Its transaction is missing, so the full block is asked for.
+    check(h.scheduler.onPong("a", nonce), "pong taken");
+    check(h.delivered.size() == 2, "height 2 held back without its transaction");
+    check(h.blockRequests.size() == 1 && h.blockRequests[0].second == blocks[2].merkleBlock.hash(), "full block asked for");
+    check(!h.scheduler.onPong("a", nonce), "same pong not taken twice");
+
+    check(h.scheduler.onBlock("a", blocks[2].block), "full block taken");
+    check(h.delivered.size() == 3 && h.deliveredTxs[2] == 1, "height 2 delivered from the full block");
+    check(h.scheduler.isIdle(), "idle once everything is delivered");
+}
+
+// One peer over a simulated link. A request reaches the peer half a round trip after it is
+// sent, the peer sends the blocks one after another taking transferMs each, then the pong.
+// Returns the simulated milliseconds until all count blocks are delivered.
+static double simulateDownload(int count, size_t window, double rttMs, double transferMs)
+{
+    Harness h;
+    h.scheduler.setBlocksPerPeer(window);
+    h.scheduler.addPeer("a");
+    vector<TestBlock> blocks = h.addBlocks(count);
+    map<uchar_vector, int> heights;
+    for (int height = 0; height < count; height++) { heights[blocks[height].merkleBlock.hash()] = height; }
+
+    multimap<double, function<void()>> events;
+    double now = 0.0;
+    double linkFree = 0.0;
+    size_t handled = 0;
+    auto send = [&]() {
+        for (; handled < h.requests.size(); handled++)
+        {
+            Harness::Request request = h.requests[handled];
+            double sent = max(now + rttMs / 2, linkFree);
+            for (auto& hash: request.hashes)
+            {
+                sent += transferMs;
+                const MerkleBlock& merkleBlock = blocks[heights[hash]].merkleBlock;
+                events.insert(make_pair(sent + rttMs / 2, [&h, &merkleBlock]() { h.scheduler.onMerkleBlock("a", merkleBlock); }));
+            }
+            linkFree = sent;
+            uint64_t nonce = request.nonce;
+            events.insert(make_pair(sent + rttMs / 2, [&h, nonce]() { h.scheduler.onPong("a", nonce); }));
+        }
+    };
+
+    h.scheduler.requestBlocks();
+    send();
+    while (!events.empty() && h.delivered.size() < (size_t)count)
+    {
+        now = events.begin()->first;
+        function<void()> event = events.begin()->second;
+        events.erase(events.begin());
+        event();
+        send();
+    }
+
+    check(h.delivered.size() == (size_t)count && isIncreasing(h.delivered), "simulated download delivered in order");
+    return now;
+}
+
+static void testWindowSpeedup()
+{
+    // 500 blocks over a 100 ms round trip at 2 ms a block.
+    const int COUNT = 500;
+    const double RTT_MS = 100.0;
+    const double TRANSFER_MS = 2.0;
+
+    double stopAndWait = simulateDownload(COUNT, 1, RTT_MS, TRANSFER_MS);
+    cout << "window    simulated ms    speedup" << endl;
+    for (size_t window: {1, 4, 16, 64})
+    {
+        double ms = simulateDownload(COUNT, window, RTT_MS, TRANSFER_MS);
+        cout << setw(6) << window << setw(16) << fixed << setprecision(0) << ms << setw(10) << setprecision(1) << stopAndWait / ms << "x" << endl;
+
+        // Close to window times faster until the link is kept busy.
+        double expected = min((double)window, (RTT_MS + TRANSFER_MS) / TRANSFER_MS);
+        check(stopAndWait / ms > 0.9 * expected, "window of " + to_string(window) + " close to its speedup");
+    }
+}
+
+int main()
+{
+    try
+    {
+        testWindow();
+        testHeightOrder();
+        testStalledPeer();
+        testPongClosing();
+        testWindowSpeedup();
+    }
+    catch (const exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        ok = false;
+    }
+
+    cout << (ok ? "All tests passed." : "Some tests failed.") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+#include <CoinQ_headerstore.h>
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace CoinQ;
+using namespace std;
+
+// Writes a synthetic chain to a header store and checks that loading it trusts the checkpoint,
+// falls back to checking the records the checkpoint does not cover, stops at a record whose
+// checksum is wrong and ignores a torn record at the end. Then checks that a load spread over
+// several threads passes on the same headers, hashes and statuses as a load on one, and that a
+// write with nothing to cut or append does not touch the files.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+// More than one RecordReader batch, so the read-ahead and the linkage between batches are used.
+static const int CHAIN_LENGTH = 20000;
+
+static vector<Coin::CoinBlockHeader> makeHeaders(int count)
+{
+    vector<Coin::CoinBlockHeader> headers;
+    headers.reserve(count);
+
+    uchar_vector prevHash(32, 0);
+    uchar_vector merkleRoot(32, 0);
+    for (int i = 0; i < count; i++)
+    {
+        merkleRoot[0] = i & 0xff; merkleRoot[1] = (i >> 8) & 0xff; merkleRoot[2] = (i >> 16) & 0xff;
+        headers.push_back(Coin::CoinBlockHeader(2, 1231006505 + i * 60, 0x207fffff, i, 0, prevHash, merkleRoot));
+        prevHash = headers.back().hash();
+    }
+    return headers;
+}
+
+static CoinQHeaderStore::record_slot_t recordsOf(const vector<Coin::CoinBlockHeader>& headers)
+{
+    return [&headers](int height, uchar_vector& headerBytes, Coin::hash256_t& hash) {
+        headerBytes = headers[height].getSerialized();
+        hash = Coin::hash256_t(headers[height].hash());
+    };
+}
+
+struct Loaded
+{
+    Loaded() : checks(0) { }
+
+    vector<Coin::hash256_t> hashes;
+    vector<CoinQHeaderStore::RecordStatus> status;
+    int checks;
+
+    int count(CoinQHeaderStore::RecordStatus s) const
+    {
+        int n = 0;
+        for (auto st: status) { if (st == s) n++; }
+        return n;
+    }
+};
+
+// Timestamps go up a minute per block, which a record out of place breaks.
+static void checkTimestamp(const Coin::CoinBlockHeader& parent, const Coin::CoinBlockHeader& header, int /*height*/)
+{
+    if (header.timestamp() != parent.timestamp() + 60) throw runtime_error("bad timestamp");
+}
+
+static Loaded load(CoinQHeaderStore& store, const string& filename, unsigned int threads = 0)
+{
+    Loaded loaded;
+    atomic<int> checks(0);
+    store.load(filename,
+        [&](size_t n) { loaded.hashes.reserve(n); loaded.status.reserve(n); },
+        [&](const Coin::CoinBlockHeader& /*header*/, const Coin::hash256_t& hash, CoinQHeaderStore::RecordStatus status) {
+            loaded.hashes.push_back(hash);
+            loaded.status.push_back(status);
+        },
+        [&](const Coin::CoinBlockHeader& parent, const Coin::CoinBlockHeader& header, int height) {
+            checks++;
+            checkTimestamp(parent, header, height);
+        },
+        threads);
+    loaded.checks = checks;
+    return loaded;
+}
+
+static bool sameHashes(const Loaded& loaded, const vector<Coin::CoinBlockHeader>& headers, int count)
+{
+    if ((int)loaded.hashes.size() != count) return false;
+    for (int i = 0; i < count; i++)
+    {
+        if (loaded.hashes[i] != Coin::hash256_t(headers[i].hash())) return false;
+    }
+    return true;
+}
+
+static void overwrite(const string& filename, uint64_t pos, const string& bytes)
+{
+    fstream f(filename.c_str(), ios::in | ios::out | ios::binary);
+    f.seekp(pos);
+    f.write(bytes.data(), bytes.size());
+}
+
+static void append(const string& filename, const string& bytes)
+{
+    ofstream f(filename.c_str(), ios::out | ios::binary | ios::app);
+    f.write(bytes.data(), bytes.size());
+}
+
+static string tempDirectory()
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("headerstoretest-%%%%-%%%%");
+    boost::filesystem::create_directory(dir);
+    return dir.string();
+}
+
+static string writeChain(const string& dir, const vector<Coin::CoinBlockHeader>& headers, int count)
+{
+    string filename = dir + "/headers.dat";
+    CoinQHeaderStore store;
+    store.open(filename);
+    store.write(0, count, recordsOf(headers));
+    return filename;
+}
+
+static void testCheckpoint(const string& dir, const vector<Coin::CoinBlockHeader>& headers)
+{
+    string filename = writeChain(dir, headers, CHAIN_LENGTH);
+    check(boost::filesystem::file_size(filename) == (uint64_t)CHAIN_LENGTH * CoinQHeaderStore::RECORD_SIZE, "file holds one record per header");
+
+    CoinQHeaderStore store;
+    Loaded loaded = load(store, filename);
+    check(sameHashes(loaded, headers, CHAIN_LENGTH), "checkpointed load returns every hash");
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == CHAIN_LENGTH, "every record is covered by the checkpoint");
+    check(loaded.checks == 0, "checkpointed records are not checked again");
+    check(store.getCount() == CHAIN_LENGTH, "count after checkpointed load");
+
+    // A checkpoint that stops short leaves the rest to the checks.
+    int covered = CHAIN_LENGTH / 2;
+    string count;
+    for (int i = 0; i < 4; i++) { count += (char)((covered >> (8 * i)) & 0xff); }
+    overwrite(filename + ".idx", 4, count);
+    loaded = load(store, filename);
+    check(sameHashes(loaded, headers, CHAIN_LENGTH), "partly checkpointed load returns every hash");
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == covered, "records up to the checkpoint count are verified");
+    check(loaded.count(CoinQHeaderStore::CHECKED) == CHAIN_LENGTH - covered, "records past the checkpoint are checked");
+    check(loaded.checks == CHAIN_LENGTH - covered, "check called for each record past the checkpoint");
+    check(store.getCount() == covered, "count stops at the checkpoint");
+
+    // A checkpoint entry that disagrees with the file stops it being trusted from there on.
+    int wrong = 1000;
+    overwrite(filename + ".idx", 8 + (uint64_t)wrong * 32, string(32, '\x5a'));
+    loaded = load(store, filename);
+    check(sameHashes(loaded, headers, CHAIN_LENGTH), "load with a wrong checkpoint entry returns every hash");
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == wrong, "records before the wrong entry are verified");
+    check(loaded.status[wrong] == CoinQHeaderStore::CHECKED, "record at the wrong entry is checked");
+    check(store.getCount() == wrong, "count stops at the wrong entry");
+
+    // Rewriting from the count restores the checkpoint.
+    store.write(store.getCount(), CHAIN_LENGTH, recordsOf(headers));
+    loaded = load(store, filename);
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == CHAIN_LENGTH, "rewrite restores the checkpoint");
+
+    // Without an index every record but the genesis block is checked.
+    boost::filesystem::remove(filename + ".idx");
+    loaded = load(store, filename);
+    check(sameHashes(loaded, headers, CHAIN_LENGTH), "load without checkpoint returns every hash");
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == 0, "no record verified without checkpoint");
+    check(loaded.count(CoinQHeaderStore::CHECKED) == CHAIN_LENGTH - 1, "every linked record checked without checkpoint");
+    check(store.getCount() == 0, "count without checkpoint");
+}
+
+static void testChecksum(const string& dir, const vector<Coin::CoinBlockHeader>& headers)
+{
+    const int bad = 12345;
+
+    // A changed header no longer matches the checksum stored after it.
+    string filename = writeChain(dir, headers, CHAIN_LENGTH);
+    boost::filesystem::remove(filename + ".idx");
+    overwrite(filename, (uint64_t)bad * CoinQHeaderStore::RECORD_SIZE + 10, string(1, '\x01'));
+
+    CoinQHeaderStore store;
+    Loaded loaded;
+    bool thrown = false;
+    try
+    {
+        store.load(filename, [](size_t) { },
+            [&](const Coin::CoinBlockHeader&, const Coin::hash256_t& hash, CoinQHeaderStore::RecordStatus status) {
+                loaded.hashes.push_back(hash);
+                loaded.status.push_back(status);
+            });
+    }
+    catch (const BlockTreeChecksumErrorException&)
+    {
+        thrown = true;
+    }
+    check(thrown, "changed header throws a checksum error");
+    check(sameHashes(loaded, headers, bad), "records before the bad one are passed on");
+
+    // So does a changed checksum, even when the checkpoint covers the record.
+    filename = writeChain(dir, headers, CHAIN_LENGTH);
+    overwrite(filename, (uint64_t)bad * CoinQHeaderStore::RECORD_SIZE + CoinQHeaderStore::HEADER_SIZE, string(1, '\x01'));
+    thrown = false;
+    try
+    {
+        load(store, filename);
+    }
+    catch (const BlockTreeChecksumErrorException&)
+    {
+        thrown = true;
+    }
+    check(thrown, "changed checksum under the checkpoint throws a checksum error");
+}
+
+static void testTornTail(const string& dir, const vector<Coin::CoinBlockHeader>& headers)
+{
+    const int count = 100;
+    string filename = writeChain(dir, headers, count);
+    append(filename, string(CoinQHeaderStore::RECORD_SIZE / 2, '\x7f'));
+
+    CoinQHeaderStore store;
+    Loaded loaded = load(store, filename);
+    check(sameHashes(loaded, headers, count), "torn record is ignored");
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == count, "records before the torn one are verified");
+    check(store.getCount() == count, "count ignores the torn record");
+
+    // The next append overwrites it.
+    store.write(store.getCount(), count + 2, recordsOf(headers));
+    check(boost::filesystem::file_size(filename) == (uint64_t)(count + 2) * CoinQHeaderStore::RECORD_SIZE, "append overwrites the torn record");
+    loaded = load(store, filename);
+    check(sameHashes(loaded, headers, count + 2), "load after overwriting the torn record");
+    check(loaded.count(CoinQHeaderStore::VERIFIED) == count + 2, "appended records are verified");
+
+    // Even when there is nothing to append.
+    append(filename, string(CoinQHeaderStore::RECORD_SIZE / 2, '\x7f'));
+    load(store, filename);
+    store.write(store.getCount(), store.getCount(), recordsOf(headers));
+    check(boost::filesystem::file_size(filename) == (uint64_t)(count + 2) * CoinQHeaderStore::RECORD_SIZE, "empty write cuts the torn record");
+
+    // A file with less than one whole record is rejected.
+    boost::filesystem::resize_file(filename, CoinQHeaderStore::RECORD_SIZE - 1);
+    bool thrown = false;
+    try
+    {
+        load(store, filename);
+    }
+    catch (const BlockTreeInvalidFileLengthException&)
+    {
+        thrown = true;
+    }
+    check(thrown, "file without a whole record is rejected");
+}
+
+static void testParallelLoad(const string& dir, const vector<Coin::CoinBlockHeader>& headers)
+{
+    string filename = writeChain(dir, headers, CHAIN_LENGTH);
+    overwrite(filename + ".idx", 4, string("\x10\x27\0\0", 4)); // 10000 checkpointed
+
+    CoinQHeaderStore store;
+    Loaded serial = load(store, filename, 1);
+    for (unsigned int threads: {2u, 4u, 7u})
+    {
+        Loaded parallel = load(store, filename, threads);
+        string what = to_string(threads) + " threads";
+        check(parallel.hashes == serial.hashes, "same hashes with " + what);
+        check(parallel.status == serial.status, "same statuses with " + what);
+        check(parallel.checks == serial.checks, "same number of checks with " + what);
+    }
+
+    // A record that fails its check surfaces at the same place either way.
+    boost::filesystem::remove(filename + ".idx");
+    const Coin::CoinBlockHeader& original = headers[15000];
+    Coin::CoinBlockHeader late(original.version(), original.timestamp() + 1, original.bits(), original.nonce(), 0, original.prevBlockHash(), original.merkleRoot());
+    CoinQHeaderStore::record_slot_t records = recordsOf(headers);
+    store.open(filename);
+    store.write(0, CHAIN_LENGTH, [&](int height, uchar_vector& headerBytes, Coin::hash256_t& hash) {
+        if (height != 15000) { records(height, headerBytes, hash); return; }
+        headerBytes = late.getSerialized();
+        hash = Coin::hash256_t(late.hash());
+    });
+    boost::filesystem::remove(filename + ".idx");
+
+    for (unsigned int threads: {1u, 4u})
+    {
+        int passed = 0;
+        string error;
+        try
+        {
+            store.load(filename, [](size_t) { },
+                [&](const Coin::CoinBlockHeader&, const Coin::hash256_t&, CoinQHeaderStore::RecordStatus) { passed++; },
+                checkTimestamp, threads);
+        }
+        catch (const exception& e)
+        {
+            error = e.what();
+        }
+        string what = to_string(threads) + " threads";
+        check(passed == 15000, "failed check stops at its record with " + what);
+        check(error.find(Coin::hash256_t(late.hash()).getHex()) != string::npos, "error names the failed record with " + what);
+    }
+}
+
+static void testEmptyWrite(const string& dir, const vector<Coin::CoinBlockHeader>& headers)
+{
+    boost::filesystem::path subdir = boost::filesystem::path(dir) / "empty";
+    boost::filesystem::create_directory(subdir);
+    string filename = (subdir / "headers.dat").string();
+
+    CoinQHeaderStore store;
+    store.open(filename);
+    store.write(0, 100, recordsOf(headers));
+    store.write(100, 150, recordsOf(headers));
+    Loaded loaded = load(store, filename);
+    check(sameHashes(loaded, headers, 150) && loaded.count(CoinQHeaderStore::VERIFIED) == 150, "appended records are checkpointed");
+
+    // With the files gone any open or write would recreate them.
+    boost::filesystem::remove_all(subdir);
+    int records = 0;
+    store.write(150, 150, [&](int, uchar_vector&, Coin::hash256_t&) { records++; });
+    store.write(200, 150, [&](int, uchar_vector&, Coin::hash256_t&) { records++; });
+    check(records == 0, "nothing to append asks for no records");
+    check(!boost::filesystem::exists(subdir), "nothing to cut or append touches no file");
+
+    // Appending to a file the checkpoint covers keeps what is there.
+    boost::filesystem::create_directory(subdir);
+    store.open(filename);
+    store.write(0, 100, recordsOf(headers));
+    store.write(100, 120, recordsOf(headers));
+    store.write(120, 120, recordsOf(headers));
+    store.write(110, 130, recordsOf(headers));
+    loaded = load(store, filename);
+    check(sameHashes(loaded, headers, 130) && loaded.count(CoinQHeaderStore::VERIFIED) == 130, "appends and a cut leave every record checkpointed");
+    check(boost::filesystem::file_size(filename + ".idx") == 8 + 130 * 32, "index holds one hash per record");
+}
+
+int main()
+{
+    string dir;
+    try
+    {
+        dir = tempDirectory();
+        vector<Coin::CoinBlockHeader> headers = makeHeaders(CHAIN_LENGTH);
+
+        testCheckpoint(dir, headers);
+        testChecksum(dir, headers);
+        testTornTail(dir, headers);
+        testParallelLoad(dir, headers);
+        testEmptyWrite(dir, headers);
+    }
+    catch (const exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        ok = false;
+    }
+
+    if (!dir.empty()) boost::filesystem::remove_all(dir);
+
+    if (ok)
+    {
+        cout << "All tests passed." << endl;
+        return 0;
+    }
+
+    cout << "Some tests failed." << endl;
+    return 1;
+}
@@ -0,0 +1,175 @@
+#include <poc.h>
+#include <CoinQ_blocks.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Follows a best chain past the 25 block base target average with a poc::BaseTargetWindow the
+// way the block trees do, then reorganizes it a few blocks deep and more than the window deep.
+// After every push and truncation the base target worked out from the window has to match the
+// one worked out by walking the ancestors, and the window must not claim heights it lost.
+
+static bool ok = true;
+
+static void check(bool condition, const string& what)
+{
+    if (!condition) { cout << "FAILED: " << what << endl; ok = false; }
+}
+
+// Well past the blocks that use the 4 block average.
+static const int START_HEIGHT = BCO_FORK_BLOCK_HEIGHT + BCOInitBlockCount + 3000;
+
+class Chain
+{
+public:
+    Chain() : mSeed(1) { }
+
+    const ChainHeader& add(const ChainHeader* parent, bool bBest)
+    {
+        mSeed = mSeed * 6364136223846793005ull + 1442695040888963407ull;
+        Coin::bits_t bits = 1000000 + (mSeed >> 40) % 1000000;
+        uint32_t timestamp = parent ? parent->timestamp() + 60 + (mSeed >> 20) % 480 : BCO_BLOCK_UNIXTIME_MIN + 1000000;
+        uchar_vector prevHash = parent ? parent->getHash() : uchar_vector(32, 0);
+        int height = parent ? parent->height + 1 : START_HEIGHT;
+
+        ChainHeader header(4, timestamp, bits, mSeed, 0, prevHash, uchar_vector(32, 0), bBest, height);
+        return mHeaders[header.getHash()] = header;
+    }
+
+    const ChainHeader* get(const uchar_vector& hash) const
+    {
+        auto it = mHeaders.find(hash);
+        return it == mHeaders.end() ? nullptr : &it->second;
+    }
+
+    void setBest(const ChainHeader& header, bool bBest) { mHeaders[header.getHash()].inBestChain = bBest; }
+
+private:
+    uint64_t mSeed;
+    map<uchar_vector, ChainHeader> mHeaders;
+};
+
+// Base target of a child of prev, from the window and from prev's ancestors.
+static void checkBaseTarget(const Chain& chain, const poc::BaseTargetWindow& window, const ChainHeader& prev, const string& what)
+{
+    Coin::CoinBlockHeader child(4, prev.timestamp() + 300, 1, 0, 0, prev.getHash());
+    poc::FGetPrevBlock getPrev = [&chain](const uchar_vector& hash) { return chain.get(hash); };
+    uint64_t walked = poc::CalculateBaseTarget(prev, child, getPrev);
+    uint64_t windowed = poc::CalculateBaseTarget(prev, child, getPrev, &window);
+    check(walked == windowed, what + ": base target from window matches walk");
+}
+
+// Reorganizes away the depth blocks above tips.back() - depth and follows a new branch of
+// length blocks, pushing and truncating the window as the trees do.
+static void reorg(Chain& chain, poc::BaseTargetWindow& window, vector<const ChainHeader*>& tips, int depth, int length)
+{
+    string what = "reorg " + to_string(depth) + " deep";
+    for (int i = 0; i < depth; i++)
+    {
+        chain.setBest(*tips.back(), false);
+        tips.pop_back();
+    }
+
+    const ChainHeader* fork = chain.get(tips.back()->getHash());
+    window.truncate(fork->height);
+
+    int left = poc::BaseTargetWindow::SIZE - depth;
+    check(!window.covers(fork->height + 1, 1), what + ": window drops the heights above the fork");
+    check(!window.covers(fork->height, max(left, 0) + 1), what + ": window does not claim heights it lost");
+    if (left > 0)
+    {
+        check(window.covers(fork->height, left), what + ": window keeps the heights below the fork");
+        check(window.bits(fork->height) == fork->bits() && window.timestamp(fork->height) == fork->timestamp(), what + ": fork point kept");
+    }
+    checkBaseTarget(chain, window, *fork, what + " at fork point");
+
+    for (int i = 0; i < length; i++)
+    {
+        const ChainHeader& header = chain.add(tips.back(), true);
+        tips.push_back(&header);
+        window.push(header.height, header.bits(), header.timestamp());
+        checkBaseTarget(chain, window, header, what + " at branch height " + to_string(i + 1));
+    }
+    check(window.covers(tips.back()->height, poc::BaseTargetWindow::SIZE) == (max(left, 0) + length >= poc::BaseTargetWindow::SIZE), what + ": window refills along the branch");
+}
+
+static void testWindow()
+{
+    poc::BaseTargetWindow window;
+    check(!window.covers(0, 1), "empty window covers nothing");
+
+    for (int height = 100; height < 130; height++) { window.push(height, height * 10, height * 100); }
+    check(window.covers(129, poc::BaseTargetWindow::SIZE), "full window covers the last SIZE heights");
+    check(!window.covers(129, poc::BaseTargetWindow::SIZE + 1), "full window covers no more than SIZE heights");
+    check(window.bits(120) == 1200 && window.timestamp(120) == 12000, "window entry");
+
+    window.truncate(126);
+    check(!window.covers(127, 1), "truncate drops the heights above it");
+    check(window.covers(126, poc::BaseTargetWindow::SIZE - 3), "truncate keeps the heights below it");
+    check(!window.covers(126, poc::BaseTargetWindow::SIZE - 2), "truncate forgets the heights the dropped entries overwrote");
+
+    window.truncate(140);
+    check(window.covers(126, poc::BaseTargetWindow::SIZE - 3), "truncate above the tip changes nothing");
+
+    window.push(127, 1, 2);
+    check(window.bits(127) == 1 && window.timestamp(127) == 2 && window.bits(126) == 1260, "push after truncate");
+
+    window.push(200, 3, 4);
+    check(window.covers(200, 1) && !window.covers(200, 2), "push off the tip starts over");
+
+    window.truncate(50);
+    check(!window.covers(50, 1) && !window.covers(200, 1), "truncate below the window empties it");
+}
+
+static void testReorgs()
+{
+    Chain chain;
+    poc::BaseTargetWindow window;
+    vector<const ChainHeader*> tips;
+
+    const ChainHeader* header = &chain.add(nullptr, true);
+    tips.push_back(header);
+    window.push(header->height, header->bits(), header->timestamp());
+    for (int i = 0; i < 60; i++)
+    {
+        header = &chain.add(header, true);
+        tips.push_back(header);
+        window.push(header->height, header->bits(), header->timestamp());
+        if (i >= 24) checkBaseTarget(chain, window, *header, "best chain height " + to_string(i + 1));
+    }
+    check(window.covers(tips.back()->height, poc::BaseTargetWindow::SIZE), "window covers the best chain");
+
+    reorg(chain, window, tips, 2, 5);
+    reorg(chain, window, tips, 1, 1);
+    reorg(chain, window, tips, 10, 20);
+    reorg(chain, window, tips, 30, 40);
+}
+
+int main()
+{
+    try
+    {
+        testWindow();
+        testReorgs();
+    }
+    catch (const exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        ok = false;
+    }
+
+    if (ok)
+    {
+        cout << "All tests passed." << endl;
+        return 0;
+    }
+
+    cout << "Some tests failed." << endl;
+    return 1;
+}
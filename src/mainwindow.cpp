@@ -303,7 +303,7 @@ void MainWindow::loadVault()
     QString fullFile = getDocDir() + "/" + vaultFile;
 
     LOGGER(trace) << "Load last vault file:" << fullFile.toStdString() << endl;
-    synchedVault.openVault(fullFile.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), false);
+    synchedVault.openVault(fullFile.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), false, CoinDB::StorageProfile::fromName(storageProfile.toStdString()));
 
     updateVaultStatus(fullFile);
 }
@@ -516,6 +516,19 @@ void MainWindow::selectTrailingDecimals(bool newShowTrailingDecimals)
     }
 }
 
+void MainWindow::selectStorageProfile(const QString& newStorageProfile)
+{
+    if (newStorageProfile != storageProfile)
+    {
+        storageProfile = newStorageProfile;
+        saveSettings();
+        if (synchedVault.isVaultOpen())
+        {
+            updateStatusMessage(tr("The new storage profile is used the next time a vault is opened."));
+        }
+    }
+}
+
 #ifdef SUPPORT_OLD_ADDRESS_VERSIONS
 void MainWindow::selectAddressVersions(bool newUseOldAddressVersions)
 {
@@ -551,7 +564,7 @@ void MainWindow::newVault(QString fileName)
 
     try
     {
-        synchedVault.openVault(fileName.toStdString(), true, SCHEMA_VERSION, getCoinParams().network_name());
+        synchedVault.openVault(fileName.toStdString(), true, SCHEMA_VERSION, getCoinParams().network_name(), false, CoinDB::StorageProfile::fromName(storageProfile.toStdString()));
         updateVaultStatus(fileName);
         addToRecents(fileName);
     }
@@ -609,7 +622,7 @@ void MainWindow::openVault(QString fileName)
         try
         {
             closeVault();
-            synchedVault.openVault(fileName.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), false);
+            synchedVault.openVault(fileName.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), false, CoinDB::StorageProfile::fromName(storageProfile.toStdString()));
         }
         catch (const CoinDB::VaultNeedsSchemaMigrationException& e)
         {
@@ -646,7 +659,7 @@ void MainWindow::openVault(QString fileName)
                 n++;
             }
 
-            synchedVault.openVault(fileName.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), true);
+            synchedVault.openVault(fileName.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), true, CoinDB::StorageProfile::fromName(storageProfile.toStdString()));
             QMessageBox::information(this, tr("Backup Made"), tr("Your vault file has been backed up to ") + backupFileName);
         }
             
@@ -2541,6 +2554,22 @@ void MainWindow::createActions()
     connect(showTrailingDecimalsAction, &QAction::toggled, [this]() { selectTrailingDecimals(showTrailingDecimalsAction->isChecked()); });
     showTrailingDecimalsAction->setChecked(showTrailingDecimals);
 
+    // storage profile actions
+    storageProfileGroup = new QActionGroup(this);
+    auto addStorageProfileAction = [this](const QString& profile, const QString& text, const QString& statusTip)
+    {
+        QAction* storageProfileAction = new QAction(text, this);
+        storageProfileAction->setCheckable(true);
+        storageProfileAction->setStatusTip(statusTip);
+        if (storageProfile == profile) { storageProfileAction->setChecked(true); }
+        connect(storageProfileAction, &QAction::triggered, [this, profile]() { selectStorageProfile(profile); });
+        storageProfileGroup->addAction(storageProfileAction);
+        storageProfileActions << storageProfileAction;
+    };
+    addStorageProfileAction("safe", tr("Safe"), tr("Sync every change to disk with a rollback journal. Slowest, nothing saved is ever lost"));
+    addStorageProfileAction("balanced", tr("Balanced"), tr("Sync every change to disk with a write-ahead log. Faster, nothing saved is ever lost"));
+    addStorageProfileAction("fast", tr("Fast"), tr("Sync the write-ahead log only now and then. Fastest, but a power failure can undo the last changes"));
+
 #ifdef SUPPORT_OLD_ADDRESS_VERSIONS
     // address version actions
     useOldAddressVersionsAction = new QAction(tr("Use Old Address Versions"), this);
@@ -2661,6 +2690,13 @@ void MainWindow::createMenus()
     currencyUnitMenu->addSeparator();
     currencyUnitMenu->addAction(showTrailingDecimalsAction);
 
+    storageProfileMenu = menuBar()->addMenu(tr("Storage"));
+    storageProfileMenu->addSeparator()->setText(tr("Vault Storage Profile"));
+    for (auto& storageProfileAction: storageProfileActions)
+    {
+        storageProfileMenu->addAction(storageProfileAction);
+    }
+
 #ifdef SUPPORT_OLD_ADDRESS_VERSIONS
     addressVersionsMenu = menuBar()->addMenu(tr("Address Versions"));
     addressVersionsMenu->addSeparator()->setText("Addresses Versions");
@@ -2737,6 +2773,7 @@ void MainWindow::loadSettings()
         currencyUnitPrefix = settings.value("currencyunitprefix", "").toString();
         showTrailingDecimals = settings.value("showtrailingdecimals", true).toBool();
         setTrailingDecimals(showTrailingDecimals);
+        storageProfile = settings.value("storageprofile", "safe").toString();
         blockTreeFile = settings.value("blocktreefile", getDefaultSettings().getDataDir() + "/blocktree.dat").toString();
         host = settings.value("host", "").toString();
         port = settings.value("port", getCoinParams().default_port()).toInt();
@@ -2766,6 +2803,7 @@ void MainWindow::saveSettings()
         QSettings settings(APP_CORP_NAME, getDefaultSettings().getNetworkSettingsPath());
         settings.setValue("currencyunitprefix", currencyUnitPrefix);
         settings.setValue("showtrailingdecimals", showTrailingDecimals);
+        settings.setValue("storageprofile", storageProfile);
         settings.setValue("blocktreefile", blockTreeFile);
         settings.setValue("host", host);
         settings.setValue("port", port);
@@ -2787,7 +2825,7 @@ void MainWindow::clearSettings()
 
 void MainWindow::loadVault(const QString &fileName)
 {
-    synchedVault.openVault(fileName.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name());
+    synchedVault.openVault(fileName.toStdString(), false, SCHEMA_VERSION, getCoinParams().network_name(), false, CoinDB::StorageProfile::fromName(storageProfile.toStdString()));
 }
 
 void MainWindow::addToRecents(const QString& fileName)
@@ -136,6 +136,7 @@ private slots:
     void selectCurrencyUnit();
     void selectCurrencyUnit(const QString& newCurrencyUnitPrefix);
     void selectTrailingDecimals(bool newShowTrailingDecimals);
+    void selectStorageProfile(const QString& newStorageProfile);
 #ifdef SUPPORT_OLD_ADDRESS_VERSIONS
     void selectAddressVersions(bool useOld);
 #endif
@@ -281,6 +282,7 @@ private:
     QMenu* networkMenu;
     QMenu* fontsMenu;
     QMenu* currencyUnitMenu;
+    QMenu* storageProfileMenu;
 #ifdef SUPPORT_OLD_ADDRESS_VERSIONS
     QMenu* addressVersionsMenu;
 #endif
@@ -381,6 +383,11 @@ private:
     QList<QAction*> currencyUnitActions;
     QAction* showTrailingDecimalsAction;
 
+    // storage profile actions, see CoinDB::StorageProfile
+    QString storageProfile;
+    QActionGroup* storageProfileGroup;
+    QList<QAction*> storageProfileActions;
+
 #ifdef SUPPORT_OLD_ADDRESS_VERSIONS
     // address version actions
     bool useOldAddressVersions;
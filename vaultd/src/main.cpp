@@ -41,6 +41,9 @@ const string WS_PORT = "12345";
 
 bool g_bShutdown = false;
 
+// Set with --dbprofile=<default|safe|balanced|fast>, see StorageProfile.h for what each trades.
+StorageProfile g_storageProfile;
+
 void finish(int sig)
 {
     LOGGER(debug) << "Stopping..." << endl;
@@ -50,7 +53,7 @@ void finish(int sig)
 // Global operations
 cli::result_t cmd_create(const cli::params_t& params)
 {
-    Vault vault(params[0], true);
+    Vault vault(params[0], true, SCHEMA_VERSION, "", false, g_storageProfile);
 
     stringstream ss;
     ss << "Vault " << params[0] << " created.";
@@ -59,7 +62,7 @@ cli::result_t cmd_create(const cli::params_t& params)
 
 cli::result_t cmd_info(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     uint32_t schema_version = vault.getSchemaVersion();
     uint32_t horizon_timestamp = vault.getHorizonTimestamp();
 
@@ -73,7 +76,7 @@ cli::result_t cmd_info(const cli::params_t& params)
 // Keychain operations
 cli::result_t cmd_keychainexists(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     bool bExists = vault.keychainExists(params[1]);
 
     stringstream ss;
@@ -83,7 +86,7 @@ cli::result_t cmd_keychainexists(const cli::params_t& params)
 
 cli::result_t cmd_newkeychain(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.newKeychain(params[1], random_bytes(32));
 
     stringstream ss;
@@ -97,7 +100,7 @@ cli::result_t cmd_erasekeychain(bool bHelp, const cli::params_t& params)
         return "erasekeychain <db file> <keychain_name> - erase a keychain.";
     }
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     if (!vault.keychainExists(params[1]))
         throw runtime_error("Keychain not found.");
 
@@ -110,7 +113,7 @@ cli::result_t cmd_erasekeychain(bool bHelp, const cli::params_t& params)
 */
 cli::result_t cmd_renamekeychain(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.renameKeychain(params[1], params[2]);
 
     stringstream ss;
@@ -120,7 +123,7 @@ cli::result_t cmd_renamekeychain(const cli::params_t& params)
 
 cli::result_t cmd_keychaininfo(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     shared_ptr<Keychain> keychain = vault.getKeychain(params[1]);
 
     stringstream ss;
@@ -141,7 +144,7 @@ cli::result_t cmd_keychains(const cli::params_t& params)
 
     bool show_hidden = params.size() > 2 && params[2] == "true";
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vector<KeychainView> views = vault.getRootKeychainViews(account_name, show_hidden);
 
     stringstream ss;
@@ -158,7 +161,7 @@ cli::result_t cmd_listkeychains(bool bHelp, const cli::params_t& params)
 
     bool root_only = params.size() > 1 ? (params[1] == "true") : false;
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vector<shared_ptr<Keychain>> keychains = vault.getAllKeychains(root_only);
 
     stringstream ss;
@@ -177,7 +180,7 @@ cli::result_t cmd_exportkeychain(const cli::params_t& params)
     if (params.size() > 3)  { output_file = params[3]; }
     else                    { output_file = params[1] + (export_privkey ? ".priv" : ".pub"); }
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.exportKeychain(params[1], output_file, export_privkey);
 
     stringstream ss;
@@ -189,7 +192,7 @@ cli::result_t cmd_importkeychain(const cli::params_t& params)
 {
     bool import_privkey = params.size() > 2 ? (params[2] == "true") : true;
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     std::shared_ptr<Keychain> keychain = vault.importKeychain(params[1], import_privkey);
 
     stringstream ss;
@@ -201,7 +204,7 @@ cli::result_t cmd_exportbip32(const cli::params_t& params)
 {
     bool export_privkey = params.size() > 2;
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.unlockChainCodes(uchar_vector("1234"));
     if (export_privkey)
     {
@@ -229,7 +232,7 @@ cli::result_t cmd_importbip32(const cli::params_t& params)
     secure_bytes_t extkey;
     if (!fromBase58Check(params[2], extkey)) throw std::runtime_error("Invalid BIP32.");
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     std::shared_ptr<Keychain> keychain = vault.importKeychainExtendedKey(params[1], extkey, import_privkey, lock_key);
 
     stringstream ss;
@@ -240,7 +243,7 @@ cli::result_t cmd_importbip32(const cli::params_t& params)
 // Account operations
 cli::result_t cmd_accountexists(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     bool bExists = vault.accountExists(params[1]);
 
     stringstream ss;
@@ -259,7 +262,7 @@ cli::result_t cmd_newaccount(const cli::params_t& params)
     for (size_t i = 3; i < params.size(); i++)
         keychain_names.push_back(params[i]);
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.unlockChainCodes(secure_bytes_t());
     vault.newAccount(params[1], minsigs, keychain_names);
 
@@ -270,7 +273,7 @@ cli::result_t cmd_newaccount(const cli::params_t& params)
 
 cli::result_t cmd_renameaccount(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.renameAccount(params[1], params[2]);
 
     stringstream ss;
@@ -280,7 +283,7 @@ cli::result_t cmd_renameaccount(const cli::params_t& params)
 
 cli::result_t cmd_accountinfo(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     AccountInfo accountInfo = vault.getAccountInfo(params[1]);
     uint64_t balance = vault.getAccountBalance(params[1], 0);
     uint64_t confirmed_balance = vault.getAccountBalance(params[1], 1);
@@ -301,7 +304,7 @@ cli::result_t cmd_accountinfo(const cli::params_t& params)
 
 cli::result_t cmd_listaccounts(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vector<AccountInfo> accounts = vault.getAllAccountInfo();
 
     stringstream ss;
@@ -313,7 +316,7 @@ cli::result_t cmd_listaccounts(const cli::params_t& params)
 
 cli::result_t cmd_exportaccount(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
 
     secure_bytes_t exportChainCodeUnlockKey;
     if (params.size() > 2 && !params[2].empty())
@@ -332,7 +335,7 @@ cli::result_t cmd_exportaccount(const cli::params_t& params)
 
 cli::result_t cmd_importaccount(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
 
     unsigned int privkeycount = 1;
 
@@ -352,7 +355,7 @@ cli::result_t cmd_importaccount(const cli::params_t& params)
 
 cli::result_t cmd_newaccountbin(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     AccountInfo accountInfo = vault.getAccountInfo(params[1]);
     vault.unlockChainCodes(secure_bytes_t());
     vault.addAccountBin(params[1], params[2]);
@@ -364,7 +367,7 @@ cli::result_t cmd_newaccountbin(const cli::params_t& params)
 
 cli::result_t cmd_listbins(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vector<AccountBinView> bins = vault.getAllAccountBinViews();
 
     stringstream ss;
@@ -376,7 +379,7 @@ cli::result_t cmd_listbins(const cli::params_t& params)
 
 cli::result_t cmd_issuescript(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     std::string account_name;
     if (params[1] != "@null") account_name = params[1];
     std::string bin_name = params.size() > 2 ? params[2] : std::string(DEFAULT_BIN_NAME);
@@ -404,7 +407,7 @@ cli::result_t cmd_listscripts(const cli::params_t& params)
 
     int flags = params.size() > 3 ? (int)strtoul(params[3].c_str(), NULL, 0) : ((int)SigningScript::ISSUED | (int)SigningScript::USED);
     
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vector<SigningScriptView> scriptViews = vault.getSigningScriptViews(account_name, bin_name, flags);
 
     stringstream ss;
@@ -424,7 +427,7 @@ cli::result_t cmd_history(const cli::params_t& params)
 
     bool hide_change = params.size() > 3 ? params[3] == "true" : true;
     
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     uint32_t best_height = vault.getBestHeight();
     vector<TxOutView> txOutViews = vault.getTxOutViews(account_name, bin_name, TxOut::ROLE_BOTH, TxOut::BOTH, Tx::ALL, hide_change);
     stringstream ss;
@@ -436,7 +439,7 @@ cli::result_t cmd_history(const cli::params_t& params)
 
 cli::result_t cmd_refillaccountpool(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     AccountInfo accountInfo = vault.getAccountInfo(params[1]);
     vault.unlockChainCodes(secure_bytes_t());
     vault.refillAccountPool(params[1]);
@@ -449,7 +452,7 @@ cli::result_t cmd_refillaccountpool(const cli::params_t& params)
 // Account bin operations
 cli::result_t cmd_exportbin(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
 
     string export_name = params.size() > 3 ? params[3] : (params[1].empty() ? params[2] : params[1] + "-" + params[2]);
     secure_bytes_t exportChainCodeUnlockKey;
@@ -468,7 +471,7 @@ cli::result_t cmd_exportbin(const cli::params_t& params)
 
 cli::result_t cmd_importbin(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
 
     secure_bytes_t importChainCodeUnlockKey;
     if (params.size() > 2 && !params[2].empty())
@@ -488,7 +491,7 @@ cli::result_t cmd_txinfo(const cli::params_t& params)
 {
     bool raw = params.size() > 2 ? params[2] == "true" : false;
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     std::shared_ptr<Tx> tx = vault.getTx(uchar_vector(params[1]));
 
     if (raw) return uchar_vector(tx->raw()).getHex();
@@ -515,7 +518,7 @@ cli::result_t cmd_txinfo(const cli::params_t& params)
 
 cli::result_t cmd_insertrawtx(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
 
     std::shared_ptr<Tx> tx(new Tx());
     tx->set(uchar_vector(params[1]));
@@ -540,7 +543,7 @@ cli::result_t cmd_newrawtx(const cli::params_t& params)
     using namespace CoinQ::Script;
     const size_t MAX_VERSION_LEN = 2;
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
 
     // Get outputs
     size_t i = 2;
@@ -564,7 +567,7 @@ cli::result_t cmd_newrawtx(const cli::params_t& params)
 
 cli::result_t cmd_deletetx(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     uchar_vector hash(params[1]);
     vault.deleteTx(hash);
 
@@ -575,7 +578,7 @@ cli::result_t cmd_deletetx(const cli::params_t& params)
 
 cli::result_t cmd_signingrequest(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     uchar_vector hash(params[1]);
 
     SigningRequest req = vault.getSigningRequest(hash, true);
@@ -599,7 +602,7 @@ cli::result_t cmd_signingrequest(const cli::params_t& params)
 // TODO: do something with passphrase
 cli::result_t cmd_signtx(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     vault.unlockChainCodes(uchar_vector("1234"));
     vault.unlockKeychain(params[2], secure_bytes_t());
 
@@ -620,7 +623,7 @@ cli::result_t cmd_signtx(const cli::params_t& params)
 // Blockchain operations
 cli::result_t cmd_bestheight(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     uint32_t best_height = vault.getBestHeight();
 
     stringstream ss;
@@ -630,7 +633,7 @@ cli::result_t cmd_bestheight(const cli::params_t& params)
 
 cli::result_t cmd_horizonheight(const cli::params_t& params)
 {
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     uint32_t horizon_height = vault.getHorizonHeight();
 
     stringstream ss;
@@ -642,7 +645,7 @@ cli::result_t cmd_horizontimestamp(const cli::params_t& params)
 {
     bool use_gmt = params.size() > 1 && params[1] == "true";
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     long timestamp = vault.getHorizonTimestamp();
 
     std::function<struct tm*(const time_t*)> fConvert = use_gmt ? &gmtime : &localtime;
@@ -658,7 +661,7 @@ cli::result_t cmd_blockinfo(const cli::params_t& params)
 {
     uint32_t height = strtoul(params[1].c_str(), NULL, 0);
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     std::shared_ptr<BlockHeader> blockheader = vault.getBlockHeader(height);
 
     return blockheader->toCoinClasses().toIndentedString();
@@ -709,7 +712,7 @@ cli::result_t cmd_insertrawmerkleblock(const cli::params_t& params)
     std::shared_ptr<MerkleBlock> merkleblock(new MerkleBlock());
     merkleblock->fromCoinClasses(rawmerkleblock, height);
 
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     bool rval = (bool)vault.insertMerkleBlock(merkleblock);
 
     stringstream ss;
@@ -720,7 +723,7 @@ cli::result_t cmd_insertrawmerkleblock(const cli::params_t& params)
 cli::result_t cmd_deleteblock(const cli::params_t& params)
 {
     uint32_t height = strtoull(params[1].c_str(), NULL, 0);
-    Vault vault(params[0], false);
+    Vault vault(params[0], false, SCHEMA_VERSION, "", false, g_storageProfile);
     unsigned int count = vault.deleteMerkleBlock(height);
 
     stringstream ss;
@@ -772,6 +775,24 @@ int main(int argc, char* argv[])
 {
     INIT_LOGGER("vaultd.log");
 
+    const string DBPROFILE_OPTION = "--dbprofile=";
+    for (int i = 1; i < argc; i++)
+    {
+        string arg(argv[i]);
+        if (arg.compare(0, DBPROFILE_OPTION.size(), DBPROFILE_OPTION) != 0) continue;
+
+        try
+        {
+            g_storageProfile = StorageProfile::fromName(arg.substr(DBPROFILE_OPTION.size()));
+        }
+        catch (const std::exception& e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        LOGGER(debug) << "Using " << g_storageProfile.getName() << " storage profile." << endl;
+    }
+
     signal(SIGINT, &finish);
 
     // Global operations